@@ -16,6 +16,7 @@
 # Imports
 import os
 import sys
+import subprocess
 import scripts.msg_ingest as mi
 import scripts.msg_tools as mt
 import importlib
@@ -251,23 +252,24 @@ if (do_topic):
         num += 1
     print
 
-    # Write out counts to a file and perform topic clustering
-    fn_counts = dir_temp + fn_table + '.{}.counts.txt'.format(num_topics)
-    
-    if (os.path.exists(fn_counts)):
-        os.remove(fn_counts)
-    mt.write_counts_file(data_table, fn_counts)
-    
-    # Run topic clustering binary
+    # Run topic clustering binary, streaming the counts to it on stdin
     fn_feat = dir_temp + fn_table + '.{}.feat.txt'.format(num_topics)
     fn_model = dir_temp + fn_table + '.{}.plsa'.format(num_topics)
-    cmd = '{}/bin/plsa_estimation_combined_file -vector_list_in {} '.format(dir_topic, fn_counts) + \
+    cmd = '{}/bin/plsa_estimation_combined_file -vector_list_in - '.format(dir_topic) + \
         '-stop_list_in {} '.format(stop_list) + \
         '-tf {} -df {} -num_topics {} -random '.format(tf_cutoff,df_cutoff,num_topics) + \
         '-feature_list_out {} '.format(fn_feat) + \
         '-plsa_model_out {} '.format(fn_model)
     print('Running command: {}'.format(cmd))
-    status = os.system(cmd)
+    proc = subprocess.Popen(cmd, shell=True, stdin=subprocess.PIPE)
+    count_keys = []
+    try:
+        count_keys = mt.write_counts(data_table, proc.stdin)
+        proc.stdin.close()
+    except IOError:
+        # The binary stopped reading, and its exit status says why
+        pass
+    status = proc.wait()
     if (status != 0):
         print 'Topic clustering failed!'
     else:
@@ -289,12 +291,8 @@ if (do_topic):
         if (os.path.exists(fn_d2z_tmp)):
             os.remove(fn_d2z_tmp)
         d2z_tmp_file = open(fn_d2z_tmp, 'w')
-        counts_file = open(fn_counts, 'r')
-        for ln in d2z_file:
-            ln_count = counts_file.readline()
-            f = ln_count.split(' ')
-            d2z_tmp_file.write('{}\t{}'.format(f[0], ln))
-        counts_file.close()
+        for ky, ln in zip(count_keys, d2z_file):
+            d2z_tmp_file.write('{}\t{}'.format(ky, ln))
         d2z_file.close()
         d2z_tmp_file.close()
         os.rename(fn_d2z_tmp, fn_d2z)
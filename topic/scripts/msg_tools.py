@@ -13,6 +13,7 @@
 # BC, 4/2013
 
 import cPickle as pickle
+import gzip
 import re
 import langid
 
@@ -591,8 +592,10 @@ def simple_sent_split(ln):
             fout.append(s)
     return fout
 
-def write_counts_file(xact, count_fn):
-    count_file = open(count_fn, 'w')
+def write_counts(xact, count_file):
+    # Write one counts line per message with counts to an open file or pipe,
+    # and return the message keys in the order they were written
+    keys = []
     for ky in xact.keys():
         if (not xact[ky].has_key('counts')):
             continue
@@ -603,7 +606,19 @@ def write_counts_file(xact, count_fn):
         for w in sorted(counts):
             count_file.write(' {}|{}'.format(w, counts[w]))
         count_file.write('\n')
+        keys.append(ky)
+    return keys
+
+def write_counts_file(xact, count_fn):
+    # Counts files ending in .gz are written gzip compressed, and can be read
+    # as is by the topic clustering binaries
+    if count_fn.endswith('.gz'):
+        count_file = gzip.open(count_fn, 'wb')
+    else:
+        count_file = open(count_fn, 'w')
+    keys = write_counts(xact, count_file)
     count_file.close()
+    return keys
 
 def remove_isolated_symbols(ln):
     ln = re.sub(r'\s[$\.:\-\(\)=/\\<>@\s]+\s', ' ', ln)
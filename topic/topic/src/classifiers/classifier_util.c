@@ -14,6 +14,17 @@
 #include <string.h>
 #include <stdarg.h>
 #include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "util/basic_util.h"
 #include "util/hash_util.h"
@@ -560,6 +571,8 @@ SPARSE_FEATURE_VECTORS *copy_sparse_feature_vectors ( SPARSE_FEATURE_VECTORS *or
   new_feature_vectors->num_sets = orig_feature_vectors->num_sets;
   new_feature_vectors->feature_set = orig_feature_vectors->feature_set;
   new_feature_vectors->class_set = orig_feature_vectors->class_set;
+  new_feature_vectors->corpus = NULL;
+  new_feature_vectors->vector_block = NULL;
   
   new_feature_vectors->vectors = (SPARSE_FEATURE_VECTOR **) calloc((size_t)num_vectors, 
 								   sizeof(SPARSE_FEATURE_VECTOR *));
@@ -640,6 +653,8 @@ SPARSE_FEATURE_VECTORS *load_sparse_feature_vectors_combined (char *count_fn, FE
   feature_vectors->vectors = (SPARSE_FEATURE_VECTOR **) calloc((size_t)num_vectors, sizeof(SPARSE_FEATURE_VECTOR *));
   feature_vectors->feature_set = feature_set;
   feature_vectors->class_set = class_set;
+  feature_vectors->corpus = NULL;
+  feature_vectors->vector_block = NULL;
   
   // Go through the count file loading vectors
   char *line = (char *) calloc(max_line_length+3, sizeof(char));
@@ -716,6 +731,8 @@ SPARSE_FEATURE_VECTORS *load_sparse_feature_vectors ( char *list_filename,
   feature_vectors->vectors = (SPARSE_FEATURE_VECTOR **) calloc((size_t)num_vectors, sizeof(SPARSE_FEATURE_VECTOR *));
   feature_vectors->feature_set = feature_set;
   feature_vectors->class_set = class_set;
+  feature_vectors->corpus = NULL;
+  feature_vectors->vector_block = NULL;
   
   // Go through the filelist loading file and class labels
   char *line = (char *) calloc(max_line_length+3, sizeof(char));
@@ -885,6 +902,1985 @@ SPARSE_FEATURE_VECTOR *load_sparse_feature_vector_combined (char *substrings[],
 
 }
 
+/*******************************************************************************************/
+
+// Open addressing table of feature names used by the single pass loader.
+// Tokens are looked up by pointer and length so they need not be copied
+// out of the line; the names held by the table are the feature names.
+typedef struct NAME_TABLE_ENTRY {
+  char *name;
+  int length;
+  int index;
+  unsigned int hash;
+} NAME_TABLE_ENTRY;
+
+typedef struct NAME_TABLE {
+  NAME_TABLE_ENTRY *entries;
+  unsigned int mask;
+  int num_entries;
+} NAME_TABLE;
+
+#define NAME_TABLE_INITIAL_SIZE 1024
+
+// Runs of up to this many features are sorted by insertion
+#define NAME_TABLE_INSERTION_SORT_MAX 16
+
+static NAME_TABLE *create_name_table ( int expected_entries )
+{
+  unsigned int size = NAME_TABLE_INITIAL_SIZE;
+  while ( size < 2*(unsigned int)expected_entries ) size <<= 1;
+  NAME_TABLE *table = (NAME_TABLE *) malloc(sizeof(NAME_TABLE));
+  table->entries = (NAME_TABLE_ENTRY *) calloc(size, sizeof(NAME_TABLE_ENTRY));
+  table->mask = size - 1;
+  table->num_entries = 0;
+  return table;
+}
+
+static void free_name_table ( NAME_TABLE *table )
+{
+  free(table->entries);
+  free(table);
+}
+
+static unsigned int hash_name ( const char *name, int length )
+{
+  unsigned int h = compute_hash ( name, length, 0 );
+  return h ^ (h >> 15);
+}
+
+// Returns the slot holding the name or the empty slot where it belongs
+static NAME_TABLE_ENTRY *find_name_table_entry ( NAME_TABLE *table, const char *name, int length,
+						  unsigned int hash )
+{
+  unsigned int slot = hash & table->mask;
+  NAME_TABLE_ENTRY *entry;
+  while ( 1 ) {
+    entry = &table->entries[slot];
+    if ( entry->name == NULL ) return entry;
+    if ( entry->hash == hash && entry->length == length && memcmp ( entry->name, name, length ) == 0 ) 
+      return entry;
+    slot = (slot + 1) & table->mask;
+  }
+}
+
+static void grow_name_table ( NAME_TABLE *table )
+{
+  NAME_TABLE_ENTRY *old_entries = table->entries;
+  unsigned int i, old_size = table->mask + 1;
+  table->entries = (NAME_TABLE_ENTRY *) calloc(2*old_size, sizeof(NAME_TABLE_ENTRY));
+  table->mask = 2*old_size - 1;
+  for ( i=0; i<old_size; i++ ) {
+    if ( old_entries[i].name != NULL ) 
+      *find_name_table_entry ( table, old_entries[i].name, old_entries[i].length, old_entries[i].hash ) = old_entries[i];
+  }
+  free(old_entries);
+}
+
+static void add_name_table_entry ( NAME_TABLE *table, NAME_TABLE_ENTRY *entry, char *name, int length, 
+				   unsigned int hash, int index )
+{
+  entry->name = name;
+  entry->length = length;
+  entry->index = index;
+  entry->hash = hash;
+  table->num_entries++;
+  if ( 2*(unsigned int)table->num_entries > table->mask ) grow_name_table ( table );
+}
+
+// Parse a count value. Plain integers are converted directly; anything
+// else goes through atof as in load_sparse_feature_vector_combined
+static float parse_count_value ( const char *start, const char *end )
+{
+  const char *p = start;
+  double value = 0;
+  if ( end - start > 0 && end - start <= 15 ) {
+    while ( p < end && *p >= '0' && *p <= '9' ) value = 10*value + (*p++ - '0');
+    if ( p == end ) return (float) value;
+  }
+  char buffer[64];
+  int length = end - start < 63 ? end - start : 63;
+  memcpy ( buffer, start, length );
+  buffer[length] = '\0';
+  return (float) atof(buffer);
+}
+
+// Sort keys in increasing order: quicksort down to small ranges, which
+// are finished by insertion sort
+static void sort_feature_keys ( unsigned long *keys, int n )
+{
+  int i, j;
+  unsigned long key, pivot;
+  while ( n > NAME_TABLE_INSERTION_SORT_MAX ) {
+    unsigned long a = keys[0], b = keys[n/2], c = keys[n-1];
+    pivot = a < b ? ( b < c ? b : ( a < c ? c : a ) ) : ( a < c ? a : ( b < c ? c : b ) );
+    i = 0;
+    j = n-1;
+    while ( i <= j ) {
+      while ( keys[i] < pivot ) i++;
+      while ( keys[j] > pivot ) j--;
+      if ( i <= j ) {
+	key = keys[i];
+	keys[i++] = keys[j];
+	keys[j--] = key;
+      }
+    }
+    // Recurse into the smaller part and loop on the larger one
+    if ( j+1 < n-i ) {
+      sort_feature_keys ( keys, j+1 );
+      keys += i;
+      n -= i;
+    } else {
+      sort_feature_keys ( keys+i, n-i );
+      n = j+1;
+    }
+  }
+  for ( i=1; i<n; i++ ) {
+    key = keys[i];
+    for ( j=i; j>0 && keys[j-1] > key; j-- ) keys[j] = keys[j-1];
+    keys[j] = key;
+  }
+}
+
+/*******************************************************************************************/
+
+SPARSE_CORPUS *create_sparse_corpus ( int num_vectors, long num_nonzeros, long names_size )
+{
+  SPARSE_CORPUS *corpus = (SPARSE_CORPUS *) malloc(sizeof(SPARSE_CORPUS));
+  corpus->num_vectors = num_vectors;
+  corpus->num_nonzeros = num_nonzeros;
+  corpus->row_offsets = (long *) calloc((size_t)num_vectors+1, sizeof(long));
+  corpus->feature_indices = (int *) calloc((size_t)num_nonzeros+1, sizeof(int));
+  corpus->feature_values = (float *) calloc((size_t)num_nonzeros+1, sizeof(float));
+  corpus->total_sums = (float *) calloc((size_t)num_vectors+1, sizeof(float));
+  corpus->name_offsets = (long *) calloc((size_t)num_vectors+1, sizeof(long));
+  corpus->names = (char *) calloc((size_t)names_size+1, sizeof(char));
+  corpus->mapping = NULL;
+  corpus->mapping_size = 0;
+  corpus->packed_rows = NULL;
+  corpus->packed_offsets = NULL;
+  if ( corpus->row_offsets == NULL || corpus->feature_indices == NULL || corpus->feature_values == NULL ||
+       corpus->total_sums == NULL || corpus->name_offsets == NULL || corpus->names == NULL )
+    die ( "create_sparse_corpus: Unable to allocate %d vectors with %ld features\n", num_vectors, num_nonzeros );
+  return corpus;
+}
+
+void free_sparse_corpus ( SPARSE_CORPUS *corpus )
+{
+  if ( corpus->mapping != NULL ) {
+    munmap ( corpus->mapping, corpus->mapping_size );
+  } else {
+    free(corpus->row_offsets);
+    free(corpus->feature_indices);
+    free(corpus->feature_values);
+    free(corpus->total_sums);
+    free(corpus->name_offsets);
+    free(corpus->names);
+  }
+  free(corpus->packed_rows);
+  free(corpus->packed_offsets);
+  free(corpus);
+}
+
+// Returns vectors whose file names, indices and values point into the rows
+// of the corpus, in corpus order. The vectors own the corpus, which is
+// freed with them by free_sparse_feature_vectors.
+SPARSE_FEATURE_VECTORS *create_sparse_corpus_view ( SPARSE_CORPUS *corpus, FEATURE_SET *feature_set )
+{
+  int d, num_vectors = corpus->num_vectors;
+  SPARSE_FEATURE_VECTORS *feature_vectors = (SPARSE_FEATURE_VECTORS *) malloc(sizeof(SPARSE_FEATURE_VECTORS));
+  feature_vectors->num_vectors = num_vectors;
+  feature_vectors->num_sets = -1;
+  feature_vectors->feature_set = feature_set;
+  feature_vectors->class_set = NULL;
+  feature_vectors->corpus = corpus;
+  feature_vectors->vector_block = (SPARSE_FEATURE_VECTOR *) calloc((size_t)num_vectors+1, sizeof(SPARSE_FEATURE_VECTOR));
+  feature_vectors->vectors = (SPARSE_FEATURE_VECTOR **) calloc((size_t)num_vectors+1, sizeof(SPARSE_FEATURE_VECTOR *));
+  for ( d=0; d<num_vectors; d++ ) {
+    SPARSE_FEATURE_VECTOR *vector = &feature_vectors->vector_block[d];
+    vector->filename = SPARSE_CORPUS_ROW_NAME(corpus,d);
+    vector->set_id = -1;
+    vector->num_labels = -1;
+    vector->class_ids = NULL;
+    vector->class_id = -1;
+    vector->num_features = SPARSE_CORPUS_ROW_LENGTH(corpus,d);
+    vector->feature_indices = SPARSE_CORPUS_ROW_INDICES(corpus,d);
+    vector->feature_values = SPARSE_CORPUS_ROW_VALUES(corpus,d);
+    vector->total_sum = corpus->total_sums[d];
+    feature_vectors->vectors[d] = vector;
+  }
+  return feature_vectors;
+}
+
+// After the vectors of a corpus view have been shortened in place, close
+// the gaps this left between the corpus rows and bring the row offsets
+// and totals back in line with the vectors
+static void compact_sparse_corpus_view ( SPARSE_FEATURE_VECTORS *feature_vectors )
+{
+  SPARSE_CORPUS *corpus = feature_vectors->corpus;
+  long offset = 0;
+  int d;
+  for ( d=0; d<corpus->num_vectors; d++ ) {
+    SPARSE_FEATURE_VECTOR *vector = &feature_vectors->vector_block[d];
+    if ( vector->feature_indices != corpus->feature_indices + offset ) {
+      memmove ( corpus->feature_indices + offset, vector->feature_indices, vector->num_features*sizeof(int) );
+      memmove ( corpus->feature_values + offset, vector->feature_values, vector->num_features*sizeof(float) );
+      vector->feature_indices = corpus->feature_indices + offset;
+      vector->feature_values = corpus->feature_values + offset;
+    }
+    corpus->row_offsets[d] = offset;
+    corpus->total_sums[d] = vector->total_sum;
+    offset += vector->num_features;
+  }
+  corpus->row_offsets[corpus->num_vectors] = offset;
+  corpus->num_nonzeros = offset;
+}
+
+// Join corpora end to end, copying the parts in parallel
+static SPARSE_CORPUS *concatenate_sparse_corpora ( SPARSE_CORPUS **parts, int num_parts )
+{
+  int p, num_vectors = 0;
+  long num_nonzeros = 0, names_size = 0;
+  int *vector_starts = (int *) calloc((size_t)num_parts+1, sizeof(int));
+  long *nonzero_starts = (long *) calloc((size_t)num_parts+1, sizeof(long));
+  long *name_starts = (long *) calloc((size_t)num_parts+1, sizeof(long));
+  for ( p=0; p<num_parts; p++ ) {
+    vector_starts[p] = num_vectors;
+    nonzero_starts[p] = num_nonzeros;
+    name_starts[p] = names_size;
+    num_vectors += parts[p]->num_vectors;
+    num_nonzeros += parts[p]->num_nonzeros;
+    names_size += parts[p]->name_offsets[parts[p]->num_vectors];
+  }
+  SPARSE_CORPUS *corpus = create_sparse_corpus ( num_vectors, num_nonzeros, names_size );
+
+#pragma omp parallel for schedule(dynamic,1)
+  for ( p=0; p<num_parts; p++ ) {
+    SPARSE_CORPUS *part = parts[p];
+    int d, n = part->num_vectors;
+    for ( d=0; d<n; d++ ) {
+      corpus->row_offsets[vector_starts[p]+d] = nonzero_starts[p] + part->row_offsets[d];
+      corpus->name_offsets[vector_starts[p]+d] = name_starts[p] + part->name_offsets[d];
+    }
+    memcpy ( corpus->feature_indices + nonzero_starts[p], part->feature_indices, part->num_nonzeros*sizeof(int) );
+    memcpy ( corpus->feature_values + nonzero_starts[p], part->feature_values, part->num_nonzeros*sizeof(float) );
+    memcpy ( corpus->total_sums + vector_starts[p], part->total_sums, n*sizeof(float) );
+    memcpy ( corpus->names + name_starts[p], part->names, part->name_offsets[n] );
+  }
+  corpus->row_offsets[num_vectors] = num_nonzeros;
+  corpus->name_offsets[num_vectors] = names_size;
+
+  free(vector_starts);
+  free(nonzero_starts);
+  free(name_starts);
+  return corpus;
+}
+
+/*******************************************************************************************/
+
+#define IS_COUNT_FILE_SPACE(c) ( (c) == ' ' || (c) == '\t' || (c) == '\r' )
+
+// Files smaller than this many bytes per chunk are split into fewer chunks
+#define COUNT_FILE_MIN_CHUNK_SIZE (1<<20)
+
+// A newline aligned piece of a combined count file, starting at byte
+// offset in the file, with the vectors parsed from it into a corpus of
+// its own. When the feature set is being built, each chunk numbers the
+// words it sees in its own table, and index_map takes those numbers to
+// the merged feature set. The corpus and table are kept from one call of
+// parse_count_file_chunk to the next, so a stream can be parsed as a
+// series of pieces that all append to the same chunk
+typedef struct COUNT_FILE_CHUNK {
+  const char *start;
+  const char *end;
+  long offset;
+  SPARSE_CORPUS *corpus;
+  int max_vectors;
+  long max_nonzeros;
+  long max_names_size;
+  NAME_TABLE *table;
+  int num_words;
+  int *index_map;
+} COUNT_FILE_CHUNK;
+
+// Parse the lines of a chunk. Words are looked up in the given table, or
+// in the chunk's own table when it is NULL, where new words that are not
+// in the stop list are numbered in order of first appearance (stop words
+// are remembered with index -1). Features are sorted by index only when
+// sort_features is set, i.e. when the indices are final; otherwise they
+// are left in file order for remap_sparse_feature_vector
+static void parse_count_file_chunk ( COUNT_FILE_CHUNK *chunk, NAME_TABLE *given_table, int filler_index,
+				     HASHTABLE *stop_list_hash, int sort_features, char *count_fn )
+{
+  NAME_TABLE *table = given_table;
+  if ( table == NULL ) {
+    if ( chunk->table == NULL ) chunk->table = create_name_table ( 0 );
+    table = chunk->table;
+  }
+  NAME_TABLE_ENTRY *entry;
+  char stop_word[1024];
+  int i;
+
+  // The chunk corpus arrays grow as lines are parsed
+  if ( chunk->corpus == NULL ) {
+    chunk->max_vectors = 1024;
+    chunk->max_nonzeros = 16384;
+    chunk->max_names_size = 16384;
+    chunk->corpus = create_sparse_corpus ( chunk->max_vectors, chunk->max_nonzeros, chunk->max_names_size );
+    chunk->corpus->num_vectors = 0;
+    chunk->corpus->num_nonzeros = 0;
+  }
+  SPARSE_CORPUS *corpus = chunk->corpus;
+  int max_vectors = chunk->max_vectors;
+  long max_nonzeros = chunk->max_nonzeros, max_names_size = chunk->max_names_size;
+
+  // Scratch space for the features of a line, keyed by index and then
+  // position on the line, and their values
+  int max_line_features = 1024;
+  unsigned long *keys = (unsigned long *) calloc(max_line_features, sizeof(unsigned long));
+  float *values = (float *) calloc(max_line_features, sizeof(float));
+
+  const char *p = chunk->start, *token, *bar, *line_end;
+  while ( p < chunk->end ) {
+    line_end = memchr ( p, '\n', chunk->end - p );
+    if ( line_end == NULL ) line_end = chunk->end;
+
+    // The first token is the file name
+    while ( p < line_end && IS_COUNT_FILE_SPACE(*p) ) p++;
+    if ( p == line_end ) 
+      die ("Bad format at byte %ld of file '%s' \n", chunk->offset + (long)(p - chunk->start), count_fn);
+    token = p;
+    while ( p < line_end && !IS_COUNT_FILE_SPACE(*p) ) p++;
+    int d = corpus->num_vectors;
+    if ( d+1 >= max_vectors ) {
+      max_vectors *= 2;
+      corpus->row_offsets = (long *) realloc(corpus->row_offsets, (max_vectors+1)*sizeof(long));
+      corpus->total_sums = (float *) realloc(corpus->total_sums, (max_vectors+1)*sizeof(float));
+      corpus->name_offsets = (long *) realloc(corpus->name_offsets, (max_vectors+1)*sizeof(long));
+    }
+    long names_size = corpus->name_offsets[d];
+    while ( names_size + (p - token) + 1 > max_names_size ) {
+      max_names_size *= 2;
+      corpus->names = (char *) realloc(corpus->names, max_names_size);
+    }
+    memcpy ( corpus->names + names_size, token, p - token );
+    corpus->names[names_size + (p - token)] = '\0';
+    corpus->name_offsets[d+1] = names_size + (p - token) + 1;
+
+    // Then the word|count tokens
+    int n = 0;
+    float total_sum = 0;
+    while ( 1 ) {
+      while ( p < line_end && IS_COUNT_FILE_SPACE(*p) ) p++;
+      if ( p == line_end ) break;
+      token = p;
+      bar = NULL;
+      while ( p < line_end && !IS_COUNT_FILE_SPACE(*p) ) {
+	if ( *p == '|' && bar == NULL ) bar = p;
+	p++;
+      }
+      int length = ( bar != NULL ? bar : p ) - token;
+      int index = -1;
+      unsigned int hash = hash_name ( token, length );
+      entry = find_name_table_entry ( table, token, length, hash );
+      if ( entry->name != NULL ) {
+	index = entry->index;
+      } else if ( given_table == NULL ) {
+	int stopped = 0;
+	if ( stop_list_hash != NULL && length < (int)sizeof(stop_word) ) {
+	  memcpy ( stop_word, token, length );
+	  stop_word[length] = '\0';
+	  stopped = ( get_hashtable_string_index ( stop_list_hash, stop_word ) != -1 );
+	}
+	if ( !stopped ) index = chunk->num_words++;
+	add_name_table_entry ( table, entry, strndup ( token, length ), length, hash, index );
+      } else {
+	index = filler_index;
+      }
+      if ( index < 0 || bar == NULL ) continue;
+
+      // The count runs from the bar to the next bar or the token end
+      const char *count_end = memchr ( bar+1, '|', p - (bar+1) );
+      if ( count_end == NULL ) count_end = p;
+      if ( count_end == bar+1 ) continue;
+      float value = parse_count_value ( bar+1, count_end );
+      if ( isnan(value) || isinf(value) ) 
+	die ("Nan detected in file : %.*s\n", (int)(p - token), token);
+      if ( n == max_line_features ) {
+	max_line_features *= 2;
+	keys = (unsigned long *) realloc(keys, max_line_features*sizeof(unsigned long));
+	values = (float *) realloc(values, max_line_features*sizeof(float));
+      }
+      keys[n] = ((unsigned long)index << 32) | (unsigned long)n;
+      values[n] = value;
+      total_sum += value;
+      n++;
+    }
+
+    // Sort the features by index, keeping repeated features in file order,
+    // and append them to the chunk corpus
+    if ( sort_features ) sort_feature_keys ( keys, n );
+    long offset = corpus->row_offsets[d];
+    if ( offset + n > max_nonzeros ) {
+      while ( offset + n > max_nonzeros ) max_nonzeros *= 2;
+      corpus->feature_indices = (int *) realloc(corpus->feature_indices, max_nonzeros*sizeof(int));
+      corpus->feature_values = (float *) realloc(corpus->feature_values, max_nonzeros*sizeof(float));
+    }
+    for ( i=0; i<n; i++ ) {
+      corpus->feature_indices[offset+i] = (int)(keys[i] >> 32);
+      corpus->feature_values[offset+i] = values[keys[i] & 0xffffffffUL];
+    }
+    corpus->row_offsets[d+1] = offset + n;
+    corpus->total_sums[d] = total_sum;
+    corpus->num_vectors++;
+    corpus->num_nonzeros += n;
+    p = line_end + 1;
+  }
+  chunk->max_vectors = max_vectors;
+  chunk->max_nonzeros = max_nonzeros;
+  chunk->max_names_size = max_names_size;
+  free(keys);
+  free(values);
+}
+
+// Map the feature indices of a vector, in file order, to new indices and
+// sort them, keeping repeated features in file order. Features mapped to
+// -1 are dropped and taken out of the total
+static void remap_sparse_feature_vector ( SPARSE_FEATURE_VECTOR *vector, int *index_map, 
+					  unsigned long **keys_ptr, float **values_ptr, int *max_features_ptr )
+{
+  int i, index, n = 0;
+  if ( vector->num_features > *max_features_ptr ) {
+    *max_features_ptr = vector->num_features;
+    *keys_ptr = (unsigned long *) realloc(*keys_ptr, vector->num_features*sizeof(unsigned long));
+    *values_ptr = (float *) realloc(*values_ptr, vector->num_features*sizeof(float));
+  }
+  unsigned long *keys = *keys_ptr;
+  float *values = *values_ptr;
+  float total_sum = 0;
+  for ( i=0; i<vector->num_features; i++ ) {
+    index = index_map[vector->feature_indices[i]];
+    if ( index < 0 ) continue;
+    keys[n] = ((unsigned long)index << 32) | (unsigned long)n;
+    values[n] = vector->feature_values[i];
+    total_sum += values[n];
+    n++;
+  }
+  if ( n < vector->num_features ) {
+    vector->num_features = n;
+    vector->total_sum = total_sum;
+  }
+  sort_feature_keys ( keys, n );
+  for ( i=0; i<n; i++ ) {
+    vector->feature_indices[i] = (int)(keys[i] >> 32);
+    vector->feature_values[i] = values[keys[i] & 0xffffffffUL];
+  }
+}
+
+// Index the names of a given feature set by a name table, and find the
+// index of its <filler> feature, if it has one
+static NAME_TABLE *create_feature_set_name_table ( FEATURE_SET *feature_set, int *filler_index_ptr )
+{
+  NAME_TABLE *table = create_name_table ( feature_set->num_features );
+  NAME_TABLE_ENTRY *entry;
+  int i;
+  for ( i=0; i<feature_set->num_features; i++ ) {
+    char *name = feature_set->feature_names[i];
+    unsigned int hash = hash_name ( name, strlen(name) );
+    entry = find_name_table_entry ( table, name, strlen(name), hash );
+    if ( entry->name == NULL ) add_name_table_entry ( table, entry, name, strlen(name), hash, i );
+  }
+  int filler_index = get_hashtable_string_index ( feature_set->feature_name_to_index_hash, "<filler>" );
+  *filler_index_ptr = ( filler_index < feature_set->num_features ) ? filler_index : -1;
+  return table;
+}
+
+// Make a feature set with unit weights that takes ownership of the given
+// array of names
+static FEATURE_SET *create_feature_set_from_names ( char **feature_names, int num_features )
+{
+  int i;
+  FEATURE_SET *feature_set = (FEATURE_SET *) malloc(sizeof(FEATURE_SET));
+  feature_set->num_features = num_features;
+  feature_set->feature_names = (char **) realloc(feature_names, ((size_t)num_features+1)*sizeof(char *));
+  feature_set->feature_names[num_features] = NULL;
+  feature_set->feature_weights = (float *) calloc((size_t)num_features+1, sizeof(float));
+  feature_set->num_words = NULL;
+  HASHTABLE *hash = hdbmcreate( (unsigned)(num_features > 1000 ? num_features : 1000), hash2);
+  for ( i=0; i<num_features; i++ ) {
+    store_hashtable_string_index ( hash, feature_set->feature_names[i], i );
+    feature_set->feature_weights[i] = 1.0;
+  }
+  feature_set->feature_name_to_index_hash = hash;
+  return feature_set;
+}
+
+// Load the feature vectors of a combined count file (one "filename w|c
+// w|c ..." line per vector) from a memory mapping of the file. The file
+// is split into newline aligned chunks that are parsed in parallel, and
+// the vectors are returned in file order. If *feature_set_ptr is NULL the
+// feature set is built at the same time: each chunk collects its own
+// words, the chunk vocabularies are merged in file order so that words
+// are numbered in order of first appearance in the file, leaving out
+// words in the stop list, as create_feature_set_from_file does, and the
+// vectors of later chunks are then remapped in parallel. Otherwise words
+// are looked up in the given set with the same <filler> handling as
+// load_sparse_feature_vectors_combined. Lines are tokenized in place 
+// without copying the line or its tokens, and the vectors are returned as
+// a view of one contiguous corpus.
+SPARSE_FEATURE_VECTORS *load_sparse_feature_vectors_combined_mmap ( char *count_fn, FEATURE_SET **feature_set_ptr,
+								    FEATURE_SET *stop_list, CLASS_SET *class_set )
+{
+  if (class_set != NULL) 
+     die("Unimplemented feature.\n");
+
+  double start_time = get_wall_time();
+  FILE *fp = fopen_safe(count_fn, "r");
+  struct stat file_stat;
+  if ( fstat ( fileno(fp), &file_stat ) != 0 ) 
+    die ("Unable to stat file '%s'\n", count_fn);
+  size_t file_size = file_stat.st_size;
+  if ( file_size == 0 ) 
+    die ("Specified file is empty: %s\n", count_fn);
+  const char *data = (const char *) mmap ( NULL, file_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0 );
+  if ( data == MAP_FAILED ) 
+    die ("Unable to map file '%s'\n", count_fn);
+  madvise ( (void *)data, file_size, MADV_SEQUENTIAL );
+  fclose(fp);
+
+  // Index the given feature set
+  FEATURE_SET *feature_set = *feature_set_ptr;
+  int build_features = ( feature_set == NULL );
+  NAME_TABLE *table = NULL;
+  NAME_TABLE_ENTRY *entry;
+  int c, j, num_features = 0, filler_index = -1;
+  if ( !build_features ) table = create_feature_set_name_table ( feature_set, &filler_index );
+  HASHTABLE *stop_list_hash = NULL;
+  if ( stop_list != NULL ) stop_list_hash = stop_list->feature_name_to_index_hash;
+
+  // Split the file at the first newline after each chunk's share of bytes
+  int num_chunks = get_num_threads();
+  if ( (size_t)num_chunks > file_size/COUNT_FILE_MIN_CHUNK_SIZE + 1 ) 
+    num_chunks = file_size/COUNT_FILE_MIN_CHUNK_SIZE + 1;
+  COUNT_FILE_CHUNK *chunks = (COUNT_FILE_CHUNK *) calloc((size_t)num_chunks, sizeof(COUNT_FILE_CHUNK));
+  const char *chunk_start = data, *data_end = data + file_size;
+  for ( c=0; c<num_chunks; c++ ) {
+    const char *chunk_end = data + (file_size*(c+1))/num_chunks;
+    if ( chunk_end < chunk_start ) chunk_end = chunk_start;
+    if ( chunk_end < data_end ) {
+      chunk_end = memchr ( chunk_end, '\n', data_end - chunk_end );
+      chunk_end = ( chunk_end == NULL ) ? data_end : chunk_end + 1;
+    }
+    chunks[c].start = chunk_start;
+    chunks[c].end = chunk_end;
+    chunks[c].offset = chunk_start - data;
+    chunk_start = chunk_end;
+  }
+
+  // The words of the first chunk come first in the file, so its indices
+  // are already final
+#pragma omp parallel for schedule(dynamic,1)
+  for ( c=0; c<num_chunks; c++ ) 
+    parse_count_file_chunk ( &chunks[c], table, filler_index, stop_list_hash, 
+			     !build_features || c == 0, count_fn );
+  munmap ( (void *)data, file_size );
+
+  // Merge the chunk vocabularies in file order
+  if ( build_features ) {
+    table = create_name_table ( chunks[0].num_words );
+    int max_features = 1024;
+    char **feature_names = (char **) calloc((size_t)max_features, sizeof(char *));
+    NAME_TABLE_ENTRY *words = NULL;
+    for ( c=0; c<num_chunks; c++ ) {
+      NAME_TABLE *chunk_table = chunks[c].table;
+      int num_words = chunks[c].num_words;
+      words = (NAME_TABLE_ENTRY *) realloc(words, (num_words+1)*sizeof(NAME_TABLE_ENTRY));
+      unsigned int slot;
+      for ( slot=0; slot<=chunk_table->mask; slot++ ) {
+	entry = &chunk_table->entries[slot];
+	if ( entry->name == NULL ) continue;
+	if ( entry->index < 0 ) free(entry->name);
+	else words[entry->index] = *entry;
+      }
+      chunks[c].index_map = (int *) calloc((size_t)num_words+1, sizeof(int));
+      for ( j=0; j<num_words; j++ ) {
+	entry = find_name_table_entry ( table, words[j].name, words[j].length, words[j].hash );
+	if ( entry->name != NULL ) {
+	  free(words[j].name);
+	  chunks[c].index_map[j] = entry->index;
+	} else {
+	  if ( num_features == max_features ) {
+	    max_features *= 2;
+	    feature_names = (char **) realloc(feature_names, max_features*sizeof(char *));
+	  }
+	  feature_names[num_features] = words[j].name;
+	  chunks[c].index_map[j] = num_features;
+	  add_name_table_entry ( table, entry, words[j].name, words[j].length, words[j].hash, num_features++ );
+	}
+      }
+      free_name_table ( chunk_table );
+    }
+    free(words);
+    feature_set = create_feature_set_from_names ( feature_names, num_features );
+    *feature_set_ptr = feature_set;
+  }
+  free_name_table ( table );
+
+  // Join the chunk corpora in file order, and view the result as vectors
+  int num_vectors = 0;
+  int *chunk_offsets = (int *) calloc((size_t)num_chunks+1, sizeof(int));
+  SPARSE_CORPUS **parts = (SPARSE_CORPUS **) calloc((size_t)num_chunks, sizeof(SPARSE_CORPUS *));
+  for ( c=0; c<num_chunks; c++ ) {
+    chunk_offsets[c] = num_vectors;
+    num_vectors += chunks[c].corpus->num_vectors;
+    parts[c] = chunks[c].corpus;
+  }
+  chunk_offsets[num_chunks] = num_vectors;
+  SPARSE_CORPUS *corpus = parts[0];
+  if ( num_chunks > 1 ) {
+    corpus = concatenate_sparse_corpora ( parts, num_chunks );
+    for ( c=0; c<num_chunks; c++ ) 
+      free_sparse_corpus ( parts[c] );
+  } else {
+    // Give back the room the chunk arrays grew into
+    corpus->feature_indices = (int *) realloc(corpus->feature_indices, (corpus->num_nonzeros+1)*sizeof(int));
+    corpus->feature_values = (float *) realloc(corpus->feature_values, (corpus->num_nonzeros+1)*sizeof(float));
+    corpus->names = (char *) realloc(corpus->names, corpus->name_offsets[num_vectors]+1);
+  }
+  free(parts);
+  SPARSE_FEATURE_VECTORS *feature_vectors = create_sparse_corpus_view ( corpus, feature_set );
+  feature_vectors->class_set = class_set;
+
+  // Remap the vectors of the later chunks to the merged feature set
+  if ( build_features && num_vectors > chunk_offsets[1] ) {
+#pragma omp parallel
+    {
+      int v, max_features = 1024, chunk = 1;
+      unsigned long *keys = (unsigned long *) calloc(max_features, sizeof(unsigned long));
+      float *values = (float *) calloc(max_features, sizeof(float));
+#pragma omp for schedule(dynamic,256)
+      for ( v=chunk_offsets[1]; v<num_vectors; v++ ) {
+	while ( v < chunk_offsets[chunk] || v >= chunk_offsets[chunk+1] ) 
+	  chunk = ( v < chunk_offsets[chunk] ) ? 1 : chunk + 1;
+	remap_sparse_feature_vector ( feature_vectors->vectors[v], chunks[chunk].index_map, &keys, &values, &max_features );
+      }
+      free(keys);
+      free(values);
+    }
+  }
+  for ( c=0; c<num_chunks; c++ ) 
+    free(chunks[c].index_map);
+  free(chunks);
+  free(chunk_offsets);
+
+  double elapsed = get_wall_time() - start_time;
+  printf("%d vectors and %d features from %.1f MB in %d chunks at %.2f GB/s...", num_vectors, 
+	 feature_set->num_features, file_size/1e6, num_chunks, elapsed > 0 ? file_size/1e9/elapsed : 0.0);
+  fflush(stdout);
+
+  return feature_vectors;
+}
+
+// Binary corpus files hold a whole set of sparse feature vectors in one
+// memory mappable file. A header gives the sizes and the offsets of the
+// sections, each of which starts on an aligned boundary:
+//   vocabulary: num_features+1 long offsets, then the NUL terminated names
+//   doc ids: num_vectors+1 long offsets, then the NUL terminated file names
+//   row offsets: num_vectors+1 longs into the indices and values
+//   indices: num_nonzeros ints, sorted by index within each vector
+//   values: num_nonzeros floats
+//   total sums: num_vectors floats
+// String offsets are relative to the first name of their section.
+#define BINARY_CORPUS_FILE_MAGIC "BINARY_CORPUS\n"
+#define BINARY_CORPUS_FILE_VERSION 1
+#define BINARY_CORPUS_FILE_ALIGNMENT 64
+#define BINARY_CORPUS_ALIGN(offset) \
+  ( ((offset) + BINARY_CORPUS_FILE_ALIGNMENT - 1) / BINARY_CORPUS_FILE_ALIGNMENT * BINARY_CORPUS_FILE_ALIGNMENT )
+
+// Count files that are not plain text are recognized by the magic number
+// at their start
+#define GZIP_FILE_MAGIC "\x1f\x8b"
+#define ZSTD_FILE_MAGIC "\x28\xb5\x2f\xfd"
+
+#define COUNT_STREAM_TEXT 0
+#define COUNT_STREAM_GZIP 1
+#define COUNT_STREAM_ZSTD 2
+
+static int count_stream_format ( const unsigned char *data, size_t length )
+{
+  if ( length >= 2 && memcmp ( data, GZIP_FILE_MAGIC, 2 ) == 0 ) return COUNT_STREAM_GZIP;
+  if ( length >= 4 && memcmp ( data, ZSTD_FILE_MAGIC, 4 ) == 0 ) return COUNT_STREAM_ZSTD;
+  return COUNT_STREAM_TEXT;
+}
+
+// Count files named "-" are read from standard input, and count files
+// that are pipes or other special files can only be read as a stream
+int is_count_file_pipe ( char *filename )
+{
+  struct stat file_stat;
+  if ( strcmp ( filename, "-" ) == 0 ) return 1;
+  if ( stat ( filename, &file_stat ) != 0 ) 
+    die ("Unable to stat file '%s'\n", filename);
+  return !S_ISREG ( file_stat.st_mode );
+}
+
+int is_compressed_count_file ( char *filename )
+{
+  unsigned char magic[4];
+  FILE *fp = fopen_safe ( filename, "r" );
+  size_t length = fread ( magic, 1, sizeof(magic), fp );
+  fclose(fp);
+  return ( count_stream_format ( magic, length ) != COUNT_STREAM_TEXT );
+}
+
+// A count file is read as a stream of text through a ring of blocks. A
+// reader thread decompresses the file into the free blocks, while the
+// lines of the filled blocks are parsed, so the file is read once from
+// front to back, and decompression overlaps with parsing
+#define COUNT_STREAM_INPUT_SIZE (1<<20)
+#define COUNT_STREAM_BLOCK_SIZE (4<<20)
+#define COUNT_STREAM_NUM_BLOCKS 4
+
+typedef struct COUNT_STREAM {
+  char *count_fn;
+  FILE *fp;
+  int format;
+  unsigned char *input;  // Bytes read from the file, not yet decompressed
+  size_t input_pos;
+  size_t input_length;
+  int frame_ended;       // Set when the input so far is a whole number of compressed frames
+  z_stream gzip;
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zstd;
+#endif
+  char *blocks[COUNT_STREAM_NUM_BLOCKS];
+  long lengths[COUNT_STREAM_NUM_BLOCKS];  // Text in each block, 0 at the end of the file, -1 if free
+  pthread_t reader;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} COUNT_STREAM;
+
+// Read the next bytes of the file, returning 0 at its end
+static int refill_count_stream_input ( COUNT_STREAM *stream )
+{
+  stream->input_length = fread ( stream->input, 1, COUNT_STREAM_INPUT_SIZE, stream->fp );
+  stream->input_pos = 0;
+  if ( ferror ( stream->fp ) ) 
+    die ("Error reading file '%s'\n", stream->count_fn);
+  return ( stream->input_length > 0 );
+}
+
+// Fill a buffer with the next size bytes of text, or with what is left of
+// it, and return the number of bytes read. Concatenated gzip members and
+// zstd frames are read as one stream
+static long read_count_stream ( COUNT_STREAM *stream, char *buffer, long size )
+{
+  long length = 0;
+  while ( length < size ) {
+    if ( stream->input_pos == stream->input_length && !refill_count_stream_input ( stream ) ) {
+      if ( !stream->frame_ended ) 
+	die ("Compressed file '%s' is truncated\n", stream->count_fn);
+      break;
+    }
+    unsigned char *input = stream->input + stream->input_pos;
+    size_t available = stream->input_length - stream->input_pos;
+    if ( stream->format == COUNT_STREAM_TEXT ) {
+      if ( available > (size_t)(size - length) ) available = size - length;
+      memcpy ( buffer + length, input, available );
+      stream->input_pos += available;
+      length += available;
+    } else if ( stream->format == COUNT_STREAM_GZIP ) {
+      z_stream *gzip = &stream->gzip;
+      if ( stream->frame_ended ) {
+	inflateReset ( gzip );
+	stream->frame_ended = 0;
+      }
+      gzip->next_in = input;
+      gzip->avail_in = available;
+      gzip->next_out = (unsigned char *)buffer + length;
+      gzip->avail_out = size - length;
+      int status = inflate ( gzip, Z_NO_FLUSH );
+      if ( status != Z_OK && status != Z_STREAM_END ) 
+	die ("Error decompressing file '%s': %s\n", stream->count_fn, gzip->msg != NULL ? gzip->msg : "bad data");
+      stream->input_pos += available - gzip->avail_in;
+      length = size - gzip->avail_out;
+      stream->frame_ended = ( status == Z_STREAM_END );
+    } else {
+#ifdef HAVE_ZSTD
+      ZSTD_inBuffer in = { input, available, 0 };
+      ZSTD_outBuffer out = { buffer, (size_t)size, (size_t)length };
+      size_t status = ZSTD_decompressStream ( stream->zstd, &out, &in );
+      if ( ZSTD_isError ( status ) ) 
+	die ("Error decompressing file '%s': %s\n", stream->count_fn, ZSTD_getErrorName ( status ));
+      stream->input_pos += in.pos;
+      length = out.pos;
+      stream->frame_ended = ( status == 0 );
+#endif
+    }
+  }
+  return length;
+}
+
+static void *fill_count_stream_blocks ( void *arg )
+{
+  COUNT_STREAM *stream = (COUNT_STREAM *) arg;
+  int b = 0;
+  long length;
+  do {
+    pthread_mutex_lock ( &stream->lock );
+    while ( stream->lengths[b] >= 0 ) 
+      pthread_cond_wait ( &stream->changed, &stream->lock );
+    pthread_mutex_unlock ( &stream->lock );
+    length = read_count_stream ( stream, stream->blocks[b], COUNT_STREAM_BLOCK_SIZE );
+    pthread_mutex_lock ( &stream->lock );
+    stream->lengths[b] = length;
+    pthread_cond_broadcast ( &stream->changed );
+    pthread_mutex_unlock ( &stream->lock );
+    b = (b+1) % COUNT_STREAM_NUM_BLOCKS;
+  } while ( length > 0 );
+  return NULL;
+}
+
+// Open a count file, or standard input for "-", tell its format from its
+// first bytes, and start the reader thread
+static COUNT_STREAM *open_count_stream ( char *count_fn )
+{
+  int b;
+  COUNT_STREAM *stream = (COUNT_STREAM *) calloc(1, sizeof(COUNT_STREAM));
+  stream->count_fn = count_fn;
+  stream->fp = ( strcmp ( count_fn, "-" ) == 0 ) ? stdin : fopen_safe ( count_fn, "r" );
+  stream->input = (unsigned char *) malloc(COUNT_STREAM_INPUT_SIZE);
+  if ( !refill_count_stream_input ( stream ) ) 
+    die ("Specified file is empty: %s\n", count_fn);
+  if ( stream->input_length >= sizeof(BINARY_CORPUS_FILE_MAGIC) && 
+       memcmp ( stream->input, BINARY_CORPUS_FILE_MAGIC, sizeof(BINARY_CORPUS_FILE_MAGIC) ) == 0 ) 
+    die ("Binary corpus '%s' must be a regular file to be mapped\n", count_fn);
+  stream->format = count_stream_format ( stream->input, stream->input_length );
+  stream->frame_ended = 1;
+  if ( stream->format == COUNT_STREAM_GZIP ) {
+    stream->frame_ended = 0;
+    if ( inflateInit2 ( &stream->gzip, 16 + MAX_WBITS ) != Z_OK ) 
+      die ("Unable to start decompressing file '%s'\n", count_fn);
+  } else if ( stream->format == COUNT_STREAM_ZSTD ) {
+#ifdef HAVE_ZSTD
+    stream->frame_ended = 0;
+    stream->zstd = ZSTD_createDStream();
+    if ( stream->zstd == NULL || ZSTD_isError ( ZSTD_initDStream ( stream->zstd ) ) ) 
+      die ("Unable to start decompressing file '%s'\n", count_fn);
+#else
+    die ("File '%s' is zstd compressed, but zstd support was not built in\n", count_fn);
+#endif
+  }
+  for ( b=0; b<COUNT_STREAM_NUM_BLOCKS; b++ ) {
+    stream->blocks[b] = (char *) malloc(COUNT_STREAM_BLOCK_SIZE);
+    stream->lengths[b] = -1;
+  }
+  pthread_mutex_init ( &stream->lock, NULL );
+  pthread_cond_init ( &stream->changed, NULL );
+  if ( pthread_create ( &stream->reader, NULL, fill_count_stream_blocks, stream ) != 0 ) 
+    die ("Unable to start reader thread for file '%s'\n", count_fn);
+  return stream;
+}
+
+static void close_count_stream ( COUNT_STREAM *stream )
+{
+  int b;
+  pthread_join ( stream->reader, NULL );
+  pthread_mutex_destroy ( &stream->lock );
+  pthread_cond_destroy ( &stream->changed );
+  if ( stream->format == COUNT_STREAM_GZIP ) inflateEnd ( &stream->gzip );
+#ifdef HAVE_ZSTD
+  if ( stream->zstd != NULL ) ZSTD_freeDStream ( stream->zstd );
+#endif
+  for ( b=0; b<COUNT_STREAM_NUM_BLOCKS; b++ ) 
+    free(stream->blocks[b]);
+  free(stream->input);
+  if ( stream->fp != stdin ) fclose(stream->fp);
+  free(stream);
+}
+
+// Add text to the end of the line carried over between blocks
+static void append_count_stream_line ( char **line_ptr, long *length_ptr, long *max_length_ptr,
+				       const char *text, long length )
+{
+  if ( *length_ptr + length > *max_length_ptr ) {
+    while ( *length_ptr + length > *max_length_ptr ) *max_length_ptr = 2*(*max_length_ptr) + 1024;
+    *line_ptr = (char *) realloc(*line_ptr, *max_length_ptr);
+  }
+  memcpy ( *line_ptr + *length_ptr, text, length );
+  *length_ptr += length;
+}
+
+// Load a count file as described for the function below. With
+// extend_features set, a given feature set is extended with the new
+// words of the file rather than used as is: the words of the given set
+// keep their indices, and a new feature set is returned in its place.
+static SPARSE_FEATURE_VECTORS *load_count_stream ( char *count_fn, FEATURE_SET **feature_set_ptr, FEATURE_SET *stop_list,
+						   int extend_features )
+{
+  double start_time = get_wall_time();
+  COUNT_STREAM *stream = open_count_stream ( count_fn );
+
+  FEATURE_SET *feature_set = *feature_set_ptr;
+  int build_features = ( feature_set == NULL || extend_features );
+  NAME_TABLE *table = NULL;
+  int i, filler_index = -1;
+  if ( !build_features ) table = create_feature_set_name_table ( feature_set, &filler_index );
+  HASHTABLE *stop_list_hash = NULL;
+  if ( stop_list != NULL ) stop_list_hash = stop_list->feature_name_to_index_hash;
+
+  // Every piece of text is parsed into the same chunk, whose table then
+  // numbers the words in order of first appearance, so the feature
+  // indices are final as soon as they are seen. Words of a feature set
+  // being extended are numbered first
+  COUNT_FILE_CHUNK chunk;
+  memset ( &chunk, 0, sizeof(COUNT_FILE_CHUNK) );
+  if ( build_features && feature_set != NULL ) {
+    chunk.table = create_name_table ( feature_set->num_features );
+    for ( i=0; i<feature_set->num_features; i++ ) {
+      char *name = feature_set->feature_names[i];
+      unsigned int hash = hash_name ( name, strlen(name) );
+      NAME_TABLE_ENTRY *entry = find_name_table_entry ( chunk.table, name, strlen(name), hash );
+      if ( entry->name != NULL ) 
+	die ("Feature '%s' appears twice in the feature set being extended\n", name);
+      add_name_table_entry ( chunk.table, entry, strdup ( name ), strlen(name), hash, i );
+    }
+    chunk.num_words = feature_set->num_features;
+  }
+  char *line = NULL;
+  long line_length = 0, max_line_length = 0, line_offset = 0, offset = 0;
+  int b = 0;
+  while ( 1 ) {
+    pthread_mutex_lock ( &stream->lock );
+    while ( stream->lengths[b] < 0 ) 
+      pthread_cond_wait ( &stream->changed, &stream->lock );
+    long length = stream->lengths[b];
+    pthread_mutex_unlock ( &stream->lock );
+    if ( length == 0 ) break;
+
+    // The whole lines of the block run up to its last newline. A line
+    // carried over from earlier blocks is finished by the first one
+    const char *block = stream->blocks[b], *block_end = block + length;
+    const char *lines = block, *lines_end = block_end;
+    while ( lines_end > block && lines_end[-1] != '\n' ) lines_end--;
+    if ( line_length > 0 ) {
+      lines = ( lines_end > block ) ? (const char *) memchr ( block, '\n', length ) + 1 : block_end;
+      append_count_stream_line ( &line, &line_length, &max_line_length, block, lines - block );
+      if ( lines_end > block ) {
+	chunk.start = line;
+	chunk.end = line + line_length;
+	chunk.offset = line_offset;
+	parse_count_file_chunk ( &chunk, table, filler_index, stop_list_hash, 1, count_fn );
+	line_length = 0;
+      }
+    }
+    if ( lines < lines_end ) {
+      chunk.start = lines;
+      chunk.end = lines_end;
+      chunk.offset = offset + (lines - block);
+      parse_count_file_chunk ( &chunk, table, filler_index, stop_list_hash, 1, count_fn );
+    }
+    const char *rest = ( lines > lines_end ) ? lines : lines_end;
+    if ( rest < block_end ) {
+      if ( line_length == 0 ) line_offset = offset + (rest - block);
+      append_count_stream_line ( &line, &line_length, &max_line_length, rest, block_end - rest );
+    }
+
+    // Hand the block back to the reader
+    pthread_mutex_lock ( &stream->lock );
+    stream->lengths[b] = -1;
+    pthread_cond_broadcast ( &stream->changed );
+    pthread_mutex_unlock ( &stream->lock );
+    offset += length;
+    b = (b+1) % COUNT_STREAM_NUM_BLOCKS;
+  }
+  close_count_stream ( stream );
+
+  // The file may end without a newline
+  if ( line_length > 0 ) {
+    chunk.start = line;
+    chunk.end = line + line_length;
+    chunk.offset = line_offset;
+    parse_count_file_chunk ( &chunk, table, filler_index, stop_list_hash, 1, count_fn );
+  }
+  free(line);
+  if ( chunk.corpus == NULL ) 
+    die ("Specified file is empty: %s\n", count_fn);
+
+  if ( build_features ) {
+    char **feature_names = (char **) calloc((size_t)chunk.num_words+1, sizeof(char *));
+    unsigned int slot;
+    for ( slot=0; slot<=chunk.table->mask; slot++ ) {
+      NAME_TABLE_ENTRY *entry = &chunk.table->entries[slot];
+      if ( entry->name == NULL ) continue;
+      if ( entry->index < 0 ) free(entry->name);
+      else feature_names[entry->index] = entry->name;
+    }
+    free_name_table ( chunk.table );
+    feature_set = create_feature_set_from_names ( feature_names, chunk.num_words );
+    *feature_set_ptr = feature_set;
+  } else {
+    free_name_table ( table );
+  }
+
+  // Give back the room the corpus arrays grew into
+  SPARSE_CORPUS *corpus = chunk.corpus;
+  int num_vectors = corpus->num_vectors;
+  corpus->feature_indices = (int *) realloc(corpus->feature_indices, (corpus->num_nonzeros+1)*sizeof(int));
+  corpus->feature_values = (float *) realloc(corpus->feature_values, (corpus->num_nonzeros+1)*sizeof(float));
+  corpus->names = (char *) realloc(corpus->names, corpus->name_offsets[num_vectors]+1);
+  SPARSE_FEATURE_VECTORS *feature_vectors = create_sparse_corpus_view ( corpus, feature_set );
+
+  double elapsed = get_wall_time() - start_time;
+  printf("%d vectors and %d features from %.1f MB of text at %.2f GB/s...", num_vectors, 
+	 feature_set->num_features, offset/1e6, elapsed > 0 ? offset/1e9/elapsed : 0.0);
+  fflush(stdout);
+
+  return feature_vectors;
+}
+
+// Load the feature vectors of a combined count file that is plain text or
+// gzip compressed, or zstd compressed when built with HAVE_ZSTD, in a
+// single forward pass over the file. The text is decompressed in a 
+// reader thread, and its lines are parsed as each block arrives, into one
+// corpus that grows as it goes, so the file can be a pipe, or standard
+// input when it is named "-". If *feature_set_ptr is NULL the feature
+// set is built at the same time, with words numbered in order of first
+// appearance in the file and stop list words left out, giving the same
+// feature set and vectors as load_sparse_feature_vectors_combined_mmap.
+SPARSE_FEATURE_VECTORS *load_sparse_feature_vectors_combined_stream ( char *count_fn, FEATURE_SET **feature_set_ptr,
+								      FEATURE_SET *stop_list, CLASS_SET *class_set )
+{
+  if (class_set != NULL) 
+     die("Unimplemented feature.\n");
+  return load_count_stream ( count_fn, feature_set_ptr, stop_list, 0 );
+}
+
+typedef struct BINARY_CORPUS_FILE_HEADER {
+  char magic[16];
+  int version;
+  int num_vectors;
+  int num_features;
+  int first_feature; // Index in the store of the first vocabulary word of a corpus store segment, else 0
+  long num_nonzeros;
+  long vocabulary_offset;
+  long doc_ids_offset;
+  long row_offsets_offset;
+  long indices_offset;
+  long values_offset;
+  long total_sums_offset;
+  long file_size;
+} BINARY_CORPUS_FILE_HEADER;
+
+int is_binary_corpus_file ( char *filename )
+{
+  char magic[16];
+  FILE *fp = fopen_safe ( filename, "r" );
+  int is_binary = ( fread ( magic, 1, sizeof(magic), fp ) == sizeof(magic) &&
+		    strcmp ( magic, BINARY_CORPUS_FILE_MAGIC ) == 0 );
+  fclose(fp);
+  return is_binary;
+}
+
+static long binary_corpus_strings_size ( char **strings, int num_strings )
+{
+  long size = (num_strings+1) * (long)sizeof(long);
+  int i;
+  for ( i=0; i<num_strings; i++ ) 
+    size += ( strings[i] != NULL ? strlen(strings[i]) : 0 ) + 1;
+  return size;
+}
+
+static void dump_binary_corpus_strings ( char **strings, int num_strings, FILE *fp )
+{
+  long offset = 0;
+  int i;
+  for ( i=0; i<=num_strings; i++ ) {
+    fwrite_safe ( &offset, sizeof(long), 1, fp );
+    if ( i < num_strings ) offset += ( strings[i] != NULL ? strlen(strings[i]) : 0 ) + 1;
+  }
+  for ( i=0; i<num_strings; i++ ) 
+    fwrite_safe ( strings[i] != NULL ? strings[i] : "", 1, ( strings[i] != NULL ? strlen(strings[i]) : 0 ) + 1, fp );
+}
+
+static void pad_binary_corpus_file ( long offset, FILE *fp )
+{
+  char padding[BINARY_CORPUS_FILE_ALIGNMENT] = {0};
+  long position = ftell(fp);
+  if ( position > offset ) 
+    die ( "save_binary_corpus: Section overran its offset\n" );
+  fwrite_safe ( padding, 1, offset - position, fp );
+}
+
+// Write the vectors to a binary corpus file whose vocabulary is the
+// num_words names of vocabulary, the features from first_feature on.
+// The features of vectors that are not sorted by index (as in per
+// document BINARY_VECTOR files) are sorted in place first.
+static void write_binary_corpus ( SPARSE_FEATURE_VECTORS *feature_vectors, char **vocabulary, int num_words,
+				  int first_feature, char *filename )
+{
+  int num_vectors = feature_vectors->num_vectors;
+  int i, v, num_features = feature_vectors->feature_set->num_features;
+  if ( feature_vectors->class_set != NULL ) 
+    die("Unimplemented feature.\n");
+  if ( SPARSE_CORPUS_IS_PACKED(feature_vectors->corpus) ) 
+    die("save_binary_corpus: Feature vectors are compressed\n");
+
+  int *identity_map = NULL, max_features = 0;
+  unsigned long *keys = NULL;
+  float *scratch = NULL;
+  for ( v=0; v<num_vectors; v++ ) {
+    SPARSE_FEATURE_VECTOR *vector = feature_vectors->vectors[v];
+    for ( i=1; i<vector->num_features && vector->feature_indices[i-1] <= vector->feature_indices[i]; i++ );
+    if ( i >= vector->num_features ) continue;
+    if ( identity_map == NULL ) {
+      identity_map = (int *) calloc((size_t)num_features+1, sizeof(int));
+      for ( i=0; i<num_features; i++ ) identity_map[i] = i;
+    }
+    remap_sparse_feature_vector ( vector, identity_map, &keys, &scratch, &max_features );
+  }
+  free(identity_map);
+  free(keys);
+  free(scratch);
+
+  char **doc_ids = (char **) calloc((size_t)num_vectors+1, sizeof(char *));
+  long num_nonzeros = 0;
+  for ( v=0; v<num_vectors; v++ ) {
+    doc_ids[v] = feature_vectors->vectors[v]->filename;
+    num_nonzeros += feature_vectors->vectors[v]->num_features;
+  }
+
+  BINARY_CORPUS_FILE_HEADER header;
+  memset ( &header, 0, sizeof(header) );
+  strcpy ( header.magic, BINARY_CORPUS_FILE_MAGIC );
+  header.version = BINARY_CORPUS_FILE_VERSION;
+  header.num_vectors = num_vectors;
+  header.num_features = num_words;
+  header.first_feature = first_feature;
+  header.num_nonzeros = num_nonzeros;
+  header.vocabulary_offset = BINARY_CORPUS_ALIGN(sizeof(header));
+  header.doc_ids_offset = BINARY_CORPUS_ALIGN(header.vocabulary_offset + 
+					      binary_corpus_strings_size ( vocabulary, num_words ));
+  header.row_offsets_offset = BINARY_CORPUS_ALIGN(header.doc_ids_offset + 
+						  binary_corpus_strings_size ( doc_ids, num_vectors ));
+  header.indices_offset = BINARY_CORPUS_ALIGN(header.row_offsets_offset + (num_vectors+1) * (long)sizeof(long));
+  header.values_offset = BINARY_CORPUS_ALIGN(header.indices_offset + num_nonzeros * (long)sizeof(int));
+  header.total_sums_offset = BINARY_CORPUS_ALIGN(header.values_offset + num_nonzeros * (long)sizeof(float));
+  header.file_size = header.total_sums_offset + num_vectors * (long)sizeof(float);
+
+  FILE *fp = fopen_safe ( filename, "w" );
+  fwrite_safe ( &header, sizeof(header), 1, fp );
+  pad_binary_corpus_file ( header.vocabulary_offset, fp );
+  dump_binary_corpus_strings ( vocabulary, num_words, fp );
+  pad_binary_corpus_file ( header.doc_ids_offset, fp );
+  dump_binary_corpus_strings ( doc_ids, num_vectors, fp );
+  pad_binary_corpus_file ( header.row_offsets_offset, fp );
+  long row_offset = 0;
+  for ( v=0; v<=num_vectors; v++ ) {
+    fwrite_safe ( &row_offset, sizeof(long), 1, fp );
+    if ( v < num_vectors ) row_offset += feature_vectors->vectors[v]->num_features;
+  }
+  pad_binary_corpus_file ( header.indices_offset, fp );
+  for ( v=0; v<num_vectors; v++ ) 
+    fwrite_safe ( feature_vectors->vectors[v]->feature_indices, sizeof(int), 
+		  feature_vectors->vectors[v]->num_features, fp );
+  pad_binary_corpus_file ( header.values_offset, fp );
+  for ( v=0; v<num_vectors; v++ ) 
+    fwrite_safe ( feature_vectors->vectors[v]->feature_values, sizeof(float), 
+		  feature_vectors->vectors[v]->num_features, fp );
+  pad_binary_corpus_file ( header.total_sums_offset, fp );
+  for ( v=0; v<num_vectors; v++ ) 
+    fwrite_safe ( &feature_vectors->vectors[v]->total_sum, sizeof(float), 1, fp );
+  if ( fclose(fp) != 0 ) 
+    die ( "save_binary_corpus: Unable to write '%s'\n", filename );
+
+  free(doc_ids);
+}
+
+// Write the vectors and their feature set to a binary corpus file
+void save_binary_corpus ( SPARSE_FEATURE_VECTORS *feature_vectors, char *filename )
+{
+  FEATURE_SET *feature_set = feature_vectors->feature_set;
+  write_binary_corpus ( feature_vectors, feature_set->feature_names, feature_set->num_features, 0, filename );
+}
+
+// Map a binary corpus file and return the corpus it holds, whose arrays
+// are the (private, copy on write) mapping itself, along with its header
+// and its vocabulary, as offsets relative to the first name
+static SPARSE_CORPUS *map_binary_corpus_file ( char *corpus_fn, BINARY_CORPUS_FILE_HEADER *header_ptr, 
+					       long **vocabulary_offsets_ptr, char **vocabulary_ptr )
+{
+  BINARY_CORPUS_FILE_HEADER header;
+  struct stat file_stat;
+  FILE *fp = fopen_safe ( corpus_fn, "r" );
+  if ( fread ( &header, sizeof(header), 1, fp ) != 1 || strcmp ( header.magic, BINARY_CORPUS_FILE_MAGIC ) != 0 )
+    die ( "map_binary_corpus: '%s' is not a binary corpus file\n", corpus_fn );
+  if ( header.version != BINARY_CORPUS_FILE_VERSION ) 
+    die ( "map_binary_corpus: Unsupported binary corpus version %d in '%s'\n", header.version, corpus_fn );
+  if ( fstat ( fileno(fp), &file_stat ) != 0 ) 
+    die ( "map_binary_corpus: Unable to stat '%s'\n", corpus_fn );
+  int num_vectors = header.num_vectors;
+  int num_features = header.num_features;
+  if ( num_vectors < 0 || num_features < 0 || header.first_feature < 0 || header.num_nonzeros < 0 ||
+       header.vocabulary_offset < (long)sizeof(header) || 
+       header.doc_ids_offset < header.vocabulary_offset + (num_features+1) * (long)sizeof(long) ||
+       header.row_offsets_offset < header.doc_ids_offset + (num_vectors+1) * (long)sizeof(long) ||
+       header.indices_offset < header.row_offsets_offset + (num_vectors+1) * (long)sizeof(long) ||
+       header.values_offset < header.indices_offset + header.num_nonzeros * (long)sizeof(int) ||
+       header.total_sums_offset < header.values_offset + header.num_nonzeros * (long)sizeof(float) ||
+       header.file_size != header.total_sums_offset + num_vectors * (long)sizeof(float) ||
+       header.file_size != (long)file_stat.st_size || 
+       header.row_offsets_offset % BINARY_CORPUS_FILE_ALIGNMENT != 0 ||
+       header.indices_offset % BINARY_CORPUS_FILE_ALIGNMENT != 0 ||
+       header.values_offset % BINARY_CORPUS_FILE_ALIGNMENT != 0 ||
+       header.total_sums_offset % BINARY_CORPUS_FILE_ALIGNMENT != 0 )
+    die ( "map_binary_corpus: Bad binary corpus file header in '%s'\n", corpus_fn );
+
+  char *mapping = (char *) mmap ( NULL, header.file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0 );
+  if ( mapping == MAP_FAILED ) 
+    die ( "map_binary_corpus: Unable to map '%s'\n", corpus_fn );
+  fclose(fp);
+
+  long *vocabulary_offsets = (long *) (mapping + header.vocabulary_offset);
+  char *vocabulary = (char *) (vocabulary_offsets + num_features + 1);
+
+  // The corpus arrays are the sections of the mapping
+  SPARSE_CORPUS *corpus = (SPARSE_CORPUS *) malloc(sizeof(SPARSE_CORPUS));
+  corpus->num_vectors = num_vectors;
+  corpus->num_nonzeros = header.num_nonzeros;
+  corpus->name_offsets = (long *) (mapping + header.doc_ids_offset);
+  corpus->names = (char *) (corpus->name_offsets + num_vectors + 1);
+  corpus->row_offsets = (long *) (mapping + header.row_offsets_offset);
+  corpus->feature_indices = (int *) (mapping + header.indices_offset);
+  corpus->feature_values = (float *) (mapping + header.values_offset);
+  corpus->total_sums = (float *) (mapping + header.total_sums_offset);
+  corpus->mapping = mapping;
+  corpus->mapping_size = header.file_size;
+  corpus->packed_rows = NULL;
+  corpus->packed_offsets = NULL;
+  if ( corpus->row_offsets[num_vectors] != header.num_nonzeros ||
+       vocabulary + vocabulary_offsets[num_features] > mapping + header.doc_ids_offset ||
+       SPARSE_CORPUS_ROW_NAME(corpus,num_vectors) > mapping + header.row_offsets_offset )
+    die ( "map_binary_corpus: Bad binary corpus file header in '%s'\n", corpus_fn );
+
+  *header_ptr = header;
+  *vocabulary_offsets_ptr = vocabulary_offsets;
+  *vocabulary_ptr = vocabulary;
+  return corpus;
+}
+
+// View a mapped corpus whose features are the num_features words of 
+// vocabulary. If *feature_set_ptr is NULL the feature set is made from
+// the vocabulary less the words in the stop list; otherwise words are 
+// looked up in the given set with the same <filler> handling as the text
+// loaders. Only when the feature set differs from the vocabulary are the
+// rows rewritten, in place, to the new indices, and *remap_ptr set.
+static SPARSE_FEATURE_VECTORS *create_mapped_corpus_view ( SPARSE_CORPUS *corpus, char **vocabulary, int num_features,
+							   FEATURE_SET **feature_set_ptr, FEATURE_SET *stop_list,
+							   int *remap_ptr )
+{
+  int num_vectors = corpus->num_vectors;
+  FEATURE_SET *feature_set = *feature_set_ptr;
+  HASHTABLE *stop_list_hash = ( stop_list != NULL ? stop_list->feature_name_to_index_hash : NULL );
+  int i, remap = 0;
+  int *index_map = (int *) calloc((size_t)num_features+1, sizeof(int));
+  if ( feature_set == NULL ) {
+    feature_set = (FEATURE_SET *) malloc(sizeof(FEATURE_SET));
+    feature_set->num_features = 0;
+    feature_set->feature_names = (char **) calloc((size_t)num_features+1, sizeof(char *));
+    feature_set->feature_weights = (float *) calloc((size_t)num_features+1, sizeof(float));
+    feature_set->num_words = NULL;
+    feature_set->feature_name_to_index_hash = hdbmcreate( (unsigned)(num_features > 1000 ? num_features : 1000), hash2);
+    for ( i=0; i<num_features; i++ ) {
+      char *name = vocabulary[i];
+      if ( stop_list_hash != NULL && get_hashtable_string_index ( stop_list_hash, name ) != -1 ) {
+	index_map[i] = -1;
+	continue;
+      }
+      index_map[i] = feature_set->num_features;
+      feature_set->feature_names[feature_set->num_features] = strdup ( name );
+      feature_set->feature_weights[feature_set->num_features] = 1.0;
+      store_hashtable_string_index ( feature_set->feature_name_to_index_hash, 
+				     feature_set->feature_names[feature_set->num_features], feature_set->num_features );
+      feature_set->num_features++;
+    }
+    *feature_set_ptr = feature_set;
+  } else {
+    int filler_index = get_hashtable_string_index ( feature_set->feature_name_to_index_hash, "<filler>" );
+    if ( filler_index >= feature_set->num_features ) filler_index = -1;
+    for ( i=0; i<num_features; i++ ) {
+      index_map[i] = get_hashtable_string_index ( feature_set->feature_name_to_index_hash, vocabulary[i] );
+      if ( index_map[i] == -1 ) index_map[i] = filler_index;
+    }
+  }
+  for ( i=0; i<num_features && !remap; i++ ) 
+    remap = ( index_map[i] != i );
+
+  SPARSE_FEATURE_VECTORS *feature_vectors = create_sparse_corpus_view ( corpus, feature_set );
+
+  // Rewrite the rows when the feature set is not the corpus vocabulary
+  if ( remap ) {
+#pragma omp parallel
+    {
+      int max_features = 1024;
+      unsigned long *keys = (unsigned long *) calloc(max_features, sizeof(unsigned long));
+      float *scratch = (float *) calloc(max_features, sizeof(float));
+      int u;
+#pragma omp for schedule(dynamic,256)
+      for ( u=0; u<num_vectors; u++ ) 
+	remap_sparse_feature_vector ( feature_vectors->vectors[u], index_map, &keys, &scratch, &max_features );
+      free(keys);
+      free(scratch);
+    }
+    compact_sparse_corpus_view ( feature_vectors );
+  }
+  free(index_map);
+  *remap_ptr = remap;
+  return feature_vectors;
+}
+
+// Map a binary corpus file and return a view of the corpus it holds, 
+// whose arrays are the mapping itself. The feature set is made or
+// matched as in create_mapped_corpus_view.
+SPARSE_FEATURE_VECTORS *map_binary_corpus ( char *corpus_fn, FEATURE_SET **feature_set_ptr, FEATURE_SET *stop_list )
+{
+  double start_time = get_wall_time();
+  BINARY_CORPUS_FILE_HEADER header;
+  long *vocabulary_offsets;
+  char *vocabulary;
+  SPARSE_CORPUS *corpus = map_binary_corpus_file ( corpus_fn, &header, &vocabulary_offsets, &vocabulary );
+  if ( header.first_feature != 0 ) 
+    die ( "map_binary_corpus: '%s' is a corpus store segment, load its store directory instead\n", corpus_fn );
+
+  int i, remap;
+  char **names = (char **) calloc((size_t)header.num_features+1, sizeof(char *));
+  for ( i=0; i<header.num_features; i++ ) 
+    names[i] = vocabulary + vocabulary_offsets[i];
+  SPARSE_FEATURE_VECTORS *feature_vectors = create_mapped_corpus_view ( corpus, names, header.num_features,
+									feature_set_ptr, stop_list, &remap );
+  free(names);
+
+  double elapsed = get_wall_time() - start_time;
+  printf("%d vectors and %d features mapped from %.1f MB in %.3f seconds%s...", corpus->num_vectors, 
+	 (*feature_set_ptr)->num_features, header.file_size/1e6, elapsed, remap ? " with remapping" : "");
+  fflush(stdout);
+
+  return feature_vectors;
+}
+
+/*******************************************************************************************/
+
+// A corpus store is a directory holding binary corpus files, its
+// segments, which never change once written, and a MANIFEST that names
+// them in order. The corpus of the store is the union of its segments. 
+// The vocabulary of each segment holds only the words that are new to
+// the store, numbered from its first_feature on, so the rows of every
+// segment already use the feature indices of the whole store and the 
+// segments can be joined without remapping. New documents are added as
+// a new segment, at a cost that depends only on the new documents, and
+// compaction merges the segments into one. Writers hold the LOCK file 
+// exclusively while they change the manifest, readers hold it shared
+// while they map the segments, and one compaction at a time holds the
+// COMPACT file. Segments are written before the LOCK is taken, under a
+// temporary name that is renamed into place with the manifest update.
+#define CORPUS_STORE_MANIFEST_FILE "MANIFEST"
+#define CORPUS_STORE_LOCK_FILE "LOCK"
+#define CORPUS_STORE_COMPACT_FILE "COMPACT"
+#define CORPUS_STORE_MAGIC "CORPUS_STORE"
+#define CORPUS_STORE_VERSION 1
+
+typedef struct CORPUS_STORE_MANIFEST {
+  int next_segment; // Number to give the next segment file
+  int num_segments;
+  char **segment_names; // File names within the store directory
+} CORPUS_STORE_MANIFEST;
+
+static char *corpus_store_path ( char *store_dir, char *name )
+{
+  char *path = (char *) malloc(strlen(store_dir) + strlen(name) + 2);
+  sprintf ( path, "%s/%s", store_dir, name );
+  return path;
+}
+
+int is_corpus_store ( char *path )
+{
+  struct stat file_stat;
+  if ( stat ( path, &file_stat ) != 0 || !S_ISDIR ( file_stat.st_mode ) ) return 0;
+  char *manifest_fn = corpus_store_path ( path, CORPUS_STORE_MANIFEST_FILE );
+  int is_store = ( access ( manifest_fn, R_OK ) == 0 );
+  free(manifest_fn);
+  return is_store;
+}
+
+// Lock a file of the store, creating it if need be. Returns -1 if a
+// non-blocking lock is held elsewhere
+static int lock_corpus_store ( char *store_dir, char *lock_name, int operation )
+{
+  char *lock_fn = corpus_store_path ( store_dir, lock_name );
+  int fd = open ( lock_fn, O_RDONLY | O_CREAT, 0666 );
+  if ( fd < 0 ) 
+    die ("Unable to open lock file '%s'\n", lock_fn);
+  if ( flock ( fd, operation ) != 0 ) {
+    if ( !(operation & LOCK_NB) ) 
+      die ("Unable to lock '%s'\n", lock_fn);
+    close(fd);
+    fd = -1;
+  }
+  free(lock_fn);
+  return fd;
+}
+
+static void unlock_corpus_store ( int fd )
+{
+  flock ( fd, LOCK_UN );
+  close(fd);
+}
+
+// Read the manifest of a store, or return an empty one for a new store
+static CORPUS_STORE_MANIFEST *read_corpus_store_manifest ( char *store_dir )
+{
+  char *manifest_fn = corpus_store_path ( store_dir, CORPUS_STORE_MANIFEST_FILE );
+  CORPUS_STORE_MANIFEST *manifest = (CORPUS_STORE_MANIFEST *) calloc(1, sizeof(CORPUS_STORE_MANIFEST));
+  manifest->next_segment = 1;
+  FILE *fp = fopen ( manifest_fn, "r" );
+  if ( fp != NULL ) {
+    char magic[64], *line = NULL;
+    size_t max_line_length = 0;
+    int version, max_segments = 0;
+    if ( fscanf ( fp, "%63s %d %d\n", magic, &version, &manifest->next_segment ) != 3 || 
+	 strcmp ( magic, CORPUS_STORE_MAGIC ) != 0 ) 
+      die ("Bad corpus store manifest '%s'\n", manifest_fn);
+    if ( version != CORPUS_STORE_VERSION ) 
+      die ("Unsupported corpus store version %d in '%s'\n", version, manifest_fn);
+    while ( getline ( &line, &max_line_length, fp ) >= 0 ) {
+      line[strcspn ( line, "\r\n" )] = '\0';
+      if ( line[0] == '\0' ) continue;
+      if ( manifest->num_segments == max_segments ) {
+	max_segments = 2*max_segments + 16;
+	manifest->segment_names = (char **) realloc(manifest->segment_names, max_segments*sizeof(char *));
+      }
+      manifest->segment_names[manifest->num_segments++] = strdup ( line );
+    }
+    free(line);
+    fclose(fp);
+  }
+  free(manifest_fn);
+  return manifest;
+}
+
+static void free_corpus_store_manifest ( CORPUS_STORE_MANIFEST *manifest )
+{
+  int s;
+  for ( s=0; s<manifest->num_segments; s++ ) 
+    free(manifest->segment_names[s]);
+  free(manifest->segment_names);
+  free(manifest);
+}
+
+// Flush a written file to disk, so that nothing refers to it before its
+// contents are there
+static void sync_corpus_store_file ( char *filename )
+{
+  int fd = open ( filename, O_RDONLY );
+  if ( fd < 0 || fsync ( fd ) != 0 ) 
+    die ("Unable to sync '%s'\n", filename);
+  close(fd);
+}
+
+// Replace the manifest in one step, by renaming a new copy over it
+static void write_corpus_store_manifest ( char *store_dir, CORPUS_STORE_MANIFEST *manifest )
+{
+  char *manifest_fn = corpus_store_path ( store_dir, CORPUS_STORE_MANIFEST_FILE );
+  char *new_fn = corpus_store_path ( store_dir, CORPUS_STORE_MANIFEST_FILE ".new" );
+  int s;
+  FILE *fp = fopen_safe ( new_fn, "w" );
+  fprintf ( fp, "%s %d %d\n", CORPUS_STORE_MAGIC, CORPUS_STORE_VERSION, manifest->next_segment );
+  for ( s=0; s<manifest->num_segments; s++ ) 
+    fprintf ( fp, "%s\n", manifest->segment_names[s] );
+  if ( fclose(fp) != 0 ) 
+    die ("Unable to write '%s'\n", new_fn);
+  sync_corpus_store_file ( new_fn );
+  if ( rename ( new_fn, manifest_fn ) != 0 ) 
+    die ("Unable to replace '%s'\n", manifest_fn);
+  free(new_fn);
+  free(manifest_fn);
+}
+
+// Map the segments of a store, checking that each vocabulary follows on
+// from the one before, and collect the vocabulary of the store, whose
+// names point into the mappings
+static SPARSE_CORPUS **map_corpus_store_segments ( char *store_dir, CORPUS_STORE_MANIFEST *manifest, 
+						   char ***vocabulary_ptr, int *num_features_ptr, long *size_ptr )
+{
+  SPARSE_CORPUS **segments = (SPARSE_CORPUS **) calloc((size_t)manifest->num_segments+1, sizeof(SPARSE_CORPUS *));
+  char **vocabulary = (char **) calloc(1, sizeof(char *));
+  int i, s, num_features = 0;
+  long size = 0;
+  for ( s=0; s<manifest->num_segments; s++ ) {
+    BINARY_CORPUS_FILE_HEADER header;
+    long *vocabulary_offsets;
+    char *words;
+    char *segment_fn = corpus_store_path ( store_dir, manifest->segment_names[s] );
+    segments[s] = map_binary_corpus_file ( segment_fn, &header, &vocabulary_offsets, &words );
+    if ( header.first_feature != num_features ) 
+      die ("Segment '%s' starts at feature %d rather than %d\n", segment_fn, header.first_feature, num_features);
+    vocabulary = (char **) realloc(vocabulary, ((size_t)num_features+header.num_features+1)*sizeof(char *));
+    for ( i=0; i<header.num_features; i++ ) 
+      vocabulary[num_features+i] = words + vocabulary_offsets[i];
+    num_features += header.num_features;
+    size += header.file_size;
+    free(segment_fn);
+  }
+  *vocabulary_ptr = vocabulary;
+  *num_features_ptr = num_features;
+  *size_ptr = size;
+  return segments;
+}
+
+// Load the union of the segments of a corpus store as one corpus view,
+// with the feature set made or matched as in map_binary_corpus. A store
+// of one segment is viewed in its mapping; otherwise the rows of the 
+// segments, which already share the feature indices of the store, are
+// copied one after another into one corpus.
+SPARSE_FEATURE_VECTORS *map_corpus_store ( char *store_dir, FEATURE_SET **feature_set_ptr, FEATURE_SET *stop_list )
+{
+  double start_time = get_wall_time();
+  int s, remap, num_features;
+  long size;
+  char **vocabulary;
+  int lock = lock_corpus_store ( store_dir, CORPUS_STORE_LOCK_FILE, LOCK_SH );
+  CORPUS_STORE_MANIFEST *manifest = read_corpus_store_manifest ( store_dir );
+  if ( manifest->num_segments == 0 ) 
+    die ("Corpus store '%s' has no segments\n", store_dir);
+  SPARSE_CORPUS **segments = map_corpus_store_segments ( store_dir, manifest, &vocabulary, &num_features, &size );
+  unlock_corpus_store ( lock );
+
+  int num_segments = manifest->num_segments;
+  SPARSE_CORPUS *corpus = segments[0];
+  if ( num_segments > 1 ) corpus = concatenate_sparse_corpora ( segments, num_segments );
+  SPARSE_FEATURE_VECTORS *feature_vectors = create_mapped_corpus_view ( corpus, vocabulary, num_features,
+									feature_set_ptr, stop_list, &remap );
+
+  // The feature set has its own copies of the names
+  if ( num_segments > 1 ) {
+    for ( s=0; s<num_segments; s++ ) 
+      free_sparse_corpus ( segments[s] );
+  }
+  free(segments);
+  free(vocabulary);
+  free_corpus_store_manifest ( manifest );
+
+  double elapsed = get_wall_time() - start_time;
+  printf("%d vectors and %d features from %d segments of %.1f MB in %.3f seconds%s...", corpus->num_vectors, 
+	 (*feature_set_ptr)->num_features, num_segments, size/1e6, elapsed, remap ? " with remapping" : "");
+  fflush(stdout);
+
+  return feature_vectors;
+}
+
+// Renumber the new words of vectors parsed against the first num_features
+// words of a store, now that the store has grown to the store_num_features
+// words of vocabulary. New words that the store has gained meanwhile take
+// its indices, and the others are numbered after them. The feature set of
+// the vectors is replaced by one holding the words of the store and then
+// the words that are still new.
+static void renumber_new_corpus_store_words ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_features,
+					      char **store_vocabulary, int store_num_features )
+{
+  FEATURE_SET *feature_set = feature_vectors->feature_set;
+  int i, v, num_words = store_num_features;
+  int *index_map = (int *) malloc(((size_t)feature_set->num_features+1)*sizeof(int));
+  for ( i=0; i<feature_set->num_features; i++ ) 
+    index_map[i] = ( i < num_features ) ? i : -1;
+  for ( i=num_features; i<store_num_features; i++ ) {
+    int index = get_hashtable_string_index ( feature_set->feature_name_to_index_hash, store_vocabulary[i] );
+    if ( index >= num_features ) index_map[index] = i;
+  }
+  char **feature_names = (char **) calloc((size_t)store_num_features+feature_set->num_features+1, sizeof(char *));
+  for ( i=0; i<store_num_features; i++ ) 
+    feature_names[i] = strdup ( store_vocabulary[i] );
+  for ( i=num_features; i<feature_set->num_features; i++ ) {
+    if ( index_map[i] >= 0 ) continue;
+    index_map[i] = num_words;
+    feature_names[num_words++] = strdup ( feature_set->feature_names[i] );
+  }
+
+  unsigned long *keys = NULL;
+  float *scratch = NULL;
+  int max_features = 0;
+  for ( v=0; v<feature_vectors->num_vectors; v++ ) 
+    remap_sparse_feature_vector ( feature_vectors->vectors[v], index_map, &keys, &scratch, &max_features );
+  free(keys);
+  free(scratch);
+  free(index_map);
+  free_feature_set ( feature_set );
+  feature_vectors->feature_set = create_feature_set_from_names ( feature_names, num_words );
+}
+
+// Add the documents of a combined count file, read as by
+// load_sparse_feature_vectors_combined_stream, to a corpus store as a new
+// segment, creating the store if need be. Of the existing segments only
+// the vocabularies are read, to number the new words after the words
+// already in the store. No stop list is applied, so that every word is
+// kept in the store. The file is parsed and the segment written without
+// holding the store lock, which is only taken to put the segment in the
+// manifest; if other appends added words meanwhile, the new words are
+// renumbered and the segment written again. Returns the number of
+// segments in the store after the append.
+int append_to_corpus_store ( char *store_dir, char *count_fn )
+{
+  int s, num_features, store_num_features;
+  long size;
+  char **vocabulary, segment_name[64], temp_name[64];
+  if ( mkdir ( store_dir, 0777 ) != 0 && errno != EEXIST ) 
+    die ("Unable to create corpus store '%s'\n", store_dir);
+  int lock = lock_corpus_store ( store_dir, CORPUS_STORE_LOCK_FILE, LOCK_SH );
+  CORPUS_STORE_MANIFEST *manifest = read_corpus_store_manifest ( store_dir );
+  SPARSE_CORPUS **segments = map_corpus_store_segments ( store_dir, manifest, &vocabulary, &num_features, &size );
+  unlock_corpus_store ( lock );
+
+  // The words of the store, to be extended with the new words
+  FEATURE_SET store_features;
+  memset ( &store_features, 0, sizeof(FEATURE_SET) );
+  store_features.num_features = num_features;
+  store_features.feature_names = vocabulary;
+  FEATURE_SET *feature_set = &store_features;
+  SPARSE_FEATURE_VECTORS *feature_vectors = load_count_stream ( count_fn, &feature_set, NULL, 1 );
+  for ( s=0; s<manifest->num_segments; s++ ) 
+    free_sparse_corpus ( segments[s] );
+  free(segments);
+  free(vocabulary);
+  free_corpus_store_manifest ( manifest );
+
+  sprintf ( temp_name, "segment.new.%d", (int) getpid() );
+  char *temp_fn = corpus_store_path ( store_dir, temp_name );
+  while ( 1 ) {
+    feature_set = feature_vectors->feature_set;
+    write_binary_corpus ( feature_vectors, feature_set->feature_names + num_features, 
+			  feature_set->num_features - num_features, num_features, temp_fn );
+    sync_corpus_store_file ( temp_fn );
+
+    // The segment can go in as it is unless the store has new words
+    lock = lock_corpus_store ( store_dir, CORPUS_STORE_LOCK_FILE, LOCK_EX );
+    manifest = read_corpus_store_manifest ( store_dir );
+    segments = map_corpus_store_segments ( store_dir, manifest, &vocabulary, &store_num_features, &size );
+    if ( store_num_features != num_features ) {
+      unlock_corpus_store ( lock );
+      lock = -1;
+      if ( store_num_features < num_features ) 
+	die ("Vocabulary of corpus store '%s' shrank during append\n", store_dir);
+      renumber_new_corpus_store_words ( feature_vectors, num_features, vocabulary, store_num_features );
+      num_features = store_num_features;
+    }
+    for ( s=0; s<manifest->num_segments; s++ ) 
+      free_sparse_corpus ( segments[s] );
+    free(segments);
+    free(vocabulary);
+    if ( lock >= 0 ) break;
+    free_corpus_store_manifest ( manifest );
+  }
+
+  sprintf ( segment_name, "segment.%08d.bin", manifest->next_segment++ );
+  char *segment_fn = corpus_store_path ( store_dir, segment_name );
+  if ( rename ( temp_fn, segment_fn ) != 0 ) 
+    die ("Unable to rename '%s' to '%s'\n", temp_fn, segment_fn);
+  manifest->segment_names = (char **) realloc(manifest->segment_names, (manifest->num_segments+1)*sizeof(char *));
+  manifest->segment_names[manifest->num_segments++] = strdup ( segment_name );
+  write_corpus_store_manifest ( store_dir, manifest );
+  unlock_corpus_store ( lock );
+  int num_segments = manifest->num_segments;
+
+  printf("%d vectors and %d new features appended as %s...", feature_vectors->num_vectors, 
+	 feature_set->num_features - num_features, segment_name);
+  fflush(stdout);
+
+  free(temp_fn);
+  free(segment_fn);
+  free_sparse_feature_vectors ( feature_vectors );
+  free_feature_set ( feature_set );
+  free_corpus_store_manifest ( manifest );
+  return num_segments;
+}
+
+// Merge the segments of a corpus store into one. The segments never
+// change, so they are merged without holding the store lock, and readers
+// and appends can go on meanwhile; segments appended during the merge
+// are kept after the merged segment, whose vocabulary is the whole 
+// vocabulary they follow on from. Returns 0 without doing anything if
+// another compaction of the store is running.
+int compact_corpus_store ( char *store_dir )
+{
+  int s, num_features;
+  long size;
+  char **vocabulary, segment_name[64];
+  int compact_lock = lock_corpus_store ( store_dir, CORPUS_STORE_COMPACT_FILE, LOCK_EX | LOCK_NB );
+  if ( compact_lock < 0 ) return 0;
+
+  // Take the segments there are now, and a number for the merged segment
+  int lock = lock_corpus_store ( store_dir, CORPUS_STORE_LOCK_FILE, LOCK_EX );
+  CORPUS_STORE_MANIFEST *manifest = read_corpus_store_manifest ( store_dir );
+  int num_segments = manifest->num_segments;
+  if ( num_segments < 2 ) {
+    unlock_corpus_store ( lock );
+    unlock_corpus_store ( compact_lock );
+    free_corpus_store_manifest ( manifest );
+    return 1;
+  }
+  sprintf ( segment_name, "segment.%08d.bin", manifest->next_segment++ );
+  write_corpus_store_manifest ( store_dir, manifest );
+  unlock_corpus_store ( lock );
+
+  SPARSE_CORPUS **segments = map_corpus_store_segments ( store_dir, manifest, &vocabulary, &num_features, &size );
+  FEATURE_SET store_features;
+  memset ( &store_features, 0, sizeof(FEATURE_SET) );
+  store_features.num_features = num_features;
+  store_features.feature_names = vocabulary;
+  SPARSE_FEATURE_VECTORS *feature_vectors = 
+    create_sparse_corpus_view ( concatenate_sparse_corpora ( segments, num_segments ), &store_features );
+  char *segment_fn = corpus_store_path ( store_dir, segment_name );
+  write_binary_corpus ( feature_vectors, vocabulary, num_features, 0, segment_fn );
+  sync_corpus_store_file ( segment_fn );
+  free_sparse_feature_vectors ( feature_vectors );
+  for ( s=0; s<num_segments; s++ ) 
+    free_sparse_corpus ( segments[s] );
+  free(segments);
+  free(vocabulary);
+  free(segment_fn);
+
+  // Put the merged segment in place of the segments it holds
+  lock = lock_corpus_store ( store_dir, CORPUS_STORE_LOCK_FILE, LOCK_EX );
+  CORPUS_STORE_MANIFEST *current = read_corpus_store_manifest ( store_dir );
+  if ( current->num_segments < num_segments ) 
+    die ("Segments of corpus store '%s' changed during compaction\n", store_dir);
+  for ( s=0; s<num_segments; s++ ) {
+    if ( strcmp ( current->segment_names[s], manifest->segment_names[s] ) != 0 ) 
+      die ("Segments of corpus store '%s' changed during compaction\n", store_dir);
+    free(current->segment_names[s]);
+  }
+  current->segment_names[0] = strdup ( segment_name );
+  memmove ( current->segment_names + 1, current->segment_names + num_segments, 
+	    (current->num_segments - num_segments)*sizeof(char *) );
+  current->num_segments -= num_segments - 1;
+  write_corpus_store_manifest ( store_dir, current );
+  unlock_corpus_store ( lock );
+
+  // Readers that mapped the old segments keep them until they unmap them
+  for ( s=0; s<num_segments; s++ ) {
+    char *old_fn = corpus_store_path ( store_dir, manifest->segment_names[s] );
+    unlink ( old_fn );
+    free(old_fn);
+  }
+  unlock_corpus_store ( compact_lock );
+  free_corpus_store_manifest ( current );
+  free_corpus_store_manifest ( manifest );
+  return 1;
+}
+
+/*******************************************************************************************/
+
+// Bytes taken by the base 128 varint of value
+static int packed_varint_size ( unsigned int value )
+{
+  int size = 1;
+  while ( value >= 128 ) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+// Bytes per value needed to store a row exactly: 1 or 2 when every value
+// is a whole count that fits, otherwise 4 for the float values themselves
+static int packed_value_width ( float *values, int num_values )
+{
+  int i, width = 1;
+  for ( i=0; i<num_values; i++ ) {
+    if ( !(values[i] >= 0 && values[i] <= 65535) || values[i] != floorf(values[i]) ) return 4;
+    if ( values[i] > 255 ) width = 2;
+  }
+  return width;
+}
+
+// Hands the whole pages of a section of a private mapping back to the
+// kernel, so they stop counting towards the resident size
+static void release_mapped_pages ( void *start, size_t size )
+{
+  size_t page_size = (size_t) sysconf ( _SC_PAGESIZE );
+  char *first = (char *) ((((size_t)start) + page_size - 1) & ~(page_size - 1));
+  char *last = (char *) ((((size_t)start) + size) & ~(page_size - 1));
+  if ( last > first ) madvise ( first, last - first, MADV_DONTNEED );
+}
+
+// Replaces the index and value arrays of a corpus view with compressed
+// rows (see SPARSE_CORPUS), which the training kernels expand one row at
+// a time with a SPARSE_VECTOR_DECODER. Rows must be sorted by feature 
+// index. Afterwards the feature_indices and feature_values of the vectors
+// are NULL, so the vectors can no longer be weighted, pruned or saved in
+// place. Returns the size of the compressed rows in bytes.
+long compress_sparse_corpus ( SPARSE_FEATURE_VECTORS *feature_vectors )
+{
+  SPARSE_CORPUS *corpus = feature_vectors->corpus;
+  if ( corpus == NULL ) die ( "compress_sparse_corpus: Feature vectors are not stored as a corpus\n" );
+  if ( corpus->packed_rows != NULL ) return corpus->packed_offsets[corpus->num_vectors];
+  int d, num_vectors = corpus->num_vectors;
+
+  // Size each row...
+  long *packed_offsets = (long *) calloc((size_t)num_vectors+1, sizeof(long));
+#pragma omp parallel for schedule(dynamic,256)
+  for ( d=0; d<num_vectors; d++ ) {
+    int i, num_features = SPARSE_CORPUS_ROW_LENGTH(corpus,d);
+    int *indices = SPARSE_CORPUS_ROW_INDICES(corpus,d);
+    long size = 1 + (long)num_features*packed_value_width ( SPARSE_CORPUS_ROW_VALUES(corpus,d), num_features );
+    for ( i=0; i<num_features; i++ ) {
+      if ( indices[i] < ( i > 0 ? indices[i-1] : 0 ) ) 
+	die ( "compress_sparse_corpus: Vector %d is not sorted by feature index\n", d );
+      size += packed_varint_size ( indices[i] - ( i > 0 ? indices[i-1] : 0 ) );
+    }
+    packed_offsets[d+1] = size;
+  }
+  for ( d=0; d<num_vectors; d++ ) packed_offsets[d+1] += packed_offsets[d];
+
+  // ...then pack them
+  unsigned char *packed_rows = (unsigned char *) malloc(packed_offsets[num_vectors]+1);
+  if ( packed_rows == NULL ) die ( "compress_sparse_corpus: Unable to allocate %ld bytes\n", packed_offsets[num_vectors] );
+#pragma omp parallel for schedule(dynamic,256)
+  for ( d=0; d<num_vectors; d++ ) {
+    int i, num_features = SPARSE_CORPUS_ROW_LENGTH(corpus,d);
+    int *indices = SPARSE_CORPUS_ROW_INDICES(corpus,d);
+    float *values = SPARSE_CORPUS_ROW_VALUES(corpus,d);
+    unsigned char *next = packed_rows + packed_offsets[d];
+    int width = packed_value_width ( values, num_features );
+    *next++ = (unsigned char) width;
+    if ( width == 1 ) {
+      for ( i=0; i<num_features; i++ ) *next++ = (unsigned char) values[i];
+    } else if ( width == 2 ) {
+      unsigned short count;
+      for ( i=0; i<num_features; i++, next += 2 ) {
+	count = (unsigned short) values[i];
+	memcpy ( next, &count, 2 );
+      }
+    } else {
+      memcpy ( next, values, num_features*sizeof(float) );
+      next += num_features*sizeof(float);
+    }
+    unsigned int gap, prev_index = 0;
+    for ( i=0; i<num_features; i++ ) {
+      gap = (unsigned int)indices[i] - prev_index;
+      prev_index = indices[i];
+      while ( gap >= 128 ) {
+	*next++ = (unsigned char)(gap | 128);
+	gap >>= 7;
+      }
+      *next++ = (unsigned char) gap;
+    }
+  }
+
+  // Drop the uncompressed rows. The pages of a mapped corpus are
+  // released but the mapping itself stays until the corpus is freed.
+  if ( corpus->mapping == NULL ) {
+    free(corpus->feature_indices);
+    free(corpus->feature_values);
+  } else {
+    release_mapped_pages ( corpus->feature_indices, corpus->num_nonzeros*sizeof(int) );
+    release_mapped_pages ( corpus->feature_values, corpus->num_nonzeros*sizeof(float) );
+  }
+  corpus->feature_indices = NULL;
+  corpus->feature_values = NULL;
+  corpus->packed_rows = packed_rows;
+  corpus->packed_offsets = packed_offsets;
+  for ( d=0; d<num_vectors; d++ ) {
+    feature_vectors->vector_block[d].feature_indices = NULL;
+    feature_vectors->vector_block[d].feature_values = NULL;
+  }
+
+  return packed_offsets[num_vectors];
+}
+
+// Returns a decoder for vectors whose corpus was compressed, or NULL if
+// the vectors can be used as they are. The decoder holds a scratch 
+// vector for each thread, sized to the longest row.
+SPARSE_VECTOR_DECODER *create_sparse_vector_decoder ( SPARSE_FEATURE_VECTORS *feature_vectors )
+{
+  SPARSE_CORPUS *corpus = feature_vectors->corpus;
+  if ( !SPARSE_CORPUS_IS_PACKED(corpus) ) return NULL;
+
+  int d, t, max_features = 1;
+  for ( d=0; d<corpus->num_vectors; d++ ) 
+    if ( SPARSE_CORPUS_ROW_LENGTH(corpus,d) > max_features ) max_features = SPARSE_CORPUS_ROW_LENGTH(corpus,d);
+
+  SPARSE_VECTOR_DECODER *decoder = (SPARSE_VECTOR_DECODER *) malloc(sizeof(SPARSE_VECTOR_DECODER));
+  decoder->feature_vectors = feature_vectors;
+  decoder->num_threads = get_num_threads();
+  decoder->scratch = (SPARSE_FEATURE_VECTOR *) calloc(decoder->num_threads, sizeof(SPARSE_FEATURE_VECTOR));
+  for ( t=0; t<decoder->num_threads; t++ ) {
+    decoder->scratch[t].feature_indices = (int *) calloc(max_features, sizeof(int));
+    decoder->scratch[t].feature_values = (float *) calloc(max_features, sizeof(float));
+  }
+  return decoder;
+}
+
+void free_sparse_vector_decoder ( SPARSE_VECTOR_DECODER *decoder )
+{
+  int t;
+  if ( decoder == NULL ) return;
+  for ( t=0; t<decoder->num_threads; t++ ) {
+    free(decoder->scratch[t].feature_indices);
+    free(decoder->scratch[t].feature_values);
+  }
+  free(decoder->scratch);
+  free(decoder);
+  return;
+}
+
+// Returns vector itself when decoder is NULL. Otherwise the row of the
+// vector is expanded into the calling thread's scratch vector, which is
+// returned and stays valid until the thread decodes its next vector.
+SPARSE_FEATURE_VECTOR *decode_sparse_feature_vector ( SPARSE_VECTOR_DECODER *decoder, SPARSE_FEATURE_VECTOR *vector )
+{
+  if ( decoder == NULL ) return vector;
+
+  int thread = get_thread_num();
+  if ( thread >= decoder->num_threads ) 
+    die ( "decode_sparse_feature_vector: Thread %d has no scratch vector\n", thread );
+  SPARSE_FEATURE_VECTOR *scratch = &decoder->scratch[thread];
+  SPARSE_CORPUS *corpus = decoder->feature_vectors->corpus;
+  long d = vector - decoder->feature_vectors->vector_block;
+  int *indices = scratch->feature_indices;
+  float *values = scratch->feature_values;
+  *scratch = *vector;
+  scratch->feature_indices = indices;
+  scratch->feature_values = values;
+
+  int i, num_features = vector->num_features;
+  const unsigned char *next = corpus->packed_rows + corpus->packed_offsets[d];
+  int width = *next++;
+  if ( width == 1 ) {
+    for ( i=0; i<num_features; i++ ) values[i] = next[i];
+    next += num_features;
+  } else if ( width == 2 ) {
+    unsigned short count;
+    for ( i=0; i<num_features; i++, next += 2 ) {
+      memcpy ( &count, next, 2 );
+      values[i] = count;
+    }
+  } else {
+    memcpy ( values, next, num_features*sizeof(float) );
+    next += num_features*sizeof(float);
+  }
+  unsigned int gap, index = 0;
+  int shift;
+  for ( i=0; i<num_features; i++ ) {
+    gap = *next++;
+    if ( gap >= 128 ) {
+      gap &= 127;
+      for ( shift=7; next[-1] >= 128; shift += 7, next++ ) gap |= ((unsigned int)(*next & 127)) << shift;
+    }
+    index += gap;
+    indices[i] = index;
+  }
+
+  return scratch;
+}
+
 SPARSE_FEATURE_VECTOR *load_sparse_feature_vector ( char *filename, FEATURE_SET *feature_set )
 {
   SPARSE_FEATURE_VECTOR *feature_vector;
@@ -1108,7 +3104,23 @@ float *extract_feature_counts_from_sparse_feature_vectors ( SPARSE_FEATURE_VECTO
   float count;
   float *counts = (float *) calloc(num_features, sizeof(float));
 
-  if ( vectors != NULL ) {
+  if ( SPARSE_CORPUS_IS_PACKED(feature_vectors->corpus) ) {
+    // Collect counts from the compressed corpus rows in storage order
+    SPARSE_VECTOR_DECODER *decoder = create_sparse_vector_decoder ( feature_vectors );
+    SPARSE_FEATURE_VECTOR *vector;
+    for ( v = 0; v < feature_vectors->corpus->num_vectors; v++ ) {
+      vector = decode_sparse_feature_vector ( decoder, &feature_vectors->vector_block[v] );
+      for ( i = 0; i < vector->num_features; i++ ) 
+	counts[vector->feature_indices[i]] += vector->feature_values[i];
+    }
+    free_sparse_vector_decoder ( decoder );
+  } else if ( feature_vectors->corpus != NULL ) {
+    // Collect counts straight from the corpus arrays
+    SPARSE_CORPUS *corpus = feature_vectors->corpus;
+    long n;
+    for ( n = 0; n < corpus->num_nonzeros; n++ ) 
+      counts[corpus->feature_indices[n]] += corpus->feature_values[n];
+  } else if ( vectors != NULL ) {
     // Collect counts from feature vectors
     for ( v = 0; v < num_vectors; v++ ) {
       for ( i = 0; i < vectors[v]->num_features; i++ ) {
@@ -1127,7 +3139,15 @@ float *extract_feature_counts_from_sparse_feature_vectors ( SPARSE_FEATURE_VECTO
 void free_sparse_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_vectors )
 {
   int i;
-  if ( feature_vectors->vectors != NULL ) {
+  if ( feature_vectors->corpus != NULL ) {
+    // Only the class labels of corpus views were allocated one by one
+    for ( i=0; i<feature_vectors->corpus->num_vectors; i++ ) 
+      if ( feature_vectors->vector_block[i].class_ids != NULL ) free(feature_vectors->vector_block[i].class_ids);
+    free(feature_vectors->vector_block);
+    free(feature_vectors->vectors);
+    free_sparse_corpus ( feature_vectors->corpus );
+    free(feature_vectors);
+  } else if ( feature_vectors->vectors != NULL ) {
     for ( i=0; i<feature_vectors->num_vectors; i++ )
       free_sparse_feature_vector(feature_vectors->vectors[i]);
     free(feature_vectors);
@@ -1179,6 +3199,115 @@ void partition_feature_vectors_into_sets ( SPARSE_FEATURE_VECTORS *feature_vecto
 
 /*******************************************************************************************/
 
+// Sort key used when reordering the corpus for cache locality
+typedef struct VECTOR_ORDER_KEY {
+  int dominant_feature;
+  int num_features;
+  int index;
+} VECTOR_ORDER_KEY;
+
+static int vector_order_key_cmp(const void *a, const void *b)
+{
+  const VECTOR_ORDER_KEY *ka = (const VECTOR_ORDER_KEY *)a;
+  const VECTOR_ORDER_KEY *kb = (const VECTOR_ORDER_KEY *)b;
+  if ( ka->dominant_feature != kb->dominant_feature ) 
+    return ( ka->dominant_feature > kb->dominant_feature ) ? 1 : -1;
+  if ( ka->num_features != kb->num_features ) 
+    return ( ka->num_features < kb->num_features ) ? 1 : -1;
+  if ( ka->index != kb->index ) return ( ka->index > kb->index ) ? 1 : -1;
+  return 0;
+}
+
+// Reorder the feature vectors so that documents sharing the same dominant 
+// (highest weighted) term sit next to each other, longest documents first 
+// within each group. Neighbouring documents then touch many of the same 
+// P(w|z) rows during EM. Returns the permutation order[new] = old, which
+// restore_sparse_feature_vector_order() uses to undo the reordering.
+int *reorder_sparse_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_vectors )
+{
+  int num_vectors = feature_vectors->num_vectors;
+  SPARSE_FEATURE_VECTOR **vectors = feature_vectors->vectors;
+  float *feature_weights = NULL;
+  if ( feature_vectors->feature_set != NULL ) 
+    feature_weights = feature_vectors->feature_set->feature_weights;
+
+  VECTOR_ORDER_KEY *keys = (VECTOR_ORDER_KEY *) calloc(num_vectors, sizeof(VECTOR_ORDER_KEY));
+  int i, j, w;
+  float score, best_score;
+  for ( i=0; i<num_vectors; i++ ) {
+    SPARSE_FEATURE_VECTOR *vector = vectors[i];
+    keys[i].dominant_feature = -1;
+    keys[i].num_features = vector->num_features;
+    keys[i].index = i;
+    best_score = 0;
+    for ( j=0; j<vector->num_features; j++ ) {
+      w = vector->feature_indices[j];
+      score = vector->feature_values[j];
+      if ( feature_weights != NULL ) score *= feature_weights[w];
+      if ( keys[i].dominant_feature == -1 || score > best_score ) {
+	keys[i].dominant_feature = w;
+	best_score = score;
+      }
+    }
+  }
+
+  qsort ( keys, (size_t)num_vectors, sizeof(VECTOR_ORDER_KEY), vector_order_key_cmp );
+
+  int *order = (int *) calloc(num_vectors, sizeof(int));
+  SPARSE_FEATURE_VECTOR **new_vectors = (SPARSE_FEATURE_VECTOR **) calloc((size_t)num_vectors, 
+									  sizeof(SPARSE_FEATURE_VECTOR *));
+  for ( i=0; i<num_vectors; i++ ) {
+    order[i] = keys[i].index;
+    new_vectors[i] = vectors[order[i]];
+  }
+  memcpy ( vectors, new_vectors, num_vectors*sizeof(SPARSE_FEATURE_VECTOR *) );
+
+  free(new_vectors);
+  free(keys);
+
+  return order;
+}
+
+// Put reordered feature vectors back into their original order
+void restore_sparse_feature_vector_order ( SPARSE_FEATURE_VECTORS *feature_vectors, int *order )
+{
+  int num_vectors = feature_vectors->num_vectors;
+  SPARSE_FEATURE_VECTOR **vectors = feature_vectors->vectors;
+  SPARSE_FEATURE_VECTOR **old_vectors = (SPARSE_FEATURE_VECTOR **) calloc((size_t)num_vectors, 
+									  sizeof(SPARSE_FEATURE_VECTOR *));
+  int i;
+  for ( i=0; i<num_vectors; i++ ) old_vectors[order[i]] = vectors[i];
+  memcpy ( vectors, old_vectors, num_vectors*sizeof(SPARSE_FEATURE_VECTOR *) );
+  free(old_vectors);
+  return;
+}
+
+// Split the feature vectors into contiguous partitions carrying roughly
+// equal numbers of non-zero features (the per-document cost of an EM pass).
+// Returns num_partitions+1 boundaries: partition p covers vectors
+// [bounds[p], bounds[p+1]).
+int *partition_sparse_feature_vectors_by_cost ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_partitions )
+{
+  int num_vectors = feature_vectors->num_vectors;
+  SPARSE_FEATURE_VECTOR **vectors = feature_vectors->vectors;
+  int *bounds = (int *) calloc(num_partitions+1, sizeof(int));
+  double total_cost = 0, cost = 0;
+  int i, p;
+
+  for ( i=0; i<num_vectors; i++ ) total_cost += vectors[i]->num_features;
+
+  bounds[0] = 0;
+  for ( i=0, p=1; i<num_vectors && p<num_partitions; i++ ) {
+    cost += vectors[i]->num_features;
+    while ( p<num_partitions && cost >= (total_cost*p)/num_partitions ) bounds[p++] = i+1;
+  }
+  for ( ; p<=num_partitions; p++ ) bounds[p] = num_vectors;
+
+  return bounds;
+}
+
+/*******************************************************************************************/
+
 int feature_vector_class_cmp(const void *a, const void *b)
 {
   const SPARSE_FEATURE_VECTOR **va = (const SPARSE_FEATURE_VECTOR **)a;
@@ -1524,6 +3653,8 @@ void prune_zero_weight_features_from_feature_vectors ( SPARSE_FEATURE_VECTORS *f
   int i, j, k;
   int old_num_features = features->num_features;
   int new_num_features = 0;
+  if ( SPARSE_CORPUS_IS_PACKED(feature_vectors->corpus) ) 
+    die("prune_zero_weight_features_from_feature_vectors: Feature vectors are compressed\n");
   for ( i=0; i<old_num_features; i++ ) 
     if ( features->feature_weights[i] > 0.0 ) 
       new_num_features++;
@@ -1566,11 +3697,13 @@ void prune_zero_weight_features_from_feature_vectors ( SPARSE_FEATURE_VECTORS *f
   features->num_words = new_num_words;
 
   // Advance through the feature vectors themselves creating 
-  // new feature vectors mapped to new feature set
+  // new feature vectors mapped to new feature set. Each vector
+  // is rewritten on its own so the vectors are split over threads.
   int index;
   SPARSE_FEATURE_VECTOR *vector;
   int non_zero_count;
 
+#pragma omp parallel for private(j,k,index,vector,non_zero_count) schedule(dynamic,256)
   for ( i=0; i<feature_vectors->num_vectors; i++ ) {
     // Create new feature vectors for the non-zero weighted features
     vector = feature_vectors->vectors[i];
@@ -1578,8 +3711,13 @@ void prune_zero_weight_features_from_feature_vectors ( SPARSE_FEATURE_VECTORS *f
     for ( j=0; j<vector->num_features; j++ ) {
       if ( old_to_new_mapping[vector->feature_indices[j]] != -1 ) non_zero_count++;
     }    
-    int *new_indices = (int *) calloc(non_zero_count,sizeof(int));
-    float *new_values = (float *) calloc(non_zero_count,sizeof(float));
+    // Vectors of a corpus view are shortened in place
+    int *new_indices = vector->feature_indices;
+    float *new_values = vector->feature_values;
+    if ( feature_vectors->corpus == NULL ) {
+      new_indices = (int *) calloc(non_zero_count,sizeof(int));
+      new_values = (float *) calloc(non_zero_count,sizeof(float));
+    }
 
     // Set the total feature sum to zero for recounting
     vector->total_sum = 0;
@@ -1596,17 +3734,184 @@ void prune_zero_weight_features_from_feature_vectors ( SPARSE_FEATURE_VECTORS *f
       }
     }
 
-    free(vector->feature_indices);
-    free(vector->feature_values);
+    if ( feature_vectors->corpus == NULL ) {
+      free(vector->feature_indices);
+      free(vector->feature_values);
+    }
     vector->feature_indices = new_indices;
     vector->feature_values = new_values;
     vector->num_features = non_zero_count;
   }
+  if ( feature_vectors->corpus != NULL ) compact_sparse_corpus_view ( feature_vectors );
 
   return;
 
 }
 
+/*******************************************************************************************/
+
+// Returns a copy of the feature values of all vectors, so they can be put 
+// back with restore_sparse_feature_vector_values after the vectors have 
+// been weighted or normalized in place. A corpus view is copied as the 
+// corpus value array, other vectors are copied one after another.
+float *copy_sparse_feature_vector_values ( SPARSE_FEATURE_VECTORS *feature_vectors )
+{
+  SPARSE_CORPUS *corpus = feature_vectors->corpus;
+  int num_vectors = feature_vectors->num_vectors;
+  int i;
+
+  if ( SPARSE_CORPUS_IS_PACKED(corpus) ) die ( "copy_sparse_feature_vector_values: Feature vectors are compressed\n" );
+  if ( corpus != NULL ) {
+    float *values = (float *) malloc(corpus->num_nonzeros*sizeof(float));
+    if ( values == NULL && corpus->num_nonzeros > 0 ) die ( "Couldn't allocate copy of feature values\n" );
+#pragma omp parallel for schedule(static)
+    for ( i=0; i<corpus->num_vectors; i++ ) 
+      memcpy ( values+corpus->row_offsets[i], SPARSE_CORPUS_ROW_VALUES(corpus,i), 
+	       SPARSE_CORPUS_ROW_LENGTH(corpus,i)*sizeof(float) );
+    return values;
+  }
+
+  long *offsets = (long *) malloc((num_vectors+1)*sizeof(long));
+  offsets[0] = 0;
+  for ( i=0; i<num_vectors; i++ ) 
+    offsets[i+1] = offsets[i] + feature_vectors->vectors[i]->num_features;
+  float *values = (float *) malloc(offsets[num_vectors]*sizeof(float));
+  if ( values == NULL && offsets[num_vectors] > 0 ) die ( "Couldn't allocate copy of feature values\n" );
+#pragma omp parallel for schedule(static)
+  for ( i=0; i<num_vectors; i++ ) 
+    memcpy ( values+offsets[i], feature_vectors->vectors[i]->feature_values, 
+	     feature_vectors->vectors[i]->num_features*sizeof(float) );
+  free(offsets);
+  return values;
+}
+
+// Puts back values saved by copy_sparse_feature_vector_values. The vectors 
+// must not have been pruned or reordered in memory in between.
+void restore_sparse_feature_vector_values ( SPARSE_FEATURE_VECTORS *feature_vectors, float *values )
+{
+  SPARSE_CORPUS *corpus = feature_vectors->corpus;
+  int num_vectors = feature_vectors->num_vectors;
+  int i;
+
+  if ( corpus != NULL ) {
+#pragma omp parallel for schedule(static)
+    for ( i=0; i<corpus->num_vectors; i++ ) 
+      memcpy ( SPARSE_CORPUS_ROW_VALUES(corpus,i), values+corpus->row_offsets[i], 
+	       SPARSE_CORPUS_ROW_LENGTH(corpus,i)*sizeof(float) );
+    return;
+  }
+
+  long *offsets = (long *) malloc((num_vectors+1)*sizeof(long));
+  offsets[0] = 0;
+  for ( i=0; i<num_vectors; i++ ) 
+    offsets[i+1] = offsets[i] + feature_vectors->vectors[i]->num_features;
+#pragma omp parallel for schedule(static)
+  for ( i=0; i<num_vectors; i++ ) 
+    memcpy ( feature_vectors->vectors[i]->feature_values, values+offsets[i], 
+	     feature_vectors->vectors[i]->num_features*sizeof(float) );
+  free(offsets);
+  return;
+}
+
+/*******************************************************************************************/
+
+typedef struct FEATURE_VALUE_PAIR {
+  int index;
+  float value;
+} FEATURE_VALUE_PAIR;
+
+static int feature_value_pair_cmp(const void *a, const void *b)
+{
+  const FEATURE_VALUE_PAIR *pa = (const FEATURE_VALUE_PAIR *)a;
+  const FEATURE_VALUE_PAIR *pb = (const FEATURE_VALUE_PAIR *)b;
+  if ( pa->index > pb->index ) return 1; 
+  else if ( pa->index < pb->index ) return -1; 
+  else return 0;
+}
+
+static int feature_value_pair_decreasing_cmp(const void *a, const void *b)
+{
+  const FEATURE_VALUE_PAIR *pa = (const FEATURE_VALUE_PAIR *)a;
+  const FEATURE_VALUE_PAIR *pb = (const FEATURE_VALUE_PAIR *)b;
+  if ( pa->value < pb->value ) return 1; 
+  else if ( pa->value > pb->value ) return -1; 
+  else return feature_value_pair_cmp(a, b);
+}
+
+// Renumber the features so the most frequent words (by total count in the
+// feature vectors) get the lowest indices. The frequent head of the 
+// vocabulary then occupies a compact prefix of any matrix indexed by 
+// feature, e.g. P(w|z). The feature set is rewritten in the new order and
+// every vector's indices are remapped and re-sorted. Returns the mapping
+// new_to_old[new index] = old index.
+int *sort_features_by_frequency ( SPARSE_FEATURE_VECTORS *feature_vectors )
+{
+  FEATURE_SET *features = feature_vectors->feature_set;
+  int num_features = features->num_features;
+  int i, j;
+
+  // Rank the features by decreasing count, ties kept in the old order
+  float *counts = extract_feature_counts_from_sparse_feature_vectors ( feature_vectors );
+  FEATURE_VALUE_PAIR *ranked = (FEATURE_VALUE_PAIR *) calloc(num_features, sizeof(FEATURE_VALUE_PAIR));
+  for ( i=0; i<num_features; i++ ) {
+    ranked[i].index = i;
+    ranked[i].value = counts[i];
+  }
+  qsort ( ranked, (size_t)num_features, sizeof(FEATURE_VALUE_PAIR), feature_value_pair_decreasing_cmp );
+
+  int *new_to_old = (int *) calloc(num_features, sizeof(int));
+  int *old_to_new = (int *) calloc(num_features, sizeof(int));
+  for ( i=0; i<num_features; i++ ) {
+    new_to_old[i] = ranked[i].index;
+    old_to_new[ranked[i].index] = i;
+  }
+  free(ranked);
+  free(counts);
+
+  // Rewrite the feature set in the new order
+  char **new_feature_names = (char **) calloc(num_features, sizeof(char *));
+  float *new_feature_weights = (float *) calloc(num_features, sizeof(float));
+  int *new_num_words = NULL; 
+  if ( features->num_words != NULL ) 
+    new_num_words = (int *) calloc( num_features, sizeof(int));
+  HASHTABLE *new_hash = hdbmcreate( 1000, hash2);
+  for ( i=0; i<num_features; i++ ) {
+    new_feature_names[i] = features->feature_names[new_to_old[i]];
+    new_feature_weights[i] = features->feature_weights[new_to_old[i]];
+    if ( new_num_words != NULL ) new_num_words[i] = features->num_words[new_to_old[i]];
+    store_hashtable_string_index (new_hash, new_feature_names[i], i);
+  }
+  free(features->feature_names);
+  free(features->feature_weights);
+  if ( features->num_words != NULL ) free( features->num_words );
+  hdbmdestroy(features->feature_name_to_index_hash);  
+  features->feature_names = new_feature_names;
+  features->feature_weights = new_feature_weights;
+  features->num_words = new_num_words;
+  features->feature_name_to_index_hash = new_hash;
+
+  // Remap the feature vector indices, keeping them in increasing order
+  SPARSE_FEATURE_VECTOR *vector;
+  FEATURE_VALUE_PAIR *pairs;
+  for ( i=0; i<feature_vectors->num_vectors; i++ ) {
+    vector = feature_vectors->vectors[i];
+    pairs = (FEATURE_VALUE_PAIR *) calloc(vector->num_features+1, sizeof(FEATURE_VALUE_PAIR));
+    for ( j=0; j<vector->num_features; j++ ) {
+      pairs[j].index = old_to_new[vector->feature_indices[j]];
+      pairs[j].value = vector->feature_values[j];
+    }
+    qsort ( pairs, (size_t)vector->num_features, sizeof(FEATURE_VALUE_PAIR), feature_value_pair_cmp );
+    for ( j=0; j<vector->num_features; j++ ) {
+      vector->feature_indices[j] = pairs[j].index;
+      vector->feature_values[j] = pairs[j].value;
+    }
+    free(pairs);
+  }
+  free(old_to_new);
+
+  return new_to_old;
+}
+
 void remove_zero_weight_features ( FEATURE_SET *features )
 {
   hdbmdestroy(features->feature_name_to_index_hash);
@@ -43,14 +43,57 @@ typedef struct SPARSE_FEATURE_VECTOR {
   float total_sum; // Sum of feature values (i.e., total word count)
 } SPARSE_FEATURE_VECTOR;
 
+// A corpus of sparse vectors stored contiguously in compressed sparse row
+// form: the features of vector d are entries row_offsets[d] up to 
+// row_offsets[d+1] of feature_indices and feature_values, sorted by index,
+// and its name is the NUL terminated string at names+name_offsets[d]
+typedef struct SPARSE_CORPUS {
+  int num_vectors;
+  long num_nonzeros;
+  long *row_offsets; // num_vectors+1 offsets into the feature arrays
+  int *feature_indices;
+  float *feature_values;
+  float *total_sums; // Sum of feature values of each vector
+  long *name_offsets; // num_vectors+1 offsets into names
+  char *names; // Arena holding the file names of the vectors
+  void *mapping; // Binary corpus mapping the arrays point into, or NULL if they were allocated
+  size_t mapping_size;
+  // Once compressed, feature_indices and feature_values are NULL and row d
+  // is the packed_offsets[d] up to packed_offsets[d+1] bytes of packed_rows:
+  // a value width byte, the values as 1 or 2 byte counts or 4 byte floats,
+  // then the index gaps from the previous index (the first from 0) as 
+  // base 128 varints
+  unsigned char *packed_rows;
+  long *packed_offsets; // num_vectors+1 offsets into packed_rows
+} SPARSE_CORPUS;
+
+#define SPARSE_CORPUS_ROW_LENGTH(corpus,d) ((int)((corpus)->row_offsets[(d)+1] - (corpus)->row_offsets[d]))
+#define SPARSE_CORPUS_ROW_INDICES(corpus,d) ((corpus)->feature_indices + (corpus)->row_offsets[d])
+#define SPARSE_CORPUS_ROW_VALUES(corpus,d) ((corpus)->feature_values + (corpus)->row_offsets[d])
+#define SPARSE_CORPUS_ROW_NAME(corpus,d) ((corpus)->names + (corpus)->name_offsets[d])
+#define SPARSE_CORPUS_IS_PACKED(corpus) ((corpus) != NULL && (corpus)->packed_rows != NULL)
+
 typedef struct SPARSE_FEATURE_VECTORS {
   int num_vectors;
   int num_sets;
   SPARSE_FEATURE_VECTOR **vectors;
   FEATURE_SET *feature_set; // Pointer to the corresponding set of features
   CLASS_SET *class_set; // Pointer to the corresponding set of classes
+  // When the vectors are a view of a corpus, vector_block[d] points at 
+  // row d of the corpus and vectors holds every row in some order; 
+  // otherwise corpus is NULL and each vector was allocated separately
+  SPARSE_CORPUS *corpus;
+  SPARSE_FEATURE_VECTOR *vector_block;
 } SPARSE_FEATURE_VECTORS;
 
+// Expands the rows of a compressed corpus one at a time into a scratch
+// vector owned by the calling thread
+typedef struct SPARSE_VECTOR_DECODER {
+  SPARSE_FEATURE_VECTORS *feature_vectors;
+  int num_threads;
+  SPARSE_FEATURE_VECTOR *scratch; // One decoded vector per thread
+} SPARSE_VECTOR_DECODER;
+
 // The basic form of a linear classifier is:
 // S(x) = Ax+b
 // S(x) produces a vector of class scores for x
@@ -107,6 +150,26 @@ typedef struct VECTOR_ERROR_STATS {
 FILE_LIST *read_file_list_from_file ( char *list_filename ); 
 SPARSE_FEATURE_VECTORS *load_sparse_feature_vectors ( char *list_filename, FEATURE_SET *feature_set, CLASS_SET *class_set);
 SPARSE_FEATURE_VECTORS *load_sparse_feature_vectors_combined (char *count_fn, FEATURE_SET *feature_set, CLASS_SET *class_set);
+SPARSE_FEATURE_VECTORS *load_sparse_feature_vectors_combined_mmap ( char *count_fn, FEATURE_SET **feature_set_ptr,
+								    FEATURE_SET *stop_list, CLASS_SET *class_set );
+int is_count_file_pipe ( char *filename );
+int is_compressed_count_file ( char *filename );
+SPARSE_FEATURE_VECTORS *load_sparse_feature_vectors_combined_stream ( char *count_fn, FEATURE_SET **feature_set_ptr,
+								      FEATURE_SET *stop_list, CLASS_SET *class_set );
+SPARSE_CORPUS *create_sparse_corpus ( int num_vectors, long num_nonzeros, long names_size );
+void free_sparse_corpus ( SPARSE_CORPUS *corpus );
+SPARSE_FEATURE_VECTORS *create_sparse_corpus_view ( SPARSE_CORPUS *corpus, FEATURE_SET *feature_set );
+int is_binary_corpus_file ( char *filename );
+void save_binary_corpus ( SPARSE_FEATURE_VECTORS *feature_vectors, char *filename );
+SPARSE_FEATURE_VECTORS *map_binary_corpus ( char *corpus_fn, FEATURE_SET **feature_set_ptr, FEATURE_SET *stop_list );
+int is_corpus_store ( char *path );
+SPARSE_FEATURE_VECTORS *map_corpus_store ( char *store_dir, FEATURE_SET **feature_set_ptr, FEATURE_SET *stop_list );
+int append_to_corpus_store ( char *store_dir, char *count_fn );
+int compact_corpus_store ( char *store_dir );
+long compress_sparse_corpus ( SPARSE_FEATURE_VECTORS *feature_vectors );
+SPARSE_VECTOR_DECODER *create_sparse_vector_decoder ( SPARSE_FEATURE_VECTORS *feature_vectors );
+void free_sparse_vector_decoder ( SPARSE_VECTOR_DECODER *decoder );
+SPARSE_FEATURE_VECTOR *decode_sparse_feature_vector ( SPARSE_VECTOR_DECODER *decoder, SPARSE_FEATURE_VECTOR *vector );
 SPARSE_FEATURE_VECTOR *load_sparse_feature_vector ( char *filename, FEATURE_SET *feature_set );
 SPARSE_FEATURE_VECTOR *load_sparse_feature_vector_combined (char *substrings[], int num_substrings, FEATURE_SET *feature_set);
 SPARSE_FEATURE_VECTORS *copy_sparse_feature_vectors ( SPARSE_FEATURE_VECTORS *orig_feature_vectors );
@@ -114,10 +177,16 @@ SPARSE_FEATURE_VECTOR *copy_sparse_feature_vector (SPARSE_FEATURE_VECTOR *orig_v
 void free_sparse_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_vectors );
 void free_sparse_feature_vector ( SPARSE_FEATURE_VECTOR *vector );
 void partition_feature_vectors_into_sets ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_sets );
+int *reorder_sparse_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_vectors );
+void restore_sparse_feature_vector_order ( SPARSE_FEATURE_VECTORS *feature_vectors, int *order );
+int *partition_sparse_feature_vectors_by_cost ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_partitions );
 void L1_normalize_sparse_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_vectors );
 void L2_normalize_sparse_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_vectors );
 void remove_zero_weight_features ( FEATURE_SET *features );
 void prune_zero_weight_features_from_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_vectors );
+float *copy_sparse_feature_vector_values ( SPARSE_FEATURE_VECTORS *feature_vectors );
+void restore_sparse_feature_vector_values ( SPARSE_FEATURE_VECTORS *feature_vectors, float *values );
+int *sort_features_by_frequency ( SPARSE_FEATURE_VECTORS *feature_vectors );
 
 float *extract_feature_counts_from_sparse_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_vectors );
 
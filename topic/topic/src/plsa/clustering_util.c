@@ -17,6 +17,11 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "util/basic_util.h"
 #include "util/hash_util.h"
 #include "classifiers/classifier_util.h"
@@ -26,24 +31,117 @@
 
 typedef struct CLUSTERING_DATA {
   int num_elements;
-  int *tree_node_clusters;
   int *active_node_to_tree_node_mapping;
-  float **active_dist;
-  float **original_dist;
+  TRIANGULAR_MATRIX *active_dist;
   int *nearest_neighbor_index;
   float *nearest_neighbor_dist;
+  int *cluster_sizes; // Number of elements in each active cluster
+  double *within_sums; // Sum of the original distances within each active cluster
+  int min_tree_size; // Number of leaves in the tournament tree (a power of 2)
+  int *min_tree; // Tournament tree over the rows' nearest neighbor distances
+  int *stale_rows; // Rows whose nearest neighbor must be recomputed after a merge
 } CLUSTERING_DATA;
 
+// Link from an active cluster to another it shares edges with in the 
+// sparse clustering: the number of edges between them and the sum, 
+// minimum and maximum of the edge distances
+typedef struct SPARSE_LINK {
+  int cluster;
+  int count;
+  double sum;
+  float min_dist;
+  float max_dist;
+} SPARSE_LINK;
+
+typedef struct SPARSE_LINK_LIST {
+  int num_links;
+  int max_links;
+  SPARSE_LINK *links;
+} SPARSE_LINK_LIST;
+
+// Candidate merge with the versions of its clusters when it was queued
+typedef struct LINKAGE_HEAP_ENTRY {
+  double value;
+  int cluster_1;
+  int cluster_2;
+  int version_1;
+  int version_2;
+} LINKAGE_HEAP_ENTRY;
+
+typedef struct SPARSE_CLUSTERING_DATA {
+  int num_elements;
+  int dist_metric;
+  float missing_dist; // Distance of element pairs without an edge
+  int *active_node_to_tree_node_mapping;
+  int *cluster_sizes;
+  double *within_sums; // Sum of the distances within each active cluster
+  int *versions; // Bumped whenever a cluster is merged
+  SPARSE_LINK_LIST *link_lists;
+  int *slots; // Scratch map from a cluster to its link in a merged list
+  LINKAGE_HEAP_ENTRY *heap;
+  long heap_size;
+  long heap_max;
+} SPARSE_CLUSTERING_DATA;
+
+// Most clusters left without links that can be merged with each other
+#define SPARSE_CLUSTERING_MAX_UNLINKED 2048
+
+// Entry of an LSH table: a vector's signature key in the table
+typedef struct LSH_ENTRY {
+  unsigned int key;
+  int index;
+} LSH_ENTRY;
+
+// Slack on the k-means distance bounds to absorb float rounding
+#define KMEANS_BOUND_MARGIN 1e-5
+
+// Largest N x K matrix of per-centroid k-means bounds worth keeping
+#define KMEANS_ELKAN_MAX_BYTES (512.0*1024*1024)
+
+// k-means|| seeding: expected candidates drawn per round as a multiple
+// of the number of clusters, and the number of sampling rounds
+#define KMEANS_PARALLEL_OVERSAMPLING 2.0
+#define KMEANS_PARALLEL_ROUNDS 5
+
+// Number of candidate centroids scattered into dense rows at a time
+#define KMEANS_SEED_BLOCK 64
+
+// Most memory for the per-thread dense rows that sparse centroids are 
+// summed in; fewer threads build the centroids when it would be exceeded
+#define KMEANS_SCRATCH_MAX_BYTES (256.0*1024*1024)
+
 static void merge_clusters ( TREE_NODE **nodes_ptr, CLUSTERING_DATA *clust_data, int dist_metric,
 			     int active_index_1, int active_index_2, int next_tree_index );
-static void max_dist_update ( float **dist, int *mapping, int num_elements, int active_index_1, int active_index_2 );
-static void min_dist_update ( float **dist, int *mapping, int num_elements, int active_index_1, int active_index_2 );
-static void avg_dist_update ( CLUSTERING_DATA *clust_data, int active_index_1, int active_index_2 );
-static void tot_dist_update ( CLUSTERING_DATA *clust_data, int active_index_1, int active_index_2 );
+static void max_dist_update ( TRIANGULAR_MATRIX *dist, int *mapping, int active_index_1, int active_index_2 );
+static void min_dist_update ( TRIANGULAR_MATRIX *dist, int *mapping, int active_index_1, int active_index_2 );
+static void sum_dist_update ( CLUSTERING_DATA *clust_data, int active_index_1, int active_index_2, int average );
+static void find_nearest_neighbor ( CLUSTERING_DATA *clust_data, int index );
+static void update_min_tree ( CLUSTERING_DATA *clust_data, int index );
 static void count_leaves_in_tree(TREE_NODE *node) ;
+static void merge_sparse_clusters ( TREE_NODE *nodes, SPARSE_CLUSTERING_DATA *clust_data, 
+				    int cluster_1, int cluster_2, double linkage, int next_tree_index );
+static double sparse_linkage ( SPARSE_CLUSTERING_DATA *clust_data, SPARSE_LINK *link, int cluster_1, int cluster_2 );
+static void add_sparse_link ( SPARSE_LINK_LIST *list, SPARSE_LINK *link );
+static void push_linkage ( SPARSE_CLUSTERING_DATA *clust_data, int cluster_1, int cluster_2, double value );
+static int pop_linkage ( SPARSE_CLUSTERING_DATA *clust_data, LINKAGE_HEAP_ENTRY *top );
+static int pop_current_linkage ( SPARSE_CLUSTERING_DATA *clust_data, LINKAGE_HEAP_ENTRY *top );
+static int merge_unlinked_clusters_by_centroid ( TREE_NODE *nodes, SPARSE_CLUSTERING_DATA *clust_data,
+						 SPARSE_FEATURE_VECTORS *feature_vectors, int next_tree_index );
+static int cmp_lsh_entry ( const void *p1, const void *p2 );
 static void compute_tree_graphics_parameters(TREE_NODE *node, int leaves_to_left);
 static int fill_in_node_heights(TREE_NODE *node, float *heights, int next, int max);
 static void mark_nodes(TREE_NODE *node, float height );
+static float kmeans_similarity ( SPARSE_FEATURE_VECTOR *vector, float *centroid, float norm );
+static float cosine_to_unit_distance ( float similarity );
+static float *compute_weighted_l2_norms ( SPARSE_FEATURE_VECTORS *feature_vectors );
+static unsigned long long kmeans_hash ( unsigned long long x );
+static double kmeans_uniform ( unsigned int seed, int stream, int index );
+static int cmp_iv_pair_by_decreasing_value ( const void *p1, const void *p2 );
+static int cmp_iv_pair_by_index ( const void *p1, const void *p2 );
+static int *select_random_seeds ( int num_vectors, int num_clusters, unsigned int seed );
+static int *select_kmeans_parallel_seeds ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, 
+					   unsigned int seed );
+static int get_num_kmeans_scratch_rows ( int num_features, size_t row_bytes );
 static int find_and_label_cluster_nodes ( TREE_NODE *node, float cutoff_height, int current_label );
 static void label_cluster_nodes (TREE_NODE *node, int cluster_label );
 static void label_leaf_node (TREE_NODE *node, int cluster_label );
@@ -101,17 +199,33 @@ void learn_feature_weights ( SPARSE_FEATURE_VECTORS *feature_vectors, float df_c
   
   // Count the total estimated count of each word over the corpus 
   // and the estimated number of documents each word appearances in
-  for ( i=0; i<num_vectors; i++ ) {
-    vector = feature_vectors->vectors[i];
-    for ( j=0; j<vector->num_features; j++ ) {
-      index = vector->feature_indices[j];
-      value = vector->feature_values[j];
+  if ( SPARSE_CORPUS_IS_PACKED(feature_vectors->corpus) ) 
+    die ("learn_feature_weights: Feature vectors are compressed\n");
+  if ( feature_vectors->corpus != NULL ) {
+    SPARSE_CORPUS *corpus = feature_vectors->corpus;
+    long n;
+    for ( n=0; n<corpus->num_nonzeros; n++ ) {
+      index = corpus->feature_indices[n];
+      value = corpus->feature_values[n];
       if ( index != -1 ) {
 	word_counts[index] += value;
 	if ( value>1.0) value = 1.0;
 	doc_counts[index] += value;
       }
     }
+  } else {
+    for ( i=0; i<num_vectors; i++ ) {
+      vector = feature_vectors->vectors[i];
+      for ( j=0; j<vector->num_features; j++ ) {
+	index = vector->feature_indices[j];
+	value = vector->feature_values[j];
+	if ( index != -1 ) {
+	  word_counts[index] += value;
+	  if ( value>1.0) value = 1.0;
+	  doc_counts[index] += value;
+	}
+      }
+    }
   }
 
   float total_count = 0;
@@ -197,6 +311,19 @@ void apply_feature_weights_to_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_
   float value;
   int index;
   SPARSE_FEATURE_VECTOR *vector;
+
+  // A corpus view's values are weighted in one pass over the corpus
+  if ( SPARSE_CORPUS_IS_PACKED(feature_vectors->corpus) ) 
+    die ("apply_feature_weights_to_feature_vectors: Feature vectors are compressed\n");
+  if ( feature_vectors->corpus != NULL ) {
+    SPARSE_CORPUS *corpus = feature_vectors->corpus;
+    long n;
+    for ( n=0; n<corpus->num_nonzeros; n++ ) {
+      index = corpus->feature_indices[n];
+      if ( index != -1 ) corpus->feature_values[n] *= weights[index];
+    }
+    return;
+  }
   
   for ( i=0; i<feature_vectors->num_vectors; i++ ) {
     vector = feature_vectors->vectors[i];
@@ -218,7 +345,19 @@ void apply_feature_weights_to_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_
 /**********************************************************************/
 
 // If log_dist is set, similarity is converted to distance using -log()
-float **compute_cosine_similarity_matrix ( SPARSE_FEATURE_VECTORS *feature_vectors, int log_dist, int verbose ) 
+TRIANGULAR_MATRIX *compute_cosine_similarity_matrix ( SPARSE_FEATURE_VECTORS *feature_vectors, int log_dist, int verbose ) 
+{
+  return compute_pruned_cosine_similarity_matrix ( feature_vectors, 1.0, log_dist, verbose );
+}
+
+// The similarities are accumulated from an inverted index of the vectors, 
+// so each row only visits the vectors it shares terms with. Terms found in
+// more than max_doc_fraction of the vectors are left out of the index; 
+// these carry the smallest IDF weights but have the longest postings. 
+// A max_doc_fraction of 1.0 keeps every term, and then each similarity 
+// is summed in the same order as compute_sparse_vector_dot_product.
+TRIANGULAR_MATRIX *compute_pruned_cosine_similarity_matrix ( SPARSE_FEATURE_VECTORS *feature_vectors, 
+							     float max_doc_fraction, int log_dist, int verbose ) 
 {
 
   // L2 norm training vectors
@@ -228,66 +367,453 @@ float **compute_cosine_similarity_matrix ( SPARSE_FEATURE_VECTORS *feature_vecto
   apply_l2_norm_to_feature_vectors ( feature_vectors );
   
   int num_vectors = feature_vectors->num_vectors;
-  float **matrix = (float **) calloc2d (num_vectors, num_vectors, sizeof(float));
-  
-  SPARSE_FEATURE_VECTOR *vector_i, *vector_j;
-  int i, j;
-  float step_size = ((float)(num_vectors*num_vectors)+num_vectors)/20.0;
-  int step_count = 1;
-  float loop_count = 0;
-  float current_step = step_size;
+  TRIANGULAR_MATRIX *matrix = create_triangular_matrix ( num_vectors );
   
-  float min_sim = 1.0;
+  SPARSE_FEATURE_VECTOR *vector;
+  int i, j, k, t;
+
+  if ( verbose ) {
+    printf("indexing..."); fflush(stdout);
+  }
+
+  // Count the postings of each term. Unmapped features (index -1) and 
+  // zero values add nothing to a similarity and are not indexed.
+  int num_terms = 0;
+  long num_entries = 0;
+  long *entry_ptr = (long *) calloc ( num_vectors+1, sizeof(long) );
+  for ( i=0; i<num_vectors; i++ ) {
+    vector = feature_vectors->vectors[i];
+    for ( k=0; k<vector->num_features; k++ ) {
+      if ( vector->feature_indices[k] >= num_terms ) num_terms = vector->feature_indices[k] + 1;
+    }
+    num_entries += vector->num_features;
+    entry_ptr[i+1] = num_entries;
+  }
+  long *posting_ptr = (long *) calloc ( num_terms+1, sizeof(long) );
+  for ( i=0; i<num_vectors; i++ ) {
+    vector = feature_vectors->vectors[i];
+    for ( k=0; k<vector->num_features; k++ ) {
+      t = vector->feature_indices[k];
+      if ( t >= 0 && vector->feature_values[k] != 0.0 ) posting_ptr[t+1]++;
+    }
+  }
+  int num_pruned = 0;
+  for ( t=0; t<num_terms; t++ ) {
+    if ( max_doc_fraction < 1.0 && posting_ptr[t+1] > max_doc_fraction * num_vectors ) {
+      posting_ptr[t+1] = -1;
+      num_pruned++;
+    }
+  }
+
+  // Fill the postings in vector order, noting where each vector entry 
+  // sits in its term's postings (-1 if it is not indexed) so that a row 
+  // can start directly at the vectors that follow it
+  long *entry_position = (long *) calloc ( num_entries > 0 ? num_entries : 1, sizeof(long) );
+  long *fill = (long *) calloc ( num_terms+1, sizeof(long) );
+  long num_postings = 0;
+  for ( t=0; t<num_terms; t++ ) {
+    fill[t] = num_postings;
+    if ( posting_ptr[t+1] > 0 ) num_postings += posting_ptr[t+1];
+  }
+  fill[num_terms] = num_postings;
+  for ( t=0; t<=num_terms; t++ ) posting_ptr[t] = fill[t];
+  int *posting_vectors = (int *) calloc ( num_postings > 0 ? num_postings : 1, sizeof(int) );
+  float *posting_values = (float *) calloc ( num_postings > 0 ? num_postings : 1, sizeof(float) );
+  for ( i=0; i<num_vectors; i++ ) {
+    vector = feature_vectors->vectors[i];
+    for ( k=0; k<vector->num_features; k++ ) {
+      t = vector->feature_indices[k];
+      entry_position[entry_ptr[i]+k] = -1;
+      if ( t >= 0 && vector->feature_values[k] != 0.0 && posting_ptr[t+1] > posting_ptr[t] ) {
+	posting_vectors[fill[t]] = i;
+	posting_values[fill[t]] = vector->feature_values[k];
+	entry_position[entry_ptr[i]+k] = fill[t]++;
+      }
+    }
+  }
+  free ( fill );
+
+  // Per-thread accumulators over the row, the list of vectors touched 
+  // and the row that last touched each vector
+  int num_threads = get_num_threads();
+  float **sums = (float **) calloc2d ( num_threads, num_vectors, sizeof(float) );
+  int **touched = (int **) calloc2d ( num_threads, num_vectors, sizeof(int) );
+  int **touched_row = (int **) calloc2d ( num_threads, num_vectors, sizeof(int) );
+  for ( i=0; i<num_threads; i++ ) {
+    for ( j=0; j<num_vectors; j++ ) touched_row[i][j] = -1;
+  }
+
   if ( verbose ) {
     printf("computing..."); fflush(stdout);
   }
-  for (i=0; i<num_vectors; i++ ) {
 
-    vector_i = feature_vectors->vectors[i];
+  // Rows are processed in 20 blocks of roughly equal numbers of pairs,
+  // with a progress dot after each block
+  float min_sim = 1.0;
+  double step_size = ((double)num_vectors*num_vectors + num_vectors) / 40.0;
+  int block_start = 0, block_end;
+  while ( block_start < num_vectors ) {
+    double block_pairs = 0;
+    for ( block_end = block_start; block_end < num_vectors && block_pairs < step_size; block_end++ ) {
+      block_pairs += num_vectors - block_end;
+    }
 
-    for ( j=i; j<num_vectors; j++ ) {
+#pragma omp parallel for schedule(dynamic,16) private(j,k,vector) reduction(min:min_sim)
+    for ( i=block_start; i<block_end; i++ ) {
+      int thread = 0;
+#ifdef _OPENMP
+      thread = omp_get_thread_num();
+#endif
+      float *sum = sums[thread];
+      int *row_touched = touched[thread];
+      int *last_row = touched_row[thread];
+      int num_touched = 0;
+      float *row = matrix->values + TRIANGULAR_ROW_OFFSET(num_vectors,i) - i;
+      long p, p_end;
+      float value, sim;
 
-      // print out progress in computing matrix
-      if ( verbose ) {
-	if ( loop_count > current_step ) {
-	  printf("."); fflush(stdout);
-	  step_count++;
-	  current_step += step_size;
+      vector = feature_vectors->vectors[i];
+      for ( k=0; k<vector->num_features; k++ ) {
+	p = entry_position[entry_ptr[i]+k];
+	if ( p < 0 ) continue;
+	value = vector->feature_values[k];
+	p_end = posting_ptr[vector->feature_indices[k]+1];
+	for ( p++; p<p_end; p++ ) {
+	  j = posting_vectors[p];
+	  if ( last_row[j] != i ) {
+	    last_row[j] = i;
+	    sum[j] = 0;
+	    row_touched[num_touched++] = j;
+	  }
+	  sum[j] += value * posting_values[p];
 	}
-	loop_count++;
       }
 
-      vector_j = feature_vectors->vectors[j];
-
       // We compute the vector dot product assuming vectors have already been L2 normed
-      matrix[i][j] = compute_sparse_vector_dot_product ( vector_i, vector_j );
-      if ( matrix[i][j] > 1.0 ) matrix[i][j] = 1.0;
-      else if ( matrix[i][j] > 0.0 && matrix[i][j] < min_sim ) min_sim = matrix[i][j];
-      matrix[j][i] = matrix[i][j];
+      sim = compute_sparse_vector_dot_product ( vector, vector );
+      if ( sim > 1.0 ) sim = 1.0;
+      else if ( sim > 0.0 && sim < min_sim ) min_sim = sim;
+      row[i] = sim;
+      for ( k=0; k<num_touched; k++ ) {
+	j = row_touched[k];
+	sim = sum[j];
+	if ( sim > 1.0 ) sim = 1.0;
+	else if ( sim > 0.0 && sim < min_sim ) min_sim = sim;
+	row[j] = sim;
+      }
+    }
+
+    // print out progress in computing matrix
+    if ( verbose && block_end < num_vectors ) {
+      printf("."); fflush(stdout);
     }
+    block_start = block_end;
   }
 
+  free2d ( (char **) sums );
+  free2d ( (char **) touched );
+  free2d ( (char **) touched_row );
+  free ( posting_vectors );
+  free ( posting_values );
+  free ( posting_ptr );
+  free ( entry_position );
+  free ( entry_ptr );
+
   if ( log_dist ) {
     if ( verbose ) {
       printf("converting to distances..."); fflush(stdout);
     }
     float max_dist = 1.25 * -logf(min_sim);
-    for (i=0; i<num_vectors; i++ ) {
-      for ( j=i; j<num_vectors; j++ ) {
-	if ( matrix[i][j] == 0.0 ) matrix[i][j] = max_dist;	
-	else matrix[i][j] = -logf(matrix[i][j]);
-	matrix[j][i] = matrix[i][j];
-      }
+    long num_values = TRIANGULAR_ROW_OFFSET(num_vectors,num_vectors);
+#pragma omp parallel for schedule(static)
+    for ( long v=0; v<num_values; v++ ) {
+      if ( matrix->values[v] == 0.0 ) matrix->values[v] = max_dist;	
+      else matrix->values[v] = -logf(matrix->values[v]);
     }
   }
  
-
-  if ( verbose ) printf("done)\n");
+  if ( verbose ) {
+    if ( num_pruned > 0 ) printf("%d high frequency terms pruned...", num_pruned);
+    printf("done)\n");
+  }
 
   return matrix;
 
-  
+}
+
+/**********************************************************************/
+
+// Approximate k nearest neighbor graph under cosine similarity, for 
+// corpora too large for the full similarity matrix. Each vector gets a 
+// SimHash signature of num_tables keys of num_bits bits, each bit being 
+// the side of a random hyperplane the weighted vector falls on, so two 
+// vectors agree on a bit with probability 1 - angle/pi. Vectors are sorted
+// by key in each table and the candidates for a vector are the vectors 
+// within window places of it in a table that share its key. Candidates 
+// are scored with the exact cosine similarity and the num_neighbors best
+// are kept. Recall grows with num_tables and window and falls as num_bits
+// grows. The graph holds an edge wherever either element is among the 
+// other's neighbors. If log_dist is set, similarities are converted to 
+// distances using -log() as in compute_cosine_similarity_matrix, and 
+// pairs without an edge take the same ceiling distance.
+SIMILARITY_GRAPH *compute_lsh_cosine_similarity_graph ( SPARSE_FEATURE_VECTORS *feature_vectors, 
+							int num_neighbors, int num_tables, int num_bits, 
+							int window, unsigned int seed, int log_dist, int verbose )
+{
+  if ( num_bits < 1 || num_bits > 32 ) 
+    die ( "compute_lsh_cosine_similarity_graph: Bits per table must be from 1 to 32 (not %d)\n", num_bits );
+  if ( num_tables < 1 || num_neighbors < 1 || window < 1 ) 
+    die ( "compute_lsh_cosine_similarity_graph: Tables, neighbors and window must be positive\n" );
+
+  if ( verbose ) {
+    printf("(Computing LSH similarity graph...normalizing..."); fflush(stdout);
+  }
+  apply_l2_norm_to_feature_vectors ( feature_vectors );
+
+  int num_vectors = feature_vectors->num_vectors;
+  int num_threads = get_num_threads();
+  SPARSE_FEATURE_VECTOR *vector;
+  int i, j, k, t;
+
+  if ( verbose ) {
+    printf("hashing..."); fflush(stdout);
+  }
+
+  // The random hyperplanes: bit b of the mask for a term and table is 
+  // the sign of the term's component in the table's b-th hyperplane
+  int num_terms = 0;
+  for ( i=0; i<num_vectors; i++ ) {
+    vector = feature_vectors->vectors[i];
+    for ( k=0; k<vector->num_features; k++ ) {
+      if ( vector->feature_indices[k] >= num_terms ) num_terms = vector->feature_indices[k] + 1;
+    }
+  }
+  unsigned int *plane_masks = (unsigned int *) calloc ( (size_t)num_terms*num_tables+1, sizeof(unsigned int) );
+  for ( t=0; t<num_tables; t++ ) {
+    unsigned long long table_seed = kmeans_hash ( (((unsigned long long)seed) << 32) ^ (unsigned int)t );
+    for ( i=0; i<num_terms; i++ ) {
+      plane_masks[(size_t)i*num_tables+t] = (unsigned int) kmeans_hash ( table_seed ^ (unsigned int)i );
+    }
+  }
+
+  // Signature keys of each vector in each table
+  unsigned int **keys = (unsigned int **) calloc2d ( num_tables, num_vectors, sizeof(unsigned int) );
+  float **projections = (float **) calloc2d ( num_threads, num_tables*num_bits, sizeof(float) );
+#pragma omp parallel for schedule(dynamic,256) private(k,t,vector)
+  for ( i=0; i<num_vectors; i++ ) {
+    int thread = 0;
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+    float *projection = projections[thread];
+    int b;
+    memset ( projection, 0, num_tables*num_bits*sizeof(float) );
+    vector = feature_vectors->vectors[i];
+    for ( k=0; k<vector->num_features; k++ ) {
+      if ( vector->feature_indices[k] < 0 ) continue;
+      float value = vector->feature_values[k];
+      unsigned int *masks = plane_masks + (size_t)vector->feature_indices[k]*num_tables;
+      for ( t=0; t<num_tables; t++ ) {
+	float *p = projection + t*num_bits;
+	for ( b=0; b<num_bits; b++ ) p[b] += ( (masks[t]>>b) & 1 ) ? value : -value;
+      }
+    }
+    for ( t=0; t<num_tables; t++ ) {
+      unsigned int key = 0;
+      for ( b=0; b<num_bits; b++ ) if ( projection[t*num_bits+b] > 0 ) key |= 1u << b;
+      keys[t][i] = key;
+    }
+  }
+  free2d ( (char **) projections );
+  free ( plane_masks );
+
+  // Sort the vectors by key in each table
+  int **order = (int **) calloc2d ( num_tables, num_vectors, sizeof(int) );
+  int **position = (int **) calloc2d ( num_tables, num_vectors, sizeof(int) );
+#pragma omp parallel for schedule(dynamic,1) private(i)
+  for ( t=0; t<num_tables; t++ ) {
+    LSH_ENTRY *entries = (LSH_ENTRY *) calloc ( num_vectors+1, sizeof(LSH_ENTRY) );
+    for ( i=0; i<num_vectors; i++ ) {
+      entries[i].key = keys[t][i];
+      entries[i].index = i;
+    }
+    qsort ( entries, num_vectors, sizeof(LSH_ENTRY), cmp_lsh_entry );
+    for ( i=0; i<num_vectors; i++ ) {
+      order[t][i] = entries[i].index;
+      position[t][entries[i].index] = i;
+    }
+    free ( entries );
+  }
+
+  if ( verbose ) {
+    printf("searching..."); fflush(stdout);
+  }
+
+  // Score the candidates of each vector and keep its nearest neighbors,
+  // most similar first with ties going to the lower index
+  int **knn_indices = (int **) calloc2d ( num_vectors, num_neighbors, sizeof(int) );
+  float **knn_sims = (float **) calloc2d ( num_vectors, num_neighbors, sizeof(float) );
+  int *knn_counts = (int *) calloc ( num_vectors, sizeof(int) );
+  int **last_seen = (int **) calloc2d ( num_threads, num_vectors, sizeof(int) );
+  float **dense_vectors = (float **) calloc2d ( num_threads, num_terms+1, sizeof(float) );
+  for ( i=0; i<num_threads; i++ ) {
+    for ( j=0; j<num_vectors; j++ ) last_seen[i][j] = -1;
+  }
+  long num_candidates = 0;
+#pragma omp parallel for schedule(dynamic,64) private(j,k,t,vector) reduction(+:num_candidates)
+  for ( i=0; i<num_vectors; i++ ) {
+    int thread = 0;
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+    int *seen = last_seen[thread];
+    float *dense = dense_vectors[thread];
+    int *indices = knn_indices[i];
+    float *sims = knn_sims[i];
+    int count = 0, p, p_start, p_end;
+    float sim;
+    // The vector is spread out over the terms so that each candidate's 
+    // similarity is a single pass over the candidate's terms
+    vector = feature_vectors->vectors[i];
+    for ( k=0; k<vector->num_features; k++ ) {
+      if ( vector->feature_indices[k] >= 0 ) dense[vector->feature_indices[k]] += vector->feature_values[k];
+    }
+
+    // A vector sharing no key with any other falls back to the vectors 
+    // next to it in each table, whose keys agree on the high bits
+    int match_keys;
+    for ( match_keys=1; match_keys>=0 && count==0; match_keys-- ) {
+      for ( t=0; t<num_tables; t++ ) {
+	unsigned int key = keys[t][i];
+	int pos = position[t][i];
+	p_start = pos - window < 0 ? 0 : pos - window;
+	p_end = pos + window >= num_vectors ? num_vectors - 1 : pos + window;
+	for ( p=p_start; p<=p_end; p++ ) {
+	  j = order[t][p];
+	  if ( j == i || seen[j] == i || ( match_keys && keys[t][j] != key ) ) continue;
+	  seen[j] = i;
+	  num_candidates++;
+	  SPARSE_FEATURE_VECTOR *candidate = feature_vectors->vectors[j];
+	  sim = 0;
+	  for ( k=0; k<candidate->num_features; k++ ) {
+	    if ( candidate->feature_indices[k] >= 0 ) 
+	      sim += dense[candidate->feature_indices[k]] * candidate->feature_values[k];
+	  }
+	  if ( sim > 1.0 ) sim = 1.0;
+	  if ( count == num_neighbors && 
+	       ( sim < sims[count-1] || ( sim == sims[count-1] && j > indices[count-1] ) ) ) continue;
+	  if ( count < num_neighbors ) count++;
+	  for ( k=count-1; k>0 && ( sims[k-1] < sim || ( sims[k-1] == sim && indices[k-1] > j ) ); k-- ) {
+	    sims[k] = sims[k-1];
+	    indices[k] = indices[k-1];
+	  }
+	  sims[k] = sim;
+	  indices[k] = j;
+	}
+      }
+    }
+    knn_counts[i] = count;
+    for ( k=0; k<vector->num_features; k++ ) {
+      if ( vector->feature_indices[k] >= 0 ) dense[vector->feature_indices[k]] = 0;
+    }
+  }
+  free2d ( (char **) last_seen );
+  free2d ( (char **) dense_vectors );
+  free2d ( (char **) keys );
+  free2d ( (char **) order );
+  free2d ( (char **) position );
+
+  // Symmetrize the neighbor lists into the graph, sorting each element's
+  // edges by neighbor and dropping the duplicates of mutual neighbors
+  SIMILARITY_GRAPH *graph = (SIMILARITY_GRAPH *) malloc ( sizeof(SIMILARITY_GRAPH) );
+  graph->num_elements = num_vectors;
+  graph->missing_value = 0;
+  graph->edge_ptr = (long *) calloc ( num_vectors+1, sizeof(long) );
+  for ( i=0; i<num_vectors; i++ ) {
+    for ( k=0; k<knn_counts[i]; k++ ) {
+      graph->edge_ptr[i+1]++;
+      graph->edge_ptr[knn_indices[i][k]+1]++;
+    }
+  }
+  for ( i=0; i<num_vectors; i++ ) graph->edge_ptr[i+1] += graph->edge_ptr[i];
+  long num_edges = graph->edge_ptr[num_vectors];
+  IV_PAIR *edges = (IV_PAIR *) calloc ( num_edges+1, sizeof(IV_PAIR) );
+  long *fill = (long *) calloc ( num_vectors+1, sizeof(long) );
+  for ( i=0; i<num_vectors; i++ ) fill[i] = graph->edge_ptr[i];
+  for ( i=0; i<num_vectors; i++ ) {
+    for ( k=0; k<knn_counts[i]; k++ ) {
+      j = knn_indices[i][k];
+      edges[fill[i]].index = j;
+      edges[fill[i]++].value = knn_sims[i][k];
+      edges[fill[j]].index = i;
+      edges[fill[j]++].value = knn_sims[i][k];
+    }
+  }
+  free2d ( (char **) knn_indices );
+  free2d ( (char **) knn_sims );
+  free ( knn_counts );
+#pragma omp parallel for schedule(dynamic,256)
+  for ( i=0; i<num_vectors; i++ ) {
+    qsort ( edges + graph->edge_ptr[i], graph->edge_ptr[i+1] - graph->edge_ptr[i], 
+	    sizeof(IV_PAIR), cmp_iv_pair_by_index );
+  }
+  long e, num_kept = 0;
+  for ( i=0; i<num_vectors; i++ ) {
+    long start = graph->edge_ptr[i];
+    graph->edge_ptr[i] = num_kept;
+    for ( e=start; e<fill[i]; e++ ) {
+      if ( e > start && edges[e].index == edges[e-1].index ) continue;
+      edges[num_kept++] = edges[e];
+    }
+  }
+  graph->edge_ptr[num_vectors] = num_kept;
+  free ( fill );
+  graph->neighbors = (int *) calloc ( num_kept+1, sizeof(int) );
+  graph->values = (float *) calloc ( num_kept+1, sizeof(float) );
+  float min_sim = 1.0;
+  for ( e=0; e<num_kept; e++ ) {
+    graph->neighbors[e] = edges[e].index;
+    graph->values[e] = edges[e].value;
+    if ( edges[e].value > 0.0 && edges[e].value < min_sim ) min_sim = edges[e].value;
+  }
+  free ( edges );
+
+  if ( log_dist ) {
+    if ( verbose ) {
+      printf("converting to distances..."); fflush(stdout);
+    }
+    graph->missing_value = 1.25 * -logf(min_sim);
+    for ( e=0; e<num_kept; e++ ) {
+      if ( graph->values[e] == 0.0 ) graph->values[e] = graph->missing_value;
+      else graph->values[e] = -logf(graph->values[e]);
+    }
+  }
+
+  if ( verbose ) {
+    printf("%.1f candidates and %.1f edges per vector...done)\n", 
+	   (float)num_candidates/num_vectors, (float)num_kept/num_vectors);
+  }
+
+  return graph;
+
+}
+
+void free_similarity_graph ( SIMILARITY_GRAPH *graph )
+{
+  if ( graph == NULL ) return;
+  free ( graph->edge_ptr );
+  free ( graph->neighbors );
+  free ( graph->values );
+  free ( graph );
+}
 
+// Orders LSH table entries by key, then by vector index
+static int cmp_lsh_entry ( const void *p1, const void *p2 )
+{
+  const LSH_ENTRY *e1 = (const LSH_ENTRY *) p1;
+  const LSH_ENTRY *e2 = (const LSH_ENTRY *) p2;
+  if ( e1->key != e2->key ) return e1->key < e2->key ? -1 : 1;
+  return e1->index - e2->index;
 }
 
 // This function applies L2 normalization to a set of sparse feature vectors
@@ -299,6 +825,8 @@ void apply_l2_norm_to_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_vectors
   SPARSE_FEATURE_VECTOR *vector;
   
   int num_vectors = feature_vectors->num_vectors;
+  if ( SPARSE_CORPUS_IS_PACKED(feature_vectors->corpus) ) 
+    die ("apply_l2_norm_to_feature_vectors: Feature vectors are compressed\n");
   
   int i, j;
   for ( i=0; i<num_vectors; i++ ) {
@@ -629,21 +1157,20 @@ LDA_FEATURE_VECTORS *load_lda_feature_vectors ( char *lda_vectors_in )
 
 /**********************************************************************/
 
-float **compute_topic_prob_similarity_matrix ( LDA_FEATURE_VECTORS *feature_vectors ) 
+TRIANGULAR_MATRIX *compute_topic_prob_similarity_matrix ( LDA_FEATURE_VECTORS *feature_vectors ) 
 {
   
   float **vectors = feature_vectors->vectors;
   int num_vectors = feature_vectors->num_vectors;
   int num_topics = feature_vectors->num_topics;
-  float **matrix = (float **) calloc2d (num_vectors, num_vectors, sizeof(float));
+  TRIANGULAR_MATRIX *matrix = create_triangular_matrix ( num_vectors );
 
   int i, j, k;
   for (i=0; i<num_vectors; i++ ) {
     for ( j=i; j<num_vectors; j++ ) {
       for ( k=0; k<num_topics; k++ ) {
-	matrix[i][j] += vectors[i][k] * vectors[j][k] ;
+	TRIANGULAR_ENTRY(matrix,i,j) += vectors[i][k] * vectors[j][k] ;
       }
-      matrix[j][i] = matrix[i][j];
     }
   }
 
@@ -652,13 +1179,13 @@ float **compute_topic_prob_similarity_matrix ( LDA_FEATURE_VECTORS *feature_vect
 
 /**********************************************************************/
 
-float **compute_lda_cosine_similarity_matrix ( LDA_FEATURE_VECTORS *feature_vectors ) 
+TRIANGULAR_MATRIX *compute_lda_cosine_similarity_matrix ( LDA_FEATURE_VECTORS *feature_vectors ) 
 {
   
   float **vectors = feature_vectors->vectors;
   int num_vectors = feature_vectors->num_vectors;
   int num_topics = feature_vectors->num_topics;
-  float **matrix = (float **) calloc2d (num_vectors, num_vectors, sizeof(float));
+  TRIANGULAR_MATRIX *matrix = create_triangular_matrix ( num_vectors );
 
   int i, j, k;
   // Apply l2 norm to feature vectors
@@ -672,9 +1199,8 @@ float **compute_lda_cosine_similarity_matrix ( LDA_FEATURE_VECTORS *feature_vect
   for (i=0; i<num_vectors; i++ ) {
     for ( j=i; j<num_vectors; j++ ) {
       for ( k=0; k<num_topics; k++ ) {
-	matrix[i][j] += vectors[i][k] * vectors[j][k] ;
+	TRIANGULAR_ENTRY(matrix,i,j) += vectors[i][k] * vectors[j][k] ;
       }
-      matrix[j][i] = matrix[i][j];
     }
   }
 
@@ -683,22 +1209,21 @@ float **compute_lda_cosine_similarity_matrix ( LDA_FEATURE_VECTORS *feature_vect
 
 /**********************************************************************/
 
-float **compute_kl_divergence_matrix ( LDA_FEATURE_VECTORS *feature_vectors ) 
+TRIANGULAR_MATRIX *compute_kl_divergence_matrix ( LDA_FEATURE_VECTORS *feature_vectors ) 
 {
   
   float **vectors = feature_vectors->vectors;
   int num_vectors = feature_vectors->num_vectors;
   int num_topics = feature_vectors->num_topics;
-  float **matrix = (float **) calloc2d (num_vectors, num_vectors, sizeof(float));
+  TRIANGULAR_MATRIX *matrix = create_triangular_matrix ( num_vectors );
 
   int i, j, k;
   for (i=0; i<num_vectors; i++ ) {
     for ( j=i; j<num_vectors; j++ ) {
       for ( k=0; k<num_topics; k++ ) {
-	matrix[i][j] += 0.5*(vectors[i][k] * logf(vectors[i][k]/vectors[j][k]));
-	matrix[i][j] += 0.5*(vectors[j][k] * logf(vectors[j][k]/vectors[i][k]));
+	TRIANGULAR_ENTRY(matrix,i,j) += 0.5*(vectors[i][k] * logf(vectors[i][k]/vectors[j][k]));
+	TRIANGULAR_ENTRY(matrix,i,j) += 0.5*(vectors[j][k] * logf(vectors[j][k]/vectors[i][k]));
       }
-      matrix[j][i] = matrix[i][j];
     }
   }
 
@@ -707,29 +1232,26 @@ float **compute_kl_divergence_matrix ( LDA_FEATURE_VECTORS *feature_vectors )
 
 /**********************************************************************/
 
-void convert_similarity_matrix_to_distance_matrix ( float **matrix, int num_dims, float ceiling )
+// Symmetry is guaranteed by the triangular storage
+void convert_similarity_matrix_to_distance_matrix ( TRIANGULAR_MATRIX *matrix, float ceiling )
 {
-  int i, j;
+  long k;
+  long num_values = TRIANGULAR_ROW_OFFSET(matrix->num_elements,matrix->num_elements);
+  float *values = matrix->values;
 
   float min = 1.0;
-  for ( i=0; i<num_dims-1; i++ ) {
-    for ( j=i; j<num_dims; j++ ) {
-      if ( matrix[i][j] != matrix[j][i] ) die ("Distance matrix is not symmetric?!?\n");
-      if ( matrix[i][j] > 1.0 ) die ("Similarity matrix has value greater than 1 (%f)!?!\n", matrix[i][j]);
-      if ( matrix[i][j] < 0.0 ) die ("Similarity matrix has value less than 0 (%f)!?!\n", matrix[i][j]);
-      if ( matrix[i][j] < min && matrix[i][j] != 0.0 ) min = matrix[i][j];
-    }
+  for ( k=0; k<num_values; k++ ) {
+    if ( values[k] > 1.0 ) die ("Similarity matrix has value greater than 1 (%f)!?!\n", values[k]);
+    if ( values[k] < 0.0 ) die ("Similarity matrix has value less than 0 (%f)!?!\n", values[k]);
+    if ( values[k] < min && values[k] != 0.0 ) min = values[k];
   }
 
-  for ( i=0; i<num_dims; i++ ) {
-    for ( j=i; j<num_dims; j++ ) {
-      if ( matrix[i][j] == 0.0 ) matrix[i][j] = ceiling;
-      else { 
-	matrix[i][j] = -logf ( matrix[i][j] );
-	if ( matrix[i][j] > ceiling ) matrix[i][j] = ceiling;
-      }
-      matrix[j][i] = matrix[i][j];
-    } 
+  for ( k=0; k<num_values; k++ ) {
+    if ( values[k] == 0.0 ) values[k] = ceiling;
+    else { 
+      values[k] = -logf ( values[k] );
+      if ( values[k] > ceiling ) values[k] = ceiling;
+    }
   }
   
   return;
@@ -738,37 +1260,39 @@ void convert_similarity_matrix_to_distance_matrix ( float **matrix, int num_dims
  
 /**********************************************************************/
 
-void add_in_similarity_matrix ( float **full_matrix, float **matrix, int num_dims )
+void add_in_similarity_matrix ( TRIANGULAR_MATRIX *full_matrix, TRIANGULAR_MATRIX *matrix )
 {
-  int i, j;
+  long k;
+  long num_values = TRIANGULAR_ROW_OFFSET(matrix->num_elements,matrix->num_elements);
 
-  for ( i=0; i<num_dims; i++ ) {
-    for ( j=0; j<num_dims; j++ ) {
-      full_matrix[i][j] += matrix[i][j];
-    }
+  if ( full_matrix->num_elements != matrix->num_elements )
+    die ("add_in_similarity_matrix: matrices are different sizes\n");
+
+  for ( k=0; k<num_values; k++ ) {
+    full_matrix->values[k] += matrix->values[k];
   }
   
   return;
 
 }
 
-float **interpolate_similarity_matrices ( float **matrix1, float **matrix2, int num_dims, float weight1 )
+TRIANGULAR_MATRIX *interpolate_similarity_matrices ( TRIANGULAR_MATRIX *matrix1, TRIANGULAR_MATRIX *matrix2, float weight1 )
 {
-  int i, j;
+  long k;
+  long num_values = TRIANGULAR_ROW_OFFSET(matrix1->num_elements,matrix1->num_elements);
 
   if ( ( weight1 < 0 ) ||
        ( weight1 > 1 ) )
     die ("interpolate_matrices: interpolation weight must be between 0 and 1\n");
 
-  float **new_matrix = (float **) calloc2d ( num_dims, num_dims, sizeof(float));
+  if ( matrix1->num_elements != matrix2->num_elements )
+    die ("interpolate_matrices: matrices are different sizes\n");
+
+  TRIANGULAR_MATRIX *new_matrix = create_triangular_matrix ( matrix1->num_elements );
 
   float weight2 = 1.0 - weight1;
-  for ( i=0; i<num_dims; i++ ) {
-    new_matrix[i][i] += (weight1 * matrix1[i][i] ) + (weight2 * matrix2[i][i]);
-    for ( j=i+1; j<num_dims; j++ ) {
-      new_matrix[i][j] += (weight1 * matrix1[i][j] ) + (weight2 * matrix2[i][j]);
-      new_matrix[j][i] = new_matrix[i][j];
-    }
+  for ( k=0; k<num_values; k++ ) {
+    new_matrix->values[k] += (weight1 * matrix1->values[k] ) + (weight2 * matrix2->values[k]);
   }
   
   return new_matrix;
@@ -781,11 +1305,9 @@ float **interpolate_similarity_matrices ( float **matrix1, float **matrix2, int
 
 /**************************************************************************************
 
- The routine bottom_up_cluster takes 5 arguments:
-          matrix:  a symmetric distance matrix (of size num_elements
-                   by num_elements) containing the distances between 
-		   each of the elements that are to be clustered.
-    num_elements:  the number of elements to be clustered.
+ The routine bottom_up_cluster takes 3 arguments:
+          matrix:  a triangular distance matrix containing the distances 
+                   between each of the elements that are to be clustered.
           labels:  an array of pointers to labels for each of the elements.
                    if labels is NULL, the feature vector indices will be used as labels
      dist_metric:  type of distance metric to use for deciding which
@@ -802,31 +1324,54 @@ float **interpolate_similarity_matrices ( float **matrix1, float **matrix2, int
  The routine returns a pointer to the root node in the resulting hierarchical				  
  structure. The structure TREE_NODE is used to represent each node.
 
+ Cluster to cluster distances are updated in O(1) per active cluster per merge
+ with Lance-Williams style recurrences. AVG_DIST and TOT_DIST are built from the 
+ sum of all pairwise distances within the merged cluster, which follows from the
+ sums within each cluster and the total for each pair of clusters. Each row 
+ keeps its nearest neighbor as before and a tournament tree over the rows 
+ finds the closest pair in O(log N), so a full clustering takes O(N^2) time
+ when few rows need their nearest neighbor recomputed. Ties are broken as 
+ in a full scan: the lowest row index, then the lowest column index.
+
+ bottom_up_cluster works on a copy of the matrix. bottom_up_cluster_in_place
+ uses the matrix itself as its working storage, overwriting it, which halves 
+ the memory needed when the caller has no further use for the distances. 
+ The matrix must be writable, so a mapped matrix has to be clustered with
+ bottom_up_cluster.
+
 **************************************************************************************/
                           
-TREE_NODE *bottom_up_cluster( float **matrix, int num_elements, 
-			      char **labels, int dist_metric )
+TREE_NODE *bottom_up_cluster( TRIANGULAR_MATRIX *matrix, char **labels, int dist_metric )
 {
-  int i, j;
+  TRIANGULAR_MATRIX *working_matrix = copy_triangular_matrix ( matrix );
+  TREE_NODE *root = bottom_up_cluster_in_place ( working_matrix, labels, dist_metric );
+  free_triangular_matrix ( working_matrix );
+  return root;
+}
+
+TREE_NODE *bottom_up_cluster_in_place( TRIANGULAR_MATRIX *matrix, char **labels, int dist_metric )
+{
+  int i;
+  int num_elements = matrix->num_elements;
   int active_index_1, active_index_2;
-  float min_dist = 0;
   int min_index;
   char label[100];
 
+  if ( matrix->mapping != NULL ) 
+    die ( "bottom_up_cluster_in_place: Mapped distance matrices are read only\n" );
+
   // These arrays keep track of current clustering state
   CLUSTERING_DATA clust_data;
   clust_data.num_elements = num_elements;
-  clust_data.tree_node_clusters = (int *) calloc ( num_elements, sizeof(int));
   clust_data.active_node_to_tree_node_mapping = (int *) calloc ( num_elements, sizeof(int));
-  clust_data.active_dist = (float **) calloc2d (num_elements, num_elements, sizeof(float));
+  clust_data.active_dist = matrix;
   clust_data.nearest_neighbor_index = (int *) calloc ( num_elements, sizeof(int));
   clust_data.nearest_neighbor_dist = (float *) calloc ( num_elements, sizeof(float));
-  clust_data.original_dist = matrix;
-
-  // The initial element wise distance matrix is copied into the working distance matrix
-  for ( i=0; i<num_elements; i++ ) {
-    memcpy (clust_data.active_dist[i], matrix[i], num_elements*sizeof(float));
-  }
+  clust_data.cluster_sizes = (int *) calloc ( num_elements, sizeof(int));
+  clust_data.within_sums = (double *) calloc ( num_elements, sizeof(double));
+  for ( clust_data.min_tree_size=1; clust_data.min_tree_size<num_elements; clust_data.min_tree_size*=2 );
+  clust_data.min_tree = (int *) calloc ( 2*clust_data.min_tree_size, sizeof(int));
+  clust_data.stale_rows = (int *) calloc ( num_elements, sizeof(int));
 
   // Tree has a leaf for every element to be clustered
   int num_leaves = num_elements; 
@@ -843,7 +1388,8 @@ TREE_NODE *bottom_up_cluster( float **matrix, int num_elements,
 
     // Initialize the state of the active clustering structure
     clust_data.active_node_to_tree_node_mapping[i] = i;
-    clust_data.tree_node_clusters[i] = i;
+    clust_data.cluster_sizes[i] = 1;
+    clust_data.within_sums[i] = 0;
 
     // Initialize the leaf nodes of the clustering tree
     nodes[i].height = 0;
@@ -858,21 +1404,14 @@ TREE_NODE *bottom_up_cluster( float **matrix, int num_elements,
     nodes[i].left_child = NULL;
     nodes[i].right_child = NULL;
     nodes[i].mark = 0;
-
-    // Find the nearest neighbor for each leaf node
-    min_index = -1;
-    min_dist = -1;
-    for (j=0; j<num_leaves;j++ ) {
-      if ( j != i ) {
-	if ( min_index == -1 || clust_data.active_dist[i][j] < min_dist ) {
-	  min_index = j;
-	  min_dist = clust_data.active_dist[i][j];
-	}
-      }
-    }
-    clust_data.nearest_neighbor_index[i] = min_index;
-    clust_data.nearest_neighbor_dist[i] = min_dist;
   }
+
+  // Find the nearest neighbor for each leaf node and 
+  // set up the tournament tree for finding the closest pair
+#pragma omp parallel for schedule(dynamic,64)
+  for( i=0; i<num_leaves; i++) find_nearest_neighbor ( &clust_data, i );
+  for ( i=0; i<2*clust_data.min_tree_size; i++ ) clust_data.min_tree[i] = -1;
+  for ( i=0; i<num_leaves; i++ ) update_min_tree ( &clust_data, i );
   
   // Initialize remaining tree nodes
   for( i=num_leaves ; i<num_nodes; i++ ) {
@@ -900,21 +1439,9 @@ TREE_NODE *bottom_up_cluster( float **matrix, int num_elements,
       current_step += step_size;
     }
 
-    // Find find the next 2 clusters to be merged
-    min_index = -1;
-    min_dist = -1.0;
-    for ( j=0; j<num_elements; j++ ) {
-      if ( clust_data.nearest_neighbor_index[j] != -1 ) {
-	if ( min_index == -1 ) { 
-	  min_index = j;
-	  min_dist = clust_data.nearest_neighbor_dist[j];
-	}
-	else if ( clust_data.nearest_neighbor_dist[j] < min_dist ) {
-	  min_index = j;
-	  min_dist = clust_data.nearest_neighbor_dist[j];
-	}
-      }
-    }
+    // The next 2 clusters to be merged are the closest pair which 
+    // is the nearest neighbor pair at the top of the tournament tree
+    min_index = clust_data.min_tree[1];
 
     // These are the indices of the clusters in the active 
     // cluster structure to be merged
@@ -927,6 +1454,14 @@ TREE_NODE *bottom_up_cluster( float **matrix, int num_elements,
   }
   printf("done)\n");
 
+  free(clust_data.active_node_to_tree_node_mapping);
+  free(clust_data.nearest_neighbor_index);
+  free(clust_data.nearest_neighbor_dist);
+  free(clust_data.cluster_sizes);
+  free(clust_data.within_sums);
+  free(clust_data.min_tree);
+  free(clust_data.stale_rows);
+
   /* Specify the root of the tree */
   next_cluster--;
   TREE_NODE *root = &nodes[next_cluster];
@@ -959,34 +1494,29 @@ static void merge_clusters ( TREE_NODE **nodes_ptr, CLUSTERING_DATA *clust_data,
   int tree_index_2 = clust_data->active_node_to_tree_node_mapping[active_index_2];
 
   // Fill in info for newly created node
-  nodes[next_tree_index].height = clust_data->active_dist[active_index_1][active_index_2];
+  nodes[next_tree_index].height = TRIANGULAR_ENTRY(clust_data->active_dist,active_index_1,active_index_2);
   if ( dist_metric == TOT_DIST) nodes[next_tree_index].height = logf(1+nodes[next_tree_index].height);
   nodes[next_tree_index].node_index = next_tree_index;
   nodes[next_tree_index].right_child = &nodes[tree_index_1];
   nodes[next_tree_index].left_child = &nodes[tree_index_2];
  
-  // Update array of tree node indices for each element
   int i, j;
-  for(i=0; i<clust_data->num_elements; i++) 
-    if( (clust_data->tree_node_clusters[i] == tree_index_1) || 
-	(clust_data->tree_node_clusters[i] == tree_index_2) ) 
-      clust_data->tree_node_clusters[i] = next_tree_index;
 
   clust_data->active_node_to_tree_node_mapping[active_index_1] = next_tree_index;
   clust_data->active_node_to_tree_node_mapping[active_index_2] = -1;
   
   // Update the active distance matrix
-  float **dist = clust_data->active_dist;
+  TRIANGULAR_MATRIX *dist = clust_data->active_dist;
   int *mapping = clust_data->active_node_to_tree_node_mapping;
   int num_elements = clust_data->num_elements;
   if ( dist_metric == MAX_DIST ) {
-    max_dist_update ( dist, mapping, num_elements, active_index_1, active_index_2 );
+    max_dist_update ( dist, mapping, active_index_1, active_index_2 );
   } else if ( dist_metric == MIN_DIST ) {
-    min_dist_update ( dist, mapping, num_elements, active_index_1, active_index_2 );
+    min_dist_update ( dist, mapping, active_index_1, active_index_2 );
   } else if ( dist_metric == AVG_DIST ) {
-    avg_dist_update ( clust_data, active_index_1, active_index_2 );
+    sum_dist_update ( clust_data, active_index_1, active_index_2, 1 );
   } else if ( dist_metric == TOT_DIST ) {
-    tot_dist_update ( clust_data, active_index_1, active_index_2 );
+    sum_dist_update ( clust_data, active_index_1, active_index_2, 0 );
   } else {
     die ("Not implemented yet!");
   }
@@ -997,22 +1527,19 @@ static void merge_clusters ( TREE_NODE **nodes_ptr, CLUSTERING_DATA *clust_data,
 
   nn_index[active_index_2] = -1;
   nn_dist[active_index_2] = -1;
+  update_min_tree ( clust_data, active_index_2 );
+
+  // Redo the nearest neighbor info for the merged cluster and any
+  // any cluster whose nearest neighbor was one of the merged clusters
+  int num_stale = 0;
+  int *stale = clust_data->stale_rows;
   for ( i=0; i<num_elements; i++ ) {
-    // Redo the nearest neighbor info for the merged cluster and any
-    // any cluster whose nearest neighbor was one of the merged clusters
-    if ( i == active_index_1 || nn_index[i] == active_index_1 || nn_index[i] == active_index_2 ) {
-      nn_index[i] = -1;
-      nn_dist[i] = -1;
-      for ( j=0; j<num_elements; j++ ) {
-	if ( j != i && mapping[j] != -1 ) {
-	  if ( nn_index[i] == -1 || dist[i][j] < nn_dist[i] ) {
-	    nn_index[i] = j;
-	    nn_dist[i] = dist[i][j];
-	  }
-	}
-      }
-    }
+    if ( i == active_index_1 || nn_index[i] == active_index_1 || nn_index[i] == active_index_2 ) 
+      stale[num_stale++] = i;
   }
+#pragma omp parallel for schedule(dynamic,1)
+  for ( j=0; j<num_stale; j++ ) find_nearest_neighbor ( clust_data, stale[j] );
+  for ( j=0; j<num_stale; j++ ) update_min_tree ( clust_data, stale[j] );
     
   return;
 
@@ -1021,33 +1548,26 @@ static void merge_clusters ( TREE_NODE **nodes_ptr, CLUSTERING_DATA *clust_data,
 
 /************************************************************************/
 
-static void max_dist_update ( float **dist, int *mapping, int num_elements, 
-			      int active_index_1, int active_index_2 ) 
+static void max_dist_update ( TRIANGULAR_MATRIX *dist, int *mapping, int active_index_1, int active_index_2 ) 
 {
   int i;
 
-  // Update the distance matrix and bookkeeping variables
+  // Update the distance matrix
   // First let's compute the distances for the new cluster
   // We will use active_index_1 as the active index for the
-  // new cluster
+  // new cluster. The second cluster's entries are never read
+  // again once it is marked inactive, so they are left as is.
 
-  dist[active_index_1][active_index_1] = dist[active_index_1][active_index_2];
-  dist[active_index_1][active_index_2] = -1;
-  dist[active_index_2][active_index_1] = -1;
-  dist[active_index_2][active_index_2] = -1;
+  TRIANGULAR_ENTRY(dist,active_index_1,active_index_1) = TRIANGULAR_ENTRY(dist,active_index_1,active_index_2);
   
-  for ( i=0; i<num_elements; i++ ) {
+  for ( i=0; i<dist->num_elements; i++ ) {
 
-    // Update the distance matrix
+    // Update the new cluster's distance to this element
     if ( i != active_index_1 && i != active_index_2 && mapping[i] != -1 ) {
-      // Update the new cluster's distance to this element
-      if ( dist[i][active_index_2] > dist[i][active_index_1] ) {
-	dist[i][active_index_1] = dist[i][active_index_2];
-	dist[active_index_1][i] = dist[active_index_2][i];
+      float dist_2 = TRIANGULAR_ENTRY(dist,i,active_index_2);
+      if ( dist_2 > TRIANGULAR_ENTRY(dist,i,active_index_1) ) {
+	TRIANGULAR_ENTRY(dist,i,active_index_1) = dist_2;
       }
-      // With merging, the second cluster's active row & column are no longer needed
-      dist[i][active_index_2] = -1;
-      dist[active_index_2][i] = -1;
     } 
   } 
   
@@ -1058,32 +1578,26 @@ static void max_dist_update ( float **dist, int *mapping, int num_elements,
 
 /************************************************************************/
 
-static void min_dist_update ( float **dist, int *mapping, int num_elements, int active_index_1, int active_index_2 ) 
+static void min_dist_update ( TRIANGULAR_MATRIX *dist, int *mapping, int active_index_1, int active_index_2 ) 
 {
   int i;
 
-  // Update the distance matrix and bookkeeping variables
+  // Update the distance matrix
   // First let's compute the distances for the new cluster
   // We will use active_index_1 as the active index for the
-  // new cluster
+  // new cluster. The second cluster's entries are never read
+  // again once it is marked inactive, so they are left as is.
 
-  dist[active_index_1][active_index_1] = dist[active_index_1][active_index_2];
-  dist[active_index_1][active_index_2] = -1;
-  dist[active_index_2][active_index_1] = -1;
-  dist[active_index_2][active_index_2] = -1;
+  TRIANGULAR_ENTRY(dist,active_index_1,active_index_1) = TRIANGULAR_ENTRY(dist,active_index_1,active_index_2);
   
-  for ( i=0; i<num_elements; i++ ) {
+  for ( i=0; i<dist->num_elements; i++ ) {
 
-    // Update the distance matrix
+    // Update the new cluster's distance to this element
     if ( i != active_index_1 && i != active_index_2 && mapping[i] != -1 ) {
-      // Update the new cluster's distance to this element
-      if ( dist[i][active_index_2] < dist[i][active_index_1] ) {
-	dist[i][active_index_1] = dist[i][active_index_2];
-	dist[active_index_1][i] = dist[active_index_2][i];
+      float dist_2 = TRIANGULAR_ENTRY(dist,i,active_index_2);
+      if ( dist_2 < TRIANGULAR_ENTRY(dist,i,active_index_1) ) {
+	TRIANGULAR_ENTRY(dist,i,active_index_1) = dist_2;
       }
-      // With merging, the second cluster's active row & column are no longer needed
-      dist[i][active_index_2] = -1;
-      dist[active_index_2][i] = -1;
     } 
   } 
   
@@ -1091,60 +1605,60 @@ static void min_dist_update ( float **dist, int *mapping, int num_elements, int
 
 }
 
+
 /************************************************************************/
 
-static void avg_dist_update ( CLUSTERING_DATA *clust_data, int active_index_1, int active_index_2 )
+// Update for the linkages built on the sum of all pairwise distances
+// within a merged cluster: the average of them (AVG_DIST) or the total
+// (TOT_DIST). Writing T(a,b) for that sum over the union of clusters a
+// and b and S(a) for the sum within cluster a, T(a,b) = S(a) + S(b) plus
+// the cross distances, and the cross distances to a merged cluster are 
+// the sums of the cross distances to its parts. So for a new cluster
+// formed from clusters 1 and 2,
+//   T(i,1+2) = T(i,1) + T(i,2) + T(1,2) - S(i) - S(1) - S(2)
+// and S(1+2) = T(1,2). The sums are recovered from the active distances
+// and carried in double precision.
+static void sum_dist_update ( CLUSTERING_DATA *clust_data, int active_index_1, int active_index_2, int average )
 {
 
   int num_elements = clust_data->num_elements;
-  float **active_dist = clust_data->active_dist;
-  float **original_dist = clust_data->original_dist;
-  int *active_node_to_tree_node_mapping = clust_data->active_node_to_tree_node_mapping;
-  
-  int new_tree_index = active_node_to_tree_node_mapping[active_index_1];
-  int *leaf_to_tree_node_mapping = clust_data->tree_node_clusters;
+  TRIANGULAR_MATRIX *active_dist = clust_data->active_dist;
+  int *mapping = clust_data->active_node_to_tree_node_mapping;
+  int *sizes = clust_data->cluster_sizes;
+  double *within_sums = clust_data->within_sums;
+  int size_1 = sizes[active_index_1];
+  int size_2 = sizes[active_index_2];
+  int i;
+
+#define PAIRS(n) ( average ? 0.5*((double)(n))*((n)-1) : 1.0 )
+
+  // The merged pair's sum is the new cluster's within-cluster sum
+  double merged_sum = TRIANGULAR_ENTRY(active_dist,active_index_1,active_index_2) * PAIRS(size_1+size_2);
+  double parts_sum = within_sums[active_index_1] + within_sums[active_index_2];
 
   // Update the distance matrix and bookkeeping variables
   // We will use active_index_1 as the active index for the
   // new cluster
 
-  active_dist[active_index_1][active_index_1] = active_dist[active_index_1][active_index_2];
-  active_dist[active_index_1][active_index_2] = -1;
-  active_dist[active_index_2][active_index_1] = -1;
-  active_dist[active_index_2][active_index_2] = -1;
+  TRIANGULAR_ENTRY(active_dist,active_index_1,active_index_1) = 
+    TRIANGULAR_ENTRY(active_dist,active_index_1,active_index_2);
   
-  int tree_index;
-  int index_j, index_k;
-  int i, j, k;
+#pragma omp parallel for schedule(static)
   for ( i=0; i<num_elements; i++ ) {
     // Update the distance matrix
-    if ( i != active_index_1 && i != active_index_2 && active_node_to_tree_node_mapping[i] != -1 ) {
-
-      // Update the new cluster's distance to the current active cluster i 
-      tree_index = active_node_to_tree_node_mapping[i];
-
-      // Compute the average distortion of merging this tree 
-      // node with the newly created tree node
-      float distance = 0;
-      float dist_count = 0;
-      for ( j=0; j<num_elements; j++ ) {
-	index_j = leaf_to_tree_node_mapping[j];
-	if ( index_j == tree_index || index_j == new_tree_index ) {
-	  for ( k=j+1; k<num_elements; k++ ) {
-	    index_k = leaf_to_tree_node_mapping[k];
-	    if ( index_k == tree_index  || index_k == new_tree_index ) {
-	      distance += original_dist[j][k];
-	      dist_count += 1.0;
-	    }
-	  }
-	}
-      }
-      active_dist[i][active_index_1] = distance/dist_count;
-      active_dist[active_index_1][i] = active_dist[i][active_index_1];
-      active_dist[i][active_index_2] = -1;
-      active_dist[active_index_2][i] = -1;
+    if ( i != active_index_1 && i != active_index_2 && mapping[i] != -1 ) {
+      float *dist_1 = &TRIANGULAR_ENTRY(active_dist,active_index_1,i);
+      double sum = *dist_1 * PAIRS(sizes[i]+size_1) 
+	+ TRIANGULAR_ENTRY(active_dist,active_index_2,i) * PAIRS(sizes[i]+size_2)
+	+ merged_sum - within_sums[i] - parts_sum;
+      *dist_1 = sum / PAIRS(sizes[i]+size_1+size_2);
     } 
   } 
+
+#undef PAIRS
+
+  sizes[active_index_1] = size_1 + size_2;
+  within_sums[active_index_1] = merged_sum;
   
   return;
 
@@ -1152,78 +1666,594 @@ static void avg_dist_update ( CLUSTERING_DATA *clust_data, int active_index_1, i
 
 /************************************************************************/
 
-static void tot_dist_update ( CLUSTERING_DATA *clust_data, int active_index_1, int active_index_2 )
+// Find the nearest active neighbor of an active row, taking the lowest
+// index among equally near neighbors
+static void find_nearest_neighbor ( CLUSTERING_DATA *clust_data, int index )
 {
-
+  int j;
   int num_elements = clust_data->num_elements;
-  float **active_dist = clust_data->active_dist;
-  float **original_dist = clust_data->original_dist;
-  int *active_node_to_tree_node_mapping = clust_data->active_node_to_tree_node_mapping;
-  
-  int new_tree_index = active_node_to_tree_node_mapping[active_index_1];
-  int *leaf_to_tree_node_mapping = clust_data->tree_node_clusters;
-
-  // Update the distance matrix and bookkeeping variables
-  // We will use active_index_1 as the active index for the
-  // new cluster
+  float *values = clust_data->active_dist->values;
+  int *mapping = clust_data->active_node_to_tree_node_mapping;
+  int nn_index = -1;
+  float nn_dist = -1;
+
+  // Neighbors before the row are read down its column of the triangle,
+  // stepping over the shrinking rows, and the rest along the row itself
+  long offset = index;
+  for ( j=0; j<index; offset+=num_elements-j-1, j++ ) {
+    if ( mapping[j] != -1 && ( nn_index == -1 || values[offset] < nn_dist ) ) {
+      nn_index = j;
+      nn_dist = values[offset];
+    }
+  }
+  float *row = values + TRIANGULAR_ROW_OFFSET(num_elements,index) - index;
+  for ( j=index+1; j<num_elements; j++ ) {
+    if ( mapping[j] != -1 && ( nn_index == -1 || row[j] < nn_dist ) ) {
+      nn_index = j;
+      nn_dist = row[j];
+    }
+  }
+  clust_data->nearest_neighbor_index[index] = nn_index;
+  clust_data->nearest_neighbor_dist[index] = nn_dist;
+}
 
-  active_dist[active_index_1][active_index_1] = active_dist[active_index_1][active_index_2];
-  active_dist[active_index_1][active_index_2] = -1;
-  active_dist[active_index_2][active_index_1] = -1;
-  active_dist[active_index_2][active_index_2] = -1;
-  
-  int tree_index;
-  int index_j, index_k;
-  int i, j, k;
-  for ( i=0; i<num_elements; i++ ) {
-    // Update the distance matrix
-    if ( i != active_index_1 && i != active_index_2 && active_node_to_tree_node_mapping[i] != -1 ) {
-
-      // Update the new cluster's distance to the current active cluster i 
-      tree_index = active_node_to_tree_node_mapping[i];
-
-      // Compute the average distortion of merging this tree 
-      // node with the newly created tree node
-      float distance = 0;
-      for ( j=0; j<num_elements; j++ ) {
-	index_j = leaf_to_tree_node_mapping[j];
-	if ( index_j == tree_index || index_j == new_tree_index ) {
-	  for ( k=j+1; k<num_elements; k++ ) {
-	    index_k = leaf_to_tree_node_mapping[k];
-	    if ( index_k == tree_index  || index_k == new_tree_index ) {
-	      distance += original_dist[j][k];
-	    }
-	  }
-	}
-      }
-      active_dist[i][active_index_1] = distance;
-      active_dist[active_index_1][i] = distance;
-      active_dist[i][active_index_2] = -1;
-      active_dist[active_index_2][i] = -1;
-    } 
-  } 
-  
-  return;
+/************************************************************************/
 
+// Replay the matches on the path from a row's leaf to the root of the 
+// tournament tree. Each match goes to the row with the smaller nearest
+// neighbor distance, or the lower index on a tie, and rows without a 
+// nearest neighbor always lose.
+static void update_min_tree ( CLUSTERING_DATA *clust_data, int index )
+{
+  int *tree = clust_data->min_tree;
+  int *nn_index = clust_data->nearest_neighbor_index;
+  float *nn_dist = clust_data->nearest_neighbor_dist;
+  int node = clust_data->min_tree_size + index;
+  int left, right;
+
+  tree[node] = nn_index[index] != -1 ? index : -1;
+  for ( node/=2; node>=1; node/=2 ) {
+    left = tree[2*node];
+    right = tree[2*node+1];
+    if ( left == -1 ) tree[node] = right;
+    else if ( right == -1 ) tree[node] = left;
+    else tree[node] = nn_dist[right] < nn_dist[left] ? right : left;
+  }
 }
 
+/************************************************************************
+
+ bottom_up_cluster_sparse builds the same kind of tree as bottom_up_cluster
+ from a sparse graph of distances, such as the nearest neighbor graph from
+ compute_lsh_cosine_similarity_graph. Pairs of elements without an edge 
+ are taken to be at the graph's missing_value distance, so on a complete
+ graph the linkages match those of bottom_up_cluster. Clusters that share
+ no edges are only merged once no linked clusters remain. This gives the
+ same tree as the full matrix for MIN_DIST and MAX_DIST when missing_value
+ is the largest distance, but is an approximation for AVG_DIST and 
+ TOT_DIST, where a pair without edges can have the lower linkage.
+
+ Each active cluster keeps a list of links to the clusters it shares 
+ edges with, holding the number of edges between the two and the sum, 
+ minimum and maximum of their distances. Candidate merges sit in a heap 
+ ordered by linkage, and entries made stale by a merge are skipped when 
+ they reach the top. 
+
+ When no linked clusters remain and the feature vectors behind the graph
+ are given, the remaining clusters are merged by the distances between 
+ their centroids (see merge_unlinked_clusters_by_centroid). Without the
+ vectors, all their cross pairs are at the missing_value distance. Either
+ way at most SPARSE_CLUSTERING_MAX_UNLINKED clusters can be left without
+ links; more means the graph is far too sparse and is an error.
 
-/************************************************************************/
+**************************************************************************************/
 
-void print_cluster_tree(TREE_NODE *node) 
+TREE_NODE *bottom_up_cluster_sparse( SIMILARITY_GRAPH *graph, char **labels, int dist_metric,
+				     SPARSE_FEATURE_VECTORS *feature_vectors )
 {
-  if( node->leaves > 1 ) {
-    if ( node->mark == 1 ) printf ("+Node " );
-    else printf( "-Node " );
-    printf( "%d", node->node_index );
-    if ( strcmp(node->label,"(no label)") ) 
-      printf ( "(%s)", node->label );
-    printf (" splits into nodes ");
-    printf ( "%d", node->left_child->node_index );
-    if ( strcmp(node->left_child->label,"(no label)") ) 
-      printf ( "(%s)", node->left_child->label );
-    printf (" and ");
-    printf ( "%d", node->right_child->node_index );
+  int i, c;
+  long e;
+  int num_elements = graph->num_elements;
+  char label[100];
+
+  if ( dist_metric != MIN_DIST && dist_metric != AVG_DIST && 
+       dist_metric != MAX_DIST && dist_metric != TOT_DIST ) die ("Not implemented yet!");
+  if ( feature_vectors != NULL && feature_vectors->num_vectors != num_elements ) 
+    die ("bottom_up_cluster_sparse: %d feature vectors for a graph of %d elements\n", 
+	 feature_vectors->num_vectors, num_elements );
+
+  SPARSE_CLUSTERING_DATA clust_data;
+  clust_data.num_elements = num_elements;
+  clust_data.dist_metric = dist_metric;
+  clust_data.missing_dist = graph->missing_value;
+  clust_data.active_node_to_tree_node_mapping = (int *) calloc ( num_elements, sizeof(int));
+  clust_data.cluster_sizes = (int *) calloc ( num_elements, sizeof(int));
+  clust_data.within_sums = (double *) calloc ( num_elements, sizeof(double));
+  clust_data.versions = (int *) calloc ( num_elements, sizeof(int));
+  clust_data.link_lists = (SPARSE_LINK_LIST *) calloc ( num_elements, sizeof(SPARSE_LINK_LIST));
+  clust_data.slots = (int *) calloc ( num_elements, sizeof(int));
+  clust_data.heap_size = 0;
+  clust_data.heap_max = graph->edge_ptr[num_elements]/2 + num_elements + 1;
+  clust_data.heap = (LINKAGE_HEAP_ENTRY *) calloc ( clust_data.heap_max, sizeof(LINKAGE_HEAP_ENTRY));
+
+  int num_leaves = num_elements; 
+  int num_nodes = ( 2 * num_leaves ) - 1 ;
+  TREE_NODE *nodes = (TREE_NODE *) calloc ( num_nodes , sizeof(TREE_NODE));
+
+  // Initialize the tree's leaf nodes and initial clustering structure
+  for( i=0; i<num_leaves; i++) {
+
+    clust_data.active_node_to_tree_node_mapping[i] = i;
+    clust_data.cluster_sizes[i] = 1;
+    clust_data.within_sums[i] = 0;
+    clust_data.slots[i] = -1;
+
+    nodes[i].height = 0;
+    nodes[i].node_index = i;
+    nodes[i].cluster_index = -1;
+    if ( labels == NULL ) {
+      sprintf(label, "%d", i);
+      nodes[i].label = strdup(label);
+    } else {
+      nodes[i].label = strdup(labels[i]);
+    }
+    nodes[i].left_child = NULL;
+    nodes[i].right_child = NULL;
+    nodes[i].mark = 0;
+  }
+  for( i=num_leaves ; i<num_nodes; i++ ) {
+    nodes[i].label = (char *) calloc ( 12 , sizeof(char) );
+    nodes[i].mark = 0;
+    strcpy ( nodes[i].label , "(no label)" );
+  }
+
+  // Each edge starts a link between two single element clusters
+  SPARSE_LINK link;
+  for ( i=0; i<num_elements; i++ ) {
+    for ( e=graph->edge_ptr[i]; e<graph->edge_ptr[i+1]; e++ ) {
+      if ( graph->neighbors[e] == i ) continue;
+      link.cluster = graph->neighbors[e];
+      link.count = 1;
+      link.sum = graph->values[e];
+      link.min_dist = link.max_dist = graph->values[e];
+      add_sparse_link ( &clust_data.link_lists[i], &link );
+      if ( i < link.cluster ) 
+	push_linkage ( &clust_data, i, link.cluster, sparse_linkage ( &clust_data, &link, i, link.cluster ) );
+    }
+  }
+
+  int next_cluster = num_leaves;
+  IV_PAIR *unlinked = NULL;
+  int num_unlinked = 0;
+  LINKAGE_HEAP_ENTRY top;
+
+  printf("(Clustering..."); fflush(stdout);
+
+  float step_size = ((float)num_leaves)/10.0;
+  int step_count = 1;
+  float current_step = step_size;
+  for( i=num_leaves; i>1; i-- ) {
+     
+    // Print out incremental progress
+    if ( ((float)(num_leaves-i))>current_step ) {
+      printf("%d%%...",10*step_count); fflush(stdout);
+      step_count++;
+      current_step += step_size;
+    }
+
+    // Take the closest linked pair that is still current
+    if ( !pop_current_linkage ( &clust_data, &top ) ) {
+
+      // No links remain: the rest of the tree comes from the centroids
+      if ( feature_vectors != NULL ) {
+	next_cluster = merge_unlinked_clusters_by_centroid ( nodes, &clust_data, feature_vectors, next_cluster );
+	break;
+      }
+
+      // Or all cross pairs of the remaining clusters are at the missing 
+      // distance
+      if ( unlinked == NULL ) {
+	if ( i > SPARSE_CLUSTERING_MAX_UNLINKED ) 
+	  die ( "bottom_up_cluster_sparse: %d clusters share no edges (at most %d can be merged), use more neighbors or LSH tables\n",
+		i, SPARSE_CLUSTERING_MAX_UNLINKED );
+	unlinked = (IV_PAIR *) calloc ( i, sizeof(IV_PAIR) );
+	for ( c=0; c<num_elements; c++ ) {
+	  if ( clust_data.active_node_to_tree_node_mapping[c] != -1 ) {
+	    unlinked[num_unlinked].index = c;
+	    unlinked[num_unlinked++].value = clust_data.cluster_sizes[c];
+	  }
+	}
+	int c1, c2;
+	for ( c1=0; c1<num_unlinked; c1++ ) {
+	  for ( c2=c1+1; c2<num_unlinked; c2++ ) {
+	    push_linkage ( &clust_data, unlinked[c1].index, unlinked[c2].index, 
+			   sparse_linkage ( &clust_data, NULL, unlinked[c1].index, unlinked[c2].index ) );
+	  }
+	}
+      }
+      pop_current_linkage ( &clust_data, &top );
+    }
+
+    merge_sparse_clusters ( nodes, &clust_data, top.cluster_1, top.cluster_2, top.value, next_cluster );
+
+    // Among unlinked clusters the merged cluster is paired with every other
+    if ( unlinked != NULL ) {
+      for ( c=0; c<num_unlinked; c++ ) {
+	int other = unlinked[c].index;
+	if ( other != top.cluster_1 && clust_data.active_node_to_tree_node_mapping[other] != -1 ) 
+	  push_linkage ( &clust_data, top.cluster_1, other, 
+			 sparse_linkage ( &clust_data, NULL, top.cluster_1, other ) );
+      }
+    }
+
+    next_cluster++;
+  }
+  printf("done)\n");
+
+  for ( i=0; i<num_elements; i++ ) free ( clust_data.link_lists[i].links );
+  free(clust_data.link_lists);
+  free(clust_data.active_node_to_tree_node_mapping);
+  free(clust_data.cluster_sizes);
+  free(clust_data.within_sums);
+  free(clust_data.versions);
+  free(clust_data.slots);
+  free(clust_data.heap);
+  free(unlinked);
+
+  /* Specify the root of the tree */
+  next_cluster--;
+  TREE_NODE *root = &nodes[next_cluster];
+  
+  /* Give the root node the pointer to the node 
+     array so it can be deallocated later */
+  root->array_ptr = &nodes[0];
+
+  /* Count leaves in each sub tree */
+  count_leaves_in_tree(root);
+
+  /* Compute tree graphing parameters */
+  compute_tree_graphics_parameters(root, 0);
+
+  /* Return a pointer to the root node of the tree */
+  return root;
+
+}
+
+/************************************************************************/
+
+// Finish a sparse clustering whose remaining clusters share no edges. 
+// Each remaining cluster is summarized by the sum of its members' vectors,
+// the centroids are clustered with bottom_up_cluster_in_place over their 
+// (log) cosine distances, and that tree's merges are replayed on the 
+// remaining clusters. The replayed merges sit at the missing distance 
+// plus their centroid linkage, so they stay above every linked merge.
+// Returns the next free tree node index.
+static int merge_unlinked_clusters_by_centroid ( TREE_NODE *nodes, SPARSE_CLUSTERING_DATA *clust_data,
+						 SPARSE_FEATURE_VECTORS *feature_vectors, int next_tree_index )
+{
+  int i, j, k, t;
+  int num_elements = clust_data->num_elements;
+  int *mapping = clust_data->active_node_to_tree_node_mapping;
+
+  // The remaining clusters, and the one each tree node belongs to
+  int num_unlinked = 0;
+  int *unlinked = (int *) calloc ( num_elements, sizeof(int) );
+  int *component = (int *) calloc ( next_tree_index, sizeof(int) );
+  for ( t=0; t<next_tree_index; t++ ) component[t] = -1;
+  for ( i=0; i<num_elements; i++ ) {
+    if ( mapping[i] != -1 ) {
+      component[mapping[i]] = num_unlinked;
+      unlinked[num_unlinked++] = i;
+    }
+  }
+  if ( num_unlinked > SPARSE_CLUSTERING_MAX_UNLINKED ) 
+    die ( "bottom_up_cluster_sparse: %d clusters share no edges (at most %d can be linked by centroid), use more neighbors or LSH tables\n",
+	  num_unlinked, SPARSE_CLUSTERING_MAX_UNLINKED );
+  printf("linking %d clusters by centroid...", num_unlinked); fflush(stdout);
+
+  // Children are created before their parents, so one pass down the 
+  // node indices hands each node's cluster to its children
+  for ( t=next_tree_index-1; t>=num_elements; t-- ) {
+    if ( component[t] == -1 ) continue;
+    component[nodes[t].left_child->node_index] = component[t];
+    component[nodes[t].right_child->node_index] = component[t];
+  }
+
+  // Sum the members of each cluster in a dense row
+  int num_features = feature_vectors->feature_set->num_features;
+  SPARSE_VECTOR_DECODER *decoder = create_sparse_vector_decoder ( feature_vectors );
+  SPARSE_FEATURE_VECTOR *vector;
+  int *member_ptr = (int *) calloc ( num_unlinked+1, sizeof(int) );
+  int *members = (int *) calloc ( num_elements, sizeof(int) );
+  for ( i=0; i<num_elements; i++ ) member_ptr[component[i]+1]++;
+  for ( k=0; k<num_unlinked; k++ ) member_ptr[k+1] += member_ptr[k];
+  for ( i=0; i<num_elements; i++ ) members[member_ptr[component[i]]++] = i;
+  for ( k=num_unlinked; k>0; k-- ) member_ptr[k] = member_ptr[k-1];
+  member_ptr[0] = 0;
+
+  float *sum = (float *) calloc ( num_features+1, sizeof(float) );
+  int *used = (int *) calloc ( num_features+1, sizeof(int) );
+  IV_PAIR *terms = (IV_PAIR *) calloc ( num_features+1, sizeof(IV_PAIR) );
+  char *mark = (char *) calloc ( num_features+1, sizeof(char) );
+  SPARSE_FEATURE_VECTORS centroids = *feature_vectors;
+  centroids.num_vectors = num_unlinked;
+  centroids.corpus = NULL;
+  centroids.vector_block = NULL;
+  centroids.vectors = (SPARSE_FEATURE_VECTOR **) calloc ( num_unlinked, sizeof(SPARSE_FEATURE_VECTOR *) );
+  for ( k=0; k<num_unlinked; k++ ) {
+    int num_used = 0;
+    for ( i=member_ptr[k]; i<member_ptr[k+1]; i++ ) {
+      vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[members[i]] );
+      for ( j=0; j<vector->num_features; j++ ) {
+	t = vector->feature_indices[j];
+	if ( t < 0 ) continue;
+	if ( !mark[t] ) {
+	  mark[t] = 1;
+	  used[num_used++] = t;
+	}
+	sum[t] += vector->feature_values[j];
+      }
+    }
+    for ( j=0; j<num_used; j++ ) {
+      terms[j].index = used[j];
+      terms[j].value = sum[used[j]];
+      sum[used[j]] = 0;
+      mark[used[j]] = 0;
+    }
+    qsort ( terms, num_used, sizeof(IV_PAIR), cmp_iv_pair_by_index );
+    vector = (SPARSE_FEATURE_VECTOR *) calloc ( 1, sizeof(SPARSE_FEATURE_VECTOR) );
+    vector->num_features = num_used;
+    vector->feature_indices = (int *) calloc ( num_used+1, sizeof(int) );
+    vector->feature_values = (float *) calloc ( num_used+1, sizeof(float) );
+    for ( j=0; j<num_used; j++ ) {
+      vector->feature_indices[j] = terms[j].index;
+      vector->feature_values[j] = terms[j].value;
+      vector->total_sum += terms[j].value;
+    }
+    centroids.vectors[k] = vector;
+  }
+  free(sum);
+  free(used);
+  free(terms);
+  free(mark);
+  free(member_ptr);
+  free(members);
+  free_sparse_vector_decoder ( decoder );
+
+  // Cluster the centroids
+  TRIANGULAR_MATRIX *matrix = compute_cosine_similarity_matrix ( &centroids, 1, 0 );
+  TREE_NODE *centroid_tree = bottom_up_cluster_in_place ( matrix, NULL, AVG_DIST );
+  TREE_NODE *centroid_nodes = centroid_tree->array_ptr;
+  free_triangular_matrix ( matrix );
+  for ( k=0; k<num_unlinked; k++ ) {
+    free(centroids.vectors[k]->feature_indices);
+    free(centroids.vectors[k]->feature_values);
+    free(centroids.vectors[k]);
+  }
+  free(centroids.vectors);
+
+  // Replay its merges; each merge keeps the index of its first cluster
+  int *active = (int *) calloc ( 2*num_unlinked, sizeof(int) );
+  for ( k=0; k<num_unlinked; k++ ) active[k] = unlinked[k];
+  for ( t=num_unlinked; t<2*num_unlinked-1; t++ ) {
+    int cluster_1 = active[centroid_nodes[t].left_child->node_index];
+    int cluster_2 = active[centroid_nodes[t].right_child->node_index];
+    merge_sparse_clusters ( nodes, clust_data, cluster_1, cluster_2, 
+			    clust_data->missing_dist + centroid_nodes[t].height, next_tree_index++ );
+    active[t] = cluster_1;
+  }
+
+  free_cluster_tree ( centroid_tree );
+  free(active);
+  free(unlinked);
+  free(component);
+
+  return next_tree_index;
+}
+
+// Merge two active clusters in the sparse clustering, keeping the index
+// of the first for the new cluster and combining the two clusters' links
+static void merge_sparse_clusters ( TREE_NODE *nodes, SPARSE_CLUSTERING_DATA *clust_data, 
+				    int cluster_1, int cluster_2, double linkage, int next_tree_index )
+{
+  int *mapping = clust_data->active_node_to_tree_node_mapping;
+  int *slots = clust_data->slots;
+  SPARSE_LINK_LIST *list_1 = &clust_data->link_lists[cluster_1];
+  SPARSE_LINK_LIST *list_2 = &clust_data->link_lists[cluster_2];
+  SPARSE_LINK_LIST merged = { 0, 0, NULL };
+  SPARSE_LINK *link;
+  int k, m;
+
+  // Fill in info for newly created node
+  nodes[next_tree_index].height = linkage;
+  if ( clust_data->dist_metric == TOT_DIST) nodes[next_tree_index].height = logf(1+nodes[next_tree_index].height);
+  nodes[next_tree_index].node_index = next_tree_index;
+  nodes[next_tree_index].right_child = &nodes[mapping[cluster_1]];
+  nodes[next_tree_index].left_child = &nodes[mapping[cluster_2]];
+  mapping[cluster_1] = next_tree_index;
+  mapping[cluster_2] = -1;
+
+  // The new cluster's within-cluster sum takes in all the cross pairs
+  int size_1 = clust_data->cluster_sizes[cluster_1];
+  int size_2 = clust_data->cluster_sizes[cluster_2];
+  double cross_sum = ((double)size_1) * size_2 * clust_data->missing_dist;
+  for ( k=0; k<list_1->num_links; k++ ) {
+    if ( list_1->links[k].cluster == cluster_2 ) 
+      cross_sum += list_1->links[k].sum - list_1->links[k].count * clust_data->missing_dist;
+  }
+  clust_data->within_sums[cluster_1] += clust_data->within_sums[cluster_2] + cross_sum;
+  clust_data->cluster_sizes[cluster_1] = size_1 + size_2;
+  clust_data->cluster_sizes[cluster_2] = 0;
+  clust_data->versions[cluster_1]++;
+  clust_data->versions[cluster_2]++;
+
+  // Combine the two link lists, adding up the links to shared neighbors
+  for ( m=0; m<2; m++ ) {
+    SPARSE_LINK_LIST *list = m == 0 ? list_1 : list_2;
+    for ( k=0; k<list->num_links; k++ ) {
+      link = &list->links[k];
+      if ( link->cluster == cluster_1 || link->cluster == cluster_2 ) continue;
+      if ( slots[link->cluster] < 0 ) {
+	slots[link->cluster] = merged.num_links;
+	add_sparse_link ( &merged, link );
+      } else {
+	SPARSE_LINK *sum = &merged.links[slots[link->cluster]];
+	sum->count += link->count;
+	sum->sum += link->sum;
+	if ( link->min_dist < sum->min_dist ) sum->min_dist = link->min_dist;
+	if ( link->max_dist > sum->max_dist ) sum->max_dist = link->max_dist;
+      }
+    }
+  }
+  free ( list_1->links );
+  free ( list_2->links );
+  list_2->links = NULL;
+  list_2->num_links = list_2->max_links = 0;
+  *list_1 = merged;
+
+  // Point each neighbor's links at the new cluster and queue the new 
+  // cluster's linkages
+  for ( k=0; k<merged.num_links; k++ ) {
+    link = &merged.links[k];
+    SPARSE_LINK_LIST *list = &clust_data->link_lists[link->cluster];
+    int index_1 = -1, index_2 = -1;
+    for ( m=0; m<list->num_links; m++ ) {
+      if ( list->links[m].cluster == cluster_1 ) index_1 = m;
+      else if ( list->links[m].cluster == cluster_2 ) index_2 = m;
+    }
+    if ( index_1 < 0 ) {
+      index_1 = index_2;
+      index_2 = -1;
+    }
+    list->links[index_1] = *link;
+    list->links[index_1].cluster = cluster_1;
+    if ( index_2 >= 0 ) list->links[index_2] = list->links[--list->num_links];
+    slots[link->cluster] = -1;
+
+    push_linkage ( clust_data, cluster_1, link->cluster, 
+		   sparse_linkage ( clust_data, link, cluster_1, link->cluster ) );
+  }
+
+}
+
+/************************************************************************/
+
+// Linkage between two active clusters from the link between them (NULL 
+// if they share no edges), with missing edges at the missing distance
+static double sparse_linkage ( SPARSE_CLUSTERING_DATA *clust_data, SPARSE_LINK *link, int cluster_1, int cluster_2 )
+{
+  int size_1 = clust_data->cluster_sizes[cluster_1];
+  int size_2 = clust_data->cluster_sizes[cluster_2];
+  double missing = ((double)size_1) * size_2 - ( link == NULL ? 0 : link->count );
+  double missing_dist = clust_data->missing_dist;
+  double sum;
+
+  switch ( clust_data->dist_metric ) {
+  case MIN_DIST:
+    if ( link == NULL || ( missing > 0 && missing_dist < link->min_dist ) ) return missing_dist;
+    return link->min_dist;
+  case MAX_DIST:
+    if ( link == NULL || ( missing > 0 && missing_dist > link->max_dist ) ) return missing_dist;
+    return link->max_dist;
+  default:
+    sum = clust_data->within_sums[cluster_1] + clust_data->within_sums[cluster_2] 
+      + missing * missing_dist + ( link == NULL ? 0 : link->sum );
+    if ( clust_data->dist_metric == AVG_DIST ) sum /= 0.5 * ((double)(size_1+size_2)) * (size_1+size_2-1);
+    return sum;
+  }
+}
+
+/************************************************************************/
+
+static void add_sparse_link ( SPARSE_LINK_LIST *list, SPARSE_LINK *link )
+{
+  if ( list->num_links == list->max_links ) {
+    list->max_links = list->max_links < 4 ? 4 : 2*list->max_links;
+    list->links = (SPARSE_LINK *) realloc ( list->links, list->max_links*sizeof(SPARSE_LINK) );
+    if ( list->links == NULL ) die ( "add_sparse_link: Out of memory\n" );
+  }
+  list->links[list->num_links++] = *link;
+}
+
+/************************************************************************/
+
+// The linkage heap is a binary min heap ordered by linkage, then by the
+// lower and the higher cluster index, so merges are made in a fixed order.
+// Each entry records the versions of its clusters when it was pushed.
+
+static int linkage_precedes ( LINKAGE_HEAP_ENTRY *a, LINKAGE_HEAP_ENTRY *b )
+{
+  if ( a->value != b->value ) return a->value < b->value;
+  if ( a->cluster_1 != b->cluster_1 ) return a->cluster_1 < b->cluster_1;
+  return a->cluster_2 < b->cluster_2;
+}
+
+static void push_linkage ( SPARSE_CLUSTERING_DATA *clust_data, int cluster_1, int cluster_2, double value )
+{
+  if ( clust_data->heap_size == clust_data->heap_max ) {
+    clust_data->heap_max *= 2;
+    clust_data->heap = (LINKAGE_HEAP_ENTRY *) realloc ( clust_data->heap, 
+							clust_data->heap_max*sizeof(LINKAGE_HEAP_ENTRY) );
+    if ( clust_data->heap == NULL ) die ( "push_linkage: Out of memory\n" );
+  }
+  LINKAGE_HEAP_ENTRY *heap = clust_data->heap;
+  LINKAGE_HEAP_ENTRY entry;
+  entry.value = value;
+  entry.cluster_1 = cluster_1 < cluster_2 ? cluster_1 : cluster_2;
+  entry.cluster_2 = cluster_1 < cluster_2 ? cluster_2 : cluster_1;
+  entry.version_1 = clust_data->versions[entry.cluster_1];
+  entry.version_2 = clust_data->versions[entry.cluster_2];
+  long node = clust_data->heap_size++;
+  while ( node > 0 && linkage_precedes ( &entry, &heap[(node-1)/2] ) ) {
+    heap[node] = heap[(node-1)/2];
+    node = (node-1)/2;
+  }
+  heap[node] = entry;
+}
+
+static int pop_linkage ( SPARSE_CLUSTERING_DATA *clust_data, LINKAGE_HEAP_ENTRY *top )
+{
+  LINKAGE_HEAP_ENTRY *heap = clust_data->heap;
+  if ( clust_data->heap_size == 0 ) return 0;
+  *top = heap[0];
+  LINKAGE_HEAP_ENTRY last = heap[--clust_data->heap_size];
+  long node = 0, child, size = clust_data->heap_size;
+  while ( (child = 2*node+1) < size ) {
+    if ( child+1 < size && linkage_precedes ( &heap[child+1], &heap[child] ) ) child++;
+    if ( !linkage_precedes ( &heap[child], &last ) ) break;
+    heap[node] = heap[child];
+    node = child;
+  }
+  if ( size > 0 ) heap[node] = last;
+  return 1;
+}
+
+// Pop entries until one whose clusters are unchanged since it was pushed
+static int pop_current_linkage ( SPARSE_CLUSTERING_DATA *clust_data, LINKAGE_HEAP_ENTRY *top )
+{
+  while ( pop_linkage ( clust_data, top ) ) {
+    if ( clust_data->versions[top->cluster_1] == top->version_1 &&
+	 clust_data->versions[top->cluster_2] == top->version_2 ) return 1;
+  }
+  return 0;
+}
+
+/************************************************************************/
+
+void print_cluster_tree(TREE_NODE *node) 
+{
+  if( node->leaves > 1 ) {
+    if ( node->mark == 1 ) printf ("+Node " );
+    else printf( "-Node " );
+    printf( "%d", node->node_index );
+    if ( strcmp(node->label,"(no label)") ) 
+      printf ( "(%s)", node->label );
+    printf (" splits into nodes ");
+    printf ( "%d", node->left_child->node_index );
+    if ( strcmp(node->left_child->label,"(no label)") ) 
+      printf ( "(%s)", node->left_child->label );
+    printf (" and ");
+    printf ( "%d", node->right_child->node_index );
     if ( strcmp(node->right_child->label,"(no label)") ) 
       printf ( "(%s)", node->right_child->label );
     printf ("  (Dist=%f)", node->height);
@@ -1491,29 +2521,211 @@ TREE_NODE *load_cluster_tree( FILE *fp )
 
 /*****************************************************************************/
 
-/* The following two commands are for save and loading distance matrices */
+/* The following commands are for saving, loading and mapping distance matrices */
+
+// Distance matrices are saved as a header followed by the packed triangle,
+// starting on an aligned offset so the file can be memory mapped and used 
+// as it is, then the labels. The header starts with a negative marker 
+// where the older formats had their first dimension, and records the 
+// fingerprint of the vectors the matrix was computed from. Files in the 
+// older unaligned triangular format and in the square format can still be
+// loaded, and have an all zero fingerprint.
+#define TRIANGULAR_MATRIX_FILE_MARKER -2
+#define MAPPED_MATRIX_FILE_MARKER -3
+#define MAPPED_MATRIX_FILE_ALIGNMENT 64
+
+typedef struct MAPPED_MATRIX_FILE_HEADER {
+  int marker;
+  int num_elements;
+  long values_offset; // Offsets from the start of the header
+  long labels_offset;
+  DISTANCE_MATRIX_FINGERPRINT fingerprint;
+} MAPPED_MATRIX_FILE_HEADER;
+
+// Hash everything that goes into the pruned cosine similarities of the
+// vectors: the vocabulary and feature weights, the document fraction 
+// cutoff, and the names and weighted features of the documents. Call it 
+// before the vectors are normalized.
+void compute_distance_matrix_fingerprint ( SPARSE_FEATURE_VECTORS *feature_vectors, float max_doc_fraction,
+					   DISTANCE_MATRIX_FINGERPRINT *fingerprint )
+{
+  int i;
+  unsigned int hash = 0;
+  FEATURE_SET *feature_set = feature_vectors->feature_set;
+  SPARSE_VECTOR_DECODER *decoder = create_sparse_vector_decoder ( feature_vectors );
+  SPARSE_FEATURE_VECTOR *vector;
+
+  memset ( fingerprint, 0, sizeof(DISTANCE_MATRIX_FINGERPRINT) );
+  fingerprint->num_features = feature_set->num_features;
+  fingerprint->max_doc_fraction = max_doc_fraction;
+  for ( i=0; i<feature_set->num_features; i++ ) {
+    char *name = feature_set->feature_names[i];
+    if ( name != NULL ) hash = compute_hash ( name, strlen(name)+1, hash );
+  }
+  if ( feature_set->feature_weights != NULL ) 
+    hash = compute_hash ( feature_set->feature_weights, feature_set->num_features * sizeof(float), hash );
+  fingerprint->features_hash = hash;
+
+  hash = compute_hash ( &feature_vectors->num_vectors, sizeof(int), 0 );
+  for ( i=0; i<feature_vectors->num_vectors; i++ ) {
+    vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[i] );
+    if ( vector->filename != NULL ) hash = compute_hash ( vector->filename, strlen(vector->filename)+1, hash );
+    hash = compute_hash ( vector->feature_indices, vector->num_features * sizeof(int), hash );
+    hash = compute_hash ( vector->feature_values, vector->num_features * sizeof(float), hash );
+  }
+  fingerprint->documents_hash = hash;
+  free_sparse_vector_decoder ( decoder );
+}
 
-void save_distance_matrix ( float **matrix, char **labels, int num_elements, FILE *fp )
+void save_distance_matrix ( TRIANGULAR_MATRIX *matrix, char **labels, DISTANCE_MATRIX_FINGERPRINT *fingerprint, 
+			    FILE *fp )
 {
-  dump_2d_float_array ( matrix, num_elements, num_elements, fp );
-  dump_strings ( labels, num_elements, fp );
+  char padding[MAPPED_MATRIX_FILE_ALIGNMENT] = {0};
+  int n = matrix->num_elements;
+  MAPPED_MATRIX_FILE_HEADER header;
+  memset ( &header, 0, sizeof(MAPPED_MATRIX_FILE_HEADER) );
+  if ( fingerprint != NULL ) header.fingerprint = *fingerprint;
+  header.marker = MAPPED_MATRIX_FILE_MARKER;
+  header.num_elements = n;
+  header.values_offset = MAPPED_MATRIX_FILE_ALIGNMENT;
+  header.labels_offset = header.values_offset + TRIANGULAR_ROW_OFFSET(n,n) * (long)sizeof(float);
+  fwrite_safe ( &header, sizeof(MAPPED_MATRIX_FILE_HEADER), 1, fp );
+  fwrite_safe ( padding, 1, header.values_offset - sizeof(MAPPED_MATRIX_FILE_HEADER), fp );
+  fwrite_safe ( matrix->values, sizeof(float), TRIANGULAR_ROW_OFFSET(n,n), fp );
+  dump_strings ( labels, n, fp );
 }
 
-float **load_distance_matrix ( int *dims_ptr, char ***labels_ptr, FILE *fp)
+TRIANGULAR_MATRIX *load_distance_matrix ( char ***labels_ptr, FILE *fp)
 {
-  int dim1, dim2;
-  
-  float **matrix = load_2d_float_array ( &dim1, &dim2, fp );
-  if ( dim1 != dim2 ) 
-    die( "load_distance_matrix: Distance matrix is not square\n" );
-  *dims_ptr = dim1;
-  *labels_ptr = load_strings ( &dim1, fp );
-  if (dim1 != *dims_ptr) 
-    die ( "load_distance_matrix: List of labels (%d) not same size as matrix (%d)",dim1, dim2 );
+  int i, j, num_labels;
+  TRIANGULAR_MATRIX *matrix;
+  int n = load_int ( fp );
+
+  if ( n == MAPPED_MATRIX_FILE_MARKER ) {
+    char padding[MAPPED_MATRIX_FILE_ALIGNMENT];
+    MAPPED_MATRIX_FILE_HEADER header;
+    header.marker = n;
+    fread_safe ( (char *) &header + sizeof(int), sizeof(MAPPED_MATRIX_FILE_HEADER) - sizeof(int), 1, fp );
+    n = header.num_elements;
+    if ( n < 0 || header.values_offset < (long)sizeof(MAPPED_MATRIX_FILE_HEADER) || 
+	 header.values_offset > MAPPED_MATRIX_FILE_ALIGNMENT )
+      die ( "load_distance_matrix: Bad distance matrix file header\n" );
+    fread_safe ( padding, 1, header.values_offset - sizeof(MAPPED_MATRIX_FILE_HEADER), fp );
+    matrix = create_triangular_matrix ( n );
+    fread_safe ( matrix->values, sizeof(float), TRIANGULAR_ROW_OFFSET(n,n), fp );
+  } else if ( n == TRIANGULAR_MATRIX_FILE_MARKER ) {
+    n = load_int ( fp );
+    if ( n < 0 ) 
+      die ( "load_distance_matrix: Bad value for matrix size: %d\n", n );
+    matrix = create_triangular_matrix ( n );
+    fread_safe ( matrix->values, sizeof(float), TRIANGULAR_ROW_OFFSET(n,n), fp );
+  } else {
+    // Square format: dimensions followed by the full matrix, read a 
+    // row at a time to keep only the upper triangle
+    int dim2 = load_int ( fp );
+    if ( n < 0 || n != dim2 ) 
+      die( "load_distance_matrix: Distance matrix is not square\n" );
+    matrix = create_triangular_matrix ( n );
+    float *row = (float *) calloc ( n > 0 ? n : 1, sizeof(float) );
+    for ( i=0; i<n; i++ ) {
+      fread_safe ( row, sizeof(float), n, fp );
+      for ( j=i; j<n; j++ ) TRIANGULAR_ENTRY(matrix,i,j) = row[j];
+    }
+    free ( row );
+  }
+
+  *labels_ptr = load_strings ( &num_labels, fp );
+  if (num_labels != n) 
+    die ( "load_distance_matrix: List of labels (%d) not same size as matrix (%d)",num_labels, n );
+
+  return matrix;
+}
+
+// Map a distance matrix file saved by save_distance_matrix into memory
+// instead of reading it. Pages of the matrix are read in as they are first
+// touched. The mapping is read only, so the matrix has to be copied before
+// it is clustered with bottom_up_cluster_in_place. If fingerprint is not 
+// NULL it is set to the one saved with the matrix. Files in the older 
+// formats are loaded.
+TRIANGULAR_MATRIX *map_distance_matrix ( char ***labels_ptr, DISTANCE_MATRIX_FINGERPRINT *fingerprint, 
+					 char *filename )
+{
+  int num_labels;
+  MAPPED_MATRIX_FILE_HEADER header;
+  struct stat file_stat;
+  FILE *fp = fopen_safe ( filename, "r" );
+  if ( fingerprint != NULL ) memset ( fingerprint, 0, sizeof(DISTANCE_MATRIX_FINGERPRINT) );
+  if ( fread ( &header, sizeof(MAPPED_MATRIX_FILE_HEADER), 1, fp ) != 1 || 
+       header.marker != MAPPED_MATRIX_FILE_MARKER ) {
+    rewind ( fp );
+    TRIANGULAR_MATRIX *matrix = load_distance_matrix ( labels_ptr, fp );
+    fclose ( fp );
+    return matrix;
+  }
+
+  int n = header.num_elements;
+  if ( fstat ( fileno(fp), &file_stat ) != 0 ) 
+    die ( "map_distance_matrix: Unable to stat '%s'\n", filename );
+  if ( n < 0 || header.values_offset % MAPPED_MATRIX_FILE_ALIGNMENT != 0 ||
+       header.labels_offset != header.values_offset + TRIANGULAR_ROW_OFFSET(n,n) * (long)sizeof(float) ||
+       header.labels_offset > (long)file_stat.st_size )
+    die ( "map_distance_matrix: Bad distance matrix file header in '%s'\n", filename );
+
+  void *mapping = mmap ( NULL, header.labels_offset, PROT_READ, MAP_SHARED, fileno(fp), 0 );
+  if ( mapping == MAP_FAILED ) 
+    die ( "map_distance_matrix: Unable to map '%s'\n", filename );
+
+  TRIANGULAR_MATRIX *matrix = (TRIANGULAR_MATRIX *) malloc ( sizeof(TRIANGULAR_MATRIX) );
+  matrix->num_elements = n;
+  matrix->values = (float *) ((char *) mapping + header.values_offset);
+  matrix->mapping = mapping;
+  matrix->mapping_size = header.labels_offset;
+  if ( fingerprint != NULL ) *fingerprint = header.fingerprint;
+
+  if ( fseek ( fp, header.labels_offset, SEEK_SET ) != 0 ) 
+    die ( "map_distance_matrix: Unable to read labels from '%s'\n", filename );
+  *labels_ptr = load_strings ( &num_labels, fp );
+  if (num_labels != n) 
+    die ( "map_distance_matrix: List of labels (%d) not same size as matrix (%d)",num_labels, n );
+  fclose ( fp );
+
+  return matrix;
+}
+
+/*****************************************************************************/
+
+TRIANGULAR_MATRIX *create_triangular_matrix ( int num_elements )
+{
+  TRIANGULAR_MATRIX *matrix = (TRIANGULAR_MATRIX *) malloc ( sizeof(TRIANGULAR_MATRIX) );
+  size_t num_values = TRIANGULAR_ROW_OFFSET(num_elements,num_elements);
+
+  matrix->num_elements = num_elements;
+  matrix->mapping = NULL;
+  matrix->mapping_size = 0;
+  matrix->values = (float *) calloc ( num_values > 0 ? num_values : 1, sizeof(float) );
+  if ( matrix->values == NULL ) 
+    die ( "create_triangular_matrix: Unable to allocate %ld values for %d elements\n", 
+	  (long) num_values, num_elements );
 
   return matrix;
 }
 
+TRIANGULAR_MATRIX *copy_triangular_matrix ( TRIANGULAR_MATRIX *matrix )
+{
+  TRIANGULAR_MATRIX *copy = create_triangular_matrix ( matrix->num_elements );
+  memcpy ( copy->values, matrix->values, 
+	   TRIANGULAR_ROW_OFFSET(matrix->num_elements,matrix->num_elements)*sizeof(float) );
+  return copy;
+}
+
+void free_triangular_matrix ( TRIANGULAR_MATRIX *matrix )
+{
+  if ( matrix == NULL ) return;
+  if ( matrix->mapping != NULL ) munmap ( matrix->mapping, matrix->mapping_size );
+  else free ( matrix->values );
+  free ( matrix );
+}
+
 /*****************************************************************************/
 
 IV_PAIR_ARRAY *create_iv_pair_array ( int num )
@@ -1715,12 +2927,21 @@ static void free_all_strings_in_tree ( TREE_NODE *node )
 /***************************************************************************************************/
 
 
-// Assign feature vectors to initial clusters using random initialization
-// of cluster centroid with clusters formed by assigning feature vectors 
-// to nearest centroid
-int *kmeans_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, int max_iter )
+// Cosine k-means over the weighted feature vectors. Vector-to-centroid
+// assignments are done in parallel and most similarity computations are
+// skipped using triangle inequality bounds. For unit length vectors the
+// Euclidean distance sqrt(2-2*cos) is a metric, so each vector keeps an
+// upper bound on its distance to its assigned centroid and lower bounds
+// on its distance to the other centroids: one per centroid (Elkan) when
+// the N x K bounds fit in memory, otherwise a single bound covering all
+// of them (Hamerly). The bounds are loosened by how far the centroids 
+// drift each iteration, and a centroid whose lower bound stays above the
+// upper bound cannot take the vector. The initial centroids are picked
+// by select_kmeans_seeds.
+int *kmeans_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, int max_iter,
+			 int seeding, unsigned int seed )
 {
-  int i, j, k;
+  int i, j, c;
 
   printf ("(Doing randomized kmeans clustering of feature vectors..."); fflush(stdout);
 
@@ -1731,55 +2952,44 @@ int *kmeans_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_cluste
   if ( feature_vectors->feature_set->feature_weights == NULL ) 
     die ("No feature weights specified for feature vectors\n");
 
-  // Compute the feature vector L2 norm factors...we store these
-  // so we don't have to alter the feature vectors themselves
+  // Compute the L2 norms of the weighted feature vectors...we store 
+  // these so we don't have to alter the feature vectors themselves
   int num_vectors = feature_vectors->num_vectors;
   int num_features = feature_vectors->feature_set->num_features;
   SPARSE_FEATURE_VECTOR *vector;  
   int *indices;
   float *values;
   float *weights = feature_vectors->feature_set->feature_weights;
-  float *vector_l2_norms = (float *)calloc(num_vectors, sizeof(float));
-  float squared_sum = 0;
-  float norm = 1;
-  float weighted_value;
-  for ( i=0; i<num_vectors; i++ ) {
-    vector = feature_vectors->vectors[i];
-    indices = vector->feature_indices;
-    values = vector->feature_values;
-    squared_sum = 0;
-    for ( j=0; j<vector->num_features; j++  ) {
-      weighted_value = values[j] * weights[indices[j]];
-      squared_sum += weighted_value;
-    }
-    vector_l2_norms[i] = sqrtf(squared_sum);
-  }
+  float *vector_l2_norms = compute_weighted_l2_norms ( feature_vectors );
+  SPARSE_VECTOR_DECODER *decoder = create_sparse_vector_decoder ( feature_vectors );
 
   // Set up centroid vectors...to simplify things these vectors 
-  // are full vectors not sparse vectors
+  // are full vectors not sparse vectors. unit_centroids holds the
+  // L2 normalized weighted centroids while centroids has the feature
+  // weights applied once more for the similarity scoring. centroids 
+  // doubles as the space the new centroids are built in, so the 
+  // previous unit_centroids are still there to measure the drift.
   int *vector_labels = (int *) calloc(num_vectors, sizeof(int));
   float **centroids = (float **)calloc2d(num_clusters,num_features,sizeof(float));
-  size_t centroids_size = (size_t)(num_clusters*num_features*sizeof(float));
-  int *centroid_counts = (int *)calloc(num_clusters,sizeof(float));
-  float *centroid_min_similarity = (float *)calloc(num_clusters, sizeof(float));
-
-  // Randomly select feature vectors to serve as cluster centroids
-  int *seed_map = (int *) calloc(num_vectors, sizeof(int));
-  srand((unsigned)(time(0)));
-  for ( i=0; i<num_vectors; i++ ) {
-    seed_map[i] = i;
-  }
+  float **unit_centroids = (float **)calloc2d(num_clusters,num_features,sizeof(float));
+  float *drift = (float *)calloc(num_clusters, sizeof(float));
+  float *upper_bounds = (float *)calloc(num_vectors, sizeof(float));
+  float *lower_bounds = (float *)calloc(num_vectors, sizeof(float));
+  int *member_ptr = (int *)calloc(num_clusters+1, sizeof(int));
+  int *members = (int *)calloc(num_vectors+1, sizeof(int));
+
+  // Use per-centroid (Elkan) lower bounds when they fit in memory and a 
+  // single (Hamerly) lower bound per vector otherwise
+  float **elkan_bounds = NULL;
+  if ( ((double)num_vectors)*num_clusters*sizeof(float) <= KMEANS_ELKAN_MAX_BYTES ) 
+    elkan_bounds = (float **)calloc2d(num_vectors,num_clusters,sizeof(float));
+
+  // Select feature vectors to serve as the initial cluster centroids
+  int *seed_map = select_kmeans_seeds ( feature_vectors, num_clusters, seeding, seed );
+
+  // Copy the selected vectors into the centroid vectors
   for ( i=0; i<num_clusters; i++ ) {
-    j = (int) (num_vectors * (rand() / (RAND_MAX + 1.0)));
-    if ( j==num_clusters) j--;
-    k = seed_map[i];
-    seed_map[i] = seed_map[j];
-    seed_map[j] = k;
-  }
-
-  // Copy the randomly selected vectors into the centroid vectors
-  for ( i=0; i<num_clusters; i++ ) {
-    vector = feature_vectors->vectors[seed_map[i]];
+    vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[seed_map[i]] );
     indices = vector->feature_indices;
     values = vector->feature_values;
     for ( j=0; j<vector->num_features; j++ ) {
@@ -1790,99 +3000,153 @@ int *kmeans_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_cluste
 
   int iter;
   int stop = 0;
-
-  float *centroid;
-  int best_cluster;
-  float similarity;
-  float max_similarity;
   int swap_count;
+  float max_drift;
+  double num_computed = 0;
+  double num_possible = 0;
+  double start_time = get_wall_time();
 
   // Start k-means iterations
   for ( iter=0; stop != 1  && iter<max_iter; iter++ ) {
 
     // On the first iteration the cluster centroids are pre-initialized
     // but after that we must compute them from the previous round of
-    // vector to centroid assignments
+    // vector to centroid assignments. Each cluster's sum is built by 
+    // one thread from the cluster's member list.
     if ( iter > 0 ) {
-      // Zero out the centroid vectors
-      memset(centroids[0], 0, centroids_size);
-      for ( i=0; i<num_vectors; i++ ) {
-	centroid = centroids[vector_labels[i]]; // This is the current centroid assignment
-	vector = feature_vectors->vectors[i];
-	indices = vector->feature_indices;
-	values = vector->feature_values;
-	for ( j=0; j<vector->num_features; j++  ) {
-	  centroid[indices[j]] += values[j];
+      memset(member_ptr, 0, (num_clusters+1)*sizeof(int));
+      for ( i=0; i<num_vectors; i++ ) member_ptr[vector_labels[i]+1]++;
+      for ( c=0; c<num_clusters; c++ ) member_ptr[c+1] += member_ptr[c];
+      for ( i=0; i<num_vectors; i++ ) members[member_ptr[vector_labels[i]]++] = i;
+      for ( c=num_clusters; c>0; c-- ) member_ptr[c] = member_ptr[c-1];
+      member_ptr[0] = 0;
+
+#pragma omp parallel for schedule(dynamic,1) private(i,j,vector)
+      for ( c=0; c<num_clusters; c++ ) {
+	float *centroid = centroids[c];
+	memset(centroid, 0, num_features*sizeof(float));
+	for ( i=member_ptr[c]; i<member_ptr[c+1]; i++ ) {
+	  vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[members[i]] );
+	  for ( j=0; j<vector->num_features; j++  ) {
+	    centroid[vector->feature_indices[j]] += vector->feature_values[j];
+	  }
 	}
       }
     } 
 
-    // Apply feature weighting to centroids
-    for ( i=0; i<num_clusters; i++ ) {
+    // Apply feature weighting and L2 normalization to the centroids,
+    // measure how far each one moved, and apply the feature weights 
+    // to the centroids again. These would normally be applied on the 
+    // feature vector side before L2 normalization. However, so we don't
+    // alter the feature vectors themselves we shift this weighting to 
+    // the centroids and we apply feature vector L2 norm after the fact.
+    // An empty cluster is left as a zero vector.
+#pragma omp parallel for schedule(dynamic,1) private(j)
+    for ( c=0; c<num_clusters; c++ ) {
+      float *centroid = centroids[c];
+      float *unit_centroid = unit_centroids[c];
+      float sum = 0, norm, diff;
       for ( j=0; j<num_features; j++ ) {
-	centroids[i][j] = centroids[i][j] * weights[j];
+	centroid[j] = centroid[j] * weights[j];
+	sum += centroid[j] * centroid[j];
       }
-    }
-
-    // Apply L2 normalization to feature centroids
-    for ( i=0; i<num_clusters; i++ ) {
-      squared_sum = 0;
-      for ( j=0; j<num_features; j++ ) squared_sum += centroids[i][j] * centroids[i][j];
-      norm = sqrtf(squared_sum);
-      for ( j=0; j<num_features; j++ ) centroids[i][j] = centroids[i][j] / norm;
-    }
-
-    // Apply the feature weights to centroids again. These would normally 
-    // be applied on the feature vector side before L2 normalization. 
-    // However, so we don't alter the feature vectors themselves we shift
-    // this weighting to the centroids and we apply feature vector L2 norm
-    // after the fact
-    for ( i=0; i<num_clusters; i++ ) {
+      norm = sqrtf(sum);
+      if ( norm > 0 ) {
+	for ( j=0; j<num_features; j++ ) centroid[j] = centroid[j] / norm;
+      }
+      sum = 0;
       for ( j=0; j<num_features; j++ ) {
-	centroids[i][j] = centroids[i][j] * weights[j];
+	diff = centroid[j] - unit_centroid[j];
+	sum += diff * diff;
+	unit_centroid[j] = centroid[j];
+	centroid[j] = centroid[j] * weights[j];
       }
+      drift[c] = sqrtf(sum);
     }
-
-    // Reset the centroid statistics vectors
-    memset(centroid_counts, 0, num_clusters*sizeof(float));
-    for ( i=0; i<num_clusters; i++ ) centroid_min_similarity[i] = 1.0;
+    max_drift = 0;
+    for ( c=0; c<num_clusters; c++ ) if ( drift[c] > max_drift ) max_drift = drift[c];
 
     // Find the best matching cluster for each feature vector
-    max_similarity=0;
     swap_count=0;
     
+#pragma omp parallel for schedule(dynamic,256) private(j,c,vector) reduction(+:swap_count,num_computed)
     for ( i=0; i<num_vectors; i++ ) {
-      vector = feature_vectors->vectors[i];
-      indices = vector->feature_indices;
-      values = vector->feature_values;
+      float similarity, max_similarity, next_similarity;
+      int best_cluster;
+      vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[i] );
+
+      // Elkan style: one lower bound per centroid, so each centroid
+      // that can't beat the current assignment is skipped on its own
+      if ( elkan_bounds != NULL && iter > 0 ) {
+	float *bounds = elkan_bounds[i];
+	int tight = 0;
+	best_cluster = vector_labels[i];
+	max_similarity = 0;
+	upper_bounds[i] += drift[best_cluster];
+	for ( c=0; c<num_clusters; c++ ) bounds[c] -= drift[c];
+	for ( c=0; c<num_clusters; c++ ) {
+	  if ( c == best_cluster || upper_bounds[i] + KMEANS_BOUND_MARGIN < bounds[c] ) continue;
+	  if ( !tight ) {
+	    max_similarity = kmeans_similarity ( vector, centroids[best_cluster], vector_l2_norms[i] );
+	    num_computed++;
+	    upper_bounds[i] = bounds[best_cluster] = cosine_to_unit_distance(max_similarity);
+	    tight = 1;
+	    if ( upper_bounds[i] + KMEANS_BOUND_MARGIN < bounds[c] ) continue;
+	  }
+	  similarity = kmeans_similarity ( vector, centroids[c], vector_l2_norms[i] );
+	  num_computed++;
+	  bounds[c] = cosine_to_unit_distance(similarity);
+	  // Ties go to the lower cluster index as in a full scan
+	  if ( similarity > max_similarity || ( similarity == max_similarity && c < best_cluster ) ) {
+	    best_cluster = c;
+	    max_similarity = similarity;
+	    upper_bounds[i] = bounds[c];
+	  }
+	}
+	if ( best_cluster != vector_labels[i] ) {
+	  vector_labels[i] = best_cluster;
+	  swap_count++;
+	}
+	continue;
+      }
+
+      // Hamerly style: loosen the bounds by the centroid drift and see
+      // if the current assignment can still be trusted
+      if ( iter > 0 ) {
+	upper_bounds[i] += drift[vector_labels[i]];
+	lower_bounds[i] -= max_drift;
+	if ( upper_bounds[i] + KMEANS_BOUND_MARGIN < lower_bounds[i] ) continue;
+	similarity = kmeans_similarity ( vector, centroids[vector_labels[i]], vector_l2_norms[i] );
+	num_computed++;
+	upper_bounds[i] = cosine_to_unit_distance(similarity);
+	if ( upper_bounds[i] + KMEANS_BOUND_MARGIN < lower_bounds[i] ) continue;
+      }
+
+      // Find the best matching cluster centroid for the current vector
       best_cluster = -1;
       max_similarity = 0;
+      next_similarity = -1;
+      for ( c=0; c<num_clusters; c++ ) {
 
-      // Find the best matching cluster centroid for the current vector
-      for ( j=0; j<num_clusters; j++ ) {
- 
-	// Compute the cosine similarity between vector i and cluster centroid [j].
+	// Compute the cosine similarity between vector i and cluster centroid [c].
 	// Vector weights for both the centroid and the vectors are built into
 	// the centroid. The L2 norm of centroid is also built into centroid vector.
-	// The L2 norm of each vector is applied hear after the vector dot product.
- 	centroid = centroids[j];
-	similarity = 0;
-	for ( k=0; k<vector->num_features; k++ ) {
-	  similarity += values[k] * centroid[indices[k]];
-	}
-	similarity = similarity/vector_l2_norms[i];
+	// The L2 norm of each vector is applied here after the vector dot product.
+	similarity = kmeans_similarity ( vector, centroids[c], vector_l2_norms[i] );
+	if ( elkan_bounds != NULL ) elkan_bounds[i][c] = cosine_to_unit_distance(similarity);
 
 	// Keep track of the best cluster for this vector
 	if ( best_cluster == -1 || similarity > max_similarity ) {
-	  best_cluster = j;
+	  if ( best_cluster != -1 ) next_similarity = max_similarity;
+	  best_cluster = c;
 	  max_similarity = similarity;
+	} else if ( similarity > next_similarity ) {
+	  next_similarity = similarity;
 	}
       }
-
-      if ( max_similarity < centroid_min_similarity[best_cluster] ) 
-	centroid_min_similarity[best_cluster] = max_similarity;
-
-      centroid_counts[best_cluster]++;
+      num_computed += num_clusters;
+      upper_bounds[i] = cosine_to_unit_distance(max_similarity);
+      lower_bounds[i] = cosine_to_unit_distance(next_similarity);
 
       // If the current best cluster is different from the
       // previous one, then perform and count the swap
@@ -1891,6 +3155,7 @@ int *kmeans_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_cluste
 	swap_count++;
       }
     }
+    num_possible += ((double)num_vectors)*num_clusters;
     
     printf ("%d...",swap_count);
 
@@ -1898,15 +3163,876 @@ int *kmeans_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_cluste
 
   }
    
-						   
+  printf("done in %.2f seconds after %d iterations...skipped %.0f of %.0f similarity computations (%.1f%%))\n",
+	 get_wall_time()-start_time, iter, num_possible-num_computed, num_possible,
+	 num_possible > 0 ? 100.0*(num_possible-num_computed)/num_possible : 0.0);
+
   free2d((char **)centroids);
-  printf("done)\n");
-   
-  //for ( i=0; i<num_clusters; i++ ) 
-  //  printf ("[%3d] %d %.3f\n", i, centroid_counts[i],centroid_min_similarity[i]);
+  free2d((char **)unit_centroids);
+  free(drift);
+  free(upper_bounds);
+  free(lower_bounds);
+  if ( elkan_bounds != NULL ) free2d((char **)elkan_bounds);
+  free(member_ptr);
+  free(members);
+  free(vector_l2_norms);
+  free_sparse_vector_decoder ( decoder );
+
+  return vector_labels;
+    
+}
+
+// Mini-batch k-means (Sculley, "Web-Scale K-Means Clustering") for use
+// as an initializer on corpora too big for full k-means. Each batch is
+// sampled at random with replacement, its vectors are assigned to the
+// nearest centroid in parallel, and each centroid moves towards its new
+// members with a per-centroid learning rate of 1/(number of vectors it
+// has absorbed so far). Applying a batch's members to a centroid one at
+// a time with that rate works out to a running mean, so each touched
+// centroid is updated once per batch. The centroids are running means 
+// of the L2 normalized weighted vectors (spherical k-means). Apart from
+// the seeding and the final parallel pass that labels every vector,
+// time and memory depend on the batch size and the model size, not on
+// the number of vectors.
+int *minibatch_kmeans_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, 
+				   int batch_size, int num_batches, int seeding, unsigned int seed )
+{
+  int i, j, c, t;
+
+  printf ("(Doing mini-batch kmeans clustering of feature vectors..."); fflush(stdout);
+
+  if ( feature_vectors->feature_set == NULL ) 
+    die ("No feature set specified for feature vectors\n");
+
+  if ( feature_vectors->feature_set->feature_weights == NULL ) 
+    die ("No feature weights specified for feature vectors\n");
+
+  if ( batch_size < 1 ) die ("Mini-batch kmeans batch size must be positive\n");
+
+  int num_vectors = feature_vectors->num_vectors;
+  int num_features = feature_vectors->feature_set->num_features;
+  float *weights = feature_vectors->feature_set->feature_weights;
+  SPARSE_FEATURE_VECTOR *vector;
+  SPARSE_VECTOR_DECODER *decoder = create_sparse_vector_decoder ( feature_vectors );
+  double start_time = get_wall_time();
+
+  // The batches draw from the same seed as the seeding
+  if ( seed == 0 ) seed = (unsigned)(time(0));
+
+  // means holds the running mean of each cluster's unit length weighted
+  // vectors and centroids the normalized mean with the weights applied
+  // once more for the similarity scoring, as in kmeans_clustering
+  float **means = (float **)calloc2d(num_clusters,num_features,sizeof(float));
+  float **centroids = (float **)calloc2d(num_clusters,num_features,sizeof(float));
+  double *counts = (double *)calloc(num_clusters, sizeof(double));
+  int *batch = (int *)calloc(batch_size, sizeof(int));
+  float *batch_norms = (float *)calloc(batch_size, sizeof(float));
+  int *batch_labels = (int *)calloc(batch_size, sizeof(int));
+  int *member_ptr = (int *)calloc(num_clusters+1, sizeof(int));
+  int *members = (int *)calloc(batch_size, sizeof(int));
+  char *changed = (char *)calloc(num_clusters, sizeof(char));
+
+  // Start each centroid from a selected vector, counted as one member
+  int *seed_map = select_kmeans_seeds ( feature_vectors, num_clusters, seeding, seed );
+  for ( c=0; c<num_clusters; c++ ) {
+    vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[seed_map[c]] );
+    float sum = 0, value;
+    for ( j=0; j<vector->num_features; j++ ) {
+      value = vector->feature_values[j] * weights[vector->feature_indices[j]];
+      sum += value * value;
+    }
+    if ( sum <= 0 ) continue;
+    for ( j=0; j<vector->num_features; j++ ) {
+      means[c][vector->feature_indices[j]] = 
+	vector->feature_values[j] * weights[vector->feature_indices[j]] / sqrtf(sum);
+    }
+    counts[c] = 1;
+  }
+  free(seed_map);
+
+  for ( t=0; t<=num_batches; t++ ) {
+
+    // Refresh the scoring copy of every centroid that changed 
+#pragma omp parallel for schedule(dynamic,1) private(j)
+    for ( c=0; c<num_clusters; c++ ) {
+      if ( t > 0 && !changed[c] ) continue;
+      float sum = 0, norm;
+      for ( j=0; j<num_features; j++ ) sum += means[c][j] * means[c][j];
+      norm = sqrtf(sum);
+      for ( j=0; j<num_features; j++ ) centroids[c][j] = norm > 0 ? means[c][j] * weights[j] / norm : 0;
+    }
+    if ( t == num_batches ) break;
+
+    // Sample and assign a batch
+#pragma omp parallel for schedule(dynamic,64) private(j,c,vector)
+    for ( i=0; i<batch_size; i++ ) {
+      float sum = 0, value, similarity, max_similarity = 0;
+      int best_cluster = 0;
+      batch[i] = (int) (num_vectors * kmeans_uniform ( seed, KMEANS_PARALLEL_ROUNDS+3+t, i ));
+      vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[batch[i]] );
+      for ( j=0; j<vector->num_features; j++ ) {
+	value = vector->feature_values[j] * weights[vector->feature_indices[j]];
+	sum += value * value;
+      }
+      batch_norms[i] = sqrtf(sum);
+      for ( c=0; c<num_clusters; c++ ) {
+	similarity = kmeans_similarity ( vector, centroids[c], batch_norms[i] );
+	if ( c == 0 || similarity > max_similarity ) {
+	  best_cluster = c;
+	  max_similarity = similarity;
+	}
+      }
+      batch_labels[i] = best_cluster;
+    }
+
+    // Gather the batch members of each cluster
+    memset(member_ptr, 0, (num_clusters+1)*sizeof(int));
+    for ( i=0; i<batch_size; i++ ) if ( batch_norms[i] > 0 ) member_ptr[batch_labels[i]+1]++;
+    for ( c=0; c<num_clusters; c++ ) member_ptr[c+1] += member_ptr[c];
+    for ( i=0; i<batch_size; i++ ) if ( batch_norms[i] > 0 ) members[member_ptr[batch_labels[i]]++] = i;
+    for ( c=num_clusters; c>0; c-- ) member_ptr[c] = member_ptr[c-1];
+    member_ptr[0] = 0;
+
+    // Move each centroid to the running mean of everything it has absorbed
+#pragma omp parallel for schedule(dynamic,1) private(i,j,vector)
+    for ( c=0; c<num_clusters; c++ ) {
+      int num_members = member_ptr[c+1] - member_ptr[c];
+      changed[c] = num_members > 0;
+      if ( num_members == 0 ) continue;
+      float *mean = means[c];
+      float scale = counts[c] / (counts[c] + num_members);
+      float rate = 1.0 / (counts[c] + num_members);
+      for ( j=0; j<num_features; j++ ) mean[j] *= scale;
+      for ( i=member_ptr[c]; i<member_ptr[c+1]; i++ ) {
+	vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[batch[members[i]]] );
+	float factor = rate / batch_norms[members[i]];
+	for ( j=0; j<vector->num_features; j++ ) {
+	  mean[vector->feature_indices[j]] += 
+	    factor * vector->feature_values[j] * weights[vector->feature_indices[j]];
+	}
+      }
+      counts[c] += num_members;
+    }
+    if ( (t+1) % 10 == 0 ) { printf("%d...", t+1); fflush(stdout); }
+  }
+  
+  // Final parallel pass assigning every vector to its nearest centroid
+  int *vector_labels = (int *) calloc(num_vectors, sizeof(int));
+#pragma omp parallel for schedule(dynamic,256) private(c,vector)
+  for ( i=0; i<num_vectors; i++ ) {
+    float similarity, max_similarity = 0, norm = 0, value;
+    int k, best_cluster = 0;
+    vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[i] );
+    for ( k=0; k<vector->num_features; k++ ) {
+      value = vector->feature_values[k] * weights[vector->feature_indices[k]];
+      norm += value * value;
+    }
+    norm = sqrtf(norm);
+    for ( c=0; c<num_clusters; c++ ) {
+      similarity = kmeans_similarity ( vector, centroids[c], norm );
+      if ( c == 0 || similarity > max_similarity ) {
+	best_cluster = c;
+	max_similarity = similarity;
+      }
+    }
+    vector_labels[i] = best_cluster;
+  }
+
+  printf("done in %.2f seconds with %d batches of %d vectors)\n", 
+	 get_wall_time()-start_time, num_batches, batch_size);
+
+  free2d((char **)means);
+  free2d((char **)centroids);
+  free(counts);
+  free(batch);
+  free(batch_norms);
+  free(batch_labels);
+  free(member_ptr);
+  free(members);
+  free(changed);
+  free_sparse_vector_decoder ( decoder );
 
   return vector_labels;
+}
+
+// Cosine k-means with sparse centroids. Each centroid keeps only its
+// max_terms largest weighted terms, L2 normalized over those terms and
+// stored sorted by feature index with the feature weights applied once
+// more, as in kmeans_clustering. Memory per centroid is bounded by 
+// max_terms and no pass touches the full vocabulary for every centroid:
+// centroid sums are built in a per-thread dense scratch row, and all K
+// vector-to-centroid similarities come from intersecting the vector with
+// an inverted index over the centroid terms. The scratch rows are capped
+// at KMEANS_SCRATCH_MAX_BYTES. The truncation is lossy, so
+// use compute_kmeans_cohesion to compare the clusters against those 
+// from dense centroids.
+int *sparse_kmeans_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, int max_iter,
+				int max_terms, int seeding, unsigned int seed )
+{
+  int i, j, c;
+
+  printf ("(Doing randomized sparse kmeans clustering of feature vectors..."); fflush(stdout);
+
+  if ( feature_vectors->feature_set == NULL ) 
+    die ("No feature set specified for feature vectors\n");
+
+  if ( feature_vectors->feature_set->feature_weights == NULL ) 
+    die ("No feature weights specified for feature vectors\n");
+
+  if ( max_terms < 1 ) die ("Sparse kmeans needs at least one term per centroid\n");
+
+  int num_vectors = feature_vectors->num_vectors;
+  int num_features = feature_vectors->feature_set->num_features;
+  float *weights = feature_vectors->feature_set->feature_weights;
+  SPARSE_VECTOR_DECODER *decoder = create_sparse_vector_decoder ( feature_vectors );
+  SPARSE_FEATURE_VECTOR *vector;
+  if ( max_terms > num_features ) max_terms = num_features;
+
+  // Per-thread scratch for building centroids and scoring vectors. A
+  // feature's sum can be zero after it is touched, so membership in the
+  // touched list is marked separately.
+  int num_threads = get_num_threads();
+  int num_scratch = get_num_kmeans_scratch_rows ( num_features, sizeof(float)+sizeof(int)+sizeof(IV_PAIR)+1 );
+  float **scratch = (float **)calloc2d(num_scratch,num_features,sizeof(float));
+  int **touched = (int **)calloc2d(num_scratch,num_features,sizeof(int));
+  char **marked = (char **)calloc2d(num_scratch,num_features,sizeof(char));
+  IV_PAIR **pairs = (IV_PAIR **)calloc2d(num_scratch,num_features,sizeof(IV_PAIR));
+  float **similarities = (float **)calloc2d(num_threads,num_clusters,sizeof(float));
+
+  // Sparse centroids and the inverted index over their terms
+  int *centroid_sizes = (int *)calloc(num_clusters, sizeof(int));
+  int **centroid_indices = (int **)calloc2d(num_clusters,max_terms,sizeof(int));
+  float **centroid_values = (float **)calloc2d(num_clusters,max_terms,sizeof(float));
+  int *posting_ptr = (int *)calloc(num_features+1, sizeof(int));
+  int *posting_centroids = (int *)calloc(num_clusters*max_terms, sizeof(int));
+  float *posting_values = (float *)calloc(num_clusters*max_terms, sizeof(float));
+
+  int *vector_labels = (int *) calloc(num_vectors, sizeof(int));
+  int *member_ptr = (int *)calloc(num_clusters+1, sizeof(int));
+  int *members = (int *)calloc(num_vectors+1, sizeof(int));
+
+  // Start from selected vectors by making each seed its own cluster
+  int *seed_map = select_kmeans_seeds ( feature_vectors, num_clusters, seeding, seed );
+  for ( c=0; c<num_clusters; c++ ) {
+    member_ptr[c] = c;
+    members[c] = seed_map[c];
+  }
+  member_ptr[num_clusters] = num_clusters;
+  free(seed_map);
+
+  int iter;
+  int stop = 0;
+  int swap_count;
+  int total_terms = 0;
+  double start_time = get_wall_time();
+
+  for ( iter=0; stop != 1 && iter<max_iter; iter++ ) {
+
+    // Gather the members of each cluster from the previous assignment
+    if ( iter > 0 ) {
+      memset(member_ptr, 0, (num_clusters+1)*sizeof(int));
+      for ( i=0; i<num_vectors; i++ ) member_ptr[vector_labels[i]+1]++;
+      for ( c=0; c<num_clusters; c++ ) member_ptr[c+1] += member_ptr[c];
+      for ( i=0; i<num_vectors; i++ ) members[member_ptr[vector_labels[i]]++] = i;
+      for ( c=num_clusters; c>0; c-- ) member_ptr[c] = member_ptr[c-1];
+      member_ptr[0] = 0;
+    }
+
+    // Sum each cluster's members, keep the top weighted terms and 
+    // normalize them. An empty cluster gets an empty centroid.
+#pragma omp parallel for schedule(dynamic,1) private(i,j,vector) num_threads(num_scratch)
+    for ( c=0; c<num_clusters; c++ ) {
+      int thread = 0;
+#ifdef _OPENMP
+      thread = omp_get_thread_num();
+#endif
+      float *sum = scratch[thread];
+      int *used = touched[thread];
+      char *mark = marked[thread];
+      IV_PAIR *terms = pairs[thread];
+      int num_used = 0, num_terms;
+      float norm = 0;
+      for ( i=member_ptr[c]; i<member_ptr[c+1]; i++ ) {
+	vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[members[i]] );
+	for ( j=0; j<vector->num_features; j++ ) {
+	  int index = vector->feature_indices[j];
+	  if ( !mark[index] ) {
+	    mark[index] = 1;
+	    used[num_used++] = index;
+	  }
+	  sum[index] += vector->feature_values[j];
+	}
+      }
+      num_terms = 0;
+      for ( j=0; j<num_used; j++ ) {
+	float value = sum[used[j]] * weights[used[j]];
+	sum[used[j]] = 0;
+	mark[used[j]] = 0;
+	if ( value <= 0 ) continue;
+	terms[num_terms].index = used[j];
+	terms[num_terms].value = value;
+	num_terms++;
+      }
+      if ( num_terms > max_terms ) {
+	qsort(terms, num_terms, sizeof(IV_PAIR), cmp_iv_pair_by_decreasing_value);
+	num_terms = max_terms;
+      }
+      qsort(terms, num_terms, sizeof(IV_PAIR), cmp_iv_pair_by_index);
+      for ( j=0; j<num_terms; j++ ) norm += terms[j].value * terms[j].value;
+      norm = sqrtf(norm);
+      for ( j=0; j<num_terms; j++ ) {
+	centroid_indices[c][j] = terms[j].index;
+	centroid_values[c][j] = terms[j].value / norm * weights[terms[j].index];
+      }
+      centroid_sizes[c] = num_terms;
+    }
+
+    // Build the inverted index from terms to centroids
+    memset(posting_ptr, 0, (num_features+1)*sizeof(int));
+    total_terms = 0;
+    for ( c=0; c<num_clusters; c++ ) {
+      for ( j=0; j<centroid_sizes[c]; j++ ) posting_ptr[centroid_indices[c][j]+1]++;
+      total_terms += centroid_sizes[c];
+    }
+    for ( j=0; j<num_features; j++ ) posting_ptr[j+1] += posting_ptr[j];
+    for ( c=0; c<num_clusters; c++ ) {
+      for ( j=0; j<centroid_sizes[c]; j++ ) {
+	int p = posting_ptr[centroid_indices[c][j]]++;
+	posting_centroids[p] = c;
+	posting_values[p] = centroid_values[c][j];
+      }
+    }
+    for ( j=num_features; j>0; j-- ) posting_ptr[j] = posting_ptr[j-1];
+    posting_ptr[0] = 0;
+
+    // Score every vector against all centroids through the inverted
+    // index and move it to the best one. Ties go to the lower index.
+    // The vector's own norm would not change which centroid is best, so
+    // the dot products are compared as they are.
+    swap_count = 0;
+#pragma omp parallel for schedule(dynamic,256) private(j,c,vector) reduction(+:swap_count)
+    for ( i=0; i<num_vectors; i++ ) {
+      int thread = 0, p, best_cluster = 0;
+#ifdef _OPENMP
+      thread = omp_get_thread_num();
+#endif
+      float *sim = similarities[thread];
+      vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[i] );
+      for ( j=0; j<vector->num_features; j++ ) {
+	int index = vector->feature_indices[j];
+	for ( p=posting_ptr[index]; p<posting_ptr[index+1]; p++ ) {
+	  sim[posting_centroids[p]] += vector->feature_values[j] * posting_values[p];
+	}
+      }
+      for ( c=1; c<num_clusters; c++ ) if ( sim[c] > sim[best_cluster] ) best_cluster = c;
+      memset(sim, 0, num_clusters*sizeof(float));
+      if ( best_cluster != vector_labels[i] ) {
+	vector_labels[i] = best_cluster;
+	swap_count++;
+      }
+    }
     
+    printf ("%d...",swap_count);
+
+    if ( swap_count == 0 ) stop = 1;
+  }
+
+  printf("done in %.2f seconds after %d iterations...%d centroid terms in %.1f MB)\n",
+	 get_wall_time()-start_time, iter, total_terms, 
+	 ((double)num_clusters)*max_terms*(sizeof(int)+sizeof(float))/(1024*1024));
+
+  free2d((char **)scratch);
+  free2d((char **)touched);
+  free2d((char **)marked);
+  free2d((char **)pairs);
+  free2d((char **)similarities);
+  free(centroid_sizes);
+  free2d((char **)centroid_indices);
+  free2d((char **)centroid_values);
+  free(posting_ptr);
+  free(posting_centroids);
+  free(posting_values);
+  free(member_ptr);
+  free(members);
+  free_sparse_vector_decoder ( decoder );
+
+  return vector_labels;
+}
+
+// Average cosine similarity of the weighted vectors to the exact (dense,
+// untruncated) centroids of the clusters they are labeled with. This is
+// the objective kmeans_clustering climbs, so it measures what cheaper 
+// initializers give up. Each cluster is summed in a per-thread scratch
+// row rather than a num_clusters x num_features matrix.
+float compute_kmeans_cohesion ( SPARSE_FEATURE_VECTORS *feature_vectors, int *vector_labels, int num_clusters )
+{
+  int i, j, c;
+  int num_vectors = feature_vectors->num_vectors;
+  int num_features = feature_vectors->feature_set->num_features;
+  float *weights = feature_vectors->feature_set->feature_weights;
+  float *norms = compute_weighted_l2_norms ( feature_vectors );
+  SPARSE_VECTOR_DECODER *decoder = create_sparse_vector_decoder ( feature_vectors );
+  int num_scratch = get_num_kmeans_scratch_rows ( num_features, sizeof(float)+sizeof(int)+1 );
+  float **scratch = (float **)calloc2d(num_scratch,num_features,sizeof(float));
+  int **touched = (int **)calloc2d(num_scratch,num_features,sizeof(int));
+  char **marked = (char **)calloc2d(num_scratch,num_features,sizeof(char));
+  int *member_ptr = (int *)calloc(num_clusters+1, sizeof(int));
+  int *members = (int *)calloc(num_vectors+1, sizeof(int));
+  double *cluster_sums = (double *)calloc(num_clusters, sizeof(double));
+  double total = 0;
+
+  for ( i=0; i<num_vectors; i++ ) member_ptr[vector_labels[i]+1]++;
+  for ( c=0; c<num_clusters; c++ ) member_ptr[c+1] += member_ptr[c];
+  for ( i=0; i<num_vectors; i++ ) members[member_ptr[vector_labels[i]]++] = i;
+  for ( c=num_clusters; c>0; c-- ) member_ptr[c] = member_ptr[c-1];
+  member_ptr[0] = 0;
+
+#pragma omp parallel for schedule(dynamic,1) private(i,j) num_threads(num_scratch)
+  for ( c=0; c<num_clusters; c++ ) {
+    int thread = 0, num_used = 0, index;
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+    float *sum = scratch[thread];
+    int *used = touched[thread];
+    char *mark = marked[thread];
+    float norm = 0, value;
+    SPARSE_FEATURE_VECTOR *vector;
+    for ( i=member_ptr[c]; i<member_ptr[c+1]; i++ ) {
+      vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[members[i]] );
+      for ( j=0; j<vector->num_features; j++ ) {
+	index = vector->feature_indices[j];
+	if ( !mark[index] ) {
+	  mark[index] = 1;
+	  used[num_used++] = index;
+	}
+	sum[index] += vector->feature_values[j];
+      }
+    }
+    for ( j=0; j<num_used; j++ ) {
+      value = sum[used[j]] * weights[used[j]];
+      norm += value * value;
+      sum[used[j]] = value * weights[used[j]];
+    }
+    norm = sqrtf(norm);
+    for ( i=member_ptr[c]; i<member_ptr[c+1] && norm > 0; i++ ) {
+      vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[members[i]] );
+      cluster_sums[c] += kmeans_similarity ( vector, sum, norms[members[i]] ) / norm;
+    }
+    for ( j=0; j<num_used; j++ ) {
+      sum[used[j]] = 0;
+      mark[used[j]] = 0;
+    }
+  }
+  for ( c=0; c<num_clusters; c++ ) total += cluster_sums[c];
+
+  free(norms);
+  free_sparse_vector_decoder ( decoder );
+  free2d((char **)scratch);
+  free2d((char **)touched);
+  free2d((char **)marked);
+  free(member_ptr);
+  free(members);
+  free(cluster_sums);
+
+  return num_vectors > 0 ? total / num_vectors : 0;
+}
+
+// Number of per-thread dense scratch rows of row_bytes per feature to 
+// use: one per thread, as long as they fit in KMEANS_SCRATCH_MAX_BYTES
+static int get_num_kmeans_scratch_rows ( int num_features, size_t row_bytes )
+{
+  int num_rows = get_num_threads();
+  double max_rows = KMEANS_SCRATCH_MAX_BYTES/(((double)num_features)*row_bytes);
+  if ( num_rows > max_rows ) num_rows = (int)max_rows;
+  if ( num_rows < 1 ) num_rows = 1;
+  return num_rows;
+}
+
+// Assign every feature vector to the nearest centroid of a labelled 
+// subset of the vectors (e.g. a clustered sample). The centroids are the 
+// means of the L2 normalized members and vectors are compared by cosine
+// similarity as they stand, so any feature weighting should already have
+// been applied. Vectors similar to no centroid go to cluster 0.
+int *assign_vectors_to_nearest_centroids ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters,
+					   int *members, int *member_labels, int num_members )
+{
+  int i, j, c;
+  int num_vectors = feature_vectors->num_vectors;
+  int num_features = 1;
+  SPARSE_FEATURE_VECTOR *vector;
+  if ( num_clusters < 1 ) die ("Cannot assign vectors to %d clusters\n", num_clusters);
+  SPARSE_VECTOR_DECODER *decoder = create_sparse_vector_decoder ( feature_vectors );
+  for ( i=0; i<num_vectors; i++ ) {
+    vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[i] );
+    for ( j=0; j<vector->num_features; j++ ) {
+      if ( vector->feature_indices[j] >= num_features ) num_features = vector->feature_indices[j] + 1;
+    }
+  }
+
+  // Centroids are stored feature major so each vector is scored against
+  // all of them in a single pass over its features
+  float *centroids = (float *) calloc ( (long)num_features*num_clusters, sizeof(float) );
+  double *centroid_norms = (double *) calloc ( num_clusters, sizeof(double) );
+  for ( i=0; i<num_members; i++ ) {
+    vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[members[i]] );
+    c = member_labels[i];
+    if ( c < 0 || c >= num_clusters ) 
+      die ("Cluster label %d of vector %d is out of range\n", c, members[i]);
+    double norm = 0;
+    for ( j=0; j<vector->num_features; j++ ) {
+      if ( vector->feature_indices[j] >= 0 ) norm += vector->feature_values[j] * vector->feature_values[j];
+    }
+    if ( norm <= 0 ) continue;
+    norm = sqrt(norm);
+    for ( j=0; j<vector->num_features; j++ ) {
+      if ( vector->feature_indices[j] >= 0 ) 
+	centroids[(long)vector->feature_indices[j]*num_clusters+c] += vector->feature_values[j] / norm;
+    }
+  }
+  long f;
+  for ( f=0; f<num_features; f++ ) {
+    for ( c=0; c<num_clusters; c++ ) 
+      centroid_norms[c] += centroids[f*num_clusters+c] * centroids[f*num_clusters+c];
+  }
+  for ( c=0; c<num_clusters; c++ ) 
+    centroid_norms[c] = centroid_norms[c] > 0 ? 1.0 / sqrt(centroid_norms[c]) : 0;
+  for ( f=0; f<num_features; f++ ) {
+    for ( c=0; c<num_clusters; c++ ) centroids[f*num_clusters+c] *= centroid_norms[c];
+  }
+
+  // The vector norm does not change which centroid is nearest, so the 
+  // plain dot products are compared
+  int num_threads = get_num_threads();
+  float **scratch = (float **)calloc2d(num_threads,num_clusters,sizeof(float));
+  int *vector_labels = (int *) calloc ( num_vectors, sizeof(int) );
+#pragma omp parallel for schedule(dynamic,256) private(j,c,vector)
+  for ( i=0; i<num_vectors; i++ ) {
+    int thread = 0, best_cluster = 0;
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+    float *similarities = scratch[thread];
+    float *centroid, value;
+    for ( c=0; c<num_clusters; c++ ) similarities[c] = 0;
+    vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[i] );
+    for ( j=0; j<vector->num_features; j++ ) {
+      if ( vector->feature_indices[j] < 0 ) continue;
+      centroid = centroids + (long)vector->feature_indices[j]*num_clusters;
+      value = vector->feature_values[j];
+      for ( c=0; c<num_clusters; c++ ) similarities[c] += value * centroid[c];
+    }
+    for ( c=1; c<num_clusters; c++ ) {
+      if ( similarities[c] > similarities[best_cluster] ) best_cluster = c;
+    }
+    vector_labels[i] = best_cluster;
+  }
+
+  free(centroids);
+  free(centroid_norms);
+  free_sparse_vector_decoder ( decoder );
+  free2d((char **)scratch);
+
+  return vector_labels;
+}
+
+// Orders IV_PAIRs by decreasing value, breaking ties by index
+static int cmp_iv_pair_by_decreasing_value ( const void *p1, const void *p2 )
+{
+  const IV_PAIR *iv1 = (const IV_PAIR *)p1;
+  const IV_PAIR *iv2 = (const IV_PAIR *)p2;
+  if ( iv1->value < iv2->value ) return 1;
+  else if ( iv2->value < iv1->value ) return -1;
+  return iv1->index - iv2->index;
+}
+
+// Orders IV_PAIRs by increasing index
+static int cmp_iv_pair_by_index ( const void *p1, const void *p2 )
+{
+  return ((const IV_PAIR *)p1)->index - ((const IV_PAIR *)p2)->index;
+}
+
+// Scaled dot product of a sparse vector with a dense centroid. With the 
+// weights and centroid norm folded into the centroid this is the cosine
+// similarity of the weighted vector and the centroid.
+static float kmeans_similarity ( SPARSE_FEATURE_VECTOR *vector, float *centroid, float norm )
+{
+  int k;
+  float similarity = 0;
+  if ( norm <= 0 ) return 0;
+  for ( k=0; k<vector->num_features; k++ ) {
+    similarity += vector->feature_values[k] * centroid[vector->feature_indices[k]];
+  }
+  return similarity/norm;
+}
+
+// Euclidean distance between two unit vectors with the given cosine similarity
+static float cosine_to_unit_distance ( float similarity )
+{
+  float squared_dist = 2.0 - 2.0*similarity;
+  if ( squared_dist < 0 ) squared_dist = 0;
+  return sqrtf(squared_dist);
+}
+
+
+
+// L2 norms of the feature vectors with the feature weights applied
+static float *compute_weighted_l2_norms ( SPARSE_FEATURE_VECTORS *feature_vectors )
+{
+  int i, j;
+  int num_vectors = feature_vectors->num_vectors;
+  float *weights = feature_vectors->feature_set->feature_weights;
+  float *norms = (float *)calloc(num_vectors, sizeof(float));
+  SPARSE_VECTOR_DECODER *decoder = create_sparse_vector_decoder ( feature_vectors );
+
+#pragma omp parallel for schedule(dynamic,256) private(j)
+  for ( i=0; i<num_vectors; i++ ) {
+    SPARSE_FEATURE_VECTOR *vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[i] );
+    float squared_sum = 0, weighted_value;
+    for ( j=0; j<vector->num_features; j++  ) {
+      weighted_value = vector->feature_values[j] * weights[vector->feature_indices[j]];
+      squared_sum += weighted_value * weighted_value;
+    }
+    norms[i] = sqrtf(squared_sum);
+  }
+  free_sparse_vector_decoder ( decoder );
+
+  return norms;
+}
+
+// Pick num_clusters distinct feature vectors to serve as initial cluster
+// centroids and return their indices. KMEANS_RANDOM_SEEDING picks them 
+// uniformly at random. KMEANS_PARALLEL_SEEDING uses k-means|| (scalable
+// k-means++), which spreads the seeds out over the data. A seed of 0 
+// seeds from the clock; any other seed gives the same selection on every
+// run, regardless of the number of threads.
+int *select_kmeans_seeds ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, 
+			   int seeding, unsigned int seed )
+{
+  if ( num_clusters > feature_vectors->num_vectors ) 
+    die ("Cannot select %d cluster seeds from %d feature vectors\n", num_clusters, feature_vectors->num_vectors);
+
+  if ( seed == 0 ) seed = (unsigned)(time(0));
+
+  if ( seeding == KMEANS_PARALLEL_SEEDING ) 
+    return select_kmeans_parallel_seeds ( feature_vectors, num_clusters, seed );
+  else if ( seeding != KMEANS_RANDOM_SEEDING )
+    die ("Unknown kmeans seeding method %d\n", seeding);
+
+  return select_random_seeds ( feature_vectors->num_vectors, num_clusters, seed );
 }
 
+// Randomly select feature vectors to serve as cluster centroids
+static int *select_random_seeds ( int num_vectors, int num_clusters, unsigned int seed )
+{
+  int i, j, k;
+  int *seed_map = (int *) calloc(num_vectors, sizeof(int));
+  srand(seed);
+  for ( i=0; i<num_vectors; i++ ) {
+    seed_map[i] = i;
+  }
+  for ( i=0; i<num_clusters; i++ ) {
+    j = (int) (num_vectors * (rand() / (RAND_MAX + 1.0)));
+    if ( j==num_clusters) j--;
+    k = seed_map[i];
+    seed_map[i] = seed_map[j];
+    seed_map[j] = k;
+  }
+  return seed_map;
+}
 
+// k-means|| seeding (Bahmani et al., "Scalable K-Means++"). Starting from
+// one random vector, each round samples every vector independently with
+// probability proportional to its squared distance to the nearest 
+// candidate so far, giving about KMEANS_PARALLEL_OVERSAMPLING * K new 
+// candidates per round. The candidates are then weighted by the number 
+// of vectors closest to them and reclustered down to K seeds with 
+// weighted k-means++. Distances are Euclidean distances between the L2
+// normalized weighted vectors. The distance updates run in parallel and
+// every random draw is a hash of (seed, round, vector), so the result 
+// does not depend on the number of threads.
+static int *select_kmeans_parallel_seeds ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, 
+					   unsigned int seed )
+{
+  int i, j, b, r;
+  int num_vectors = feature_vectors->num_vectors;
+  int num_features = feature_vectors->feature_set->num_features;
+  float *weights = feature_vectors->feature_set->feature_weights;
+  double start_time = get_wall_time();
+
+  float *norms = compute_weighted_l2_norms ( feature_vectors );
+  SPARSE_VECTOR_DECODER *decoder = create_sparse_vector_decoder ( feature_vectors );
+  float *cost = (float *)calloc(num_vectors, sizeof(float));
+  int *nearest = (int *)calloc(num_vectors, sizeof(int));
+  char *is_candidate = (char *)calloc(num_vectors, sizeof(char));
+  int max_candidates = num_clusters + 1;
+  int num_candidates = 0;
+  int *candidates = (int *)calloc(max_candidates, sizeof(int));
+  float **block = (float **)calloc2d(KMEANS_SEED_BLOCK, num_features, sizeof(float));
+
+  // Vectors with no weighted features can't serve as centroids, so
+  // they are given zero cost and are never sampled
+  int num_usable = 0;
+  for ( i=0; i<num_vectors; i++ ) {
+    if ( norms[i] > 0 ) { cost[i] = 4.0; num_usable++; }
+    nearest[i] = -1;
+  }
+  if ( num_usable == 0 ) die ("No feature vectors with non-zero weighted features to seed kmeans\n");
+
+  // The first candidate is a uniformly random usable vector
+  i = (int) (num_vectors * kmeans_uniform ( seed, 0, 0 ));
+  while ( norms[i] <= 0 ) i = (i+1) % num_vectors;
+  candidates[num_candidates++] = i;
+  is_candidate[i] = 1;
+
+  int first_new = 0;
+  double oversampling = KMEANS_PARALLEL_OVERSAMPLING * num_clusters;
+  for ( r=0; r<=KMEANS_PARALLEL_ROUNDS; r++ ) {
+
+    // Update every vector's distance to its nearest candidate using the
+    // candidates added last round, a block of dense rows at a time. Each
+    // row holds a unit length weighted candidate with the weights applied
+    // once more, so a dot product with a raw vector over its norm is the
+    // cosine similarity.
+    for ( b=first_new; b<num_candidates; b+=KMEANS_SEED_BLOCK ) {
+      int block_size = num_candidates-b < KMEANS_SEED_BLOCK ? num_candidates-b : KMEANS_SEED_BLOCK;
+      for ( j=0; j<block_size; j++ ) {
+	SPARSE_FEATURE_VECTOR *candidate = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[candidates[b+j]] );
+	float norm = norms[candidates[b+j]];
+	for ( i=0; i<candidate->num_features; i++ ) {
+	  int index = candidate->feature_indices[i];
+	  block[j][index] = candidate->feature_values[i] * weights[index] * weights[index] / norm;
+	}
+      }
+#pragma omp parallel for schedule(dynamic,256) private(j)
+      for ( i=0; i<num_vectors; i++ ) {
+	if ( cost[i] <= 0 ) continue;
+	SPARSE_FEATURE_VECTOR *vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[i] );
+	for ( j=0; j<block_size; j++ ) {
+	  float distance = cosine_to_unit_distance ( kmeans_similarity ( vector, block[j], norms[i] ) );
+	  float squared_distance = candidates[b+j] == i ? 0 : distance * distance;
+	  if ( nearest[i] < 0 || squared_distance < cost[i] ) {
+	    cost[i] = squared_distance;
+	    nearest[i] = b+j;
+	  }
+	}
+      }
+      for ( j=0; j<block_size; j++ ) {
+	SPARSE_FEATURE_VECTOR *candidate = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[candidates[b+j]] );
+	for ( i=0; i<candidate->num_features; i++ ) block[j][candidate->feature_indices[i]] = 0;
+      }
+    }
+    first_new = num_candidates;
+    if ( r == KMEANS_PARALLEL_ROUNDS ) break;
+
+    // Sample the next round of candidates. The total cost is summed in 
+    // index order so it is the same for any number of threads.
+    double total_cost = 0;
+    for ( i=0; i<num_vectors; i++ ) total_cost += cost[i];
+    if ( total_cost <= 0 ) break;
+    for ( i=0; i<num_vectors; i++ ) {
+      if ( cost[i] <= 0 || is_candidate[i] ) continue;
+      if ( kmeans_uniform ( seed, r+1, i ) < oversampling * cost[i] / total_cost ) {
+	if ( num_candidates == max_candidates ) {
+	  max_candidates *= 2;
+	  candidates = (int *)realloc(candidates, max_candidates*sizeof(int));
+	}
+	candidates[num_candidates++] = i;
+	is_candidate[i] = 1;
+      }
+    }
+  }
+
+  // Weight each candidate by the number of vectors nearest to it
+  float *candidate_weights = (float *)calloc(num_candidates, sizeof(float));
+  for ( i=0; i<num_vectors; i++ ) {
+    if ( nearest[i] >= 0 ) candidate_weights[nearest[i]] += 1.0;
+  }
+
+  // Recluster the weighted candidates down to the seeds with weighted 
+  // k-means++, which picks each seed with probability proportional to
+  // its weight times its squared distance to the seeds picked so far.
+  // If there are too few candidates the rest are drawn at random.
+  int *seed_map = (int *)calloc(num_vectors, sizeof(int));
+  int num_seeds = 0;
+  if ( num_candidates <= num_clusters ) {
+    for ( j=0; j<num_candidates; j++ ) seed_map[num_seeds++] = candidates[j];
+    for ( i=0; num_seeds<num_clusters; i++ ) {
+      r = (int) (num_vectors * kmeans_uniform ( seed, KMEANS_PARALLEL_ROUNDS+2, i ));
+      while ( is_candidate[r] ) r = (r+1) % num_vectors;
+      is_candidate[r] = 1;
+      seed_map[num_seeds++] = r;
+    }
+  } else {
+    float *candidate_cost = (float *)calloc(num_candidates, sizeof(float));
+    for ( j=0; j<num_candidates; j++ ) candidate_cost[j] = 1.0;
+    while ( num_seeds < num_clusters ) {
+      double total = 0, target, sum = 0;
+      for ( j=0; j<num_candidates; j++ ) total += candidate_weights[j] * candidate_cost[j];
+      target = total * kmeans_uniform ( seed, KMEANS_PARALLEL_ROUNDS+1, num_seeds );
+      b = -1;
+      for ( j=0; j<num_candidates; j++ ) {
+	if ( candidate_cost[j] <= 0 ) continue;
+	b = j;
+	sum += candidate_weights[j] * candidate_cost[j];
+	if ( sum > target ) break;
+      }
+      // Every remaining candidate has zero weighted cost: take the first
+      if ( total <= 0 ) for ( b=0; candidate_cost[b] <= 0; b++ ) ;
+      seed_map[num_seeds++] = candidates[b];
+
+      // Distances from the remaining candidates to the new seed
+      SPARSE_FEATURE_VECTOR *chosen = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[candidates[b]] );
+      float norm = norms[candidates[b]];
+      for ( i=0; i<chosen->num_features; i++ ) {
+	int index = chosen->feature_indices[i];
+	block[0][index] = chosen->feature_values[i] * weights[index] * weights[index] / norm;
+      }
+      candidate_cost[b] = 0;
+#pragma omp parallel for schedule(dynamic,64)
+      for ( j=0; j<num_candidates; j++ ) {
+	if ( candidate_cost[j] <= 0 ) continue;
+	SPARSE_FEATURE_VECTOR *vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[candidates[j]] );
+	float distance = cosine_to_unit_distance ( kmeans_similarity ( vector, block[0], norms[candidates[j]] ) );
+	// Keep exact duplicates of a seed selectable as a last resort
+	float squared_distance = distance * distance > 0 ? distance * distance : 1e-12;
+	if ( squared_distance < candidate_cost[j] ) candidate_cost[j] = squared_distance;
+      }
+      chosen = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[candidates[b]] );
+      for ( i=0; i<chosen->num_features; i++ ) block[0][chosen->feature_indices[i]] = 0;
+    }
+    free(candidate_cost);
+  }
+
+  printf("k-means|| seeding from %d candidates in %.2f seconds...", num_candidates, get_wall_time()-start_time);
+  fflush(stdout);
+
+  free(norms);
+  free_sparse_vector_decoder ( decoder );
+  free(cost);
+  free(nearest);
+  free(is_candidate);
+  free(candidates);
+  free(candidate_weights);
+  free2d((char **)block);
+
+  return seed_map;
+}
+
+// splitmix64 finalizer, used to derive independent random draws
+static unsigned long long kmeans_hash ( unsigned long long x )
+{
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// Uniform draw in [0,1) determined only by the seed, a stream number
+// and an index within the stream
+static double kmeans_uniform ( unsigned int seed, int stream, int index )
+{
+  unsigned long long x = kmeans_hash ( (((unsigned long long)seed) << 32) ^ (unsigned int)stream );
+  x = kmeans_hash ( x ^ (unsigned int)index );
+  return (x >> 11) * (1.0/9007199254740992.0);
+}
@@ -58,6 +58,40 @@ typedef struct TREE_PLOT_PARAMETERS {
   int margin;
 } TREE_PLOT_PARAMETERS;
 
+// Symmetric matrix stored as its upper triangle (diagonal included)
+// packed row by row. Entry (i,j) for i <= j is at offset
+// i*(2n-i+1)/2 + (j-i), so row i from the diagonal on is contiguous.
+typedef struct TRIANGULAR_MATRIX {
+  int num_elements;
+  float *values;
+  void *mapping; // File mapping holding values, or NULL if values were allocated
+  size_t mapping_size;
+} TRIANGULAR_MATRIX;
+
+// Identifies the data a saved distance matrix was computed from, so that
+// a cached matrix can be checked before it is reused. All zero if unknown.
+typedef struct DISTANCE_MATRIX_FINGERPRINT {
+  int num_features;
+  float max_doc_fraction;
+  unsigned int features_hash;  // Feature names and weights
+  unsigned int documents_hash; // Document names and weighted features
+} DISTANCE_MATRIX_FINGERPRINT;
+
+#define TRIANGULAR_ROW_OFFSET(n,i) ( ((long)(i)) * (2*(long)(n) - (i) + 1) / 2 )
+#define TRIANGULAR_OFFSET(n,i,j) ( (i) <= (j) ? TRIANGULAR_ROW_OFFSET(n,i) + ((j)-(i)) : TRIANGULAR_ROW_OFFSET(n,j) + ((i)-(j)) )
+#define TRIANGULAR_ENTRY(m,i,j) ( (m)->values[TRIANGULAR_OFFSET((m)->num_elements,i,j)] )
+
+// Sparse symmetric graph of similarities (or distances) between elements, 
+// stored as adjacency lists sorted by neighbor. Element pairs without an
+// edge are taken to have missing_value.
+typedef struct SIMILARITY_GRAPH {
+  int num_elements;
+  long *edge_ptr; // Edges of element i are at edge_ptr[i] to edge_ptr[i+1]-1
+  int *neighbors;
+  float *values;
+  float missing_value;
+} SIMILARITY_GRAPH;
+
 typedef struct LDA_FEATURE_VECTORS {
   int num_vectors; // Number of feature vectors (i.e., number of documents)
   int num_topics; // Number of underlying topics in LDA representation
@@ -77,6 +111,18 @@ typedef struct LDA_FEATURE_VECTORS {
 #define MAX_DIST 2
 #define TOT_DIST 3
 
+// Defaults for the LSH nearest neighbor graph: hash tables, bits per
+// table and places scanned either side of an element in each table
+#define LSH_DEFAULT_TABLES 16
+#define LSH_DEFAULT_BITS 12
+#define LSH_DEFAULT_WINDOW 32
+
+// Seed of the LSH hash tables when none is given
+#define LSH_DEFAULT_SEED 1
+
+#define KMEANS_RANDOM_SEEDING 0
+#define KMEANS_PARALLEL_SEEDING 1
+
 /***************************************************************************************************/
 
 /* Function prototypes */
@@ -87,7 +133,13 @@ void normalize_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_vectors,
 				 float df_cutoff, float tf_cutoff, int smooth, int weighting, int root );
 void learn_feature_weights ( SPARSE_FEATURE_VECTORS *feature_vectors,
 			     float df_cutoff, float tf_cutoff, int smooth, int weighting, int root );
-float **compute_cosine_similarity_matrix ( SPARSE_FEATURE_VECTORS *feature_vectors, int log_dist, int verbose );
+TRIANGULAR_MATRIX *compute_cosine_similarity_matrix ( SPARSE_FEATURE_VECTORS *feature_vectors, int log_dist, int verbose );
+TRIANGULAR_MATRIX *compute_pruned_cosine_similarity_matrix ( SPARSE_FEATURE_VECTORS *feature_vectors, 
+							     float max_doc_fraction, int log_dist, int verbose );
+SIMILARITY_GRAPH *compute_lsh_cosine_similarity_graph ( SPARSE_FEATURE_VECTORS *feature_vectors, 
+							int num_neighbors, int num_tables, int num_bits, 
+							int window, unsigned int seed, int log_dist, int verbose );
+void free_similarity_graph ( SIMILARITY_GRAPH *graph );
 void apply_l2_norm_to_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_vectors );
 float compute_sparse_vector_dot_product ( SPARSE_FEATURE_VECTOR *vector_i, 
 					  SPARSE_FEATURE_VECTOR *vector_j );
@@ -95,12 +147,12 @@ void apply_feature_weights_to_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_
 void prune_zero_weight_features_from_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_vectors );
 
 LDA_FEATURE_VECTORS *load_lda_feature_vectors ( char *lda_vectors_in );
-float **compute_lda_cosine_similarity_matrix ( LDA_FEATURE_VECTORS *feature_vectors );
-float **compute_topic_prob_similarity_matrix ( LDA_FEATURE_VECTORS *feature_vectors );
-void convert_similarity_matrix_to_distance_matrix ( float **matrix, int num_dims, float ceiling );
-float **compute_kl_divergence_matrix ( LDA_FEATURE_VECTORS *feature_vectors ); 
-void add_in_similarity_matrix ( float **full_matrix, float **matrix, int num_dims );
-float **interpolate_similarity_matrices ( float **matrix1, float **matrix2, int num_dims, float weight1 );
+TRIANGULAR_MATRIX *compute_lda_cosine_similarity_matrix ( LDA_FEATURE_VECTORS *feature_vectors );
+TRIANGULAR_MATRIX *compute_topic_prob_similarity_matrix ( LDA_FEATURE_VECTORS *feature_vectors );
+void convert_similarity_matrix_to_distance_matrix ( TRIANGULAR_MATRIX *matrix, float ceiling );
+TRIANGULAR_MATRIX *compute_kl_divergence_matrix ( LDA_FEATURE_VECTORS *feature_vectors ); 
+void add_in_similarity_matrix ( TRIANGULAR_MATRIX *full_matrix, TRIANGULAR_MATRIX *matrix );
+TRIANGULAR_MATRIX *interpolate_similarity_matrices ( TRIANGULAR_MATRIX *matrix1, TRIANGULAR_MATRIX *matrix2, float weight1 );
 
 void create_tk_plotting_file( TREE_NODE *root, TREE_PLOT_PARAMETERS *param, FILE *fp );
 void create_tk_commands_for_node( TREE_NODE *node, TREE_PLOT_PARAMETERS *param, FILE *fp);
@@ -108,16 +160,34 @@ int find_longest_label(TREE_NODE *node);
 void find_cluster_labels(TREE_NODE *node, int node_id, int child,
 			 char ***list_ptr, int *n_ptr, char ***ptr );
 
-int *kmeans_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, int max_iter );
-
-TREE_NODE *bottom_up_cluster ( float **matrix, int ndims, char **labels, int dist_metric );
+int *select_kmeans_seeds ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, 
+			   int seeding, unsigned int seed );
+int *kmeans_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, int max_iter,
+			 int seeding, unsigned int seed );
+int *minibatch_kmeans_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, 
+				   int batch_size, int num_batches, int seeding, unsigned int seed );
+int *sparse_kmeans_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, int max_iter,
+				int max_terms, int seeding, unsigned int seed );
+float compute_kmeans_cohesion ( SPARSE_FEATURE_VECTORS *feature_vectors, int *vector_labels, int num_clusters );
+int *assign_vectors_to_nearest_centroids ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters,
+					   int *members, int *member_labels, int num_members );
+
+TREE_NODE *bottom_up_cluster ( TRIANGULAR_MATRIX *matrix, char **labels, int dist_metric );
+TREE_NODE *bottom_up_cluster_in_place ( TRIANGULAR_MATRIX *matrix, char **labels, int dist_metric );
+TREE_NODE *bottom_up_cluster_sparse ( SIMILARITY_GRAPH *graph, char **labels, int dist_metric,
+				      SPARSE_FEATURE_VECTORS *feature_vectors );
 void print_cluster_tree( TREE_NODE *node ); 
 void save_cluster_tree( TREE_NODE *node, FILE *fp );
 void save_cluster_trees( TREE_NODE **nodes, int num_trees, FILE *fp );
 TREE_NODE *load_cluster_tree( FILE *fp );
 TREE_NODE **load_cluster_trees( int *num_trees, FILE *fp );
-void save_distance_matrix ( float **matrix, char **labels, int num_elements, FILE *fp );
-float **load_distance_matrix ( int *dims_ptr, char ***labels_ptr, FILE *fp);
+void save_distance_matrix ( TRIANGULAR_MATRIX *matrix, char **labels, DISTANCE_MATRIX_FINGERPRINT *fingerprint, 
+			    FILE *fp );
+TRIANGULAR_MATRIX *load_distance_matrix ( char ***labels_ptr, FILE *fp);
+TRIANGULAR_MATRIX *map_distance_matrix ( char ***labels_ptr, DISTANCE_MATRIX_FINGERPRINT *fingerprint, 
+					 char *filename );
+void compute_distance_matrix_fingerprint ( SPARSE_FEATURE_VECTORS *feature_vectors, float max_doc_fraction,
+					   DISTANCE_MATRIX_FINGERPRINT *fingerprint );
 void mark_top_clusters_in_tree(TREE_NODE *node, int num_to_mark); 
 int label_clusters_in_tree(TREE_NODE *node, int num_to_label);
 int *assign_vector_labels_from_cluster_tree ( TREE_NODE *cluster_tree, int num_vectors );
@@ -129,6 +199,10 @@ void clear_non_terminal_labels ( TREE_NODE *node );
 void mark_all_nodes_in_tree ( TREE_NODE *node ); 
 void free_cluster_tree ( TREE_NODE *node ); 
 
+TRIANGULAR_MATRIX *create_triangular_matrix ( int num_elements );
+TRIANGULAR_MATRIX *copy_triangular_matrix ( TRIANGULAR_MATRIX *matrix );
+void free_triangular_matrix ( TRIANGULAR_MATRIX *matrix );
+
 IV_PAIR_ARRAY *create_iv_pair_array ( int num );
 void free_iv_pair_array ( IV_PAIR_ARRAY *array );
 int cmp_iv_pair ( const void *p1, const void *p2 );
@@ -0,0 +1,106 @@
+/* -*- C -*-
+ *
+ * Copyright (c) 2011
+ * MIT Lincoln Laboratory
+ * Massachusetts Institute of Technology
+ *
+ * All Rights Reserved
+ *
+ * FILE: convert_to_binary_corpus.c
+ * Converts a combined count file, plain or gzip compressed and possibly
+ * read from standard input, or a list of feature vector files into a
+ * single memory mappable binary corpus file, which can be given to
+ * plsa_estimation_combined_file as its -vector_list_in.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "util/basic_util.h"
+#include "util/args_util.h"
+#include "util/hash_util.h"
+#include "classifiers/classifier_util.h"
+
+/* Main Program */
+int main(int argc, char **argv)
+{
+  // Set up argument table
+  ARG_TABLE *argtab = NULL;
+  argtab = llspeech_new_string_arg(argtab, "vector_list_in", NULL,
+				   "Input combined count file, which may be gzip compressed or \"-\" for stdin, or list of feature vector files with -file_list");
+  argtab = llspeech_new_flag_arg(argtab, "file_list",
+				 "Input is a list of feature vector files rather than a combined count file");
+  argtab = llspeech_new_string_arg(argtab, "feature_list_in", NULL,
+				  "List of terms to use in feature set");
+  argtab = llspeech_new_string_arg(argtab, "stop_list_in", NULL,
+				  "List of terms to exclude from feature set");
+  argtab = llspeech_new_string_arg(argtab, "corpus_out", NULL,
+				   "Output binary corpus file");
+
+  // Parse the command line arguments
+  argc = llspeech_args(argc, argv, argtab);
+
+  // Extract command line argument settings
+  char *vector_list_in = (char *) llspeech_get_string_arg(argtab, "vector_list_in");
+  int file_list = llspeech_get_flag_arg(argtab, "file_list");
+  char *feature_list_in = (char *) llspeech_get_string_arg(argtab, "feature_list_in");
+  char *stop_list_in = (char *) llspeech_get_string_arg(argtab, "stop_list_in");
+  char *corpus_out = (char *) llspeech_get_string_arg(argtab, "corpus_out");
+
+  if ( vector_list_in == NULL || corpus_out == NULL ) {
+    fprintf ( stderr, "\nArgument list:\n");
+    llspeech_args_prusage(argtab);
+    if ( vector_list_in == NULL ) die ( "Must specify argument -vector_list_in\n");
+    else die ( "Must specify argument -corpus_out\n");
+  }
+
+  time_t start_time, end_time;
+  time(&start_time);
+
+  FEATURE_SET *stop_list = NULL;
+  if (stop_list_in != NULL) {
+    printf ("(Loading stop list..."); fflush(stdout);
+    stop_list = load_feature_set ( stop_list_in );
+    printf("done)\n");
+  }
+
+  FEATURE_SET *features = NULL;
+  if ( feature_list_in != NULL ) {
+    printf ("(Loading feature list..."); fflush(stdout);
+    features = load_feature_set ( feature_list_in );
+    printf("done)\n");
+  }
+
+  // Load the feature vectors, creating the feature set from the features
+  // observed in the data if no feature list was given
+  SPARSE_FEATURE_VECTORS *feature_vectors;
+  if ( file_list ) {
+    if ( features == NULL ) {
+      printf("(Creating feature set..."); fflush(stdout);
+      features = create_feature_set_from_file_list ( vector_list_in, 0, stop_list );
+      printf("done)\n");
+    }
+    printf("(Loading feature vectors..."); fflush(stdout);
+    feature_vectors = load_sparse_feature_vectors ( vector_list_in, features, NULL );
+  } else if ( is_count_file_pipe ( vector_list_in ) || is_compressed_count_file ( vector_list_in ) ) {
+    printf("(Loading feature vectors..."); fflush(stdout);
+    feature_vectors = load_sparse_feature_vectors_combined_stream ( vector_list_in, &features, stop_list, NULL );
+  } else {
+    printf("(Loading feature vectors..."); fflush(stdout);
+    feature_vectors = load_sparse_feature_vectors_combined_mmap ( vector_list_in, &features, stop_list, NULL );
+  }
+  printf("done)\n");
+
+  printf("(Writing binary corpus with %d vectors and %d features...",
+	 feature_vectors->num_vectors, features->num_features); fflush(stdout);
+  save_binary_corpus ( feature_vectors, corpus_out );
+  printf("done)\n");
+
+  time(&end_time);
+  printf ("(Total conversion time: %d seconds)\n",(int)difftime(end_time,start_time));
+
+  return 0;
+}
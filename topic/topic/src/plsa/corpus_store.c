@@ -0,0 +1,79 @@
+/* -*- C -*-
+ *
+ * Copyright (c) 2011
+ * MIT Lincoln Laboratory
+ * Massachusetts Institute of Technology
+ *
+ * All Rights Reserved
+ *
+ * FILE: corpus_store.c
+ * Maintains a segmented corpus store: a directory of immutable binary
+ * corpus segments that plsa_estimation_combined_file can load as one
+ * corpus with -vector_list_in. Each day's combined count file is
+ * appended as a new segment, and the segments can be merged by a
+ * compaction that runs alongside appends and training. An append that
+ * leaves the store with -auto_compact segments compacts it too.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "util/basic_util.h"
+#include "util/args_util.h"
+#include "util/hash_util.h"
+#include "classifiers/classifier_util.h"
+
+/* Main Program */
+int main(int argc, char **argv)
+{
+  // Set up argument table
+  ARG_TABLE *argtab = NULL;
+  argtab = llspeech_new_string_arg(argtab, "store", NULL,
+				   "Corpus store directory, created by the first append");
+  argtab = llspeech_new_string_arg(argtab, "append", NULL,
+				   "Combined count file to append as a new segment, which may be gzip compressed or \"-\" for stdin");
+  argtab = llspeech_new_flag_arg(argtab, "compact",
+				 "Merge the segments of the store into one");
+  argtab = llspeech_new_int_arg(argtab, "auto_compact", 16,
+				"Compact the store after an append that leaves it with at least this many segments (0 never does)");
+
+  // Parse the command line arguments
+  argc = llspeech_args(argc, argv, argtab);
+
+  // Extract command line argument settings
+  char *store = (char *) llspeech_get_string_arg(argtab, "store");
+  char *append = (char *) llspeech_get_string_arg(argtab, "append");
+  int compact = llspeech_get_flag_arg(argtab, "compact");
+  int compact_segments = llspeech_get_int_arg(argtab, "auto_compact");
+
+  if ( store == NULL || ( append == NULL && !compact ) ) {
+    fprintf ( stderr, "\nArgument list:\n");
+    llspeech_args_prusage(argtab);
+    if ( store == NULL ) die ( "Must specify argument -store\n");
+    else die ( "Must specify -append or -compact\n");
+  }
+
+  time_t start_time, end_time;
+  time(&start_time);
+
+  if ( append != NULL ) {
+    printf("(Appending to corpus store..."); fflush(stdout);
+    int num_segments = append_to_corpus_store ( store, append );
+    printf("done)\n");
+    if ( compact_segments > 0 && num_segments >= compact_segments ) compact = 1;
+  }
+
+  if ( compact ) {
+    printf("(Compacting corpus store..."); fflush(stdout);
+    if ( compact_corpus_store ( store ) ) printf("done)\n");
+    else printf("skipped, another compaction is running)\n");
+  }
+
+  time(&end_time);
+  printf ("(Total time: %d seconds)\n",(int)difftime(end_time,start_time));
+
+  return 0;
+}
@@ -17,6 +17,10 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "util/basic_util.h"
 #include "util/hash_util.h"
 #include "classifiers/classifier_util.h"
@@ -24,6 +28,54 @@
 #include "plsa/plsa.h"
 #include "porter_stemmer/porter_stemmer.h"
 
+#ifdef __GNUC__
+#define PLSA_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PLSA_PREFETCH(addr)
+#endif
+
+// Work space for the vocabulary tiled E-step. Each tile is a range of
+// tile_size feature indices; entry e of tile t is the run of non-zeros
+// [entry_start[e],entry_end[e]) of document entry_doc[e] in that range.
+typedef struct PLSA_TILES {
+  int num_tiles;
+  int tile_size;
+  int num_entries;
+  int *entry_ptr;                // Tile t owns entries [entry_ptr[t],entry_ptr[t+1])
+  int *entry_doc;
+  int *entry_start;
+  int *entry_end;
+  float **P_d_z;                 // Document-major copy of P(z|d)
+  float **new_P_d_z;             // Document-major P'(z|d) accumulators
+  int num_threads;
+  float ***partial_P_w_given_z;  // Per-thread tile accumulators
+  float **P_z_given_d_w;         // Per-thread P(z|d,w) scratch
+  int num_e_steps;
+  double e_step_time;            // Wall clock seconds spent in tiled E-steps
+  double e_step_bytes;           // Estimated bytes moved by those E-steps
+} PLSA_TILES;
+
+// Work space for the topic parallel E-step
+typedef struct PLSA_TOPIC_BLOCKS {
+  int num_blocks;
+  int *block_ptr;                // Block b covers documents [block_ptr[b],block_ptr[b+1])
+  int max_block_nonzeros;
+  int max_block_docs;
+  int num_slices;                // One topic slice per thread
+  int *topic_ptr;                // Slice s covers topics [topic_ptr[s],topic_ptr[s+1])
+  float **partial_denom;         // Per-slice P(z|d,w) normalizer partial sums
+  float **partial_doc_sum;       // Per-slice P'(z|d) normalizer partial sums
+} PLSA_TOPIC_BLOCKS;
+
+// Private P'(w|z) accumulator for one document partition. Only the rows 
+// of the features that occur in the partition's documents are stored.
+typedef struct PLSA_PARTITION_ROWS {
+  int num_rows;
+  int elem_size;
+  char *values;                  // num_rows x num_topics accumulators
+  char **row;                    // Accumulator row of each feature, NULL if unused
+} PLSA_PARTITION_ROWS;
+
 /**********************************************************************/
 
 static SIG_WORDS *create_signature_words_struct ( int num_sig_words ); 
@@ -35,6 +87,34 @@ static void remove_substrings_from_sig_word_list ( SIG_WORDS *signature_words, F
 static int substring (int i, int j, FEATURE_SET *features);
 static void estimate_P_z_in_plsa_model ( PLSA_MODEL *plsa_model );
 static void estimate_P_w_in_plsa_model ( PLSA_MODEL *plsa_model );
+static float accumulate_plsa_statistics ( SPARSE_FEATURE_VECTOR **vectors, SPARSE_VECTOR_DECODER *decoder, 
+					  int start, int end, float **P_w_given_z, float **P_z_given_d,
+					  float **new_P_w_given_z, float **new_P_z_given_d,
+					  float *P_z_given_d_w, int num_topics, float alpha, int ignore_set );
+static PLSA_TILES *create_plsa_tiles ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_features, 
+				       int num_topics, int tile_size, int ignore_set );
+static void free_plsa_tiles ( PLSA_TILES *tiles );
+static void run_tiled_plsa_e_step ( PLSA_TILES *tiles, SPARSE_FEATURE_VECTORS *feature_vectors,
+				    float **P_w_given_z, float **P_z_given_d,
+				    float **new_P_w_given_z, float **new_P_z_given_d,
+				    int num_features, int num_topics, float alpha, int ignore_set );
+static int choose_plsa_exec_mode ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_features, 
+				   int num_topics );
+static PLSA_TOPIC_BLOCKS *create_plsa_topic_blocks ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_topics );
+static void free_plsa_topic_blocks ( PLSA_TOPIC_BLOCKS *blocks );
+static void run_topic_parallel_plsa_e_step ( PLSA_TOPIC_BLOCKS *blocks, SPARSE_FEATURE_VECTORS *feature_vectors,
+					     float **P_w_given_z, float **P_z_given_d,
+					     float **new_P_w_given_z, float **new_P_z_given_d,
+					     int num_topics, float alpha, int ignore_set );
+static float compute_plsa_log_likelihood ( SPARSE_FEATURE_VECTORS *feature_vectors, SPARSE_VECTOR_DECODER *decoder,
+					   float **P_w_given_z, float **P_z_given_d, int num_topics, 
+					   int ignore_set, int *bounds, int num_partitions );
+static PLSA_PARTITION_ROWS *create_plsa_partition_rows ( SPARSE_FEATURE_VECTORS *feature_vectors, 
+							 SPARSE_VECTOR_DECODER *decoder, int start, int end,
+							 int num_features, int num_topics, int elem_size,
+							 int ignore_set );
+static void clear_plsa_partition_rows ( PLSA_PARTITION_ROWS *rows, int num_topics );
+static void free_plsa_partition_rows ( PLSA_PARTITION_ROWS *rows );
 
 /**********************************************************************/
 
@@ -54,10 +134,14 @@ PLSA_MODEL *train_plsa_model_from_labels ( SPARSE_FEATURE_VECTORS *feature_vecto
 
 
 // Assign feature vectors to initial clusters using agglomerative clustering
-int *deterministic_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters )
+// Terms in more than max_doc_fraction of the documents are ignored when
+// computing document similarities (1.0 uses all terms). If matrix_cache 
+// is not NULL the document distance matrix is cached in that file.
+int *deterministic_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, float max_doc_fraction,
+				char *matrix_cache )
 {
   // Cluster the documents
-  TREE_NODE *cluster_tree = create_document_cluster_tree ( feature_vectors );
+  TREE_NODE *cluster_tree = create_document_cluster_tree ( feature_vectors, max_doc_fraction, matrix_cache );
   
   // Assign cluster labels to feature vectors
   int *vector_labels = extract_cluster_labels_from_cluster_tree ( cluster_tree, feature_vectors->num_vectors, num_clusters );
@@ -68,6 +152,78 @@ int *deterministic_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num
   return vector_labels;
 }
 
+// Assign feature vectors to initial clusters using agglomerative clustering
+// over an LSH nearest neighbor graph of the documents instead of the full
+// similarity matrix, for corpora too large for the matrix. Parts of the
+// graph left unconnected are joined by their centroids. A seed of 0 uses
+// LSH_DEFAULT_SEED, so the clustering is the same on every run.
+int *approximate_deterministic_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, int num_neighbors,
+					    int num_tables, int num_bits, int window, unsigned int seed )
+{
+  if ( seed == 0 ) seed = LSH_DEFAULT_SEED;
+  SIMILARITY_GRAPH *graph = compute_lsh_cosine_similarity_graph ( feature_vectors, num_neighbors, num_tables, num_bits,
+								  window, seed, 1, 1 );
+  TREE_NODE *cluster_tree = bottom_up_cluster_sparse ( graph, NULL, AVG_DIST, feature_vectors );
+  free_similarity_graph ( graph );
+
+  int *vector_labels = extract_cluster_labels_from_cluster_tree ( cluster_tree, feature_vectors->num_vectors, num_clusters );
+  free_cluster_tree ( cluster_tree );
+
+  return vector_labels;
+}
+
+// Assign feature vectors to initial clusters using agglomerative clustering
+// of a random sample of sqrt(num_clusters * num_vectors) documents, after 
+// which every document is assigned to the nearest centroid of the sample 
+// clusters (buckshot clustering). The seed picks the sample; a seed of 0
+// uses CLUSTER_SAMPLE_DEFAULT_SEED, so the same input gives the same 
+// clustering on every run.
+int *sampled_deterministic_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, 
+					float max_doc_fraction, unsigned int seed )
+{
+  int i, num_samples = 0;
+  int num_vectors = feature_vectors->num_vectors;
+  int sample_size = (int) ceil(sqrt((double)num_clusters * num_vectors));
+  if ( sample_size < num_clusters ) sample_size = num_clusters;
+  if ( sample_size > num_vectors ) sample_size = num_vectors;
+
+  // Draw the sample, keeping the documents in corpus order
+  if ( seed == 0 ) seed = CLUSTER_SAMPLE_DEFAULT_SEED;
+  int *seed_map = select_kmeans_seeds ( feature_vectors, sample_size, KMEANS_RANDOM_SEEDING, seed );
+  char *in_sample = (char *) calloc ( num_vectors, sizeof(char) );
+  for ( i=0; i<sample_size; i++ ) in_sample[seed_map[i]] = 1;
+  int *samples = (int *) calloc ( sample_size, sizeof(int) );
+  for ( i=0; i<num_vectors; i++ ) {
+    if ( in_sample[i] ) samples[num_samples++] = i;
+  }
+  free(seed_map);
+  free(in_sample);
+  printf("(Clustering a sample of %d of %d documents)\n", num_samples, num_vectors);
+
+  // The sample shares its vectors with the full set; the similarity 
+  // computation L2 normalizes them in place, which the assignment of
+  // documents to centroids does not depend on. It covers only part of
+  // any corpus behind the full set, so it is not a view of that corpus.
+  SPARSE_FEATURE_VECTORS sample_vectors = *feature_vectors;
+  sample_vectors.num_vectors = num_samples;
+  sample_vectors.corpus = NULL;
+  sample_vectors.vector_block = NULL;
+  sample_vectors.vectors = (SPARSE_FEATURE_VECTOR **) calloc ( num_samples, sizeof(SPARSE_FEATURE_VECTOR *) );
+  for ( i=0; i<num_samples; i++ ) sample_vectors.vectors[i] = feature_vectors->vectors[samples[i]];
+  int *sample_labels = deterministic_clustering ( &sample_vectors, num_clusters, max_doc_fraction, NULL );
+  free(sample_vectors.vectors);
+
+  printf("(Assigning documents to nearest sample cluster centroids..."); fflush(stdout);
+  int *vector_labels = assign_vectors_to_nearest_centroids ( feature_vectors, num_clusters, samples, 
+							     sample_labels, num_samples );
+  printf("done)\n");
+
+  free(samples);
+  free(sample_labels);
+
+  return vector_labels;
+}
+
 int *extract_cluster_labels_from_cluster_tree ( TREE_NODE *cluster_tree, int num_labels, int num_clusters )
 {
   // Assign cluster labels to feature vectors
@@ -80,16 +236,78 @@ int *extract_cluster_labels_from_cluster_tree ( TREE_NODE *cluster_tree, int num
 }
 
 
-// Create a document cluster tree
-TREE_NODE *create_document_cluster_tree ( SPARSE_FEATURE_VECTORS *feature_vectors ) 
+// Create a document cluster tree. When matrix_cache names an existing 
+// distance matrix file whose fingerprint matches the documents, their 
+// weighted features, the vocabulary and max_doc_fraction, it is mapped 
+// instead of computing the matrix; otherwise the computed matrix is saved
+// there. Clustering needs a writable matrix, so a mapped one is copied.
+TREE_NODE *create_document_cluster_tree ( SPARSE_FEATURE_VECTORS *feature_vectors, float max_doc_fraction,
+					  char *matrix_cache ) 
 {
+  int i;
+  int num_vectors = feature_vectors->num_vectors;
+  TRIANGULAR_MATRIX *matrix = NULL;
+  char **labels = NULL;
+  DISTANCE_MATRIX_FINGERPRINT fingerprint, cached_fingerprint;
+
+  // The fingerprint has to be taken before the similarity computation 
+  // normalizes the vectors
+  if ( matrix_cache != NULL ) 
+    compute_distance_matrix_fingerprint ( feature_vectors, max_doc_fraction, &fingerprint );
+
+  if ( matrix_cache != NULL && access ( matrix_cache, R_OK ) == 0 ) {
+    printf("(Mapping cached distance matrix '%s'...", matrix_cache); fflush(stdout);
+    matrix = map_distance_matrix ( &labels, &cached_fingerprint, matrix_cache );
+    int matches = ( matrix->num_elements == num_vectors && 
+		    memcmp ( &cached_fingerprint, &fingerprint, sizeof(DISTANCE_MATRIX_FINGERPRINT) ) == 0 );
+    for ( i=0; matches && i<num_vectors; i++ ) {
+      char *filename = feature_vectors->vectors[i]->filename;
+      if ( strcmp ( labels[i], filename != NULL ? filename : "" ) != 0 ) matches = 0;
+    }
+    for ( i=0; i<matrix->num_elements; i++ ) free ( labels[i] );
+    free ( labels );
+    printf("done)\n");
+    if ( !matches ) {
+      warn ( "Cached distance matrix '%s' is for different documents or features...recomputing it\n", 
+	     matrix_cache );
+      free_triangular_matrix ( matrix );
+      matrix = NULL;
+    }
+  }
 
-  // Compute cosine similarity matrix
-  float **matrix = compute_cosine_similarity_matrix ( feature_vectors, 1, 1 );
+  if ( matrix == NULL ) {
+    // Compute cosine similarity matrix
+    matrix = compute_pruned_cosine_similarity_matrix ( feature_vectors, max_doc_fraction, 1, 1 );
+    if ( matrix_cache != NULL ) {
+      printf("(Saving distance matrix to '%s'...", matrix_cache); fflush(stdout);
+      labels = (char **) calloc ( num_vectors+1, sizeof(char *) );
+      for ( i=0; i<num_vectors; i++ ) {
+	labels[i] = feature_vectors->vectors[i]->filename != NULL ? feature_vectors->vectors[i]->filename : "";
+      }
+      // Write a new file and rename it over the cache, so that other runs
+      // mapping the old file keep it and the cache is never left half written
+      char *new_fn = (char *) malloc ( strlen(matrix_cache) + 32 );
+      sprintf ( new_fn, "%s.new.%d", matrix_cache, (int) getpid() );
+      FILE *fp = fopen_safe ( new_fn, "w" );
+      save_distance_matrix ( matrix, labels, &fingerprint, fp );
+      if ( fclose ( fp ) != 0 ) 
+	die ( "Unable to write '%s'\n", new_fn );
+      if ( rename ( new_fn, matrix_cache ) != 0 ) 
+	die ( "Unable to replace '%s'\n", matrix_cache );
+      free ( new_fn );
+      free ( labels );
+      printf("done)\n");
+    }
+  }
   
-  // Do bottom up clustering to seed PLSA
-  TREE_NODE *cluster_tree = bottom_up_cluster( matrix, feature_vectors->num_vectors, NULL, AVG_DIST );
-  free2d((char **)matrix);
+  // Do bottom up clustering to seed PLSA; a computed matrix is not needed 
+  // afterwards so it serves as the clustering's working storage
+  TREE_NODE *cluster_tree;
+  if ( matrix->mapping != NULL ) 
+    cluster_tree = bottom_up_cluster( matrix, NULL, AVG_DIST );
+  else 
+    cluster_tree = bottom_up_cluster_in_place( matrix, NULL, AVG_DIST );
+  free_triangular_matrix(matrix);
   
   return cluster_tree;
 }
@@ -98,33 +316,24 @@ TREE_NODE *create_document_cluster_tree ( SPARSE_FEATURE_VECTORS *feature_vector
 
 // Assign feature vectors to initial clusters using random initialization
 // of cluster centroid with clusters formed by assigning feature vectors 
-// to nearest centroid
-int *random_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters )
+// to nearest centroid. The seed picks the centroids (0 seeds from the clock).
+int *random_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, unsigned int seed )
 {
 
   printf ("(Doing randomized clustering of feature vectors..."); fflush(stdout);
   int num_vectors = feature_vectors->num_vectors;
-  int *seed_map = (int *) calloc(num_vectors, sizeof(int));
-  int i, j, tmp;
+  int i, j;
   int *vector_labels = (int *) calloc(num_vectors, sizeof(int));
-  srand((unsigned)(time(0)));
 
   // Randomly select feature vectors to serve as cluster centroids
-  for ( i=0; i<num_vectors; i++ ) {
-    seed_map[i] = i;
-  }
-  for ( i=0; i<num_clusters; i++ ) {
-    j = (int) (num_vectors * (rand() / (RAND_MAX + 1.0)));
-    if ( j==num_clusters) j--;
-    tmp = seed_map[i];
-    seed_map[i] = seed_map[j];
-    seed_map[j] = tmp;
-  }
+  int *seed_map = select_kmeans_seeds ( feature_vectors, num_clusters, KMEANS_RANDOM_SEEDING, seed );
 
   // Create an independent copy of the centroid vectors
   SPARSE_FEATURE_VECTORS *centroid_vectors = 
     (SPARSE_FEATURE_VECTORS *) malloc(sizeof(SPARSE_FEATURE_VECTORS));
   centroid_vectors->num_vectors = num_clusters;
+  centroid_vectors->corpus = NULL;
+  centroid_vectors->vector_block = NULL;
   centroid_vectors->vectors = (SPARSE_FEATURE_VECTOR **) calloc(num_clusters, 
 								sizeof(SPARSE_FEATURE_VECTOR *));
   for ( i=0; i<num_clusters; i++ ) {
@@ -225,6 +434,9 @@ PLSA_MODEL *initialize_plsa_model ( SPARSE_FEATURE_VECTORS *feature_vectors, int
   plsa_model->word_P_of_class = NULL;
   plsa_model->alpha = alpha;
   plsa_model->beta = beta;
+  plsa_model->exec_mode = PLSA_DOC_PARALLEL;
+  plsa_model->tile_size = 0;
+  SPARSE_VECTOR_DECODER *decoder = create_sparse_vector_decoder ( feature_vectors );
   
 
   // Collect raw counts for P(w), P(z), and P(w|z)
@@ -239,7 +451,7 @@ PLSA_MODEL *initialize_plsa_model ( SPARSE_FEATURE_VECTORS *feature_vectors, int
       printf("Num features: %d\n", vector->num_features);
       die("Topic index %d is out of range for document %d of %d?!?\n",z,d,num_documents);
     }
-    vector = vectors[d];
+    vector = decode_sparse_feature_vector ( decoder, vectors[d] );
     float doc_word_count = 0.0;
     for ( i=0; i<vector->num_features; i++ ) {
       w = vector->feature_indices[i];
@@ -316,7 +528,7 @@ PLSA_MODEL *initialize_plsa_model ( SPARSE_FEATURE_VECTORS *feature_vectors, int
     if ( 1 ) {
       // Do a fast approximation of P(z|d) from P(w|z) and P(z) 
       for ( d=0; d<num_documents; d++ ) {
-	vector = vectors[d];
+	vector = decode_sparse_feature_vector ( decoder, vectors[d] );
 	denom=0;
 	for ( i=0; i<vector->num_features; i++ ) {
 	  w = vector->feature_indices[i];
@@ -365,6 +577,7 @@ PLSA_MODEL *initialize_plsa_model ( SPARSE_FEATURE_VECTORS *feature_vectors, int
     plsa_model->word_P_of_class = word_P_of_class;
 
   }
+  free_sparse_vector_decoder ( decoder );
   printf("done)\n");
 
   return plsa_model;
@@ -373,6 +586,136 @@ PLSA_MODEL *initialize_plsa_model ( SPARSE_FEATURE_VECTORS *feature_vectors, int
 }
 
 
+// Warm start a PLSA model from a model trained on an earlier version of
+// the corpus. Words of the current feature set are matched to the prior
+// model's vocabulary by name and keep their prior P(w|z), while words new
+// to the vocabulary get their smoothed corpus frequency P(w) in every 
+// topic. P(z|d) then comes from folding the documents into these topics.
+PLSA_MODEL *initialize_plsa_model_from_prior_model ( SPARSE_FEATURE_VECTORS *feature_vectors, PLSA_MODEL *prior_model,
+						     float alpha, float beta, int fold_in_iter )
+{
+  int w, z;
+  int num_topics = prior_model->num_topics;
+  int num_documents = feature_vectors->num_vectors;
+  FEATURE_SET *features = feature_vectors->feature_set;
+  HASHTABLE *prior_hash = prior_model->features->feature_name_to_index_hash;
+
+  // Set up the model and its corpus statistics (P(w), document word 
+  // counts and class information) with a trivial labelling
+  int *vector_labels = (int *) calloc(num_documents+1, sizeof(int));
+  PLSA_MODEL *plsa_model = initialize_plsa_model ( feature_vectors, vector_labels, num_topics, alpha, beta, 1 );
+  free(vector_labels);
+  int num_features = plsa_model->num_features;
+  float **P_w_given_z = plsa_model->P_w_given_z;
+  float *P_w = plsa_model->P_w;
+
+  printf("(Mapping prior model vocabulary..."); fflush(stdout);
+  int *prior_index = (int *) calloc(num_features+1, sizeof(int));
+  int num_new = 0;
+  double new_mass = 0;
+  for ( w=0; w<num_features; w++ ) {
+    prior_index[w] = get_hashtable_string_index ( prior_hash, features->feature_names[w] );
+    if ( prior_index[w] < 0 || prior_index[w] >= prior_model->num_features ) {
+      prior_index[w] = -1;
+      num_new++;
+      new_mass += P_w[w];
+    }
+  }
+
+  // Scale each prior topic over the surviving words to leave room for
+  // the new words
+  for ( z=0; z<num_topics; z++ ) {
+    double sum = 0;
+    for ( w=0; w<num_features; w++ ) {
+      if ( prior_index[w] >= 0 ) sum += prior_model->P_w_given_z[prior_index[w]][z];
+    }
+    for ( w=0; w<num_features; w++ ) {
+      if ( prior_index[w] >= 0 && sum > 0 ) 
+	P_w_given_z[w][z] = (float)(prior_model->P_w_given_z[prior_index[w]][z] * (1.0 - new_mass) / sum);
+      else if ( prior_index[w] >= 0 ) 
+	P_w_given_z[w][z] = 0;
+      else 
+	P_w_given_z[w][z] = P_w[w];
+    }
+  }
+  free(prior_index);
+  printf("done...%d of %d words are new)\n", num_new, num_features);
+
+  // Start the fold-in from the prior topic proportions
+  for ( z=0; z<num_topics; z++ ) plsa_model->P_z[z] = prior_model->P_z[z];
+  fold_in_plsa_documents ( plsa_model, feature_vectors, alpha, fold_in_iter );
+  estimate_P_z_in_plsa_model ( plsa_model );
+
+  return plsa_model;
+}
+
+// Estimate P(z|d) for the documents with P(w|z) held fixed. Each document
+// starts from the approximation P(z|d) ~ sum_w n(d,w) P(w|z) P(z) and 
+// takes num_iter EM updates of P(z|d) alone. Documents are independent
+// so they are split across threads.
+void fold_in_plsa_documents ( PLSA_MODEL *plsa_model, SPARSE_FEATURE_VECTORS *feature_vectors, 
+			      float alpha, int num_iter )
+{
+  printf("(Folding in documents..."); fflush(stdout);
+  int d;
+  int num_topics = plsa_model->num_topics;
+  int num_documents = plsa_model->num_documents;
+  float **P_w_given_z = plsa_model->P_w_given_z;
+  float **P_z_given_d = plsa_model->P_z_given_d;
+  float *P_z = plsa_model->P_z;
+  int num_threads = get_num_threads();
+  float **scratch = (float **) calloc2d ( num_threads, 3*num_topics, sizeof(float) );
+  SPARSE_VECTOR_DECODER *decoder = create_sparse_vector_decoder ( feature_vectors );
+
+#pragma omp parallel for schedule(dynamic,64)
+  for ( d=0; d<num_documents; d++ ) {
+    int i, w, z, iter, thread = 0;
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+    float *P_z_d = scratch[thread];
+    float *new_P_z_d = P_z_d + num_topics;
+    float *P_z_given_d_w = new_P_z_d + num_topics;
+    float denom, num_w_in_d;
+    SPARSE_FEATURE_VECTOR *vector = decode_sparse_feature_vector ( decoder, feature_vectors->vectors[d] );
+
+    denom = 0;
+    for ( z=0; z<num_topics; z++ ) P_z_d[z] = 0;
+    for ( i=0; i<vector->num_features; i++ ) {
+      w = vector->feature_indices[i];
+      num_w_in_d = vector->feature_values[i];
+      for ( z=0; z<num_topics; z++ ) P_z_d[z] += num_w_in_d * P_w_given_z[w][z] * P_z[z];
+    }
+    for ( z=0; z<num_topics; z++ ) denom += P_z_d[z];
+    for ( z=0; z<num_topics; z++ ) P_z_d[z] = denom > 0 ? P_z_d[z]/denom : P_z[z];
+
+    for ( iter=0; iter<num_iter; iter++ ) {
+      for ( z=0; z<num_topics; z++ ) new_P_z_d[z] = alpha;
+      for ( i=0; i<vector->num_features; i++ ) {
+	w = vector->feature_indices[i];
+	num_w_in_d = vector->feature_values[i];
+	denom = 0;
+	for ( z=0; z<num_topics; z++ ) {
+	  P_z_given_d_w[z] = P_w_given_z[w][z] * P_z_d[z];
+	  denom += P_z_given_d_w[z];
+	}
+	if ( denom <= 0 ) continue;
+	for ( z=0; z<num_topics; z++ ) new_P_z_d[z] += num_w_in_d * P_z_given_d_w[z] / denom;
+      }
+      denom = 0;
+      for ( z=0; z<num_topics; z++ ) denom += new_P_z_d[z];
+      if ( denom <= 0 ) break;
+      for ( z=0; z<num_topics; z++ ) P_z_d[z] = new_P_z_d[z]/denom;
+    }
+
+    for ( z=0; z<num_topics; z++ ) P_z_given_d[z][d] = P_z_d[z];
+  }
+
+  free2d((char **)scratch);
+  free_sparse_vector_decoder ( decoder );
+  printf("done)\n");
+}
+
 PLSA_MODEL *copy_plsa_model ( PLSA_MODEL *plsa_model_orig )
 {
   if ( plsa_model_orig == NULL ) return NULL;
@@ -388,6 +731,8 @@ PLSA_MODEL *copy_plsa_model ( PLSA_MODEL *plsa_model_orig )
   plsa_model_copy->num_documents = num_documents;
   plsa_model_copy->alpha = plsa_model_orig->alpha;
   plsa_model_copy->beta = plsa_model_orig->beta;
+  plsa_model_copy->exec_mode = plsa_model_orig->exec_mode;
+  plsa_model_copy->tile_size = plsa_model_orig->tile_size;
   
   float **P_z_given_d = (float **) copy2d( (char **)plsa_model_orig->P_z_given_d, num_topics, 
 					   num_documents, sizeof(float));
@@ -433,7 +778,7 @@ void estimate_plsa_model ( PLSA_MODEL *plsa_model, SPARSE_FEATURE_VECTORS *featu
     die ("ERROR in estimate_plsa_model: # of feature vectors (%d) != # of documents (%d)!?!\n",
 	 feature_vectors->num_vectors, num_documents);
 
-  int i, d,w,z;
+  int d,w,z,p;
 
   SPARSE_FEATURE_VECTOR **vectors = feature_vectors->vectors;
   SPARSE_FEATURE_VECTOR *vector;
@@ -446,30 +791,74 @@ void estimate_plsa_model ( PLSA_MODEL *plsa_model, SPARSE_FEATURE_VECTORS *featu
   time_t start_time, end_time;
   time(&start_time);
 
+  int exec_mode = plsa_model->exec_mode;
+  if ( exec_mode == PLSA_AUTO_PARALLEL ) 
+    exec_mode = choose_plsa_exec_mode ( feature_vectors, num_features, num_topics );
+
+  // Compressed vectors are expanded one document at a time, which only
+  // the document parallel E-step does. The tiled and topic parallel
+  // E-steps index into the middle of documents, or revisit each 
+  // document once per thread, so they fall back to it.
+  SPARSE_VECTOR_DECODER *decoder = create_sparse_vector_decoder ( feature_vectors );
+  if ( decoder != NULL && exec_mode != PLSA_DOC_PARALLEL ) {
+    if ( verbose ) printf("(document parallel for compressed vectors)...");
+    exec_mode = PLSA_DOC_PARALLEL;
+  }
+
+  // Split the documents into cost balanced partitions, one per thread.
+  // These drive the likelihood computation in every mode and the
+  // document parallel E-step, where partition 0 accumulates directly
+  // into P'(w|z) while the others use private accumulators that are
+  // summed in after each E-step, so a single thread reproduces the
+  // serial update exactly. The private accumulators only hold the rows
+  // of the features each partition uses.
+  int num_partitions = get_num_threads();
+  if ( num_partitions > num_documents ) num_partitions = num_documents;
+  if ( num_partitions < 1 ) num_partitions = 1;
+  int *bounds = partition_sparse_feature_vectors_by_cost ( feature_vectors, num_partitions );
+  PLSA_PARTITION_ROWS **partial_P_w_given_z = 
+    (PLSA_PARTITION_ROWS **) calloc(num_partitions, sizeof(PLSA_PARTITION_ROWS *));
+  if ( exec_mode == PLSA_DOC_PARALLEL ) {
+    for ( p=1; p<num_partitions; p++ ) 
+      partial_P_w_given_z[p] = create_plsa_partition_rows ( feature_vectors, decoder, bounds[p], bounds[p+1],
+							    num_features, num_topics, sizeof(float), ignore_set );
+  }
+  float **P_z_given_d_w = (float **) calloc2d( num_partitions, num_topics, sizeof(float));
+
+  // Lay out the vocabulary tiles for the cache blocked mode
+  PLSA_TILES *tiles = NULL;
+  if ( exec_mode == PLSA_VOCAB_TILED ) 
+    tiles = create_plsa_tiles ( feature_vectors, num_features, num_topics, plsa_model->tile_size, ignore_set );
+
+  // Or the document blocks and topic slices for the topic parallel mode
+  PLSA_TOPIC_BLOCKS *topic_blocks = NULL;
+  if ( exec_mode == PLSA_TOPIC_PARALLEL ) {
+    topic_blocks = create_plsa_topic_blocks ( feature_vectors, num_topics );
+    if ( verbose ) printf("(topic parallel over %d slices)...", topic_blocks->num_slices);
+  }
+
+  // The document parallel E-step sums the likelihood of the model it 
+  // starts from as it goes, which saves a second pass over (and, for
+  // compressed vectors, a second decoding of) every document. The 
+  // convergence check then runs one E-step later, and the E-step that
+  // finds convergence is discarded so the model is the same as when the
+  // likelihood is computed after each M-step.
+  int e_step_likelihood = ( tiles == NULL && topic_blocks == NULL );
+  float *partial_L = (float *) calloc(num_partitions, sizeof(float));
+
   // Compute initial likelihood
   float denom;
-  float tmp;
-
-  float num_w_in_d = 0;
   float L = 0.0;
 
   for ( d=0; d<num_documents; d++ ) {
     vector = vectors[d];
-    if ( ignore_set == -1 || vector->set_id != ignore_set ) {
-      denom = 0;
-      for ( i=0; i<vector->num_features; i++ ) {
-	w = vector->feature_indices[i];
-	num_w_in_d = vector->feature_values[i];
-	tmp = 0;
-	for ( z=0; z<num_topics; z++ ) {
-	  tmp += P_w_given_z[w][z] * P_z_given_d[z][d];
-	}
-	L += num_w_in_d * logf(tmp);
-      }
-      total_num_w += vector->total_sum;
-    }
+    if ( ignore_set == -1 || vector->set_id != ignore_set ) total_num_w += vector->total_sum;
+  }
+  if ( !e_step_likelihood ) {
+    L = compute_plsa_log_likelihood ( feature_vectors, decoder, P_w_given_z, P_z_given_d, num_topics, 
+				      ignore_set, bounds, num_partitions );
+    L = L/total_num_w;
   }
-  L = L/total_num_w;
   //printf("%.3f...",L);fflush(stdout);
   float prev_L = L;
 
@@ -479,7 +868,6 @@ void estimate_plsa_model ( PLSA_MODEL *plsa_model, SPARSE_FEATURE_VECTORS *featu
 
   float **tmp_P_z_given_d, **tmp_P_w_given_z;
   int iter;
-  float *P_z_given_d_w = (float *)calloc(num_topics, sizeof(float));
   int stop = 0;
   int stop_count = 0;
 
@@ -496,45 +884,59 @@ void estimate_plsa_model ( PLSA_MODEL *plsa_model, SPARSE_FEATURE_VECTORS *featu
       }
     }      
 
-    // Loop through documents
-    for ( d=0; d<num_documents; d++ ) {
-      vector = vectors[d];
-      if ( ignore_set == -1 || vector->set_id != ignore_set ) {
-	// Initialize P'(z|d) with the alpha smoothing parameter
-	for ( z=0; z<num_topics; z++ ) { 
-	  new_P_z_given_d[z][d] = alpha;
+    if ( tiles != NULL ) {
+      // Sweep the vocabulary tiles
+      run_tiled_plsa_e_step ( tiles, feature_vectors, P_w_given_z, P_z_given_d, 
+			      new_P_w_given_z, new_P_z_given_d, num_features, num_topics,
+			      alpha, ignore_set );
+    } else if ( topic_blocks != NULL ) {
+      // Split the topics across threads
+      run_topic_parallel_plsa_e_step ( topic_blocks, feature_vectors, P_w_given_z, P_z_given_d, 
+				       new_P_w_given_z, new_P_z_given_d, num_topics, alpha, ignore_set );
+    } else {
+      // Loop through the document partitions in parallel
+#pragma omp parallel for schedule(dynamic,1)
+      for ( p=0; p<num_partitions; p++ ) {
+	float **acc_P_w_given_z = new_P_w_given_z;
+	if ( p > 0 ) {
+	  clear_plsa_partition_rows ( partial_P_w_given_z[p], num_topics );
+	  acc_P_w_given_z = (float **) partial_P_w_given_z[p]->row;
 	}
+	partial_L[p] = accumulate_plsa_statistics ( vectors, decoder, bounds[p], bounds[p+1], P_w_given_z, 
+						    P_z_given_d, acc_P_w_given_z, new_P_z_given_d, 
+						    P_z_given_d_w[p], num_topics, alpha, ignore_set );
+      }
 
-	// Loop through word features w in this document d
-	for ( i=0; i<vector->num_features; i++ ) {
-	  w = vector->feature_indices[i];
-	  num_w_in_d = vector->feature_values[i];
-
-	  // Learn P(z|d,w) for each topic z
-	  denom = 0;
-	  for ( z=0; z<num_topics; z++ ) {
-	     P_z_given_d_w[z]  = P_w_given_z[w][z] * P_z_given_d[z][d];
-	     denom += P_z_given_d_w[z];
-	  }
-	  for ( z=0; z<num_topics; z++ ) P_z_given_d_w[z] = P_z_given_d_w[z]/denom;
-	  
-	  // Incorporate statistics collected from this w and d
-	  for ( z=0; z<num_topics; z++ ) {
-	    tmp = num_w_in_d * P_z_given_d_w[z];
-	    new_P_w_given_z[w][z] += tmp;
-	    new_P_z_given_d[z][d] += tmp;
-	  }
+      // Check the convergence of the model going into this iteration
+      L = 0.0;
+      for ( p=0; p<num_partitions; p++ ) L += partial_L[p];
+      L = L/total_num_w;
+      if ( iter > 0 ) {
+	if ( L - prev_L < conv_threshold ) { 
+	  stop_count++;
+	} else if ( stop_count > 0 ) {
+	  stop_count--;
 	}
+	if ( stop_count >= 10 ) stop = 1;
+      }
+      prev_L = L;
+      if ( stop ) break;
+    }
 
-	// Do final normalization for P'(z|d)
-	denom = 0;
-	for ( z=0; z<num_topics; z++ ) denom += new_P_z_given_d[z][d];
-	for ( z=0; z<num_topics; z++ ) new_P_z_given_d[z][d] = new_P_z_given_d[z][d]/denom;
-
+    // Fold the other partitions' statistics into P'(w|z)
+    if ( exec_mode == PLSA_DOC_PARALLEL && num_partitions > 1 ) {
+#pragma omp parallel for private(z,p)
+      for ( w=0; w<num_features; w++ ) {
+	for ( p=1; p<num_partitions; p++ ) {
+	  float *acc = (float *) partial_P_w_given_z[p]->row[w];
+	  if ( acc == NULL ) continue;
+	  for ( z=0; z<num_topics; z++ ) new_P_w_given_z[w][z] += acc[z];
+	}
       }
     }
     
     // Do final normalization for P'(w|z)
+#pragma omp parallel for private(w,denom)
     for ( z=0; z<num_topics; z++ ) {
       denom = 0;
       for ( w=0; w<num_features; w++ ) denom += new_P_w_given_z[w][z];
@@ -550,25 +952,13 @@ void estimate_plsa_model ( PLSA_MODEL *plsa_model, SPARSE_FEATURE_VECTORS *featu
     new_P_w_given_z = tmp_P_w_given_z;
     plsa_model->P_z_given_d = P_z_given_d;
     plsa_model->P_w_given_z = P_w_given_z;
+    if ( e_step_likelihood ) continue;
 
     // Compute the likelihood for this iteration
-    L = 0;
-    for ( d=0; d<num_documents; d++ ) {
-      vector = vectors[d];
-      if ( ignore_set == -1 || vector->set_id != ignore_set ) {
-	denom = 0;
-	for ( i=0; i<vector->num_features; i++ ) {
-	  w = vector->feature_indices[i];
-	  num_w_in_d = vector->feature_values[i];
-	  tmp = 0;
-	  for ( z=0; z<num_topics; z++ ) tmp += P_w_given_z[w][z] * P_z_given_d[z][d];
-	  L += num_w_in_d * logf(tmp);
-	}
-      }
-    }
+    L = compute_plsa_log_likelihood ( feature_vectors, decoder, P_w_given_z, P_z_given_d, num_topics, 
+				      ignore_set, bounds, num_partitions );
     L = L/total_num_w;			       
     // printf("%.3f...",L);fflush(stdout);
-
     // Check if convergence criterion has been reached.
     // The likelihood change must stay below the convergance
     // threshold for 10 straight iterations
@@ -580,6 +970,13 @@ void estimate_plsa_model ( PLSA_MODEL *plsa_model, SPARSE_FEATURE_VECTORS *featu
     if ( stop_count >= 10 ) stop = 1;
     prev_L = L;
   }
+
+  // Without convergence the last E-step has not seen the final model
+  if ( e_step_likelihood && !stop ) {
+    L = compute_plsa_log_likelihood ( feature_vectors, decoder, P_w_given_z, P_z_given_d, num_topics, 
+				      ignore_set, bounds, num_partitions );
+    L = L/total_num_w;
+  }
   
   // Estimated P(z) by document count
   //for (z=0; z<num_topics; z++ ) P_z[z] = 0;
@@ -681,6 +1078,255 @@ void estimate_plsa_model ( PLSA_MODEL *plsa_model, SPARSE_FEATURE_VECTORS *featu
     printf("done in %d seconds...",(int)total_time);
     printf("avg time per iteration=%.1f seconds...",avg_time);
     printf("avg likelihood=%.6f over %.3f total words)\n",L,total_num_w);
+    if ( tiles != NULL && tiles->num_e_steps > 0 && tiles->e_step_time > 0 ) {
+      printf("(Tiled E-step: %d tiles of %d features, %.3f seconds per E-step, ",
+	     tiles->num_tiles, tiles->tile_size, tiles->e_step_time/tiles->num_e_steps);
+      printf("~%.2f GB/s estimated memory bandwidth)\n", tiles->e_step_bytes/tiles->e_step_time/1e9);
+    }
+  }
+  plsa_model->avg_likelihood = L;
+  plsa_model->total_likelihood = L*total_num_w;
+  plsa_model->total_words = total_num_w;
+  
+  free2d((char**)new_P_z_given_d);
+  free2d((char**)new_P_w_given_z);
+  for ( p=1; p<num_partitions; p++ ) free_plsa_partition_rows ( partial_P_w_given_z[p] );
+  free(partial_P_w_given_z);
+  free2d((char**)P_z_given_d_w);
+  free(partial_L);
+  free(bounds);
+  free_plsa_tiles ( tiles );
+  free_plsa_topic_blocks ( topic_blocks );
+  free_sparse_vector_decoder ( decoder );
+
+  return;
+}
+
+
+// Perform hard (Viterbi) EM estimation of a pre-initialized PLSA model. Each
+// (d,w) count goes entirely to its most likely topic, or is split between
+// its top two topics when top_n is 2, instead of being spread over all
+// topics. With top-1 assignments of integral counts the statistics are 
+// accumulated in integers, so the result does not depend on the number of
+// threads. It can be used on its own or as a warm-up before estimate_plsa_model.
+void estimate_plsa_model_hard_em ( PLSA_MODEL *plsa_model, SPARSE_FEATURE_VECTORS *feature_vectors, 
+				   float alpha, float beta, int max_iter, float conv_threshold,
+				   int top_n, int ignore_set, int verbose )
+{
+
+  if ( conv_threshold < 0 ) die("Convergence threshold can not be negative\n");
+  if ( top_n != 1 && top_n != 2 ) die("Hard EM supports top-1 or top-2 assignments only\n");
+
+  int num_topics = plsa_model->num_topics;
+  int num_features = plsa_model->num_features;
+  int num_documents = plsa_model->num_documents;
+
+  if ( feature_vectors->num_vectors != num_documents )
+    die ("ERROR in estimate_plsa_model_hard_em: # of feature vectors (%d) != # of documents (%d)!?!\n",
+	 feature_vectors->num_vectors, num_documents);
+
+  int i, d, w, z, p;
+
+  SPARSE_FEATURE_VECTOR **vectors = feature_vectors->vectors;
+  SPARSE_FEATURE_VECTOR *vector;
+  float **P_z_given_d = plsa_model->P_z_given_d;
+  float **P_w_given_z = plsa_model->P_w_given_z;
+  float total_num_w = 0;
+  SPARSE_VECTOR_DECODER *decoder = create_sparse_vector_decoder ( feature_vectors );
+
+  // Integer accumulators are exact when every count is a whole number
+  int integer_counts = ( top_n == 1 );
+  for ( d=0; d<num_documents && integer_counts; d++ ) {
+    vector = decode_sparse_feature_vector ( decoder, vectors[d] );
+    for ( i=0; i<vector->num_features; i++ ) {
+      if ( vector->feature_values[i] != floorf(vector->feature_values[i]) ) {
+	integer_counts = 0;
+	break;
+      }
+    }
+  }
+
+  if ( verbose ) {
+    printf("(Training %d topic PLSA model with top-%d hard EM%s...", num_topics, top_n,
+	   integer_counts ? " (integer counts)" : ""); 
+    fflush(stdout);
+  }
+
+  time_t start_time, end_time;
+  time(&start_time);
+
+  // One cost balanced partition of the documents per thread, each 
+  // with its own P'(w|z) count accumulator rows for the features it uses
+  int num_partitions = get_num_threads();
+  if ( num_partitions > num_documents ) num_partitions = num_documents;
+  if ( num_partitions < 1 ) num_partitions = 1;
+  int *bounds = partition_sparse_feature_vectors_by_cost ( feature_vectors, num_partitions );
+  PLSA_PARTITION_ROWS **counts = (PLSA_PARTITION_ROWS **) calloc(num_partitions, sizeof(PLSA_PARTITION_ROWS *));
+  for ( p=0; p<num_partitions; p++ ) 
+    counts[p] = create_plsa_partition_rows ( feature_vectors, decoder, bounds[p], bounds[p+1], num_features, 
+					     num_topics, integer_counts ? sizeof(int) : sizeof(float), ignore_set );
+  double *partial_L = (double *) calloc(num_partitions, sizeof(double));
+
+  float denom;
+  float L = 0.0;
+  float prev_L = 0.0;
+  for ( d=0; d<num_documents; d++ ) {
+    vector = vectors[d];
+    if ( ignore_set == -1 || vector->set_id != ignore_set ) total_num_w += vector->total_sum;
+  }
+
+  // Set up variables for iterative training
+  float **new_P_z_given_d = (float **) calloc2d ( num_topics, num_documents, sizeof(float));
+  float **new_P_w_given_z = (float **) calloc2d( num_features, num_topics, sizeof(float));
+  float **tmp_P_z_given_d, **tmp_P_w_given_z;
+  int iter;
+  int stop = 0;
+  int stop_count = 0;
+
+  for ( iter=0; iter<max_iter && !stop; iter++ ) {
+    if ( verbose ) {
+      printf("%d...", iter); fflush(stdout);
+    }
+
+    // Hard E-step over the document partitions in parallel. It also 
+    // collects the hard assignment objective of the current model: the
+    // log of the P(w|z)P(z|d) mass of the topics each count goes to.
+#pragma omp parallel for schedule(dynamic,1) private(d,i,w,z)
+    for ( p=0; p<num_partitions; p++ ) {
+      int z1, z2;
+      float s, s1, s2, count;
+      double L_p = 0.0;
+      float *P_z = (float *) calloc(num_topics, sizeof(float));
+      int **int_counts = (int **) counts[p]->row;
+      float **float_counts = (float **) counts[p]->row;
+      SPARSE_FEATURE_VECTOR *vector;
+      clear_plsa_partition_rows ( counts[p], num_topics );
+
+      for ( d=bounds[p]; d<bounds[p+1]; d++ ) {
+	vector = vectors[d];
+	if ( ignore_set != -1 && vector->set_id == ignore_set ) continue;
+	vector = decode_sparse_feature_vector ( decoder, vector );
+
+	// P'(z|d) collects the assigned counts on top of the alpha smoothing.
+	// P(z|d) is gathered into a contiguous buffer for the topic scans.
+	for ( z=0; z<num_topics; z++ ) {
+	  new_P_z_given_d[z][d] = alpha;
+	  P_z[z] = P_z_given_d[z][d];
+	}
+
+	for ( i=0; i<vector->num_features; i++ ) {
+	  w = vector->feature_indices[i];
+	  count = vector->feature_values[i];
+
+	  // Find the best (and second best) topics for this w and d
+	  z1 = 0; z2 = -1;
+	  s1 = P_w_given_z[w][0] * P_z[0];
+	  s2 = 0;
+	  for ( z=1; z<num_topics; z++ ) {
+	    s = P_w_given_z[w][z] * P_z[z];
+	    if ( s > s1 ) {
+	      z2 = z1; s2 = s1;
+	      z1 = z; s1 = s;
+	    } else if ( z2 == -1 || s > s2 ) {
+	      z2 = z; s2 = s;
+	    }
+	  }
+
+	  // Assign the count to the winner(s)
+	  if ( integer_counts ) {
+	    int_counts[w][z1] += (int)count;
+	    new_P_z_given_d[z1][d] += count;
+	    L_p += count * logf(s1);
+	  } else if ( top_n == 1 || z2 == -1 || s1+s2 <= 0 ) {
+	    float_counts[w][z1] += count;
+	    new_P_z_given_d[z1][d] += count;
+	    L_p += count * logf(s1);
+	  } else {
+	    s = count * s1/(s1+s2);
+	    float_counts[w][z1] += s;
+	    new_P_z_given_d[z1][d] += s;
+	    float_counts[w][z2] += count - s;
+	    new_P_z_given_d[z2][d] += count - s;
+	    L_p += count * logf(s1+s2);
+	  }
+	}
+
+	// Do final normalization for P'(z|d)
+	s = 0;
+	for ( z=0; z<num_topics; z++ ) s += new_P_z_given_d[z][d];
+	for ( z=0; z<num_topics; z++ ) new_P_z_given_d[z][d] = new_P_z_given_d[z][d]/s;
+      }
+      partial_L[p] = L_p;
+      free(P_z);
+    }
+
+    // Combine the partition counts with the beta smoothing for P'(w|z)
+#pragma omp parallel for private(z,p)
+    for ( w=0; w<num_features; w++ ) {
+      for ( z=0; z<num_topics; z++ ) {
+	if ( integer_counts ) {
+	  int total = 0;
+	  for ( p=0; p<num_partitions; p++ ) 
+	    if ( counts[p]->row[w] != NULL ) total += ((int *)counts[p]->row[w])[z];
+	  new_P_w_given_z[w][z] = beta + (float)total;
+	} else {
+	  float total = 0;
+	  for ( p=0; p<num_partitions; p++ ) 
+	    if ( counts[p]->row[w] != NULL ) total += ((float *)counts[p]->row[w])[z];
+	  new_P_w_given_z[w][z] = beta + total;
+	}
+      }
+    }
+
+    // Do final normalization for P'(w|z)
+#pragma omp parallel for private(w,denom)
+    for ( z=0; z<num_topics; z++ ) {
+      denom = 0;
+      for ( w=0; w<num_features; w++ ) denom += new_P_w_given_z[w][z];
+      for ( w=0; w<num_features; w++ ) new_P_w_given_z[w][z] = new_P_w_given_z[w][z]/denom;
+    }
+    
+    // Swap the working space and stored model pointers 
+    tmp_P_z_given_d = P_z_given_d;
+    tmp_P_w_given_z = P_w_given_z;
+    P_z_given_d = new_P_z_given_d;
+    P_w_given_z = new_P_w_given_z;
+    new_P_z_given_d = tmp_P_z_given_d;
+    new_P_w_given_z = tmp_P_w_given_z;
+    plsa_model->P_z_given_d = P_z_given_d;
+    plsa_model->P_w_given_z = P_w_given_z;
+
+    // The hard objective of the model going into this iteration, summed 
+    // over the partitions in order. Same convergence rule as soft EM.
+    double total_L = 0.0;
+    for ( p=0; p<num_partitions; p++ ) total_L += partial_L[p];
+    L = (float)(total_L/total_num_w);
+    if ( iter > 0 ) {
+      if ( L - prev_L < conv_threshold ) { 
+	stop_count++;
+      } else if ( stop_count > 0 ) {
+	stop_count--;
+      }
+      if ( stop_count >= 10 ) stop = 1;
+    }
+    prev_L = L;
+  }
+
+  // The reported likelihood is the usual (soft) one of the final model
+  L = compute_plsa_log_likelihood ( feature_vectors, decoder, P_w_given_z, P_z_given_d, num_topics, 
+				    ignore_set, bounds, num_partitions );
+  L = L/total_num_w;
+
+  // Estimated P(z) by word count
+  estimate_P_z_in_plsa_model(plsa_model);
+
+  time(&end_time);
+  if ( verbose ) {
+    double total_time = difftime(end_time,start_time);
+    double avg_time = total_time/((double)(iter > 0 ? iter : 1));
+    printf("done in %d seconds...",(int)total_time);
+    printf("avg time per iteration=%.1f seconds...",avg_time);
+    printf("avg likelihood=%.6f over %.3f total words)\n",L,total_num_w);
   }
   plsa_model->avg_likelihood = L;
   plsa_model->total_likelihood = L*total_num_w;
@@ -688,10 +1334,606 @@ void estimate_plsa_model ( PLSA_MODEL *plsa_model, SPARSE_FEATURE_VECTORS *featu
   
   free2d((char**)new_P_z_given_d);
   free2d((char**)new_P_w_given_z);
+  for ( p=0; p<num_partitions; p++ ) free_plsa_partition_rows ( counts[p] );
+  free(counts);
+  free(partial_L);
+  free(bounds);
+  free_sparse_vector_decoder ( decoder );
+
+  return;
+}
+
+
+// Run the E-step over documents [start,end), adding the expected counts
+// into new_P_w_given_z and computing the normalized P'(z|d) for each document.
+// Returns the log likelihood of the documents under the model the E-step
+// started from, summed the same way as compute_plsa_log_likelihood.
+static float accumulate_plsa_statistics ( SPARSE_FEATURE_VECTOR **vectors, SPARSE_VECTOR_DECODER *decoder, 
+					  int start, int end, float **P_w_given_z, float **P_z_given_d,
+					  float **new_P_w_given_z, float **new_P_z_given_d,
+					  float *P_z_given_d_w, int num_topics, float alpha, int ignore_set )
+{
+  int i, d, w, z;
+  float denom, tmp, num_w_in_d;
+  float L = 0.0;
+  SPARSE_FEATURE_VECTOR *vector;
+
+  for ( d=start; d<end; d++ ) {
+    vector = decode_sparse_feature_vector ( decoder, vectors[d] );
+    if ( ignore_set == -1 || vector->set_id != ignore_set ) {
+      // Initialize P'(z|d) with the alpha smoothing parameter
+      for ( z=0; z<num_topics; z++ ) { 
+	new_P_z_given_d[z][d] = alpha;
+      }
+
+      // Loop through word features w in this document d
+      for ( i=0; i<vector->num_features; i++ ) {
+	w = vector->feature_indices[i];
+	num_w_in_d = vector->feature_values[i];
+
+	// Learn P(z|d,w) for each topic z
+	denom = 0;
+	for ( z=0; z<num_topics; z++ ) {
+	  P_z_given_d_w[z]  = P_w_given_z[w][z] * P_z_given_d[z][d];
+	  denom += P_z_given_d_w[z];
+	}
+	L += num_w_in_d * logf(denom);
+	for ( z=0; z<num_topics; z++ ) P_z_given_d_w[z] = P_z_given_d_w[z]/denom;
+	  
+	// Incorporate statistics collected from this w and d
+	for ( z=0; z<num_topics; z++ ) {
+	  tmp = num_w_in_d * P_z_given_d_w[z];
+	  new_P_w_given_z[w][z] += tmp;
+	  new_P_z_given_d[z][d] += tmp;
+	}
+      }
+
+      // Do final normalization for P'(z|d)
+      denom = 0;
+      for ( z=0; z<num_topics; z++ ) denom += new_P_z_given_d[z][d];
+      for ( z=0; z<num_topics; z++ ) new_P_z_given_d[z][d] = new_P_z_given_d[z][d]/denom;
+    }
+  }
+
+  return L;
+}
+
+// Total log likelihood of the (non-ignored) data under the model. Each 
+// partition is summed separately and the partial sums are added in order
+// so the result does not depend on how the threads were scheduled.
+static float compute_plsa_log_likelihood ( SPARSE_FEATURE_VECTORS *feature_vectors, SPARSE_VECTOR_DECODER *decoder,
+					   float **P_w_given_z, float **P_z_given_d, int num_topics, 
+					   int ignore_set, int *bounds, int num_partitions )
+{
+  SPARSE_FEATURE_VECTOR **vectors = feature_vectors->vectors;
+  float *partial_L = (float *) calloc(num_partitions, sizeof(float));
+  float L = 0.0;
+  int p;
+
+#pragma omp parallel for schedule(dynamic,1)
+  for ( p=0; p<num_partitions; p++ ) {
+    SPARSE_FEATURE_VECTOR *vector;
+    int i, d, w, z;
+    float tmp, num_w_in_d;
+    float L_p = 0.0;
+    for ( d=bounds[p]; d<bounds[p+1]; d++ ) {
+      vector = vectors[d];
+      if ( ignore_set == -1 || vector->set_id != ignore_set ) {
+	vector = decode_sparse_feature_vector ( decoder, vector );
+	for ( i=0; i<vector->num_features; i++ ) {
+	  w = vector->feature_indices[i];
+	  num_w_in_d = vector->feature_values[i];
+	  tmp = 0;
+	  for ( z=0; z<num_topics; z++ ) tmp += P_w_given_z[w][z] * P_z_given_d[z][d];
+	  L_p += num_w_in_d * logf(tmp);
+	}
+      }
+    }
+    partial_L[p] = L_p;
+  }
+
+  for ( p=0; p<num_partitions; p++ ) L += partial_L[p];
+  free(partial_L);
+
+  return L;
+}
+
+// Lay out the private P'(w|z) accumulator rows for documents [start,end).
+// Ignored documents add nothing, so their features get no rows.
+static PLSA_PARTITION_ROWS *create_plsa_partition_rows ( SPARSE_FEATURE_VECTORS *feature_vectors, 
+							 SPARSE_VECTOR_DECODER *decoder, int start, int end,
+							 int num_features, int num_topics, int elem_size,
+							 int ignore_set )
+{
+  PLSA_PARTITION_ROWS *rows = (PLSA_PARTITION_ROWS *) malloc(sizeof(PLSA_PARTITION_ROWS));
+  SPARSE_FEATURE_VECTOR *vector;
+  int d, i, w;
+
+  rows->row = (char **) calloc(num_features, sizeof(char *));
+  rows->elem_size = elem_size;
+  rows->num_rows = 0;
+
+  // Mark the features in use with a placeholder, then give each its row
+  for ( d=start; d<end; d++ ) {
+    vector = feature_vectors->vectors[d];
+    if ( ignore_set != -1 && vector->set_id == ignore_set ) continue;
+    vector = decode_sparse_feature_vector ( decoder, vector );
+    for ( i=0; i<vector->num_features; i++ ) {
+      w = vector->feature_indices[i];
+      if ( rows->row[w] == NULL ) {
+	rows->row[w] = (char *) rows;
+	rows->num_rows++;
+      }
+    }
+  }
+
+  size_t row_size = (size_t)num_topics*elem_size;
+  rows->values = (char *) calloc((size_t)rows->num_rows*row_size + 1, 1);
+  if ( rows->values == NULL ) die ( "Out of memory for %d P'(w|z) accumulator rows\n", rows->num_rows );
+  char *next = rows->values;
+  for ( w=0; w<num_features; w++ ) {
+    if ( rows->row[w] != NULL ) {
+      rows->row[w] = next;
+      next += row_size;
+    }
+  }
+
+  return rows;
+}
+
+static void clear_plsa_partition_rows ( PLSA_PARTITION_ROWS *rows, int num_topics )
+{
+  memset ( rows->values, 0, (size_t)rows->num_rows*num_topics*rows->elem_size );
+}
+
+static void free_plsa_partition_rows ( PLSA_PARTITION_ROWS *rows )
+{
+  if ( rows == NULL ) return;
+  free(rows->row);
+  free(rows->values);
+  free(rows);
+}
+
+/**********************************************************************/
+
+// Undo a corpus reordering (see reorder_sparse_feature_vectors) in the
+// per-document parts of the model so that P(z|d) and the document counts
+// come back in the original document order
+void restore_plsa_model_document_order ( PLSA_MODEL *plsa_model, int *order )
+{
+  int num_topics = plsa_model->num_topics;
+  int num_documents = plsa_model->num_documents;
+  int d, z;
+
+  float **P_z_given_d = (float **) calloc2d( num_topics, num_documents, sizeof(float));
+  for ( z=0; z<num_topics; z++ ) {
+    for ( d=0; d<num_documents; d++ ) P_z_given_d[z][order[d]] = plsa_model->P_z_given_d[z][d];
+  }
+  free2d((char **)plsa_model->P_z_given_d);
+  plsa_model->P_z_given_d = P_z_given_d;
+
+  if ( plsa_model->num_words_in_d != NULL ) {
+    float *num_words_in_d = (float *) calloc( num_documents, sizeof(float));
+    for ( d=0; d<num_documents; d++ ) num_words_in_d[order[d]] = plsa_model->num_words_in_d[d];
+    free(plsa_model->num_words_in_d);
+    plsa_model->num_words_in_d = num_words_in_d;
+  }
+
+  if ( plsa_model->class_indices != NULL ) {
+    int *class_indices = (int *) calloc( num_documents, sizeof(int));
+    for ( d=0; d<num_documents; d++ ) class_indices[order[d]] = plsa_model->class_indices[d];
+    free(plsa_model->class_indices);
+    plsa_model->class_indices = class_indices;
+  }
+
+  return;
+}
+
+/**********************************************************************/
+
+// Vocabulary tiled E-step. The feature space is cut into tiles of 
+// tile_size rows of P(w|z), sized so a tile of P(w|z) plus a tile of
+// accumulators fit in the L2 cache. All documents' non-zeros in one tile
+// are processed before moving on to the next tile, with P(z|d) and the
+// P'(z|d) partial sums held in document-major scratch.
+
+#define PLSA_PREFETCH_DISTANCE 4
+
+static PLSA_TILES *create_plsa_tiles ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_features, 
+				       int num_topics, int tile_size, int ignore_set )
+{
+  int num_documents = feature_vectors->num_vectors;
+  SPARSE_FEATURE_VECTOR **vectors = feature_vectors->vectors;
+  SPARSE_FEATURE_VECTOR *vector;
+  int d, i, t, prev_t;
+
+  // Size the tiles to the host cache unless told otherwise
+  if ( tile_size <= 0 ) {
+    long cache_size = get_cache_size(2);
+    if ( cache_size <= 0 ) cache_size = 256*1024;
+    tile_size = (int)(cache_size/(2*num_topics*sizeof(float)));
+  }
+  if ( tile_size < 1 ) tile_size = 1;
+  if ( tile_size > num_features ) tile_size = num_features;
+
+  PLSA_TILES *tiles = (PLSA_TILES *) calloc(1, sizeof(PLSA_TILES));
+  tiles->tile_size = tile_size;
+  tiles->num_tiles = (num_features + tile_size - 1)/tile_size;
+  tiles->entry_ptr = (int *) calloc(tiles->num_tiles+1, sizeof(int));
+
+  // Count the document runs falling in each tile...
+  for ( d=0; d<num_documents; d++ ) {
+    vector = vectors[d];
+    if ( ignore_set != -1 && vector->set_id == ignore_set ) continue;
+    prev_t = -1;
+    for ( i=0; i<vector->num_features; i++ ) {
+      t = vector->feature_indices[i]/tile_size;
+      if ( t != prev_t ) tiles->entry_ptr[t+1]++;
+      prev_t = t;
+    }
+  }
+  for ( t=0; t<tiles->num_tiles; t++ ) tiles->entry_ptr[t+1] += tiles->entry_ptr[t];
+  tiles->num_entries = tiles->entry_ptr[tiles->num_tiles];
+
+  // ...then fill them in, in document order within each tile
+  tiles->entry_doc = (int *) calloc(tiles->num_entries+1, sizeof(int));
+  tiles->entry_start = (int *) calloc(tiles->num_entries+1, sizeof(int));
+  tiles->entry_end = (int *) calloc(tiles->num_entries+1, sizeof(int));
+  int *fill = (int *) calloc(tiles->num_tiles, sizeof(int));
+  memcpy ( fill, tiles->entry_ptr, tiles->num_tiles*sizeof(int) );
+  int e = -1;
+  for ( d=0; d<num_documents; d++ ) {
+    vector = vectors[d];
+    if ( ignore_set != -1 && vector->set_id == ignore_set ) continue;
+    prev_t = -1;
+    for ( i=0; i<vector->num_features; i++ ) {
+      t = vector->feature_indices[i]/tile_size;
+      if ( t != prev_t ) {
+	e = fill[t]++;
+	tiles->entry_doc[e] = d;
+	tiles->entry_start[e] = i;
+      }
+      tiles->entry_end[e] = i+1;
+      prev_t = t;
+    }
+  }
+  free(fill);
+
+  // Document-major working copies of P(z|d) and P'(z|d)
+  tiles->P_d_z = (float **) calloc2d( num_documents, num_topics, sizeof(float));
+  tiles->new_P_d_z = (float **) calloc2d( num_documents, num_topics, sizeof(float));
+
+  // Per-thread tile accumulators (thread 0 accumulates directly into P'(w|z))
+  tiles->num_threads = get_num_threads();
+  tiles->partial_P_w_given_z = (float ***) calloc(tiles->num_threads, sizeof(float **));
+  for ( t=1; t<tiles->num_threads; t++ ) 
+    tiles->partial_P_w_given_z[t] = (float **) calloc2d( tile_size, num_topics, sizeof(float));
+  tiles->P_z_given_d_w = (float **) calloc2d( tiles->num_threads, num_topics, sizeof(float));
+
+  return tiles;
+}
+
+static void free_plsa_tiles ( PLSA_TILES *tiles )
+{
+  int t;
+  if ( tiles == NULL ) return;
+  free(tiles->entry_ptr);
+  free(tiles->entry_doc);
+  free(tiles->entry_start);
+  free(tiles->entry_end);
+  free2d((char **)tiles->P_d_z);
+  free2d((char **)tiles->new_P_d_z);
+  for ( t=1; t<tiles->num_threads; t++ ) free2d((char **)tiles->partial_P_w_given_z[t]);
+  free(tiles->partial_P_w_given_z);
+  free2d((char **)tiles->P_z_given_d_w);
+  free(tiles);
+  return;
+}
+
+// One tiled E-step. new_P_w_given_z must already hold the beta smoothing.
+// On return new_P_z_given_d holds the normalized P'(z|d) for every 
+// non-ignored document.
+static void run_tiled_plsa_e_step ( PLSA_TILES *tiles, SPARSE_FEATURE_VECTORS *feature_vectors,
+				    float **P_w_given_z, float **P_z_given_d,
+				    float **new_P_w_given_z, float **new_P_z_given_d,
+				    int num_features, int num_topics, float alpha, int ignore_set )
+{
+  SPARSE_FEATURE_VECTOR **vectors = feature_vectors->vectors;
+  int num_documents = feature_vectors->num_vectors;
+  int tile_size = tiles->tile_size;
+  float **P_d_z = tiles->P_d_z;
+  float **new_P_d_z = tiles->new_P_d_z;
+  double start_time = get_wall_time();
+
+#pragma omp parallel num_threads(tiles->num_threads)
+  {
+    int tid = 0, num_threads = 1;
+#ifdef _OPENMP
+    tid = omp_get_thread_num();
+    num_threads = omp_get_num_threads();
+#endif
+    float *P_z_given_d_w = tiles->P_z_given_d_w[tid];
+    int d, e, i, r, t, w, z, u, base, rows;
+    float denom, tmp, num_w_in_d;
+    float *P_z, *new_P_z;
+    float **acc_rows;  // Indexed by absolute feature index w
+    SPARSE_FEATURE_VECTOR *vector;
+
+    // Load P(z|d) into document-major order and seed P'(z|d) with alpha
+#pragma omp for schedule(static)
+    for ( d=0; d<num_documents; d++ ) {
+      if ( ignore_set == -1 || vectors[d]->set_id != ignore_set ) {
+	for ( z=0; z<num_topics; z++ ) {
+	  P_d_z[d][z] = P_z_given_d[z][d];
+	  new_P_d_z[d][z] = alpha;
+	}
+      }
+    }
+
+    for ( t=0; t<tiles->num_tiles; t++ ) {
+      base = t*tile_size;
+      rows = num_features - base;
+      if ( rows > tile_size ) rows = tile_size;
+      if ( tid == 0 ) {
+	acc_rows = new_P_w_given_z;
+      } else {
+	acc_rows = tiles->partial_P_w_given_z[tid] - base;
+	memset ( *tiles->partial_P_w_given_z[tid], 0, (size_t)rows*num_topics*sizeof(float) );
+      }
+
+      // Each thread takes a contiguous run of this tile's documents
+#pragma omp for schedule(static)
+      for ( e=tiles->entry_ptr[t]; e<tiles->entry_ptr[t+1]; e++ ) {
+	if ( e+PLSA_PREFETCH_DISTANCE < tiles->entry_ptr[t+1] ) {
+	  u = tiles->entry_doc[e+PLSA_PREFETCH_DISTANCE];
+	  PLSA_PREFETCH(P_d_z[u]);
+	  PLSA_PREFETCH(new_P_d_z[u]);
+	  PLSA_PREFETCH(vectors[u]->feature_indices + tiles->entry_start[e+PLSA_PREFETCH_DISTANCE]);
+	  PLSA_PREFETCH(vectors[u]->feature_values + tiles->entry_start[e+PLSA_PREFETCH_DISTANCE]);
+	}
+	d = tiles->entry_doc[e];
+	vector = vectors[d];
+	P_z = P_d_z[d];
+	new_P_z = new_P_d_z[d];
+	for ( i=tiles->entry_start[e]; i<tiles->entry_end[e]; i++ ) {
+	  w = vector->feature_indices[i];
+	  num_w_in_d = vector->feature_values[i];
+
+	  // Learn P(z|d,w) for each topic z
+	  denom = 0;
+	  for ( z=0; z<num_topics; z++ ) {
+	    P_z_given_d_w[z] = P_w_given_z[w][z] * P_z[z];
+	    denom += P_z_given_d_w[z];
+	  }
+	  for ( z=0; z<num_topics; z++ ) P_z_given_d_w[z] = P_z_given_d_w[z]/denom;
+
+	  // Incorporate statistics collected from this w and d
+	  for ( z=0; z<num_topics; z++ ) {
+	    tmp = num_w_in_d * P_z_given_d_w[z];
+	    acc_rows[w][z] += tmp;
+	    new_P_z[z] += tmp;
+	  }
+	}
+      }
+
+      // Fold the other threads' accumulators into this tile of P'(w|z)
+      if ( num_threads > 1 ) {
+#pragma omp for schedule(static)
+	for ( r=0; r<rows; r++ ) {
+	  for ( u=1; u<num_threads; u++ ) {
+	    for ( z=0; z<num_topics; z++ ) 
+	      new_P_w_given_z[base+r][z] += tiles->partial_P_w_given_z[u][r][z];
+	  }
+	}
+      }
+    }
+
+    // Normalize P'(z|d) and store it back in topic-major order
+#pragma omp for schedule(static)
+    for ( d=0; d<num_documents; d++ ) {
+      if ( ignore_set == -1 || vectors[d]->set_id != ignore_set ) {
+	new_P_z = new_P_d_z[d];
+	denom = 0;
+	for ( z=0; z<num_topics; z++ ) denom += new_P_z[z];
+	for ( z=0; z<num_topics; z++ ) new_P_z_given_d[z][d] = new_P_z[z]/denom;
+      }
+    }
+  }
+
+  // Estimate the memory traffic of this pass: the index/value stream, the 
+  // document scratch rows touched per tile entry (read P(z|d), update
+  // P'(z|d)), one read and one update of each tile of P(w|z), and the
+  // transposes in and out of document-major order
+  double bytes = 0;
+  int t, e;
+  for ( t=0; t<tiles->num_tiles; t++ ) {
+    for ( e=tiles->entry_ptr[t]; e<tiles->entry_ptr[t+1]; e++ ) {
+      bytes += (double)(tiles->entry_end[e]-tiles->entry_start[e])*(sizeof(int)+sizeof(float));
+    }
+  }
+  bytes += (double)tiles->num_entries * 3 * num_topics * sizeof(float);
+  bytes += (double)num_features * 3 * num_topics * sizeof(float);
+  bytes += (double)num_documents * 4 * num_topics * sizeof(float);
+  tiles->e_step_bytes += bytes;
+  tiles->e_step_time += get_wall_time() - start_time;
+  tiles->num_e_steps++;
 
   return;
 }
 
+/**********************************************************************/
+
+// Topic parallel E-step. Every thread visits every (d,w) non-zero but only
+// for its own contiguous slice of topics, so threads never write the same
+// P'(w|z) or P'(z|d) entries. Documents are processed in blocks; the
+// normalizers of P(z|d,w) and P'(z|d) are assembled from the per-thread
+// partial sums of each block between barriers.
+
+#define PLSA_TOPIC_BLOCK_NONZEROS 2048
+
+// Pick document or topic parallel execution from the data shape. Document 
+// parallel training pays for zeroing and summing up to (T-1) private V x K
+// copies of P'(w|z) every iteration (less the features a partition never 
+// sees), while topic parallel training pays two 
+// barriers per document block and a T-way sum per non-zero. Topic slices
+// also need to be long enough to keep the inner loops vectorized.
+static int choose_plsa_exec_mode ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_features, 
+				   int num_topics )
+{
+  int num_threads = get_num_threads();
+  double num_nonzeros = 0;
+  int d;
+
+  if ( num_threads < 2 ) return PLSA_DOC_PARALLEL;
+  if ( num_topics/num_threads < 16 ) return PLSA_DOC_PARALLEL;
+
+  for ( d=0; d<feature_vectors->num_vectors; d++ ) 
+    num_nonzeros += feature_vectors->vectors[d]->num_features;
+  
+  if ( ((double)num_features)*(num_threads-1) > 0.5*num_nonzeros ) return PLSA_TOPIC_PARALLEL;
+  return PLSA_DOC_PARALLEL;
+}
+
+static PLSA_TOPIC_BLOCKS *create_plsa_topic_blocks ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_topics )
+{
+  int num_documents = feature_vectors->num_vectors;
+  SPARSE_FEATURE_VECTOR **vectors = feature_vectors->vectors;
+  int d, t, nnz, start;
+
+  PLSA_TOPIC_BLOCKS *blocks = (PLSA_TOPIC_BLOCKS *) calloc(1, sizeof(PLSA_TOPIC_BLOCKS));
+  blocks->block_ptr = (int *) calloc(num_documents+1, sizeof(int));
+
+  // Cut the documents into blocks of roughly PLSA_TOPIC_BLOCK_NONZEROS non-zeros
+  nnz = 0;
+  start = 0;
+  for ( d=0; d<num_documents; d++ ) {
+    nnz += vectors[d]->num_features;
+    if ( nnz >= PLSA_TOPIC_BLOCK_NONZEROS || d == num_documents-1 ) {
+      blocks->block_ptr[++blocks->num_blocks] = d+1;
+      if ( nnz > blocks->max_block_nonzeros ) blocks->max_block_nonzeros = nnz;
+      if ( d+1-start > blocks->max_block_docs ) blocks->max_block_docs = d+1-start;
+      nnz = 0;
+      start = d+1;
+    }
+  }
+
+  // Slice t covers topics [topic_ptr[t],topic_ptr[t+1])
+  blocks->num_slices = get_num_threads();
+  if ( blocks->num_slices > num_topics ) blocks->num_slices = num_topics;
+  blocks->topic_ptr = (int *) calloc(blocks->num_slices+1, sizeof(int));
+  for ( t=0; t<=blocks->num_slices; t++ ) 
+    blocks->topic_ptr[t] = (int)(((long)num_topics*t)/blocks->num_slices);
+
+  blocks->partial_denom = (float **) calloc2d( blocks->num_slices, blocks->max_block_nonzeros+1, 
+					       sizeof(float));
+  blocks->partial_doc_sum = (float **) calloc2d( blocks->num_slices, blocks->max_block_docs+1, 
+						 sizeof(float));
+
+  return blocks;
+}
+
+static void free_plsa_topic_blocks ( PLSA_TOPIC_BLOCKS *blocks )
+{
+  if ( blocks == NULL ) return;
+  free(blocks->block_ptr);
+  free(blocks->topic_ptr);
+  free2d((char **)blocks->partial_denom);
+  free2d((char **)blocks->partial_doc_sum);
+  free(blocks);
+  return;
+}
+
+// One topic parallel E-step. new_P_w_given_z must already hold the beta
+// smoothing. On return new_P_z_given_d holds the normalized P'(z|d) for
+// every non-ignored document.
+static void run_topic_parallel_plsa_e_step ( PLSA_TOPIC_BLOCKS *blocks, SPARSE_FEATURE_VECTORS *feature_vectors,
+					     float **P_w_given_z, float **P_z_given_d,
+					     float **new_P_w_given_z, float **new_P_z_given_d,
+					     int num_topics, float alpha, int ignore_set )
+{
+  SPARSE_FEATURE_VECTOR **vectors = feature_vectors->vectors;
+  int num_slices = blocks->num_slices;
+
+  // The slices are shared out with worksharing loops, so every slice is
+  // computed even if the team is smaller than asked for, and the 
+  // normalizers are summed in slice order whatever the team size.
+#pragma omp parallel num_threads(num_slices)
+  {
+    int b, d, i, n, s, t, w, z, z_start, z_end;
+    float denom, tmp, num_w_in_d;
+    float *partial_denom, *partial_doc_sum;
+    SPARSE_FEATURE_VECTOR *vector;
+
+    for ( b=0; b<blocks->num_blocks; b++ ) {
+      int block_start = blocks->block_ptr[b];
+      int block_end = blocks->block_ptr[b+1];
+
+      // Partial P(z|d,w) normalizers over each slice's topics
+#pragma omp for schedule(static,1)
+      for ( s=0; s<num_slices; s++ ) {
+	z_start = blocks->topic_ptr[s];
+	z_end = blocks->topic_ptr[s+1];
+	partial_denom = blocks->partial_denom[s];
+	for ( d=block_start, n=0; d<block_end; d++ ) {
+	  vector = vectors[d];
+	  if ( ignore_set != -1 && vector->set_id == ignore_set ) continue;
+	  for ( i=0; i<vector->num_features; i++, n++ ) {
+	    w = vector->feature_indices[i];
+	    denom = 0;
+	    for ( z=z_start; z<z_end; z++ ) denom += P_w_given_z[w][z] * P_z_given_d[z][d];
+	    partial_denom[n] = denom;
+	  }
+	}
+      }
+
+      // Complete the normalizers and accumulate each slice's topics
+#pragma omp for schedule(static,1)
+      for ( s=0; s<num_slices; s++ ) {
+	z_start = blocks->topic_ptr[s];
+	z_end = blocks->topic_ptr[s+1];
+	partial_doc_sum = blocks->partial_doc_sum[s];
+	for ( d=block_start, n=0; d<block_end; d++ ) {
+	  vector = vectors[d];
+	  partial_doc_sum[d-block_start] = 0;
+	  if ( ignore_set != -1 && vector->set_id == ignore_set ) continue;
+	  for ( z=z_start; z<z_end; z++ ) new_P_z_given_d[z][d] = alpha;
+	  for ( i=0; i<vector->num_features; i++, n++ ) {
+	    w = vector->feature_indices[i];
+	    num_w_in_d = vector->feature_values[i];
+	    denom = 0;
+	    for ( t=0; t<num_slices; t++ ) denom += blocks->partial_denom[t][n];
+	    for ( z=z_start; z<z_end; z++ ) {
+	      tmp = num_w_in_d * ((P_w_given_z[w][z] * P_z_given_d[z][d])/denom);
+	      new_P_w_given_z[w][z] += tmp;
+	      new_P_z_given_d[z][d] += tmp;
+	    }
+	  }
+	  denom = 0;
+	  for ( z=z_start; z<z_end; z++ ) denom += new_P_z_given_d[z][d];
+	  partial_doc_sum[d-block_start] = denom;
+	}
+      }
+
+      // Normalize each slice of P'(z|d)
+#pragma omp for schedule(static,1)
+      for ( s=0; s<num_slices; s++ ) {
+	z_start = blocks->topic_ptr[s];
+	z_end = blocks->topic_ptr[s+1];
+	for ( d=block_start; d<block_end; d++ ) {
+	  vector = vectors[d];
+	  if ( ignore_set != -1 && vector->set_id == ignore_set ) continue;
+	  denom = 0;
+	  for ( t=0; t<num_slices; t++ ) denom += blocks->partial_doc_sum[t][d-block_start];
+	  for ( z=z_start; z<z_end; z++ ) new_P_z_given_d[z][d] = new_P_z_given_d[z][d]/denom;
+	}
+      }
+    }
+  }
+
+  return;
+}
+
+/**********************************************************************/
 
 static void estimate_P_z_in_plsa_model ( PLSA_MODEL *plsa_model )
 {
@@ -1013,36 +2255,36 @@ float **map_truth_to_plsa ( PLSA_MODEL *plsa_model )
 
 // Compute similarity matrix for documents in PLSA
 // If log_dist is set, similarity is converted to distance using -log()
-float **compute_similarity_matrix_from_plsa_model ( PLSA_MODEL *plsa_model, int log_dist )
+TRIANGULAR_MATRIX *compute_similarity_matrix_from_plsa_model ( PLSA_MODEL *plsa_model, int log_dist )
 {
   int num_topics = plsa_model->num_topics;
   int num_documents = plsa_model->num_documents;
   float **P_z_given_d = plsa_model->P_z_given_d;
 
-  float **matrix = (float **)calloc2d(num_documents, num_documents, sizeof(float));
+  TRIANGULAR_MATRIX *matrix = create_triangular_matrix(num_documents);
   
   int i, j, z;
   float min=1.0;
   
   for ( i=0; i<num_documents; i++ ) {
-    matrix[i][i] = 1.0;
+    float *row = matrix->values + TRIANGULAR_ROW_OFFSET(num_documents,i) - i;
+    row[i] = 1.0;
     for ( j=i+1; j<num_documents; j++ ) {
       for ( z=0; z<num_topics; z++ ) {
-	matrix[i][j] += P_z_given_d[z][i] * P_z_given_d[z][j];
+	row[j] += P_z_given_d[z][i] * P_z_given_d[z][j];
       }
-      matrix[j][i] = matrix[i][j];
-      if ( matrix[i][j] > 0 && matrix[i][j] < min ) min = matrix[i][j];
+      if ( row[j] > 0 && row[j] < min ) min = row[j];
     }
   }
 
   if ( log_dist ) {
     float max = - 1.25 * logf(min);
     for ( i=0; i<num_documents; i++ ) {
-      matrix[i][i] = 0.0;
+      float *row = matrix->values + TRIANGULAR_ROW_OFFSET(num_documents,i) - i;
+      row[i] = 0.0;
       for ( j=i+1; j<num_documents; j++ ) {
-	if ( matrix[i][j] == 0.0 ) matrix[i][j] = max;
-	else matrix[i][j] = -logf(matrix[i][j]);
-	matrix[j][i] = matrix[i][j];
+	if ( row[j] == 0.0 ) row[j] = max;
+	else row[j] = -logf(row[j]);
       }
     }
   }
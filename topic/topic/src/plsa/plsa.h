@@ -17,6 +17,15 @@
 
 #include "classifiers/classifier_util.h"
 
+// EM execution modes
+#define PLSA_DOC_PARALLEL 0    // Documents split across threads
+#define PLSA_VOCAB_TILED 1     // Cache-blocked over vocabulary tiles
+#define PLSA_TOPIC_PARALLEL 2  // Topics split across threads
+#define PLSA_AUTO_PARALLEL 3   // Document or topic parallel, chosen from the data shape
+
+// Seed of the sampled agglomerative initialization when none is given
+#define CLUSTER_SAMPLE_DEFAULT_SEED 1
+
 typedef struct PLSA_MODEL {
   // Model parameters
   int num_topics;
@@ -47,6 +56,10 @@ typedef struct PLSA_MODEL {
   float total_likelihood;
   float total_words;
 
+  // EM execution settings
+  int exec_mode;          // One of the PLSA_* execution modes above
+  int tile_size;          // Feature rows per vocabulary tile (0 = size to the cache)
+
 } PLSA_MODEL;
 
 typedef struct PLSA_EVAL_METRICS {
@@ -116,10 +129,19 @@ void free_plsa_model ( PLSA_MODEL *plsa_model );
 PLSA_MODEL *copy_plsa_model ( PLSA_MODEL *plsa_model_orig );
 PLSA_MODEL *initialize_plsa_model ( SPARSE_FEATURE_VECTORS *feature_vectors, int *vector_labels, 
 				    int num_topics, float alpha, float beta, int hard_init );
+PLSA_MODEL *initialize_plsa_model_from_prior_model ( SPARSE_FEATURE_VECTORS *feature_vectors, PLSA_MODEL *prior_model,
+						     float alpha, float beta, int fold_in_iter );
+void fold_in_plsa_documents ( PLSA_MODEL *plsa_model, SPARSE_FEATURE_VECTORS *feature_vectors, 
+			      float alpha, int num_iter );
 
 void estimate_plsa_model ( PLSA_MODEL *plsa_model, SPARSE_FEATURE_VECTORS *feature_vectors, 
 			   float alpha, float beta, int max_iter, float conv_threshold,
 			   int ignore_set, int verbose );
+void estimate_plsa_model_hard_em ( PLSA_MODEL *plsa_model, SPARSE_FEATURE_VECTORS *feature_vectors, 
+				   float alpha, float beta, int max_iter, float conv_threshold,
+				   int top_n, int ignore_set, int verbose );
+
+void restore_plsa_model_document_order ( PLSA_MODEL *plsa_model, int *order );
 
 PLSA_SUMMARY *summarize_plsa_model ( PLSA_MODEL *plsa_model, int stem_list);
 void print_plsa_summary ( PLSA_SUMMARY *summary, int eval_topics, char *file_out );
@@ -131,11 +153,17 @@ float **compute_joint_latent_truth_counts ( PLSA_MODEL *plsa_model );
 float **map_plsa_to_truth ( PLSA_MODEL *plsa_model );
 float **map_truth_to_plsa ( PLSA_MODEL *plsa_model );
 
-float **compute_similarity_matrix_from_plsa_model ( PLSA_MODEL *plsa_model, int log_dist );
-int *deterministic_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters );
-int *random_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters );
+TRIANGULAR_MATRIX *compute_similarity_matrix_from_plsa_model ( PLSA_MODEL *plsa_model, int log_dist );
+int *deterministic_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, float max_doc_fraction,
+				char *matrix_cache );
+int *approximate_deterministic_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, int num_neighbors,
+					    int num_tables, int num_bits, int window, unsigned int seed );
+int *random_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, unsigned int seed );
+int *sampled_deterministic_clustering ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_clusters, 
+					float max_doc_fraction, unsigned int seed );
 int *extract_cluster_labels_from_cluster_tree ( TREE_NODE *cluster_tree, int num_labels, int num_clusters );
-TREE_NODE *create_document_cluster_tree ( SPARSE_FEATURE_VECTORS *feature_vectors );
+TREE_NODE *create_document_cluster_tree ( SPARSE_FEATURE_VECTORS *feature_vectors, float max_doc_fraction,
+					  char *matrix_cache );
 float compute_distribution_entropy ( float *P, int num );
 
 LINEAR_CLASSIFIER *train_naive_bayes_classifier_over_plsa_topics ( SPARSE_FEATURE_VECTORS *feature_vectors,
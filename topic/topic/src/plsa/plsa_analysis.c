@@ -37,13 +37,13 @@ int **find_best_stories_map ( PLSA_MODEL *plsa_model, int *class_indices, int nu
 
 char **create_latent_topic_labels_list ( PLSA_SUMMARY *summary, int summary_size );
 void plot_topic_cluster_tree ( TREE_NODE *cluster_tree );
-float **compute_topic_bhattacharyya_distance_matrix ( PLSA_MODEL *plsa_model );
-float **compute_topic_inner_product_distance_matrix ( PLSA_MODEL *plsa_model );
-float **compute_topic_intersection_distance_matrix ( PLSA_MODEL *plsa_model );
-float **compute_topic_chebyshev_distance_matrix ( PLSA_MODEL *plsa_model );
-float **compute_topic_soergel_distance_matrix ( PLSA_MODEL *plsa_model );
-float **compute_topic_kulczynski_distance_matrix ( PLSA_MODEL *plsa_model );
-int **compute_ranking_matrix_from_distance_matrix(float **topic_dist_matrix, int dim );
+TRIANGULAR_MATRIX *compute_topic_bhattacharyya_distance_matrix ( PLSA_MODEL *plsa_model );
+TRIANGULAR_MATRIX *compute_topic_inner_product_distance_matrix ( PLSA_MODEL *plsa_model );
+TRIANGULAR_MATRIX *compute_topic_intersection_distance_matrix ( PLSA_MODEL *plsa_model );
+TRIANGULAR_MATRIX *compute_topic_chebyshev_distance_matrix ( PLSA_MODEL *plsa_model );
+TRIANGULAR_MATRIX *compute_topic_soergel_distance_matrix ( PLSA_MODEL *plsa_model );
+TRIANGULAR_MATRIX *compute_topic_kulczynski_distance_matrix ( PLSA_MODEL *plsa_model );
+int **compute_ranking_matrix_from_distance_matrix(TRIANGULAR_MATRIX *topic_dist_matrix );
 
 void write_z2t_counts_to_file ( PLSA_MODEL *plsa_model, char *filename );
 void write_doc_to_topic_map_to_file ( PLSA_MODEL *plsa_model, char *filename ); 
@@ -151,7 +151,7 @@ int main(int argc, char **argv)
   write_d2z_counts_to_file ( plsa_model, d2z_out ); 
 
   // Compute distance matrix between topics
-  float **topic_dist_matrix = NULL;
+  TRIANGULAR_MATRIX *topic_dist_matrix = NULL;
   if ( zrank_out != NULL || 
        zdist_out != NULL ||
        cluster_topics) {
@@ -171,7 +171,7 @@ int main(int argc, char **argv)
       for ( j=0; j<plsa_model->num_topics; j++ ) {
 	z_j = z_mapping[i];
 	if ( j > 0 ) fprintf( fp, " ");
-	fprintf( fp, "%.6f", topic_dist_matrix[z_i][z_j] );
+	fprintf( fp, "%.6f", TRIANGULAR_ENTRY(topic_dist_matrix,z_i,z_j) );
       }
       fprintf (fp, "\n");
     }
@@ -180,8 +180,7 @@ int main(int argc, char **argv)
   // Write out top ranked document for each pair of document labels and latent topics
   // Index is from [1..N} for use in MATLAB
   if ( zrank_out != NULL ) {
-    int **topic_sim_rankings = compute_ranking_matrix_from_distance_matrix (topic_dist_matrix,
-									    plsa_model->num_topics);
+    int **topic_sim_rankings = compute_ranking_matrix_from_distance_matrix (topic_dist_matrix);
     int *inverse_z_mapping = (int *) calloc(plsa_model->num_topics, sizeof(int));
     for ( i=0; i<plsa_model->num_topics; i++ ) {
       z = z_mapping[i];
@@ -201,8 +200,7 @@ int main(int argc, char **argv)
   // Create hierarchical cluster tree of topics from topic distance matrix 
   if ( cluster_topics ) {
     char **topic_labels = create_latent_topic_labels_list ( plsa_summary, 5 );
-    TREE_NODE *cluster_tree = bottom_up_cluster( topic_dist_matrix, plsa_model->num_topics,
-						 topic_labels, MAX_DIST );
+    TREE_NODE *cluster_tree = bottom_up_cluster( topic_dist_matrix, topic_labels, MAX_DIST );
     plot_topic_cluster_tree ( cluster_tree );
   }
   
@@ -396,14 +394,15 @@ void load_feature_vector_info_into_plsa_model ( PLSA_MODEL *plsa_model, char *ve
   
 }
 
-int **compute_ranking_matrix_from_distance_matrix(float **topic_dist_matrix, int dim )
+int **compute_ranking_matrix_from_distance_matrix(TRIANGULAR_MATRIX *topic_dist_matrix )
 {
+  int dim = topic_dist_matrix->num_elements;
   int **ranking_matrix = (int **) calloc2d (dim, dim, sizeof(int));
   int i, j;
   for ( i=0; i<dim; i++ ) {
     IV_PAIR_ARRAY *array = create_iv_pair_array ( dim );
     for ( j=0; j<dim; j++ ) {
-      array->pairs[j]->value = -topic_dist_matrix[i][j];
+      array->pairs[j]->value = -TRIANGULAR_ENTRY(topic_dist_matrix,i,j);
     }
     sort_iv_pair_array(array);
     for ( j=0; j<dim; j++ ) {
@@ -444,58 +443,56 @@ void plot_topic_cluster_tree ( TREE_NODE *cluster_tree )
 }
 
 
-float **compute_topic_bhattacharyya_distance_matrix ( PLSA_MODEL *plsa_model )   
+TRIANGULAR_MATRIX *compute_topic_bhattacharyya_distance_matrix ( PLSA_MODEL *plsa_model )   
 {
   float **P_w_given_z = plsa_model->P_w_given_z;
   int num_w = plsa_model->num_features;
   int num_z = plsa_model->num_topics;
-  float **D = (float **) calloc2d (num_z, num_z, sizeof(float));
+  TRIANGULAR_MATRIX *D = create_triangular_matrix (num_z);
   int i, j, w;
   float dist;
   for ( i=0; i<num_z; i++ ) {
-    D[i][i]=0;
+    TRIANGULAR_ENTRY(D,i,i)=0;
     for ( j=i+1; j<num_z; j++ ) {
       dist = 0;
       for ( w=0; w<num_w; w++ ) dist += sqrtf(P_w_given_z[w][i] * P_w_given_z[w][j]);
       dist = -logf (dist);
-      D[i][j] = dist;
-      D[j][i] = dist;
+      TRIANGULAR_ENTRY(D,i,j) = dist;
     }  
   }
   return D;
 }
 
-float **compute_topic_inner_product_distance_matrix ( PLSA_MODEL *plsa_model )
+TRIANGULAR_MATRIX *compute_topic_inner_product_distance_matrix ( PLSA_MODEL *plsa_model )
 {
   float **P_w_given_z = plsa_model->P_w_given_z;
   int num_w = plsa_model->num_features;
   int num_z = plsa_model->num_topics;
-  float **D = (float **) calloc2d (num_z, num_z, sizeof(float));
+  TRIANGULAR_MATRIX *D = create_triangular_matrix (num_z);
   int i, j, w;
   float dist;
   for ( i=0; i<num_z; i++ ) {
-    D[i][i]=0;
+    TRIANGULAR_ENTRY(D,i,i)=0;
     for ( j=i+1; j<num_z; j++ ) {
       dist = 0;
       for ( w=0; w<num_w; w++ ) dist += P_w_given_z[w][i] * P_w_given_z[w][j];
       dist = -logf (dist);
-      D[i][j] = dist;
-      D[j][i] = dist;
+      TRIANGULAR_ENTRY(D,i,j) = dist;
     }  
   }
   return D;
 }
 
-float **compute_topic_intersection_distance_matrix ( PLSA_MODEL *plsa_model )
+TRIANGULAR_MATRIX *compute_topic_intersection_distance_matrix ( PLSA_MODEL *plsa_model )
 {
   float **P_w_given_z = plsa_model->P_w_given_z;
   int num_w = plsa_model->num_features;
   int num_z = plsa_model->num_topics;
-  float **D = (float **) calloc2d (num_z, num_z, sizeof(float));
+  TRIANGULAR_MATRIX *D = create_triangular_matrix (num_z);
   int i, j, w;
   float dist;
   for ( i=0; i<num_z; i++ ) {
-    D[i][i]=0;
+    TRIANGULAR_ENTRY(D,i,i)=0;
     for ( j=i+1; j<num_z; j++ ) {
       dist = 0;
       for ( w=0; w<num_w; w++ ) {
@@ -506,23 +503,22 @@ float **compute_topic_intersection_distance_matrix ( PLSA_MODEL *plsa_model )
 	}
       }
       dist = -logf (dist);
-      D[i][j] = dist;
-      D[j][i] = dist;
+      TRIANGULAR_ENTRY(D,i,j) = dist;
     }  
   }
   return D;
 }
 
-float **compute_topic_chebyshev_distance_matrix ( PLSA_MODEL *plsa_model )
+TRIANGULAR_MATRIX *compute_topic_chebyshev_distance_matrix ( PLSA_MODEL *plsa_model )
 {
   float **P_w_given_z = plsa_model->P_w_given_z;
   int num_w = plsa_model->num_features;
   int num_z = plsa_model->num_topics;
-  float **D = (float **) calloc2d (num_z, num_z, sizeof(float));
+  TRIANGULAR_MATRIX *D = create_triangular_matrix (num_z);
   int i, j, w;
   float dist, max_dist;
   for ( i=0; i<num_z; i++ ) {
-    D[i][i]=0;
+    TRIANGULAR_ENTRY(D,i,i)=0;
     for ( j=i+1; j<num_z; j++ ) {
       max_dist = 0;
       for ( w=0; w<num_w; w++ ) {
@@ -533,23 +529,22 @@ float **compute_topic_chebyshev_distance_matrix ( PLSA_MODEL *plsa_model )
 	  max_dist = -dist;
 	}
       }
-      D[i][j] = max_dist;
-      D[j][i] = max_dist;
+      TRIANGULAR_ENTRY(D,i,j) = max_dist;
     }  
   }
   return D;
 }
 
-float **compute_topic_soergel_distance_matrix ( PLSA_MODEL *plsa_model )
+TRIANGULAR_MATRIX *compute_topic_soergel_distance_matrix ( PLSA_MODEL *plsa_model )
 {
   float **P_w_given_z = plsa_model->P_w_given_z;
   int num_w = plsa_model->num_features;
   int num_z = plsa_model->num_topics;
-  float **D = (float **) calloc2d (num_z, num_z, sizeof(float));
+  TRIANGULAR_MATRIX *D = create_triangular_matrix (num_z);
   int i, j, w;
   float numer, denom, dist;
   for ( i=0; i<num_z; i++ ) {
-    D[i][i]=0;
+    TRIANGULAR_ENTRY(D,i,i)=0;
     for ( j=i+1; j<num_z; j++ ) {
       numer = 0;
       denom = 0;
@@ -563,23 +558,22 @@ float **compute_topic_soergel_distance_matrix ( PLSA_MODEL *plsa_model )
 	}
       }
       dist = numer/denom;
-      D[i][j] = dist;
-      D[j][i] = dist;
+      TRIANGULAR_ENTRY(D,i,j) = dist;
     }  
   }
   return D;
 }
 
-float **compute_topic_kulczynski_distance_matrix ( PLSA_MODEL *plsa_model )
+TRIANGULAR_MATRIX *compute_topic_kulczynski_distance_matrix ( PLSA_MODEL *plsa_model )
 {
   float **P_w_given_z = plsa_model->P_w_given_z;
   int num_w = plsa_model->num_features;
   int num_z = plsa_model->num_topics;
-  float **D = (float **) calloc2d (num_z, num_z, sizeof(float));
+  TRIANGULAR_MATRIX *D = create_triangular_matrix (num_z);
   int i, j, w;
   float numer, denom, dist;
   for ( i=0; i<num_z; i++ ) {
-    D[i][i]=0;
+    TRIANGULAR_ENTRY(D,i,i)=0;
     for ( j=i+1; j<num_z; j++ ) {
       numer = 0;
       denom = 0;
@@ -593,8 +587,7 @@ float **compute_topic_kulczynski_distance_matrix ( PLSA_MODEL *plsa_model )
 	}
       }
       dist = numer/denom;
-      D[i][j] = dist;
-      D[j][i] = dist;
+      TRIANGULAR_ENTRY(D,i,j) = dist;
     }  
   }
   return D;
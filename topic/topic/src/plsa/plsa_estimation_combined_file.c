@@ -33,6 +33,7 @@ void characterize_words_by_topical_importance ( PLSA_MODEL *plsa_model, FEATURE_
 						float *feature_counts, char *file_out );
 void create_jackknife_partitions ( SPARSE_FEATURE_VECTORS *feature_vectors, int num_sets );
 PLSA_MODEL *construct_reference_plsa_model ( SPARSE_FEATURE_VECTORS *feature_vectors );
+void compress_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_vectors );
 
 /* Main Program */
 int main(int argc, char **argv)
@@ -40,13 +41,17 @@ int main(int argc, char **argv)
   // Set up argument table
   ARG_TABLE *argtab = NULL;
   argtab = llspeech_new_string_arg(argtab, "vector_list_in", NULL,
-				   "Input file containing a list of labeled feature vector files");
+				   "Input combined count file, which may be gzip compressed or \"-\" for stdin, binary corpus file from convert_to_binary_corpus, or corpus store directory");
   argtab = llspeech_new_string_arg(argtab, "feature_list_in", NULL, 
 				  "List of terms to use in feature set");
   argtab = llspeech_new_string_arg(argtab, "stop_list_in", NULL, 
 				  "List of terms to exclude from feature set");
   argtab = llspeech_new_string_arg(argtab, "plsa_model_out", NULL,
 				   "Output file containing PLSA topic unigram models");
+  argtab = llspeech_new_string_arg(argtab, "init_model_in", NULL,
+				   "PLSA model from an earlier run to warm start from instead of clustering the documents");
+  argtab = llspeech_new_int_arg(argtab, "fold_in_iter", 5,
+				"Number of P(z|d) updates used to fold the documents into the -init_model_in topics");
   argtab = llspeech_new_string_arg(argtab, "feature_list_out", NULL, 
 				   "Output file containing list of terms used in feature set");
   argtab = llspeech_new_string_arg(argtab, "ranked_words_out", NULL,
@@ -65,12 +70,50 @@ int main(int argc, char **argv)
 				"Maximum number of PLSA training iterations");
   argtab = llspeech_new_float_arg(argtab, "convergence", 0.001,
 				"Average likelihood convergence threshhold");
+  argtab = llspeech_new_int_arg(argtab, "hard_em_iter", 0,
+				"Maximum number of hard (Viterbi) EM iterations run before soft EM");
+  argtab = llspeech_new_int_arg(argtab, "hard_em_top", 1,
+				"Number of topics (1 or 2) sharing each word count in hard EM");
+  argtab = llspeech_new_string_arg(argtab, "exec_mode", "auto",
+				   "EM execution mode: doc, topic, auto (doc or topic parallel) or tiled");
+  argtab = llspeech_new_int_arg(argtab, "tile_size", 0,
+				"Features per vocabulary tile in tiled mode (0 sizes tiles to the L2 cache)");
+  argtab = llspeech_new_int_arg(argtab, "num_threads", 0,
+				"Number of worker threads (0 uses the OpenMP default)");
+  argtab = llspeech_new_string_arg(argtab, "kmeans_seeding", "random",
+				   "Seeding of the -random kmeans initialization: random or parallel (k-means||)");
+  argtab = llspeech_new_int_arg(argtab, "kmeans_batch_size", 0,
+				"Vectors per batch for mini-batch kmeans in -random initialization (0 runs full kmeans)");
+  argtab = llspeech_new_int_arg(argtab, "kmeans_batches", 100,
+				"Number of mini-batch kmeans batches");
+  argtab = llspeech_new_int_arg(argtab, "kmeans_centroid_terms", 0,
+				"Keep only this many top weighted terms per kmeans centroid (0 keeps dense centroids)");
+  argtab = llspeech_new_float_arg(argtab, "cluster_df_cutoff", 1.0,
+				  "Leave terms in greater than this fraction of vectors out of the document similarities used by the agglomerative initialization");
+  argtab = llspeech_new_string_arg(argtab, "cluster_matrix_cache", NULL,
+				   "File caching the document distance matrix of the agglomerative initialization between runs (mapped when it matches the documents and feature settings, rewritten otherwise)");
+  argtab = llspeech_new_int_arg(argtab, "cluster_neighbors", 0,
+				"Cluster an LSH nearest neighbor graph with this many neighbors per document in the agglomerative initialization (0 uses the full similarity matrix)");
+  argtab = llspeech_new_flag_arg(argtab, "cluster_sample", 
+				 "Run the agglomerative initialization on a sqrt(topics x documents) sample and assign the other documents to the nearest sample cluster");
+  argtab = llspeech_new_int_arg(argtab, "lsh_tables", LSH_DEFAULT_TABLES,
+				"Number of LSH hash tables for -cluster_neighbors (more raise recall)");
+  argtab = llspeech_new_int_arg(argtab, "lsh_bits", LSH_DEFAULT_BITS,
+				"Bits per LSH hash table for -cluster_neighbors (fewer raise recall)");
+  argtab = llspeech_new_int_arg(argtab, "lsh_window", LSH_DEFAULT_WINDOW,
+				"Places scanned either side of a document in each LSH table for -cluster_neighbors (more raise recall)");
+  argtab = llspeech_new_int_arg(argtab, "seed", 0,
+				"Random seed for the -random initialization, the -cluster_sample sample and the LSH hash tables (0 seeds -random from the clock and gives the sample and LSH tables a fixed seed)");
   argtab = llspeech_new_flag_arg(argtab, "random", "Do a random seeding initialization of the PLSA topics");
+  argtab = llspeech_new_flag_arg(argtab, "sort_features", "Renumber features by decreasing corpus frequency");
+  argtab = llspeech_new_flag_arg(argtab, "reorder_corpus", "Reorder documents by dominant term for cache locality during training");
+  argtab = llspeech_new_flag_arg(argtab, "compress_corpus", "Hold the feature vectors as compressed counts during clustering and training (trades speed for memory: every document is decoded once per EM iteration)");
   argtab = llspeech_new_flag_arg(argtab, "list_stemming", "Do Porter stemming to remove redundant signature words");
   argtab = llspeech_new_flag_arg(argtab, "jackknife", "Compute test likelihood on jackknifed partitions");
   argtab = llspeech_new_flag_arg(argtab, "summarize", "Generate a summary of the data from the PLSA model");
   argtab = llspeech_new_flag_arg(argtab, "reference", "Generate reference PLSA model from truth labels");
   argtab = llspeech_new_flag_arg(argtab, "eval_topics", "Evaluation PLSA topics angainst reference labels");
+  argtab = llspeech_new_flag_arg(argtab, "verbose", "Print extra diagnostics, e.g. the cohesion of the -random clusters");
   
 
   /* Parse the command line arguments */ 
@@ -81,6 +124,8 @@ int main(int argc, char **argv)
   char *feature_list_in = (char *) llspeech_get_string_arg(argtab, "feature_list_in");
   char *stop_list_in = (char *) llspeech_get_string_arg(argtab, "stop_list_in");
   char *plsa_model_out = (char *) llspeech_get_string_arg(argtab, "plsa_model_out");
+  char *init_model_in = (char *) llspeech_get_string_arg(argtab, "init_model_in");
+  int fold_in_iter = llspeech_get_int_arg(argtab, "fold_in_iter");
   char *feature_list_out = (char *) llspeech_get_string_arg(argtab, "feature_list_out");
   char *ranked_words_out = (char *) llspeech_get_string_arg(argtab, "ranked_words_out");
   float df_cutoff = llspeech_get_float_arg(argtab, "df_cutoff");
@@ -90,12 +135,33 @@ int main(int argc, char **argv)
   int num_topics = llspeech_get_int_arg(argtab, "num_topics");
   int max_iter = llspeech_get_int_arg(argtab, "max_iter");
   float conv_threshold = llspeech_get_float_arg(argtab, "convergence");
+  int hard_em_iter = llspeech_get_int_arg(argtab, "hard_em_iter");
+  int hard_em_top = llspeech_get_int_arg(argtab, "hard_em_top");
+  char *exec_mode_name = (char *) llspeech_get_string_arg(argtab, "exec_mode");
+  int tile_size = llspeech_get_int_arg(argtab, "tile_size");
+  int num_threads = llspeech_get_int_arg(argtab, "num_threads");
+  char *kmeans_seeding_name = (char *) llspeech_get_string_arg(argtab, "kmeans_seeding");
+  int kmeans_batch_size = llspeech_get_int_arg(argtab, "kmeans_batch_size");
+  int kmeans_batches = llspeech_get_int_arg(argtab, "kmeans_batches");
+  int kmeans_centroid_terms = llspeech_get_int_arg(argtab, "kmeans_centroid_terms");
+  float cluster_df_cutoff = llspeech_get_float_arg(argtab, "cluster_df_cutoff");
+  char *cluster_matrix_cache = (char *) llspeech_get_string_arg(argtab, "cluster_matrix_cache");
+  int cluster_neighbors = llspeech_get_int_arg(argtab, "cluster_neighbors");
+  int cluster_sample = llspeech_get_flag_arg(argtab, "cluster_sample");
+  int lsh_tables = llspeech_get_int_arg(argtab, "lsh_tables");
+  int lsh_bits = llspeech_get_int_arg(argtab, "lsh_bits");
+  int lsh_window = llspeech_get_int_arg(argtab, "lsh_window");
+  int seed = llspeech_get_int_arg(argtab, "seed");
   int random = llspeech_get_flag_arg(argtab, "random");
+  int sort_features = llspeech_get_flag_arg(argtab, "sort_features");
+  int reorder_corpus = llspeech_get_flag_arg(argtab, "reorder_corpus");
+  int compress_corpus = llspeech_get_flag_arg(argtab, "compress_corpus");
   int stem_list = llspeech_get_flag_arg(argtab, "list_stemming");
   int jackknife = llspeech_get_flag_arg(argtab, "jackknife");
   int summarize = llspeech_get_flag_arg(argtab, "summarize");
   int reference = llspeech_get_flag_arg(argtab, "reference");
   int eval_topics = llspeech_get_flag_arg(argtab, "eval_topics");
+  int verbose = llspeech_get_flag_arg(argtab, "verbose");
 
   time_t begin_time, start_time, end_time;
 
@@ -108,7 +174,37 @@ int main(int argc, char **argv)
   if ( alpha < 0 ) die ( "-alpha parameter cannot be negative\n");
   if ( beta < 0 ) die ( "-beta parameter cannot be negative\n");
   if ( max_iter < 0 ) die ( "-max_iter parameter must non-negative\n");
-  if ( num_topics < 1 ) die ( "-num_topics parameters must be set to a positive value\n");
+  if ( hard_em_iter < 0 ) die ( "-hard_em_iter parameter must non-negative\n");
+  if ( hard_em_top != 1 && hard_em_top != 2 ) die ( "-hard_em_top parameter must be 1 or 2\n");
+  if ( num_topics < 1 && init_model_in == NULL ) die ( "-num_topics parameters must be set to a positive value\n");
+  if ( fold_in_iter < 0 ) die ( "-fold_in_iter parameter must be non-negative\n");
+  if ( num_threads < 0 ) die ( "-num_threads parameter must be non-negative\n");
+  if ( tile_size < 0 ) die ( "-tile_size parameter must be non-negative\n");
+
+  int exec_mode = PLSA_AUTO_PARALLEL;
+  if ( strcmp(exec_mode_name, "doc") == 0 ) exec_mode = PLSA_DOC_PARALLEL;
+  else if ( strcmp(exec_mode_name, "topic") == 0 ) exec_mode = PLSA_TOPIC_PARALLEL;
+  else if ( strcmp(exec_mode_name, "auto") == 0 ) exec_mode = PLSA_AUTO_PARALLEL;
+  else if ( strcmp(exec_mode_name, "tiled") == 0 ) exec_mode = PLSA_VOCAB_TILED;
+  else die ( "Unknown -exec_mode '%s' (expected doc, topic, auto or tiled)\n", exec_mode_name );
+
+  if ( kmeans_batch_size < 0 ) die ( "-kmeans_batch_size parameter must be non-negative\n");
+  if ( kmeans_batches < 0 ) die ( "-kmeans_batches parameter must be non-negative\n");
+  if ( kmeans_centroid_terms < 0 ) die ( "-kmeans_centroid_terms parameter must be non-negative\n");
+  if ( cluster_df_cutoff <= 0 ) die ( "-cluster_df_cutoff parameter must be positive\n");
+  if ( cluster_neighbors < 0 ) die ( "-cluster_neighbors parameter must be non-negative\n");
+  if ( cluster_sample && cluster_neighbors > 0 ) die ( "-cluster_sample and -cluster_neighbors cannot be used together\n");
+  if ( lsh_tables < 1 ) die ( "-lsh_tables parameter must be positive\n");
+  if ( lsh_bits < 1 || lsh_bits > 32 ) die ( "-lsh_bits parameter must be from 1 to 32\n");
+  if ( lsh_window < 1 ) die ( "-lsh_window parameter must be positive\n");
+  if ( seed < 0 ) die ( "-seed parameter must be non-negative\n");
+
+  int kmeans_seeding = KMEANS_RANDOM_SEEDING;
+  if ( strcmp(kmeans_seeding_name, "random") == 0 ) kmeans_seeding = KMEANS_RANDOM_SEEDING;
+  else if ( strcmp(kmeans_seeding_name, "parallel") == 0 ) kmeans_seeding = KMEANS_PARALLEL_SEEDING;
+  else die ( "Unknown -kmeans_seeding '%s' (expected random or parallel)\n", kmeans_seeding_name );
+
+  set_num_threads ( num_threads );
 
   time(&begin_time);
 
@@ -126,32 +222,42 @@ int main(int argc, char **argv)
     printf("done)\n");
   }
 
-  // Load feature set from features observed in training data 
-  if ( features == NULL ) {
-    printf("(Creating feature set from training files..."); fflush(stdout);
-    time(&start_time);
-    features = create_feature_set_from_file (vector_list_in, 0, stop_list);
-    time(&end_time);
-    printf("done in %d seconds)\n",(int)difftime(end_time,start_time));
-  }
-  
-  // Add some count info into the feature set about multiword units
-  add_word_count_info_into_feature_set (features, stop_list);
-
   // Load list of classes
   CLASS_SET *classes = NULL;
   if (eval_topics) {
+    if ( is_corpus_store ( vector_list_in ) ) die ( "-eval_topics is not supported with a corpus store\n" );
+    if ( is_count_file_pipe ( vector_list_in ) ) die ( "-eval_topics is not supported with streamed input\n" );
     classes = create_class_set_from_file_list (vector_list_in);
   }
 
   printf("classes is : %p\n", classes);
   
-  // Load training set feature vectors
+  // Load training set feature vectors, creating the feature set from the
+  // features observed in the training data in the same pass if no 
+  // feature list was given. Binary corpus files and the segments of a
+  // corpus store directory are mapped instead, and compressed count 
+  // files, pipes and standard input ("-") are parsed in one pass as they
+  // are read.
   printf("(Loading feature vectors..."); fflush(stdout);
   time(&start_time);
-  SPARSE_FEATURE_VECTORS *feature_vectors = load_sparse_feature_vectors_combined (vector_list_in, features, classes);
+  SPARSE_FEATURE_VECTORS *feature_vectors;
+  if ( is_corpus_store ( vector_list_in ) ) {
+    feature_vectors = map_corpus_store ( vector_list_in, &features, stop_list );
+  } else if ( is_count_file_pipe ( vector_list_in ) ) {
+    feature_vectors = load_sparse_feature_vectors_combined_stream ( vector_list_in, &features, stop_list, classes );
+  } else if ( is_binary_corpus_file ( vector_list_in ) ) {
+    if ( classes != NULL ) die ( "-eval_topics is not supported with a binary corpus\n" );
+    feature_vectors = map_binary_corpus ( vector_list_in, &features, stop_list );
+  } else if ( is_compressed_count_file ( vector_list_in ) ) {
+    feature_vectors = load_sparse_feature_vectors_combined_stream ( vector_list_in, &features, stop_list, classes );
+  } else {
+    feature_vectors = load_sparse_feature_vectors_combined_mmap ( vector_list_in, &features, stop_list, classes );
+  }
   time(&end_time);
   printf("done in %d seconds)\n",(int)difftime(end_time,start_time));
+
+  // Add some count info into the feature set about multiword units
+  add_word_count_info_into_feature_set (features, stop_list);
   
   time(&end_time);
   printf ("(Total load time: %d seconds)\n",(int)difftime(end_time,begin_time));
@@ -168,6 +274,15 @@ int main(int argc, char **argv)
   prune_zero_weight_features_from_feature_vectors(feature_vectors);
   printf("done)\n");
 
+  // Renumber the features so frequent words share a compact
+  // prefix of the model. The saved feature list and the model 
+  // both use this numbering.
+  if ( sort_features ) {
+    printf("(Sorting features by frequency..."); fflush(stdout);
+    free ( sort_features_by_frequency ( feature_vectors ) );
+    printf("done)\n");
+  }
+
   // Save the pruned feature set to file if requested
   if ( feature_list_out != NULL ) {
     printf("(Writing feature set to file '%s'...",feature_list_out); fflush(stdout);
@@ -175,26 +290,88 @@ int main(int argc, char **argv)
     printf("done)\n");
   }
 
+  // Reorder the documents so neighbouring documents share vocabulary. 
+  // Everything up to the end of training works in the reordered space
+  // and document_order maps it back to the original order afterwards.
+  int *document_order = NULL;
+  if ( reorder_corpus ) {
+    printf("(Reordering feature vectors for cache locality..."); fflush(stdout);
+    document_order = reorder_sparse_feature_vectors ( feature_vectors );
+    int num_partitions = get_num_threads();
+    int *bounds = partition_sparse_feature_vectors_by_cost ( feature_vectors, num_partitions );
+    int p, d, max_cost = 0, total_cost = 0;
+    for ( p=0; p<num_partitions; p++ ) {
+      int cost = 0;
+      for ( d=bounds[p]; d<bounds[p+1]; d++ ) cost += feature_vectors->vectors[d]->num_features;
+      if ( cost > max_cost ) max_cost = cost;
+      total_cost += cost;
+    }
+    printf("done...%d partitions with max/mean non-zero load of %.3f)\n", num_partitions, 
+	   total_cost > 0 ? ((float)max_cost*num_partitions)/total_cost : 1.0 );
+    free(bounds);
+  }
+
+  // A prior model replaces the clustering of the documents
+  PLSA_MODEL *prior_model = NULL;
+  if ( init_model_in != NULL ) {
+    printf("(Loading initial PLSA model from '%s'...", init_model_in); fflush(stdout);
+    prior_model = load_plsa_model_from_file ( init_model_in );
+    printf("done)\n");
+    if ( num_topics < 1 ) num_topics = prior_model->num_topics;
+    if ( num_topics != prior_model->num_topics ) 
+      die ( "-num_topics (%d) does not match the %d topics of -init_model_in\n", num_topics, prior_model->num_topics );
+  }
+
+  // Compress the vectors now unless the deterministic clustering
+  // is going to weight them in place
+  if ( compress_corpus && ( prior_model != NULL || random ) ) 
+    compress_feature_vectors ( feature_vectors );
+
   // Compute initial assignments of vectors to clusters 
   int *vector_labels = NULL;
-  if ( random ) {
-    //vector_labels = random_clustering ( feature_vectors, num_topics );
-    vector_labels = kmeans_clustering ( feature_vectors, num_topics, 20 );
+  if ( prior_model != NULL ) {
+    // Nothing to cluster
+  } else if ( random ) {
+    //vector_labels = random_clustering ( feature_vectors, num_topics, (unsigned)seed );
+    if ( kmeans_batch_size > 0 ) 
+      vector_labels = minibatch_kmeans_clustering ( feature_vectors, num_topics, kmeans_batch_size,
+						    kmeans_batches, kmeans_seeding, (unsigned)seed );
+    else if ( kmeans_centroid_terms > 0 ) 
+      vector_labels = sparse_kmeans_clustering ( feature_vectors, num_topics, 20, kmeans_centroid_terms,
+						 kmeans_seeding, (unsigned)seed );
+    else
+      vector_labels = kmeans_clustering ( feature_vectors, num_topics, 20, kmeans_seeding, (unsigned)seed );
+    if ( verbose ) 
+      printf("(Mean cosine similarity of vectors to their cluster centroids: %.4f)\n", 
+	     compute_kmeans_cohesion ( feature_vectors, vector_labels, num_topics ));
   } else {
+    // Clustering weights and normalizes the vectors in place, so keep 
+    // the raw counts to put back before the model is estimated
+    float *unweighted_values = copy_sparse_feature_vector_values ( feature_vectors );
+
     printf("(Applying feature weights..."); fflush(stdout);
     apply_feature_weights_to_feature_vectors ( feature_vectors );
     printf ("done)\n");
 
-    vector_labels = deterministic_clustering ( feature_vectors, num_topics );
+    if ( cluster_sample ) 
+      vector_labels = sampled_deterministic_clustering ( feature_vectors, num_topics, cluster_df_cutoff, 
+							 (unsigned)seed );
+    else if ( cluster_neighbors > 0 ) 
+      vector_labels = approximate_deterministic_clustering ( feature_vectors, num_topics, cluster_neighbors,
+							     lsh_tables, lsh_bits, lsh_window, (unsigned)seed );
+    else
+      vector_labels = deterministic_clustering ( feature_vectors, num_topics, cluster_df_cutoff, cluster_matrix_cache );
+
+    printf("(Restoring unweighted feature vectors..."); fflush(stdout);
+    restore_sparse_feature_vector_values ( feature_vectors, unweighted_values );
+    free(unweighted_values);
+    printf("done)\n");
 
-    printf("(Remove zero weight features from feature set..."); fflush(stdout);
-    remove_zero_weight_features ( features );
+    printf("(Remove zero weight features..."); fflush(stdout);
+    prune_zero_weight_features_from_feature_vectors ( feature_vectors );
     printf ("done)\n");
-    
-    printf("(Reloading feature vectors..."); fflush(stdout);
-    free_sparse_feature_vectors ( feature_vectors );
-    feature_vectors = load_sparse_feature_vectors ( vector_list_in, features, classes );
-    printf("done)\n");
+
+    if ( compress_corpus ) compress_feature_vectors ( feature_vectors );
   } 
   
   time(&end_time);
@@ -202,13 +379,34 @@ int main(int argc, char **argv)
   time(&begin_time);
 
   // Estimating the PLSA model
-  PLSA_MODEL *plsa_model = train_plsa_model_from_labels ( feature_vectors, vector_labels, 
-							  num_topics, alpha, beta, max_iter,
-							  conv_threshold, 0 );
+  PLSA_MODEL *plsa_model;
+  if ( prior_model != NULL ) {
+    plsa_model = initialize_plsa_model_from_prior_model ( feature_vectors, prior_model, alpha, beta, fold_in_iter );
+    free_plsa_model ( prior_model );
+  } else {
+    plsa_model = initialize_plsa_model ( feature_vectors, vector_labels, num_topics, alpha, beta, 0 );
+  }
+  plsa_model->exec_mode = exec_mode;
+  plsa_model->tile_size = tile_size;
+  if ( hard_em_iter > 0 ) {
+    // Hard EM on its own (-max_iter 0) or as a warm-up for soft EM
+    estimate_plsa_model_hard_em ( plsa_model, feature_vectors, alpha, beta, hard_em_iter, 
+				  conv_threshold, hard_em_top, -1, 1 );
+  }
+  if ( max_iter > 0 || hard_em_iter == 0 ) {
+    estimate_plsa_model ( plsa_model, feature_vectors, alpha, beta, max_iter, conv_threshold, -1, 1 );
+  }
 
   time(&end_time);
   printf ("(Total training time: %d seconds)\n",(int)difftime(end_time,begin_time));
 
+  // Put the documents back in their original order
+  if ( document_order != NULL ) {
+    restore_plsa_model_document_order ( plsa_model, document_order );
+    restore_sparse_feature_vector_order ( feature_vectors, document_order );
+    free(document_order);
+  }
+
 
   // Print out evaluation metrics
   if ( eval_topics ) {
@@ -469,3 +667,13 @@ void evaluate_plsa_summary_against_reference ( PLSA_SUMMARY *summary, PLSA_SUMMA
 
 
 }
+
+void compress_feature_vectors ( SPARSE_FEATURE_VECTORS *feature_vectors )
+{
+  printf("(Compressing feature vectors..."); fflush(stdout);
+  long num_nonzeros = feature_vectors->corpus->num_nonzeros;
+  long packed_size = compress_sparse_corpus ( feature_vectors );
+  printf("done...%.1f MB of features held in %.1f MB, %.2f bytes per non-zero)\n", 
+	 num_nonzeros*(sizeof(int)+sizeof(float))/1e6, packed_size/1e6,
+	 num_nonzeros > 0 ? ((double)packed_size)/num_nonzeros : 0.0 );
+}
@@ -14,6 +14,11 @@
 #include <string.h>
 #include <stdarg.h>
 #include <math.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "util/basic_util.h"
 
@@ -353,6 +358,89 @@ static int cmp_float_decreasing(const void *a, const void *b)
 
 
 
+/********************************************************************/
+
+/* Worker thread control...without OpenMP everything runs on one thread */
+
+int get_num_threads ( void )
+{
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+int get_thread_num ( void )
+{
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+void set_num_threads ( int num_threads )
+{
+#ifdef _OPENMP
+  if ( num_threads > 0 ) omp_set_num_threads(num_threads);
+#endif
+  return;
+}
+
+/********************************************************************/
+
+/* Wall clock time in seconds, for timing multithreaded code */
+double get_wall_time ( void )
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec + 1e-6*(double)tv.tv_usec;
+}
+
+/* Size in bytes of the data (or unified) cache at the given level
+   on this host, or 0 if it can't be determined */
+long get_cache_size ( int level )
+{
+  long size = 0;
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE) && defined(_SC_LEVEL3_CACHE_SIZE)
+  if ( level == 1 ) size = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+  else if ( level == 2 ) size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  else if ( level == 3 ) size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if ( size > 0 ) return size;
+#endif
+
+  // Fall back on the sysfs cache description
+  char path[256], type[32], units;
+  int i, cache_level;
+  long value;
+  FILE *fp;
+  for ( i=0; i<8; i++ ) {
+    sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%d/level", i);
+    if ( (fp = fopen(path, "r")) == NULL ) break;
+    if ( fscanf(fp, "%d", &cache_level) != 1 ) cache_level = -1;
+    fclose(fp);
+    if ( cache_level != level ) continue;
+    sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%d/type", i);
+    if ( (fp = fopen(path, "r")) == NULL ) continue;
+    if ( fscanf(fp, "%31s", type) != 1 ) type[0] = '\0';
+    fclose(fp);
+    if ( strcmp(type, "Instruction") == 0 ) continue;
+    sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+    if ( (fp = fopen(path, "r")) == NULL ) continue;
+    units = ' ';
+    if ( fscanf(fp, "%ld%c", &value, &units) >= 1 ) {
+      if ( units == 'K' ) value *= 1024;
+      else if ( units == 'M' ) value *= 1024*1024;
+      size = value;
+    }
+    fclose(fp);
+    break;
+  }
+
+  return size;
+}
+
 /********************************************************************/
 
 /* Fatal errors and warnings */
@@ -44,6 +44,12 @@ int count_lines_in_file (FILE *fp, int *max_line_length);
 
 void sort_float_array ( float *array, int num, int decreasing );
 
+int get_num_threads ( void );
+int get_thread_num ( void );
+void set_num_threads ( int num_threads );
+double get_wall_time ( void );
+long get_cache_size ( int level );
+
 void die(char *format, ...);
 void warn(char *format, ...);
 